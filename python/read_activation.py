@@ -0,0 +1,45 @@
+import sys
+import struct
+import numpy as np
+
+# Read activations saved with "format": "binary" in save_activation.
+# The file is "TNACT001" and records of
+#   uint32 name bytes, name, int32 iter, uint64 npy bytes, a .npy blob
+# where name is the node name with ".data" or ".diff", see
+# src/utils/activation_stream.h.
+
+def iter_records(act_file):
+    """Yield (iter, name, array) in file order."""
+    f = open(act_file, 'rb')
+    if f.read(8) != b'TNACT001':
+        raise ValueError('%s is not an activation file' % act_file)
+    while True:
+        head = f.read(4)
+        if len(head) < 4:
+            break
+        name_bytes, = struct.unpack('<I', head)
+        name = f.read(name_bytes).decode('utf-8')
+        it, npy_bytes = struct.unpack('<iQ', f.read(12))
+        start = f.tell()
+        value = np.lib.format.read_array(f)
+        f.seek(start + npy_bytes)
+        yield it, name, value
+    f.close()
+
+def load(act_file):
+    """The layout of the json dump: a list over iters of
+    {node: {"data": array, "diff": array}}."""
+    iters = []
+    for it, name, value in iter_records(act_file):
+        while len(iters) <= it:
+            iters.append({})
+        node, kind = name.rsplit('.', 1)
+        iters[it].setdefault(node, {})[kind] = value
+    return iters
+
+if __name__ == '__main__':
+    if len(sys.argv) < 2:
+        print("Usage: python read_activation.py [activation_file]")
+        sys.exit(1)
+    for it, name, value in iter_records(sys.argv[1]):
+        print('%d %s %s' % (it, name, str(value.shape)))
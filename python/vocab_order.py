@@ -0,0 +1,40 @@
+import sys
+
+# Order word ids by corpus frequency for "vocab_map_file" of the embedding layer.
+# Line k of the map file is the word id kept in table row k: hot words first,
+# so they share a small contiguous region of the table. Ties keep id order,
+# words not in the corpus go last.
+# Corpus files are in the DATA_FORMAT.md layout: id length wid wid ...
+# A table_file records a hash of the map it was built with, so a new map
+# needs a new table_file.
+
+if len(sys.argv) < 4:
+    print("Usage: python vocab_order.py [word_count] [map_file] [corpus_file ...]")
+    sys.exit(1)
+
+word_count = int(sys.argv[1])
+map_file = sys.argv[2]
+corpus_files = sys.argv[3:]
+
+freq = [0] * word_count
+for corpus_file in corpus_files:
+    for line in open(corpus_file):
+        fields = line.split()
+        for wid in fields[2:]:
+            wid = int(wid)
+            if 0 <= wid < word_count:
+                freq[wid] += 1
+    print('Count %s over.' % corpus_file)
+
+order = sorted(range(word_count), key=lambda wid: (-freq[wid], wid))
+out = open(map_file, 'w')
+for wid in order:
+    out.write('%d\n' % wid)
+out.close()
+
+total = sum(freq)
+hot, covered = 0, 0
+while hot < word_count and covered * 10 < total * 9:
+    covered += freq[order[hot]]
+    hot += 1
+print('Write %s over, %d of %d words cover 90%% of %d tokens.' % (map_file, hot, word_count, total))
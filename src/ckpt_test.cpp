@@ -0,0 +1,295 @@
+#define _CRT_SECURE_NO_WARNINGS
+#define _CRT_SECURE_NO_DEPRECATE
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "./utils/checkpoint.h"
+#include "./utils/async_checkpoint.h"
+#include "./utils/corpus_store.h"
+
+// binary checkpoints written and read back, also by the background
+// writer, sharded, compressed and as an incremental chain, and the
+// corpus cache, no mshadow needed
+// usage: ckpt_test [dir]
+
+using namespace std;
+using namespace textnet;
+using namespace textnet::utils;
+
+const int kRow = 300, kCol = 37;
+
+void FillRandom(vector<float> &x) {
+  for (size_t i = 0; i < x.size(); ++i) {
+    x[i] = static_cast<float>(rand()) / RAND_MAX - 0.5f;
+  }
+}
+
+// saved row i holds source row row_map[i], as Node::SaveNode writes it
+bool SameRows(const float *saved, const float *src, const int *row_map, int nrow, int ncol) {
+  for (int i = 0; i < nrow; ++i) {
+    const int r = row_map == NULL ? i : row_map[i];
+    if (memcmp(saved + i * ncol, src + r * ncol, ncol * sizeof(float)) != 0) return false;
+  }
+  return true;
+}
+
+// an embedding with a row map and a dense weight, read back bit exact
+bool RoundTrip(const string &dir, int shards, int codec) {
+  vector<float> emb(kRow * kCol), w(5 * 7);
+  FillRandom(emb);
+  FillRandom(w);
+  vector<int> row_map(kRow);
+  for (int i = 0; i < kRow; ++i) row_map[i] = i;
+  random_shuffle(row_map.begin(), row_map.end());
+  const int emb_shape[4] = {kRow, kCol, 1, 1}, w_shape[4] = {1, 1, 5, 7};
+  Json::Value config;
+  config["net_name"] = "ckpt_test";
+
+  const string path = dir + "/ckpt_test.model";
+  CheckpointWriter writer;
+  writer.SetShards(shards);
+  writer.SetCodec(codec);
+  writer.Add("layers.0.0.data", &emb[0], emb_shape, &row_map[0]);
+  writer.Add("layers.1.0.data", &w[0], w_shape);
+  writer.Meta()["kind"] = "full";
+  writer.Write(path, config);
+
+  CheckpointReader reader;
+  reader.Open(path);
+  vector<string> names;
+  names.push_back("layers.0.0.data");
+  names.push_back("layers.1.0.data");
+  reader.Prepare(names);
+  int es[4], ws[4];
+  const float *e = reader.Find(names[0], es);
+  const float *v = reader.Find(names[1], ws);
+  bool ok = e != NULL && v != NULL && reader.Find("layers.2.0.data", ws) == NULL;
+  ok = ok && equal(es, es + 4, emb_shape) && equal(ws, ws + 4, w_shape);
+  ok = ok && SameRows(e, &emb[0], &row_map[0], kRow, kCol);
+  ok = ok && SameRows(v, &w[0], NULL, 1, 5 * 7);
+  ok = ok && reader.Config()["net_name"].asString() == "ckpt_test";
+  ok = ok && reader.Meta()["kind"].asString() == "full";
+  remove(path.c_str());
+  for (int k = 0; k < shards; ++k) remove(CheckpointWriter::ShardPath(path, k).c_str());
+  return ok;
+}
+
+bool TestCheckpoint(const string &dir) {
+  // lz4 writes zlib when the build has no lz4
+  const char *codecs[] = {"none", "zlib", "lz4"};
+  const int shards[] = {0, 3};
+  int fail = 0;
+  for (int c = 0; c < 3; ++c) {
+    for (int s = 0; s < 2; ++s) {
+      bool ok = RoundTrip(dir, shards[s], ParseCodec(codecs[c]));
+      cout << "checkpoint codec " << codecs[c] << " shards " << shards[s] << ": "
+           << (ok ? "ok" : "FAILED") << endl;
+      if (!ok) ++fail;
+    }
+  }
+  return fail == 0;
+}
+
+// written by the background writer, the sources are overwritten right after
+// Submit, the file must hold the values of the snapshot
+bool TestAsync(const string &dir) {
+  vector<float> emb(kRow * kCol);
+  FillRandom(emb);
+  vector<int> row_map(kRow);
+  for (int i = 0; i < kRow; ++i) row_map[i] = kRow - 1 - i;
+  const int shape[4] = {kRow, kCol, 1, 1};
+  AsyncCheckpoint async;
+  async.Start(2);
+  bool ok = true;
+  for (int k = 0; k < 3; ++k) {
+    char path[256];
+    SPrintf(path, sizeof(path), "%s/ckpt_test.async%d", dir.c_str(), k);
+    int slot = async.Acquire();
+    CheckpointWriter &writer = async.Writer(slot);
+    writer.Add("layers.0.0.data", &emb[0], shape, &row_map[0]);
+    async.Submit(slot, path, Json::Value());
+    vector<float> expect = emb;
+    FillRandom(emb);
+    async.Wait();
+    CheckpointReader reader;
+    reader.Open(path);
+    int s[4];
+    const float *e = reader.Find("layers.0.0.data", s);
+    ok = ok && e != NULL && SameRows(e, &expect[0], &row_map[0], kRow, kCol);
+    remove(path);
+  }
+  // an unstaged table is written by Submit, before the source changes
+  const string path = dir + "/ckpt_test.async_table";
+  int slot = async.Acquire();
+  async.Writer(slot).Add("layers.0.0.data", &emb[0], shape, &row_map[0], false);
+  async.Submit(slot, path, Json::Value());
+  vector<float> expect = emb;
+  FillRandom(emb);
+  CheckpointReader reader;
+  reader.Open(path);
+  int s[4];
+  const float *e = reader.Find("layers.0.0.data", s);
+  ok = ok && e != NULL && SameRows(e, &expect[0], &row_map[0], kRow, kCol);
+  remove(path.c_str());
+  async.Stop();
+  cout << "async checkpoint: " << (ok ? "ok" : "FAILED") << endl;
+  return ok;
+}
+
+// saving again with fewer shards leaves no shard files of the earlier save
+bool TestShardCleanup(const string &dir) {
+  vector<float> w(5 * 7);
+  FillRandom(w);
+  const int shape[4] = {1, 1, 5, 7};
+  const string path = dir + "/ckpt_test.shards";
+  const int shards[] = {3, 2, 0};
+  bool ok = true;
+  for (int s = 0; s < 3; ++s) {
+    CheckpointWriter writer;
+    writer.SetShards(shards[s]);
+    writer.Add("layers.0.0.data", &w[0], shape);
+    writer.Write(path, Json::Value());
+    for (int k = 0; k < 3; ++k) {
+      ok = ok && (access(CheckpointWriter::ShardPath(path, k).c_str(), F_OK) == 0) == (k < shards[s]);
+    }
+  }
+  CheckpointReader reader;
+  reader.Open(path);
+  int s[4];
+  const float *v = reader.Find("layers.0.0.data", s);
+  ok = ok && v != NULL && SameRows(v, &w[0], NULL, 1, 5 * 7);
+  remove(path.c_str());
+  cout << "checkpoint shard cleanup: " << (ok ? "ok" : "FAILED") << endl;
+  return ok;
+}
+
+// a full save, then the changed rows as .rows/.delta chained by meta "prev",
+// replayed onto the full save as Net::LoadParamsChain does
+bool TestDelta(const string &dir) {
+  vector<float> emb(kRow * kCol);
+  FillRandom(emb);
+  vector<int> row_map(kRow);
+  for (int i = 0; i < kRow; ++i) row_map[i] = kRow - 1 - i;
+  const int shape[4] = {kRow, kCol, 1, 1};
+  const string full_path = dir + "/ckpt_test.full", delta_path = dir + "/ckpt_test.delta";
+
+  CheckpointWriter writer;
+  writer.Add("layers.0.0.data", &emb[0], shape, &row_map[0]);
+  writer.Meta()["kind"] = "full";
+  writer.Write(full_path, Json::Value());
+
+  // dirty rows are source rows, the ids saved rows
+  vector<int> dirty, ids;
+  for (int r = 3; r < kRow; r += 41) dirty.push_back(r);
+  for (size_t i = 0; i < dirty.size(); ++i) {
+    for (int j = 0; j < kCol; ++j) emb[dirty[i] * kCol + j] += 1.0f;
+    ids.push_back(kRow - 1 - dirty[i]);
+  }
+  const int n = dirty.size();
+  const int delta_shape[4] = {n, kCol, 1, 1};
+  writer.Add("layers.0.0.delta", &emb[0], delta_shape, &dirty[0]);
+  writer.AddIds("layers.0.0.rows", &ids[0], n);
+  writer.Meta()["kind"] = "delta";
+  writer.Meta()["prev"] = full_path;
+  writer.Write(delta_path, Json::Value());
+
+  CheckpointReader reader;
+  reader.Open(delta_path);
+  bool ok = reader.Meta()["kind"].asString() == "delta";
+  CheckpointReader prev;
+  prev.Open(reader.Meta()["prev"].asString());
+  vector<string> names(1, "layers.0.0.data");
+  prev.Prepare(names);
+  int s[4], m;
+  const float *base = prev.Find(names[0], s);
+  ok = ok && base != NULL && prev.Meta()["kind"].asString() == "full";
+  vector<float> saved;
+  if (base != NULL) saved.assign(base, base + kRow * kCol);
+  const int *rows = reader.FindIds("layers.0.0.rows", &m);
+  const float *values = reader.Find("layers.0.0.delta", s);
+  ok = ok && rows != NULL && values != NULL && m == n && s[0] == n && s[1] == kCol;
+  for (int i = 0; ok && i < m; ++i) {
+    memcpy(&saved[rows[i] * kCol], values + i * kCol, kCol * sizeof(float));
+  }
+  ok = ok && SameRows(&saved[0], &emb[0], &row_map[0], kRow, kCol);
+  cout << "checkpoint delta chain: " << (ok ? "ok" : "FAILED") << endl;
+  remove(full_path.c_str());
+  remove(delta_path.c_str());
+  return ok;
+}
+
+bool SameDocs(const CorpusFile &a, const CorpusFile &b) {
+  if (a.ndoc != b.ndoc || a.ntoken != b.ntoken) return false;
+  for (int d = 0; d <= a.ndoc; ++d) {
+    if (a.offsets[d] != b.offsets[d] || a.key_offsets[d] != b.key_offsets[d]) return false;
+  }
+  for (int d = 0; d < a.ndoc; ++d) {
+    if (a.order[d] != b.order[d]) return false;
+  }
+  return equal(a.tokens, a.tokens + a.ntoken, b.tokens) &&
+         equal(a.keys, a.keys + a.key_offsets[a.ndoc], b.keys);
+}
+
+// the first load parses and writes the cache, the second maps it; both must
+// match a parse without cache, and a changed text must not use the old cache
+bool TestCorpusCache(const string &dir) {
+  const string path = dir + "/ckpt_test.corpus";
+  vector<vector<int> > docs(200);
+  {
+    ofstream out(path.c_str());
+    for (size_t d = 0; d < docs.size(); ++d) {
+      docs[d].resize(rand() % 20);
+      out << "doc" << d << " " << docs[d].size();
+      for (size_t i = 0; i < docs[d].size(); ++i) {
+        docs[d][i] = rand() % 10000;
+        out << " " << docs[d][i];
+      }
+      out << "\n";
+    }
+    // a repeated key is skipped
+    out << "doc7 1 42\n";
+  }
+  CorpusFile text, parsed, mapped;
+  text.Load(path, false);
+  parsed.Load(path, true);
+  mapped.Load(path, true);
+  bool ok = text.ndoc == static_cast<int>(docs.size());
+  ok = ok && SameDocs(text, parsed) && SameDocs(text, mapped);
+  for (size_t d = 0; ok && d < docs.size(); ++d) {
+    char key[32];
+    SPrintf(key, sizeof(key), "doc%d", static_cast<int>(d));
+    int id = mapped.Find(key);
+    ok = id >= 0 && mapped.offsets[id + 1] - mapped.offsets[id] == docs[d].size() &&
+         equal(docs[d].begin(), docs[d].end(), mapped.tokens + mapped.offsets[id]);
+  }
+  ok = ok && mapped.Find("doc") == -1 && mapped.Find("doc999") == -1;
+  {
+    ofstream out(path.c_str(), ios::app);
+    out << "doc_new 2 1 2\n";
+  }
+  CorpusFile changed;
+  changed.Load(path, true);
+  ok = ok && changed.ndoc == static_cast<int>(docs.size()) + 1 && changed.Find("doc_new") >= 0;
+  cout << "corpus cache: " << (ok ? "ok" : "FAILED") << endl;
+  remove(path.c_str());
+  remove((path + ".bin_cache").c_str());
+  return ok;
+}
+
+int main(int argc, char *argv[]) {
+  srand(37);
+  string dir = argc > 1 ? argv[1] : ".";
+  bool ok = TestCheckpoint(dir);
+  ok = TestShardCleanup(dir) && ok;
+  ok = TestAsync(dir) && ok;
+  ok = TestDelta(dir) && ok;
+  ok = TestCorpusCache(dir) && ok;
+  return ok ? 0 : 1;
+}
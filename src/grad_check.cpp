@@ -7,10 +7,15 @@
 #include <cstring>
 #include <vector>
 #include <map>
+#include <set>
 #include <climits>
+#include <cmath>
+#include <fstream>
+#include <algorithm>
 
 #include "./layer/layer.h"
 #include "./checker/checker.h"
+#include "./net/param_arena.h"
 #include "global.h"
 
 // orc for read interal variable in layer classes
@@ -2406,6 +2411,281 @@ void TestWordClassSoftmaxLayer(mshadow::Random<cpu>* prnd) {
   cout << "Done." << endl;
 }
 
+// the word embed of the word class softmax is row sparse, its diff rows are
+// compared with the dense numerical gradient, rows of unseen classes get none;
+// a dense (1, 1, vocab, feat) param of an older model must load unchanged
+void TestWordClassSoftmaxSparseLayer(mshadow::Random<cpu>* prnd) {
+  cout << "G Check Test Word Class Softmax Sparse Word Embed." << endl;
+  Node<cpu> bottom0, bottom1;
+  Node<cpu> top0, top1, top2, top3;
+  vector<Node<cpu>*> bottoms;
+  vector<Node<cpu>*> tops;
+  bottoms.push_back(&bottom0);
+  bottoms.push_back(&bottom1);
+  tops.push_back(&top0);
+  tops.push_back(&top1);
+  tops.push_back(&top2);
+  tops.push_back(&top3);
+
+  const int batch_size = 2, vocab_size = 7, feat_size = 4;
+  {
+    // classes 0: words 0 1 5, 1: words 2 3, 2: words 4 6
+    ofstream ofs("./tmp.wordclass.sparse");
+    ofs << "0 0\n1 0\n2 1\n3 1\n4 2\n5 0\n6 2\n";
+  }
+  bottom0.Resize(Shape4(batch_size,1,1,feat_size), true);
+  bottom1.Resize(Shape4(batch_size,1,1,1), true);
+  prnd->SampleUniform(&bottom0.data, -1, 1);
+  bottom1.data[0][0][0][0] = 5;
+  bottom1.data[1][0][0][0] = 1; // class 0 twice, its rows are merged
+
+  map<string, SettingV> setting;
+  {
+    setting["word_class_file"] = "./tmp.wordclass.sparse";
+    setting["feat_size"]  = feat_size;
+    setting["vocab_size"] = vocab_size;
+    setting["class_num"]  = 3;
+
+    map<string, SettingV> &w_filler = *(new map<string, SettingV>());
+      w_filler["init_type"] = SettingV(initializer::kUniform);
+      w_filler["range"] = SettingV(0.5f);
+    setting["w_class_filler"] = SettingV(&w_filler);
+    setting["b_class_filler"] = SettingV(&w_filler);
+    setting["w_word_filler"]  = SettingV(&w_filler);
+    setting["b_word_filler"]  = SettingV(&w_filler);
+    map<string, SettingV> &w_updater = *(new map<string, SettingV>());
+      w_updater["updater_type"] = SettingV(updater::kSGD);
+      w_updater["lr"] = SettingV(0.1f);
+    setting["w_class_updater"] = SettingV(&w_updater);
+    setting["b_class_updater"] = SettingV(&w_updater);
+    setting["w_word_updater"] = SettingV(&w_updater);
+    setting["b_word_updater"] = SettingV(&w_updater);
+  }
+  Layer<cpu> *layer = CreateLayer<cpu>(kWordClassSoftmaxLoss);
+  layer->PropAll();
+  layer->SetupLayer(setting, bottoms, tops, prnd);
+  layer->Reshape(bottoms, tops);
+  Node<cpu> &w_word = layer->params[2];
+
+  layer->ClearDiff(bottoms, tops);
+  layer->Forward(bottoms, tops);
+  layer->Backprop(bottoms, tops);
+  // densify the sparse diff, the layer sums over the labels, the loss averages
+  vector<float> dense(vocab_size * feat_size, 0.f);
+  for (int i = 0; i < w_word.idx.size(0); ++i) {
+    int r = static_cast<int>(w_word.idx[i]);
+    for (int j = 0; j < feat_size; ++j) dense[r * feat_size + j] += w_word.diff[i][j][0][0];
+  }
+  cout << "sparse diff rows: " << w_word.idx.size(0) << " of " << vocab_size << endl;
+
+  float eps = 0.001f, max_err = 0.f;
+  for (int i = 0; i < vocab_size * feat_size; ++i) {
+    float *p = w_word.data.dptr_ + i;
+    float ori = *p;
+    *p = ori + eps;
+    layer->Forward(bottoms, tops);
+    float loss1 = top3.data[0][0][0][0] * batch_size;
+    *p = ori - eps;
+    layer->Forward(bottoms, tops);
+    float loss2 = top3.data[0][0][0][0] * batch_size;
+    *p = ori;
+    float err = fabs((loss1 - loss2) / (2 * eps) - dense[i]);
+    if (err > max_err) max_err = err;
+  }
+  cout << "max |numerical - sparse| over the word embed: " << max_err << endl;
+
+  // a model saved with the dense shape keeps the row layout
+  vector<float> saved(w_word.data.dptr_, w_word.data.dptr_ + vocab_size * feat_size);
+  for (size_t i = 0; i < saved.size(); ++i) saved[i] += 1.f;
+  w_word.LoadData(&saved[0], Shape4(1, 1, vocab_size, feat_size));
+  bool same = w_word.data.shape_ == Shape4(vocab_size, feat_size, 1, 1);
+  for (size_t i = 0; same && i < saved.size(); ++i) same = w_word.data.dptr_[i] == saved[i];
+  cout << "dense shape load: " << (same ? "ok" : "FAILED") << endl;
+
+  cout << "Done." << endl;
+}
+
+// one step of a sparse param: distinct rows and their diff rows
+struct SparseStep {
+  vector<int> rows;
+  vector<float> diff;
+};
+
+// steps of random distinct rows, every row in each step if all_rows
+vector<SparseStep> MakeSparseSteps(int nstep, int nrow, int row_len, bool all_rows,
+                                   mshadow::Random<cpu>* prnd) {
+  vector<SparseStep> steps(nstep);
+  TensorContainer<cpu, 1> r(Shape1(nrow * row_len));
+  for (int s = 0; s < nstep; ++s) {
+    for (int i = 0; i < nrow; ++i) {
+      if (all_rows || rand() % 3 == 0) steps[s].rows.push_back(i);
+    }
+    if (steps[s].rows.empty()) steps[s].rows.push_back(rand() % nrow);
+    random_shuffle(steps[s].rows.begin(), steps[s].rows.end());
+    prnd->SampleUniform(&r, -1, 1);
+    steps[s].diff.assign(r.dptr_, r.dptr_ + steps[s].rows.size() * row_len);
+  }
+  return steps;
+}
+
+// runs the steps from init through UpdateSparse, or through the dense Update
+// with zero diff rows for the rows a step does not touch
+void RunUpdaterSteps(map<string, SettingV> setting, const vector<SparseStep> &steps,
+                     bool dense, Tensor<cpu, 4> init, TensorContainer<cpu, 4> &data,
+                     mshadow::Random<cpu>* prnd) {
+  int type = setting["updater_type"].iVal();
+  updater::Updater<cpu, 4> *up = updater::CreateUpdater<cpu, 4>(type, setting, prnd);
+  const int nrow = init.size(0), row_len = init.size(1);
+  data.Resize(init.shape_);
+  Copy(data, init);
+  for (size_t s = 0; s < steps.size(); ++s) {
+    const vector<int> &rows = steps[s].rows;
+    if (dense) {
+      TensorContainer<cpu, 4> diff(init.shape_, 0.f);
+      for (size_t i = 0; i < rows.size(); ++i) {
+        memcpy(diff.dptr_ + rows[i] * row_len, &steps[s].diff[i * row_len], sizeof(float) * row_len);
+      }
+      up->Update(data, diff);
+    } else {
+      TensorContainer<cpu, 4> diff(Shape4(rows.size(), row_len, 1, 1));
+      TensorContainer<cpu, 1> idx(Shape1(rows.size()));
+      for (size_t i = 0; i < rows.size(); ++i) idx[i] = rows[i];
+      memcpy(diff.dptr_, &steps[s].diff[0], sizeof(float) * rows.size() * row_len);
+      up->UpdateSparse(data, diff, idx);
+    }
+  }
+  utils::Check(nrow == data.size(0), "updater test: shape error.");
+  delete up;
+}
+
+float MaxAbsDiff(Tensor<cpu, 4> a, Tensor<cpu, 4> b) {
+  float m = 0.f;
+  for (size_t i = 0; i < a.shape_.Size(); ++i) m = max(m, static_cast<float>(fabs(a.dptr_[i] - b.dptr_[i])));
+  return m;
+}
+
+// SGD with momentum, Adagrad and Adam, the updaters with a sparse path
+vector<map<string, SettingV> > UpdaterTestSettings(void) {
+  vector<map<string, SettingV> > settings(3);
+  settings[0]["updater_type"] = SettingV(updater::kSGD);
+  settings[0]["lr"] = SettingV(0.1f);
+  settings[0]["momentum"] = SettingV(0.9f);
+  settings[0]["l2"] = SettingV(0.01f);
+  settings[1]["updater_type"] = SettingV(updater::kAdagrad);
+  settings[1]["lr"] = SettingV(0.1f);
+  settings[1]["l2"] = SettingV(0.01f);
+  settings[2]["updater_type"] = SettingV(updater::kAdam);
+  settings[2]["lr"] = SettingV(0.01f);
+  settings[2]["l2"] = SettingV(0.01f);
+  settings[2]["bias_correct"] = SettingV(true);
+  return settings;
+}
+
+const char *kUpdaterTestNames[] = {"SGD momentum", "Adagrad", "Adam"};
+
+// the row parallel lazy sparse steps against the dense steps, when every
+// row has a diff in every step they must agree
+void TestSparseUpdater(mshadow::Random<cpu>* prnd) {
+  cout << "G Check Sparse Updater." << endl;
+  const int nrow = 50, row_len = 70, nstep = 20;
+  TensorContainer<cpu, 4> init(Shape4(nrow, row_len, 1, 1));
+  prnd->SampleUniform(&init, -1, 1);
+  vector<SparseStep> every = MakeSparseSteps(nstep, nrow, row_len, true, prnd);
+  vector<map<string, SettingV> > settings = UpdaterTestSettings();
+
+  TensorContainer<cpu, 4> a, b;
+  for (int u = 0; u < 3; ++u) {
+    RunUpdaterSteps(settings[u], every, true, init, a, prnd);
+    RunUpdaterSteps(settings[u], every, false, init, b, prnd);
+    cout << kUpdaterTestNames[u] << " dense vs sparse, every row: " << MaxAbsDiff(a, b) << endl;
+  }
+  cout << "Done." << endl;
+}
+
+// the compact state modes against the full state, on random row subsets
+void TestUpdaterState(mshadow::Random<cpu>* prnd) {
+  cout << "G Check Updater State." << endl;
+  const int nrow = 50, row_len = 70, nstep = 20;
+  TensorContainer<cpu, 4> init(Shape4(nrow, row_len, 1, 1));
+  prnd->SampleUniform(&init, -1, 1);
+  vector<SparseStep> some = MakeSparseSteps(nstep, nrow, row_len, false, prnd);
+  vector<map<string, SettingV> > settings = UpdaterTestSettings();
+
+  TensorContainer<cpu, 4> a, b;
+  for (int u = 0; u < 3; ++u) {
+    RunUpdaterSteps(settings[u], some, false, init, a, prnd);
+    map<string, SettingV> touched = settings[u];
+    touched["state"] = SettingV("touched");
+    RunUpdaterSteps(touched, some, false, init, b, prnd);
+    cout << kUpdaterTestNames[u] << " full vs touched state: " << MaxAbsDiff(a, b) << endl;
+  }
+
+  // approximate modes, the deviation from the full state after the steps
+  RunUpdaterSteps(settings[1], some, false, init, a, prnd);
+  map<string, SettingV> row_wise = settings[1];
+  row_wise["state"] = SettingV("row_wise");
+  RunUpdaterSteps(row_wise, some, false, init, b, prnd);
+  cout << "Adagrad full vs row_wise state: " << MaxAbsDiff(a, b) << endl;
+
+  RunUpdaterSteps(settings[2], some, false, init, a, prnd);
+  map<string, SettingV> int8 = settings[2];
+  int8["state"] = SettingV("int8");
+  RunUpdaterSteps(int8, some, false, init, b, prnd);
+  cout << "Adam full vs int8 state: " << MaxAbsDiff(a, b)
+       << " (lr " << settings[2]["lr"].fVal() << ", " << nstep << " steps)" << endl;
+
+  cout << "Done." << endl;
+}
+
+// params stepped as one flat tensor in the param arena against each param
+// stepped by its own updater, odd shapes so the arena pads between them
+void TestParamArena(mshadow::Random<cpu>* prnd) {
+  cout << "G Check ParamArena." << endl;
+  const int nparam = 3, nstep = 10;
+  const mshadow::Shape<4> shapes[nparam] = {Shape4(1, 1, 7, 13), Shape4(1, 1, 1, 5), Shape4(1, 1, 30, 20)};
+  vector<map<string, SettingV> > settings = UpdaterTestSettings();
+  set<string> tags;
+  tags.insert("Train");
+
+  for (int u = 0; u < 3; ++u) {
+    Node<cpu> own[nparam], fused[nparam];
+    for (int i = 0; i < nparam; ++i) {
+      Node<cpu> *nodes[2] = {&own[i], &fused[i]};
+      for (int k = 0; k < 2; ++k) {
+        nodes[k]->data.Resize(shapes[i], 0.f);
+        nodes[k]->diff.Resize(shapes[i], 0.f);
+        nodes[k]->inited_data = nodes[k]->inited_diff = true;
+        nodes[k]->updater_ = updater::CreateUpdater<cpu, 4>(settings[u]["updater_type"].iVal(),
+                                                             settings[u], prnd);
+      }
+      prnd->SampleUniform(&own[i].data, -1, 1);
+      Copy(fused[i].data, own[i].data);
+    }
+    net::ParamArena<cpu> arena;
+    for (int i = 0; i < nparam; ++i) arena.Add(&fused[i], tags);
+    arena.Build(prnd);
+    for (int s = 0; s < nstep; ++s) {
+      for (int i = 0; i < nparam; ++i) {
+        prnd->SampleUniform(&own[i].diff, -1, 1);
+        Copy(fused[i].diff, own[i].diff);
+        own[i].Update();
+      }
+      arena.Step("Train");
+    }
+    float m = 0.f;
+    for (int i = 0; i < nparam; ++i) {
+      utils::Check(fused[i].in_arena, "ParamArena test: param %d is not in the arena.", i);
+      m = max(m, MaxAbsDiff(own[i].data, fused[i].data));
+    }
+    cout << kUpdaterTestNames[u] << " own vs arena steps: " << m << endl;
+    for (int i = 0; i < nparam; ++i) {
+      delete own[i].updater_;
+      delete fused[i].updater_;
+    }
+  }
+  cout << "Done." << endl;
+}
+
 void TestPosPredRepLayer(mshadow::Random<cpu>* prnd) {
   cout << "G Check PosPredRepLayer." << endl;
   Node<cpu> bottom0, bottom1, bottom2;
@@ -6145,6 +6425,10 @@ int main(int argc, char *argv[]) {
   // TestFlattenLayer(mshadow::Random<cpu>* prnd);
   // TestSoftmaxFuncLayer(&rnd);
   // TestWordClassSoftmaxLayer(&rnd);
+  // TestWordClassSoftmaxSparseLayer(&rnd);
+  // TestSparseUpdater(&rnd);
+  // TestUpdaterState(&rnd);
+  // TestParamArena(&rnd);
   // TestGatingLayer(&rnd);
   // TestSoftmaxVarLenFuncLayer(&rnd);
   // TestSumLayer(&rnd);
@@ -3,7 +3,7 @@
 
 #include <mshadow/tensor.h>
 #include "./initializer.h"
-#include <fstream>
+#include "../utils/text_loader.h"
 
 namespace textnet {
 namespace initializer {
@@ -24,6 +24,8 @@ class FileInitializer : public Initializer<xpu, dim>{
     // require value, set to SettingV(),
     // it will force custom to set in config
     this->defaults["file_path"] = SettingV();
+    // keep file_path + ".bin_cache" for faster loads
+    this->defaults["bin_cache"] = SettingV(true);
     
     Initializer<xpu, dim>::Require(setting);
   }
@@ -33,29 +35,19 @@ class FileInitializer : public Initializer<xpu, dim>{
     
     this->init_type = setting["init_type"].iVal();
     file_path = setting["file_path"].sVal();
+    bin_cache = setting["bin_cache"].bVal();
   }
   
   virtual void DoInitialize(mshadow::Tensor<xpu, dim> data) {
-    std::ifstream ifs(file_path.c_str());
-    vector<float> vals;
-    float s = 0;
-    while (ifs >> s) {
-        vals.push_back(s);
-    }
-    ifs.close();
-    utils::Check(vals.size() == data.shape_.Size(), "FileInitializer: parameter file error. %d params in file, but we need %d params.", vals.size(), data.shape_.Size());
-
     mshadow::Tensor<xpu, 2, float> mat = data.FlatTo2D();
-    index_t idx = 0;
-    for (index_t i = 0; i < mat.size(0); ++i) {
-      for (index_t j = 0; j < mat.size(1); ++j) {
-        mat[i][j] = vals[idx];
-        idx += 1;
-      }
-    }
+    utils::Check(mat.stride_ == mat.size(1), "FileInitializer: param rows must be contiguous.");
+    utils::TextLoader loader(file_path, bin_cache);
+    size_t n = loader.LoadStream(mat.dptr_, data.shape_.Size());
+    utils::Check(n == data.shape_.Size(), "FileInitializer: parameter file error. %d params in file, but we need %d params.", n, data.shape_.Size());
   }
   
   string file_path;
+  bool bin_cache;
 };
 }  // namespace initializer
 }  // namespace textnet
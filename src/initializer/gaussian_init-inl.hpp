@@ -49,7 +49,9 @@ class GaussianInitializer : public Initializer<xpu, dim>{
 		this->sigma = sqrt(2.0 / node_size);
 		cout << "MSRA INITIAL: " << this->sigma << endl;
 	}
-    this->prnd_->SampleGaussian(&data, mu, sigma);
+    if (!this->CounterGaussian(data, mu, sigma)) {
+      this->prnd_->SampleGaussian(&data, mu, sigma);
+    }
   }
   
   float mu;
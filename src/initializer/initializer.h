@@ -9,6 +9,7 @@
 #include "../utils/utils.h"
 #include "../utils/io.h"
 #include "../utils/settingv.h"
+#include "../utils/philox.h"
 
 /*! \brief namespace of textnet */
 namespace textnet {
@@ -40,6 +41,9 @@ class Initializer {
   // To implement this function you need call base function in the end
   virtual void Require(std::map<std::string, SettingV> &setting) {
     defaults["init_type"] = SettingV(kZero);
+    // "mshadow" or "philox", the counter based generator of utils/philox.h
+    defaults["rng"] = SettingV("mshadow");
+    defaults["seed"] = SettingV(0);
     for (std::map<std::string, SettingV>::iterator it = defaults.begin();
           it != defaults.end(); ++it) {
       std::string name = it->first;
@@ -58,6 +62,14 @@ class Initializer {
   virtual void SetupInitializer(std::map<std::string, SettingV> &setting) {
     init_type = 0;
     this->Require(setting);
+    std::string rng = setting["rng"].sVal();
+    utils::Check(rng == "mshadow" || rng == "philox",
+                 "Initializer: unknown rng %s.", rng.c_str());
+    use_philox = rng == "philox";
+    fallback_logged_ = false;
+    // every initializer is one stream, numbered in the order of creation
+    crnd_.Seed(setting["seed"].iVal(), NextStream());
+    init_step_ = 0;
   }
   
   virtual void DoInitialize(mshadow::Tensor<xpu, dim> data) {}
@@ -65,8 +77,40 @@ class Initializer {
   virtual InitType GetInitType() { return init_type; }
   
  protected:
+  // fill data from the counter based generator, each call is a new step;
+  // false if rng is mshadow or data is not a plain cpu tensor
+  inline bool CounterGaussian(mshadow::Tensor<xpu, dim> data, float mu, float sigma) {
+    if (!CounterUsable(data)) return false;
+    crnd_.FillGaussian(data.dptr_, data.shape_.Size(), mu, sigma, init_step_++);
+    return true;
+  }
+  inline bool CounterUniform(mshadow::Tensor<xpu, dim> data, float lower, float upper) {
+    if (!CounterUsable(data)) return false;
+    crnd_.FillUniform(data.dptr_, data.shape_.Size(), lower, upper, init_step_++);
+    return true;
+  }
+  inline bool CounterUsable(const mshadow::Tensor<xpu, dim> &data) {
+    if (!use_philox) return false;
+    if (xpu::kDevCPU && data.stride_ == data.size(dim - 1)) return true;
+    if (!fallback_logged_) {
+      utils::Printf("Initializer: rng philox is cpu only and needs a contiguous tensor, "
+                    "this filler draws from mshadow.\n");
+      fallback_logged_ = true;
+    }
+    return false;
+  }
+  inline static unsigned NextStream(void) {
+    static unsigned stream = 0;
+    return stream++;
+  }
+
+
   InitType init_type;
   mshadow::Random<xpu>* prnd_;
+  bool use_philox;
+  utils::CounterRandom crnd_;
+  unsigned long init_step_;
+  bool fallback_logged_;
   // required setting
   std::map<std::string, SettingV> defaults;
   
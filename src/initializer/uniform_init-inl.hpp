@@ -40,7 +40,9 @@ class UniformInitializer : public Initializer<xpu, dim>{
   }
   
   virtual void DoInitialize(mshadow::Tensor<xpu, dim> data) {
-    this->prnd_->SampleUniform(&data, -range, range);
+    if (!this->CounterUniform(data, -range, range)) {
+      this->prnd_->SampleUniform(&data, -range, range);
+    }
   }
   
   float range;
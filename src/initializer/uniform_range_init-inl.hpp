@@ -43,7 +43,9 @@ class UniformRangeInitializer : public Initializer<xpu, dim>{
   }
   
   virtual void DoInitialize(mshadow::Tensor<xpu, dim> data) {
-    this->prnd_->SampleUniform(&data, lower, upper);
+    if (!this->CounterUniform(data, lower, upper)) {
+      this->prnd_->SampleUniform(&data, lower, upper);
+    }
   }
   
   float lower, upper;
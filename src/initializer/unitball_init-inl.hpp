@@ -39,7 +39,9 @@ class UnitballInitializer : public Initializer<xpu, dim>{
   }
   
   virtual void DoInitialize(mshadow::Tensor<xpu, dim> data) {
-    this->prnd_->SampleGaussian(&data, mu, sigma);
+    if (!this->CounterGaussian(data, mu, sigma)) {
+      this->prnd_->SampleGaussian(&data, mu, sigma);
+    }
     for (int i = 0; i < data.shape_.Size(); i += vec_len) {
 	  float norm = 0.0f;
       for (int j = 0; j < vec_len; ++j) {
@@ -6,6 +6,7 @@
 #include <mshadow/tensor.h>
 #include "../layer.h"
 #include "../../utils/utils.h"
+#include "../../utils/batch_gemm.h"
 
 namespace textnet {
 namespace layer {
@@ -237,84 +238,107 @@ void PrintTensor(const char * name, mshadow::Tensor<xpu, 4> x) {
     }
   }
 
+  // Collect per-example kernel and length info, each example convolves with
+  // its own kernel so shapes of the batched gemm may differ between examples
+  void SetupBatch(const std::vector<Node<xpu>*> &bottom,
+                  const std::vector<Node<xpu>*> &top, bool set_top_len) {
+    mshadow::Tensor<xpu, 2> bottom_len = bottom[0]->length;
+    mshadow::Tensor<xpu, 2> top_len = top[0]->length;
+    mshadow::Tensor<xpu, 2> weights_len = bottom[1]->length;
+    const index_t nbatch = bottom[0]->data.size(0);
+
+    ex_kernel_y.resize(nbatch);
+    ex_kernel_x.resize(nbatch);
+    ex_top_len_y.resize(nbatch);
+    ex_top_len_x.resize(nbatch);
+    ex_bottom_len_y.resize(nbatch);
+    ex_bottom_len_x.resize(nbatch);
+
+    for (index_t i = 0; i < nbatch; ++i) {
+      channel_in = weights_len[i][0];
+      kernel_y = weights_len[i][1];
+      kernel_x = weights_len[i][2];
+      utils::Check(channel_in == bottom[0]->data.size(1),
+                   "ConvolutionParamLayer: kernel channel_in must equal bottom channel.");
+      if (set_top_len) {
+        if (dim == 1) {
+          top_len[i][0] = (bottom_len[i][0] + pad_y * 2 - kernel_y) / stride_y + 1; // all input channels shoud have the same length
+          utils::Check(top_len[i][0] > 0, "ConvolutionParamLayer: top_len must positive. i=%d, bottom_len=%f, top_len=%f", i, bottom_len[i][0], top_len[i][0]);
+          utils::Check(pad_x == 0, "ConvolutionParamLayer: dim=1 pad_x!=0.");
+        } else {
+          top_len[i][0] = (bottom_len[i][0] + pad_y * 2 - kernel_y) / stride_y + 1;
+          top_len[i][1] = (bottom_len[i][1] + pad_x * 2 - kernel_x) / stride_x + 1;
+          utils::Check(top_len[i][0] > 0 && top_len[i][1] > 0, "ConvolutionParamLayer: top_len must positive. i=%d, bottom_len=(%f,%f), top_len=(%f,%f)",
+                  i, bottom_len[i][0], bottom_len[i][1], top_len[i][0], top_len[i][1]);
+        }
+      }
+      if (dim == 1) {
+        ex_top_len_x[i] = 1;
+        ex_top_len_y[i] = top_len[i][0];
+        ex_bottom_len_x[i] = kernel_x;
+        ex_bottom_len_y[i] = bottom_len[i][0];
+      } else {
+        ex_top_len_y[i] = top_len[i][0];
+        ex_top_len_x[i] = top_len[i][1];
+        ex_bottom_len_y[i] = bottom_len[i][0];
+        ex_bottom_len_x[i] = bottom_len[i][1];
+      }
+      ex_kernel_y[i] = kernel_y;
+      ex_kernel_x[i] = kernel_x;
+    }
+
+    // column matrices of all examples are packed with the same leading
+    // dimension as the generated kernels, so one strided gemm covers them
+    max_pos = shape_out[2] * shape_out[3];
+    ld_kernel = bottom[1]->data_d3().size(2);
+    col_batch_.Resize(mshadow::Shape2(nbatch, max_pos * ld_kernel));
+    out_batch_.Resize(mshadow::Shape2(nbatch, channel_out * max_pos));
+  }
+
   virtual void Forward(const std::vector<Node<xpu>*> &bottom,
                        const std::vector<Node<xpu>*> &top) {
     using namespace mshadow::expr;
     mshadow::Tensor<xpu, 4> bottom_data = bottom[0]->data;
     mshadow::Tensor<xpu, 4> top_data = top[0]->data;
-    mshadow::Tensor<xpu, 2> bottom_len = bottom[0]->length;
-    mshadow::Tensor<xpu, 2> top_len = top[0]->length;
 
     mshadow::Tensor<xpu, 3> weights_data = bottom[1]->data_d3();
     mshadow::Tensor<xpu, 2> biases_data = bottom[2]->data_d2();
-    mshadow::Tensor<xpu, 2> weights_len = bottom[1]->length;
 
 	utils::Check(bottom_data.size(0) == weights_data.size(0), "ConvolutionParamLayer: different batch size on kernel. %d %d", bottom_data.size(0), weights_data.size(0)); 
 	utils::Check(bottom_data.size(0) <= biases_data.size(0), "ConvolutionParamLayer: different batch size on bias. %d %d", bottom_data.size(0), biases_data.size(0)); 
 
-    const index_t nbatch = bottom_data.size(0);
+    const int nbatch = bottom_data.size(0);
 	top_data = 0;
-	int top_len_x = 0, top_len_y = 0, bottom_len_x = 0, bottom_len_y = 0;
+    SetupBatch(bottom, top, true);
 
-    for (index_t i = 0; i < nbatch; ++i) {
-      // Specify kernels 
-      mshadow::Tensor<xpu, 1> bias_data = biases_data[i];
-      channel_in = weights_len[i][0];
-      kernel_y = weights_len[i][1];
-      kernel_x = weights_len[i][2];
+    std::vector<utils::GemmShape> shapes(nbatch);
+    #pragma omp parallel for
+    for (int i = 0; i < nbatch; ++i) {
+      int n_pos = ex_top_len_y[i] * ex_top_len_x[i];
+      int n_k = channel_in * ex_kernel_y[i] * ex_kernel_x[i];
+      mshadow::Tensor<xpu, 2> col(col_batch_[i].dptr_, mshadow::Shape2(max_pos, ld_kernel));
+      unpack_patch2col_var(col, bottom_data[i], ex_bottom_len_y[i], ex_bottom_len_x[i],
+                           ex_kernel_y[i], ex_kernel_x[i], stride_y, stride_x, pad_y, pad_x);
+      shapes[i] = utils::GemmShape(channel_out, n_pos, n_k);
+    }
+
+    // out_i (channel_out x pos) = kernel_i (channel_out x k) * col_i^T
+    utils::GemmStridedBatched(false, true, shapes, 1.0f,
+        weights_data.dptr_, ld_kernel, weights_data[0].shape_.Size(),
+        col_batch_.dptr_, ld_kernel, col_batch_[0].shape_.Size(),
+        0.0f, out_batch_.dptr_, max_pos, out_batch_[0].shape_.Size());
 
-      weight_data.Resize(mshadow::Shape2(channel_out, channel_in * kernel_x * kernel_y));
-      for (index_t j = 0; j < channel_out; ++j) {
-        for (index_t k = 0; k < channel_in * kernel_x * kernel_y; ++k) {
-          weight_data[j][k] = weights_data[i][j][k];
+    #pragma omp parallel for
+    for (int i = 0; i < nbatch; ++i) {
+      int top_len_x = ex_top_len_x[i];
+      int n_pos = ex_top_len_y[i] * top_len_x;
+      for (int ch = 0; ch < channel_out; ++ch) {
+        const float *out = out_batch_[i].dptr_ + ch * max_pos;
+        float bias = no_bias ? 0.f : biases_data[i][ch];
+        for (int idx = 0; idx < n_pos; ++idx) {
+          top_data[i][ch][idx / top_len_x][idx % top_len_x] = out[idx] + bias;
         }
       }
-
-      temp_col_.Resize(mshadow::Shape2(shape_out[2]*shape_out[3], channel_in*kernel_x*kernel_y));
-      // Share the memory
-      temp_dif_ = temp_col_;
-      temp_data_.Resize(mshadow::Shape2(shape_out[2]*shape_out[3], channel_out));
-    
-      if (dim == 1) {
-          top_len[i][0] = (bottom_len[i][0] + pad_y * 2 - kernel_y) / stride_y + 1; // all input channels shoud have the same length
-		  utils::Check(top_len[i][0] > 0, "ConvolutionParamLayer: top_len must positive. i=%d, bottom_len=%f, top_len=%f", i, bottom_len[i][0], top_len[i][0]);
-		  utils::Check(pad_x == 0, "ConvolutionParamLayer: dim=1 pad_x!=0.");
-		  top_len_x = 1;
-		  top_len_y = top_len[i][0];
-		  bottom_len_x = kernel_x;
-		  bottom_len_y = bottom_len[i][0];
-	  } else {
-		  top_len[i][0] = (bottom_len[i][0] + pad_y * 2 - kernel_y) / stride_y + 1;
-		  top_len[i][1] = (bottom_len[i][1] + pad_x * 2 - kernel_x) / stride_x + 1;
-		  utils::Check(top_len[i][0] > 0 && top_len[i][1] > 0, "ConvolutionParamLayer: top_len must positive. i=%d, bottom_len=(%f,%f), top_len=(%f,%f)",
-				  i, bottom_len[i][0], bottom_len[i][1], top_len[i][0], top_len[i][1]);
-		  top_len_y = top_len[i][0];
-		  top_len_x = top_len[i][1];
-		  bottom_len_y = bottom_len[i][0];
-		  bottom_len_x = bottom_len[i][1];
-	  }
-
-      // cout << "kernel: " << kernel_x << ", " << kernel_y << endl;
-      // cout << "bottom: " << bottom_len_x << ", " << bottom_len_y << endl;
-      // cout << "top: " << top_len_x << ", " << top_len_y << endl;
-
-      unpack_patch2col_var(temp_col_, bottom_data[i], bottom_len_y, bottom_len_x,
-					   kernel_y, kernel_x, stride_y, stride_x, pad_y, pad_x);
-	  // PrintTensor("temp_col_", temp_col_);
-	  temp_data_.Resize(mshadow::Shape2(top_len_y * top_len_x, channel_out));
-      temp_data_ = dot(temp_col_.Slice(0, top_len_y * top_len_x), weight_data.T());
-	  // PrintTensor("temp_data_", temp_data_);
-	  for (index_t idx = 0; idx < temp_data_.size(0); ++idx) {
-		for (index_t ch = 0; ch < temp_data_.size(1); ++ch) {
-		  int row = idx / top_len_x;
-		  int col = idx % top_len_x;
-		  if (no_bias) {
-			top_data[i][ch][row][col] = temp_data_[idx][ch];
-		  } else {
-			top_data[i][ch][row][col] = temp_data_[idx][ch] + bias_data[ch];
-		  }
-		}
-	  }
     }
   }
   
@@ -324,88 +348,67 @@ void PrintTensor(const char * name, mshadow::Tensor<xpu, 4> x) {
     mshadow::Tensor<xpu, 4> top_diff = top[0]->diff;
     mshadow::Tensor<xpu, 4> bottom_data = bottom[0]->data;
     mshadow::Tensor<xpu, 4> bottom_diff = bottom[0]->diff;
-    mshadow::Tensor<xpu, 2> top_len = top[0]->length;
-    mshadow::Tensor<xpu, 2> bottom_len = bottom[0]->length;
 
     mshadow::Tensor<xpu, 3> weights_data = bottom[1]->data_d3();
     mshadow::Tensor<xpu, 3> weights_diff = bottom[1]->diff_d3();
     mshadow::Tensor<xpu, 2> biases_diff = bottom[2]->diff_d2();
-    mshadow::Tensor<xpu, 2> weights_len = bottom[1]->length;
 
-    const index_t nbatch = bottom_data.size(0);
-	int top_len_x = 0, top_len_y = 0, bottom_len_x = 0, bottom_len_y = 0;
-        
-    for (int i = 0; i < nbatch; ++i) {
-      // Specify kernels 
-      mshadow::Tensor<xpu, 1> bias_diff = biases_diff[i];
-      channel_in = weights_len[i][0];
-      kernel_y = weights_len[i][1];
-      kernel_x = weights_len[i][2];
+    const int nbatch = bottom_data.size(0);
+    SetupBatch(bottom, top, false);
 
-      weight_data.Resize(mshadow::Shape2(channel_out, channel_in * kernel_x * kernel_y));
-      weight_diff.Resize(mshadow::Shape2(channel_out, channel_in * kernel_x * kernel_y));
-      weight_diff = 0.0;
-
-      for (index_t j = 0; j < channel_out; ++j) {
-        for (index_t k = 0; k < channel_in * kernel_x * kernel_y; ++k) {
-          weight_data[j][k] = weights_data[i][j][k];
+    // gather top diff as (channel_out x pos) per example, rebuild columns
+    std::vector<utils::GemmShape> shapes(nbatch);
+    #pragma omp parallel for
+    for (int i = 0; i < nbatch; ++i) {
+      int top_len_x = ex_top_len_x[i];
+      int n_pos = ex_top_len_y[i] * top_len_x;
+      for (int ch = 0; ch < channel_out; ++ch) {
+        float *out = out_batch_[i].dptr_ + ch * max_pos;
+        for (int idx = 0; idx < n_pos; ++idx) {
+          out[idx] = top_diff[i][ch][idx / top_len_x][idx % top_len_x];
         }
       }
-
-      if (dim == 1) {
-		  top_len_x = 1;
-		  top_len_y = top_len[i][0];
-		  bottom_len_x = kernel_x;
-		  bottom_len_y = bottom_len[i][0];
-	  } else {
-		  top_len_y = top_len[i][0];
-		  top_len_x = top_len[i][1];
-		  bottom_len_y = bottom_len[i][0];
-		  bottom_len_x = bottom_len[i][1];
-	  }
-
-      temp_col_.Resize(mshadow::Shape2(top_len_y*top_len_x, channel_in*kernel_x*kernel_y));
-      // Share the memory
-      temp_dif_ = temp_col_;
-      temp_data_.Resize(mshadow::Shape2(top_len_y*top_len_x, channel_out));
-    
-	  for (index_t idx = 0; idx < temp_data_.size(0); ++idx) {
-		for (index_t ch = 0; ch < temp_data_.size(1); ++ch) {
-		  int row = idx / top_len_x;
-		  int col = idx % top_len_x;
-		  temp_data_[idx][ch] = top_diff[i][ch][row][col];
-		}
-	  }
-
-	  //PrintTensor("temp_data_", temp_data_);
-
-      unpack_patch2col_var(temp_col_, bottom_data[i], bottom_len_y, bottom_len_x, 
-					   kernel_y, kernel_x, stride_y, stride_x, pad_y, pad_x);
-      
-	  //PrintTensor("temp_col_", temp_col_);
-
-      if (this->prop_error[1]) {
-        weight_diff += dot(temp_data_.T(), temp_col_.Slice(0, top_len_y * top_len_x));
-        for (index_t j = 0; j < channel_out; ++j) {
-          for (index_t k = 0; k < channel_in * kernel_x * kernel_y; ++k) {
-            weights_diff[i][j][k] += weight_diff[j][k];
+      mshadow::Tensor<xpu, 2> col(col_batch_[i].dptr_, mshadow::Shape2(max_pos, ld_kernel));
+      unpack_patch2col_var(col, bottom_data[i], ex_bottom_len_y[i], ex_bottom_len_x[i],
+                           ex_kernel_y[i], ex_kernel_x[i], stride_y, stride_x, pad_y, pad_x);
+
+      if (!no_bias && this->prop_error[2]) {
+        for (int ch = 0; ch < channel_out; ++ch) {
+          const float *out = out_batch_[i].dptr_ + ch * max_pos;
+          float sum = 0.f;
+          for (int idx = 0; idx < n_pos; ++idx) {
+            sum += out[idx];
           }
+          biases_diff[i][ch] += sum;
         }
       }
+      shapes[i] = utils::GemmShape(channel_out, channel_in * ex_kernel_y[i] * ex_kernel_x[i], n_pos);
+    }
 
-	  //PrintTensor("weight_diff", weight_diff);
-
-	  if (!no_bias && this->prop_error[2]) {
-		bias_diff += sumall_except_dim<1>(temp_data_);
-	  }
+    if (this->prop_error[1]) {
+      // kernel_diff_i (channel_out x k) += out_i (channel_out x pos) * col_i
+      utils::GemmStridedBatched(false, false, shapes, 1.0f,
+          out_batch_.dptr_, max_pos, out_batch_[0].shape_.Size(),
+          col_batch_.dptr_, ld_kernel, col_batch_[0].shape_.Size(),
+          1.0f, weights_diff.dptr_, ld_kernel, weights_diff[0].shape_.Size());
+    }
 
-      if (this->prop_error[0]) {
-		temp_dif_.Resize(mshadow::Shape2(top_len_y * top_len_x, channel_in * kernel_x * kernel_y));
-        temp_dif_ = dot(temp_data_, weight_data);
-        pack_col2patch_var(bottom_diff[i], temp_dif_, bottom_len_y, bottom_len_x,
-              kernel_y, kernel_x, stride_y, stride_x, pad_y, pad_x);
+    if (this->prop_error[0]) {
+      // col_diff_i (pos x k) = out_i^T * kernel_i, reuse the column buffer
+      for (int i = 0; i < nbatch; ++i) {
+        shapes[i] = utils::GemmShape(shapes[i].k, shapes[i].n, shapes[i].m);
+      }
+      utils::GemmStridedBatched(true, false, shapes, 1.0f,
+          out_batch_.dptr_, max_pos, out_batch_[0].shape_.Size(),
+          weights_data.dptr_, ld_kernel, weights_data[0].shape_.Size(),
+          0.0f, col_batch_.dptr_, ld_kernel, col_batch_[0].shape_.Size());
+
+      #pragma omp parallel for
+      for (int i = 0; i < nbatch; ++i) {
+        mshadow::Tensor<xpu, 2> col(col_batch_[i].dptr_, mshadow::Shape2(max_pos, ld_kernel));
+        pack_col2patch_var(bottom_diff[i], col, ex_bottom_len_y[i], ex_bottom_len_x[i],
+              ex_kernel_y[i], ex_kernel_x[i], stride_y, stride_x, pad_y, pad_x);
       }
-      
     }
   }
 
@@ -420,12 +423,16 @@ void PrintTensor(const char * name, mshadow::Tensor<xpu, 4> x) {
   int channel_out;
   int dim;
   bool no_bias;
+  int max_pos;
+  int ld_kernel;
   mshadow::Shape<4> shape_out;
-  mshadow::TensorContainer<xpu, 2> temp_col_;
-  mshadow::TensorContainer<xpu, 2> temp_dif_;
-  mshadow::TensorContainer<xpu, 2> temp_data_;
-  mshadow::TensorContainer<xpu, 2> weight_data;
-  mshadow::TensorContainer<xpu, 2> weight_diff;
+  // per example kernel size and lengths
+  std::vector<int> ex_kernel_y, ex_kernel_x;
+  std::vector<int> ex_top_len_y, ex_top_len_x;
+  std::vector<int> ex_bottom_len_y, ex_bottom_len_x;
+  // packed column matrices and outputs of all examples
+  mshadow::TensorContainer<xpu, 2> col_batch_;
+  mshadow::TensorContainer<xpu, 2> out_batch_;
 };
 }  // namespace layer
 }  // namespace textnet
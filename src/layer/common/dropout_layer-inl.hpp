@@ -9,6 +9,7 @@
 #include <mshadow/tensor.h>
 #include "../layer.h"
 #include "../op.h"
+#include "../../utils/philox.h"
 
 namespace textnet {
 namespace layer {
@@ -26,6 +27,10 @@ class DropoutLayer : public Layer<xpu>{
   virtual void Require() {
     // default value, just set the value you want
     this->defaults["rate"] = SettingV(0.5f);
+    // "philox": masks from a counter based stream keyed by seed and layer
+    // name, the same on any thread count
+    this->defaults["rng"] = SettingV("mshadow");
+    this->defaults["seed"] = SettingV(0);
     // require value, set to SettingV(),
     // it will force custom to set in config
     
@@ -46,6 +51,14 @@ class DropoutLayer : public Layer<xpu>{
     rate = setting["rate"].fVal(); 
     utils::Check(rate >= 0.0 && rate <= 1.0, 
                   "Dropout rate must between 0.0 and 1.0.");    
+    std::string rng = setting["rng"].sVal();
+    utils::Check(rng == "mshadow" || rng == "philox",
+                  "DropoutLayer: unknown rng %s.", rng.c_str());
+    use_philox = rng == "philox";
+    utils::Check(!use_philox || xpu::kDevCPU,
+                  "DropoutLayer: rng philox is cpu only, use mshadow on gpu.");
+    crnd_.Seed(setting["seed"].iVal(), utils::StreamId(this->layer_name));
+    mask_step = 0;
   }
   
   virtual void Reshape(const std::vector<Node<xpu>*> &bottom,
@@ -58,6 +71,8 @@ class DropoutLayer : public Layer<xpu>{
                   
     top[0]->Resize(bottom[0]->data.shape_, bottom[0]->length.shape_, true);
     mask.Resize(bottom[0]->data.shape_, true);
+    utils::Check(!use_philox || mask.stride_ == mask.size(3),
+                  "DropoutLayer: rng philox needs a contiguous mask.");
 
     if (show_info) {
         bottom[0]->PrintShape("bottom0");
@@ -88,7 +103,11 @@ class DropoutLayer : public Layer<xpu>{
 
     const float pkeep = 1.0f - rate;
     if (this->phrase_type == kTrain) {
-      mask = F<op::threshold>(this->prnd_->uniform(mask.shape_), pkeep); 
+      if (use_philox) {
+        crnd_.FillBernoulli(mask.dptr_, mask.shape_.Size(), pkeep, mask_step++);
+      } else {
+        mask = F<op::threshold>(this->prnd_->uniform(mask.shape_), pkeep); 
+      }
       top_data = bottom_data * mask;
     } else {
       top_data = bottom_data * pkeep;
@@ -108,6 +127,9 @@ class DropoutLayer : public Layer<xpu>{
  protected:
   float rate;
   mshadow::TensorContainer<xpu, 4> mask;
+  bool use_philox;
+  utils::CounterRandom crnd_;
+  unsigned long mask_step;
 
 };
 }  // namespace layer
@@ -4,6 +4,7 @@
 #include <mshadow/tensor.h>
 #include "../layer.h"
 #include "../op.h"
+#include "../../utils/topk_engine.h"
 
 namespace textnet {
 namespace layer {
@@ -99,7 +100,8 @@ class DynamicKMaxPoolingLayer : public Layer<xpu>{
   typedef mshadow::Tensor<xpu,2> Tensor2D;
   typedef mshadow::Tensor<xpu,2,int> Tensor2DInt;
 
-  void pooling_one_matrix(Tensor2D t_in, Tensor2D t_out, Tensor2DInt pos, int len, int k) {
+  void pooling_one_matrix(Tensor2D t_in, Tensor2D t_out, Tensor2DInt pos, int len, int k,
+                          std::vector<int> &sel, utils::TopKWorkspace *ws) {
     utils::Check(t_out.size(0) == pos.size(0) && t_out.size(1) == pos.size(1), "DynamicKMaxPoolingLayer: size error.");
     utils::Check(t_out.size(1) == t_in.size(1), "DynamicKMaxPoolingLayer: size error.");
     utils::Check(k <= t_out.size(0) && len <= t_in.size(0), "DynamicKMaxPoolingLayer: size error.");
@@ -114,22 +116,13 @@ class DynamicKMaxPoolingLayer : public Layer<xpu>{
         }
       }
     } else {
-      vector<float> v(len, 0);
+      sel.resize(k);
       for (int j = 0; j < t_in.size(1); ++j) {
-        for (int i = 0; i < len; ++i) {
-          v[i] = t_in[i][j];
-        }
-        std::partial_sort(v.begin(), v.begin() + k, v.end(), std::greater<float>());
-        float topk_threshold = v[k-1];
-
-        int p = 0;
-        for (int i = 0; i < len; ++i) {
-          if (t_in[i][j] >= topk_threshold) {
-            t_out[p][j] = t_in[i][j];
-            pos[p][j] = i;
-            ++p;
-            if (p == k) break;
-          }
+        const float *col = ws->Gather(t_in.dptr_ + j, len, t_in.stride_);
+        utils::TopKByPos(col, len, k, &sel[0], NULL, ws);
+        for (int p = 0; p < k; ++p) {
+          t_out[p][j] = col[sel[p]];
+          pos[p][j] = sel[p];
         }
       }
     }
@@ -157,8 +150,15 @@ class DynamicKMaxPoolingLayer : public Layer<xpu>{
     mshadow::Tensor<xpu, 2> top_len      = top[0]->length;
 
     top_data = 0; pos = -1; top_len = -1;
-    for (index_t batch_idx = 0; batch_idx < bottom_data.size(0); ++batch_idx) {
-      for (index_t sen_idx = 0; sen_idx < bottom_data.size(1); ++sen_idx) {
+    const int nsen = bottom_data.size(1);
+    const int nexample = bottom_data.size(0) * nsen;
+    #pragma omp parallel
+    {
+      utils::TopKWorkspace ws;
+      std::vector<int> sel;
+      #pragma omp for schedule(dynamic)
+      for (int ex = 0; ex < nexample; ++ex) {
+        int batch_idx = ex / nsen, sen_idx = ex % nsen;
         int sen_len = sentence_len[batch_idx][sen_idx];
         int len     = rep_len[batch_idx][sen_idx];
         int k = get_dynamic_k(sen_len, min_rep_length, L, l);
@@ -167,7 +167,7 @@ class DynamicKMaxPoolingLayer : public Layer<xpu>{
                            top_data[batch_idx][sen_idx],
                            pos[batch_idx][sen_idx],
                            len, 
-                           k);
+                           k, sel, &ws);
       }
     }
   }
@@ -180,12 +180,14 @@ class DynamicKMaxPoolingLayer : public Layer<xpu>{
     mshadow::Tensor<xpu, 4> top_diff     = top[0]->diff;
     mshadow::Tensor<xpu, 2> top_len      = top[0]->length;
 
-    for (index_t batch_idx = 0; batch_idx < bottom_diff.size(0); ++batch_idx) {
-      for (index_t sen_idx = 0; sen_idx < bottom_diff.size(1); ++sen_idx) {
-        int len = rep_len[batch_idx][sen_idx];
-        int k   = top_len[batch_idx][sen_idx];
-        unpooling_one_matrix(bottom_diff[batch_idx][sen_idx], top_diff[batch_idx][sen_idx], pos[batch_idx][sen_idx], len, k);
-      }
+    const int nsen = bottom_diff.size(1);
+    const int nexample = bottom_diff.size(0) * nsen;
+    #pragma omp parallel for
+    for (int ex = 0; ex < nexample; ++ex) {
+      int batch_idx = ex / nsen, sen_idx = ex % nsen;
+      int len = rep_len[batch_idx][sen_idx];
+      int k   = top_len[batch_idx][sen_idx];
+      unpooling_one_matrix(bottom_diff[batch_idx][sen_idx], top_diff[batch_idx][sen_idx], pos[batch_idx][sen_idx], len, k);
     }
   }
  protected:
@@ -4,6 +4,7 @@
 #include <mshadow/tensor.h>
 #include "../layer.h"
 #include "../op.h"
+#include "../../utils/pooling_engine.h"
 
 namespace textnet {
 namespace layer {
@@ -151,99 +152,30 @@ void PrintTensor(const char * name, mshadow::Tensor<xpu, 4> x) {
   typedef mshadow::Tensor<xpu,2> Tensor2D;
   typedef mshadow::Tensor<xpu,2,int> Tensor2DInt;
 
-  // select top 1 position from a chunk
-  void pooling_one_chunk(Tensor2D t, 
-                         int input_row, int input_col, 
-                         int begin_row, int end_row, 
-                         int begin_col, int end_col, 
-                         int &max_row,  int &max_col) {
-    max_row = max_col = -1;
-    float max_val = -100000000.f;
-    for (int row_idx = begin_row; row_idx < end_row; ++row_idx) {
-      for (int col_idx = begin_col; col_idx < end_col; ++col_idx) {
-        int real_row_idx = row_idx % input_row;
-        int real_col_idx = col_idx % input_col;
-        if (t[real_row_idx][real_col_idx] > max_val) {
-          max_val = t[real_row_idx][real_col_idx];
-          max_row = row_idx;
-          max_col = col_idx;
-        }
-      }
-    }
-  }
-  // void duplicate_by_row(Tensor2D &t, int ori_row, int dst_row) {
-  //   int max_row = t.size(0);
-  //   utils::Check(ori_row < dst_row && dst_row <= max_row, "DynamicPoolingLayer: duplicate error.");
-  //   for (int row_idx = ori_row; row_idx < dst_row; ++row_idx) {
-  //     int src_row_idx = (row_idx-ori_row) % ori_row;
-  //     for (int col_idx = 0; col_idx < t.size(1); ++col_idx) {
-  //       t[row_idx][col_idx] = t[src_row_idx][col_idx];
-  //     }
-  //   }
-  // }
-  // void duplicate_by_col(Tensor2D &t, int ori_col, int dst_col) {
-  //   int max_col = t.size(0);
-  //   utils::Check(ori_col < dst_col && dst_col <= max_col, "DynamicPoolingLayer: duplicate error.");
-  //   for (int col_idx = ori_col; col_idx < dst_col; ++col_idx) {
-  //     int src_col_idx = (col_idx-ori_col) % ori_col;
-  //     for (int row_idx = 0; row_idx < t.size(0); ++row_idx) {
-  //       t[row_idx][col_idx] = t[row_idx][src_col_idx];
-  //     }
-  //   }
-  // }
-
-  // this functions return the split spans of each dynamic window
-  // NOTE: if the input size is smaller than output size
-  // this functions will return split spans larger than input size
-  // and it is required to pad the input in other functions
-  void dynamic_split(int input_row, int pool_row, vector<int> &pos) {
-    pos.clear();
-    int pad_input_row = input_row < pool_row ? pool_row : input_row;
-    int margin = pad_input_row / pool_row;
-    int mod    = pad_input_row % pool_row;
-    pos.push_back(0);
-    for (size_t i = 0; i < pool_row; ++i) {
-      if (i < (pool_row-mod)) { 
-        pos.push_back(pos[pos.size()-1]+margin);
-      } else {
-        pos.push_back(pos[pos.size()-1]+margin+1);
-      }
-    }
-    
-    utils::Check(pos[pos.size()-1] == pad_input_row, "DynamicPoolingLayer: split error.");
-    
-    for (size_t i = 1; i < pos.size(); ++i) {
-      utils::Check(pos[i-1] < pos[i], "DynamicPoolingLayer: split error.");
-      utils::Check((pos[i] - pos[i-1]) <= ((pad_input_row-1)/pool_row) + 1, "DynamicPoolingLayer: split error.");
-    }
-  }
-
+  // split plans come from split_cache, see utils::SplitPlanCache for the
+  // padding behaviour when the input is smaller than the output size
   void pooling_one_matrix(Tensor2D t_in, Tensor2D t_out,
                           int input_row,  int input_col,
                           int pool_row,   int pool_col,
+                          const vector<int> &begin_pos_row,
+                          const vector<int> &begin_pos_col,
                           Tensor2DInt row_pos, Tensor2DInt col_pos) {
     utils::Check(t_out.size(0) == pool_row && t_out.size(1) == pool_col, "DynamicPoolingLayer: size error. C1 %d, %d, %d, %d", t_out.size(0), pool_row, t_out.size(1), pool_col);
     utils::Check(t_in.size(0) >= input_row && t_in.size(1) >= input_col, "DynamicPoolingLayer: size error. C2 %d, %d, %d, %d", t_in.size(0), input_row, t_in.size(1), input_col);
     utils::Check(t_in.size(0) >= pool_row  && t_in.size(1) >= pool_col, "DynamicPoolingLayer: size error. C3 %d, %d, %d, %d", t_in.size(0), pool_row, t_in.size(1), pool_col);
 
-    vector<int> begin_pos_row, begin_pos_col;
-    dynamic_split(input_row, pool_row, begin_pos_row);
-    dynamic_split(input_col, pool_col, begin_pos_col);
-
+    const int ld = t_in.size(1);
     for (int i = 0; i < pool_row; ++i) {
       for (int j = 0; j < pool_col; ++j) {
         int max_row = -1; 
         int max_col = -1;
-        pooling_one_chunk(t_in,
-                          input_row, input_col,
-                          begin_pos_row[i], begin_pos_row[i+1],
-                          begin_pos_col[j], begin_pos_col[j+1],
-                          max_row, max_col);
-        int real_pos_row = max_row % input_row;
-        int real_pos_col = max_col % input_col;
-        t_out[i][j] = t_in[real_pos_row][real_pos_col];
-        row_pos[i][j] = real_pos_row;
-        col_pos[i][j] = real_pos_col;
+        t_out[i][j] = utils::ChunkMaxArg(t_in.dptr_, ld,
+                                         input_row, input_col,
+                                         begin_pos_row[i], begin_pos_row[i+1],
+                                         begin_pos_col[j], begin_pos_col[j+1],
+                                         &max_row, &max_col);
+        row_pos[i][j] = max_row;
+        col_pos[i][j] = max_col;
       }
     }
   }
@@ -260,60 +192,70 @@ void PrintTensor(const char * name, mshadow::Tensor<xpu, 4> x) {
     }
   }
 
+  void get_length(index_t batch_idx, int &len_l, int &len_r,
+                  const std::vector<Node<xpu>*> &bottom) {
+    if (nbottom == 3) {
+      if (dim==1) {
+        len_l = 1;
+        len_r = bottom[1]->length[batch_idx][0];
+      } else {
+        len_l = bottom[1]->length[batch_idx][0];
+        len_r = bottom[2]->length[batch_idx][0];
+      } 
+    } else {
+      if (dim==1) {
+        len_l = 1;
+        len_r = bottom[0]->length[batch_idx][0];
+      } else {
+        len_l = bottom[0]->length[batch_idx][0];
+        len_r = bottom[0]->length[batch_idx][1];
+      }
+    }
+  }
+
   virtual void Forward(const std::vector<Node<xpu>*> &bottom,
                        const std::vector<Node<xpu>*> &top) {
     using namespace mshadow::expr;
     mshadow::Tensor<xpu, 4> bottom_data = bottom[0]->data;
-    mshadow::Tensor<xpu, 2> bottom_len;
-    mshadow::Tensor<xpu, 2> bottom_len_l;
-    mshadow::Tensor<xpu, 2> bottom_len_r;
     mshadow::Tensor<xpu, 4> top_data = top[0]->data;
     mshadow::Tensor<xpu, 2> top_len = top[0]->length;
 
     // PrintTensor("bottom_data", bottom[0]->data);
     // PrintTensor("bottom_len", bottom[0]->length);
 
-    if (nbottom == 1) {
-      bottom_len = bottom[0]->length;
-    } else if (nbottom == 3) {
-      bottom_len_l = bottom[1]->length;
-      bottom_len_r = bottom[2]->length;
-    }
+    const int nbatch = bottom_data.size(0);
+    const int nchannel = bottom_data.size(1);
 
-    top_data = 0;
-    for (index_t batch_idx = 0; batch_idx < bottom_data.size(0); ++batch_idx) {
+    // all channels of an example share the same lengths, so the split
+    // plans are looked up once per example before the parallel loop
+    len_ls.resize(nbatch);
+    len_rs.resize(nbatch);
+    plan_rows.resize(nbatch);
+    plan_cols.resize(nbatch);
+    for (int batch_idx = 0; batch_idx < nbatch; ++batch_idx) {
       if (nbottom == 1) { // top len is not variable length
         top_len[batch_idx][0] = row;
         top_len[batch_idx][1] = col;
       }
-      for (index_t channel_idx = 0; channel_idx < bottom_data.size(1); ++channel_idx) {
-        int len_r = 0, len_l = 0;
-        if (nbottom == 3) {
-          if (dim==1) {
-            len_l = 1;
-            len_r = bottom_len_l[batch_idx][0];
-          } else {
-            len_l = bottom_len_l[batch_idx][0];
-            len_r = bottom_len_r[batch_idx][0];
-          } 
-        } else {
-          if (dim==1) {
-            len_l = 1;
-            len_r = bottom_len[batch_idx][0];
-          } else {
-            len_l = bottom_len[batch_idx][0];
-            len_r = bottom_len[batch_idx][1];
-          }
-        }
-        // printf("batch_idex:%d,channel_idx:%d,len_l:%d,len_r:%d,row:%d,col:%d\n",batch_idx,channel_idx,len_l,len_r,row,col);
-        
-        if (len_l == 0 || len_r == 0) continue;
+      get_length(batch_idx, len_ls[batch_idx], len_rs[batch_idx], bottom);
+      // printf("batch_idex:%d,len_l:%d,len_r:%d,row:%d,col:%d\n",batch_idx,len_l,len_r,row,col);
+      if (len_ls[batch_idx] == 0 || len_rs[batch_idx] == 0) continue;
+      plan_rows[batch_idx] = &split_cache.Get(len_ls[batch_idx], row);
+      plan_cols[batch_idx] = &split_cache.Get(len_rs[batch_idx], col);
+    }
 
-        pooling_one_matrix(bottom_data[batch_idx][channel_idx], top_data[batch_idx][channel_idx],
-                           len_l, len_r,
-                           row, col,
-                           pos_row[batch_idx][channel_idx], pos_col[batch_idx][channel_idx]);
-      }
+    top_data = 0;
+    #pragma omp parallel for schedule(dynamic)
+    for (int idx = 0; idx < nbatch * nchannel; ++idx) {
+      int batch_idx = idx / nchannel;
+      int channel_idx = idx % nchannel;
+      if (len_ls[batch_idx] == 0 || len_rs[batch_idx] == 0) continue;
+
+      pooling_one_matrix(bottom_data[batch_idx][channel_idx], top_data[batch_idx][channel_idx],
+                         len_ls[batch_idx], len_rs[batch_idx],
+                         row, col,
+                         *plan_rows[batch_idx], *plan_cols[batch_idx],
+                         pos_row[batch_idx][channel_idx], pos_col[batch_idx][channel_idx]);
     }
   }
   
@@ -323,13 +265,16 @@ void PrintTensor(const char * name, mshadow::Tensor<xpu, 4> x) {
     mshadow::Tensor<xpu, 4> bottom_diff  = bottom[0]->diff;
     mshadow::Tensor<xpu, 4> top_diff     = top[0]->diff;
 
-    for (index_t batch_idx = 0; batch_idx < bottom_diff.size(0); ++batch_idx) {
-      for (index_t channel_idx = 0; channel_idx < bottom_diff.size(1); ++channel_idx) {
-        unpooling_one_matrix(bottom_diff[batch_idx][channel_idx], top_diff[batch_idx][channel_idx],
-                             row, col,
-                             pos_row[batch_idx][channel_idx], pos_col[batch_idx][channel_idx]);
-        
-      }
+    const int nbatch = bottom_diff.size(0);
+    const int nchannel = bottom_diff.size(1);
+    #pragma omp parallel for
+    for (int idx = 0; idx < nbatch * nchannel; ++idx) {
+      int batch_idx = idx / nchannel;
+      int channel_idx = idx % nchannel;
+      if (len_ls[batch_idx] == 0 || len_rs[batch_idx] == 0) continue;
+      unpooling_one_matrix(bottom_diff[batch_idx][channel_idx], top_diff[batch_idx][channel_idx],
+                           row, col,
+                           pos_row[batch_idx][channel_idx], pos_col[batch_idx][channel_idx]);
     }
   }
  protected:
@@ -338,6 +283,10 @@ void PrintTensor(const char * name, mshadow::Tensor<xpu, 4> x) {
   int row, col, dim;
 
   int nbottom;
+  utils::SplitPlanCache split_cache;
+  // per example lengths and split plans of the last forward
+  vector<int> len_ls, len_rs;
+  vector<const vector<int> *> plan_rows, plan_cols;
 };
 }  // namespace layer
 }  // namespace textnet
@@ -4,11 +4,16 @@
 #include <iostream>
 #include <fstream>
 #include <sstream>
-#include <set>
+#include <vector>
+#include <algorithm>
 
 #include <mshadow/tensor.h>
 #include "../layer.h"
 #include "../op.h"
+#include "../../utils/row_gather.h"
+#include "../../utils/sparse_grad.h"
+#include "../../utils/text_loader.h"
+#include "../../utils/mapped_table.h"
 
 namespace textnet {
 namespace layer {
@@ -29,6 +34,13 @@ class EmbeddingLayer : public Layer<xpu>{
     this->defaults["embedding_file"] = SettingV("");
     this->defaults["update_indication_file"] = SettingV(""); // id (0 or 1), 1 is for update, 0 is for un update
     this->defaults["length_mode"] = SettingV("embedding"); // embedding or kernel or featmap
+    this->defaults["bin_cache"] = SettingV(true); // keep embedding_file + ".bin_cache"
+    // the table in a binary file used through mmap, built on the first run
+    this->defaults["table_file"] = SettingV("");
+    this->defaults["table_mode"] = SettingV("private"); // readonly or private or writeback
+    // line k: the word id kept in row k, hot words first (python/vocab_order.py);
+    // ids of input, embedding_file, indication file and saved params stay as they are
+    this->defaults["vocab_map_file"] = SettingV("");
     // require value, set to SettingV(),
     // it will force custom to set in config
     this->defaults["feat_size"] = SettingV();
@@ -57,6 +69,14 @@ class EmbeddingLayer : public Layer<xpu>{
     word_count = setting["word_count"].iVal();
     pad_value = setting["pad_value"].fVal();
     length_mode = setting["length_mode"].sVal();
+    bin_cache = setting["bin_cache"].bVal();
+    table_file = setting["table_file"].sVal();
+    table_mode = utils::ParseTableMode(setting["table_mode"].sVal());
+    utils::Check(table_file.empty() || xpu::kDevCPU, "EmbeddingLayer: table_file needs a cpu net.");
+    vocab_map_file = setting["vocab_map_file"].sVal();
+    if (!vocab_map_file.empty()) {
+      ReadVocabMap();
+    }
 
     utils::Check(length_mode == "embedding" || length_mode == "kernel" || length_mode == "featmap",
                  "EmbeddingLayer: error value of length_mode");
@@ -68,23 +88,55 @@ class EmbeddingLayer : public Layer<xpu>{
       // No need allocate diff memory
       this->params[0].need_diff = false;
       this->params[0].is_sparse = true;
-      this->params[0].Resize(word_count, feat_size, 1, 1);
+      bool fill = true;
+      std::string table_tmp;
+      if (table_file.empty()) {
+        this->params[0].Resize(word_count, feat_size, 1, 1);
+      } else if (utils::MappedTable::Exists(table_file)) {
+        // the table of an earlier run, w_filler and embedding_file are not read
+        OpenTable(table_file, table_mode);
+        fill = false;
+      } else {
+        // filled in a temporary file, moved into place and mapped again as
+        // table_mode asks
+        utils::Printf("EmbeddingLayer: create table %s\n", table_file.c_str());
+        table_tmp = utils::MappedTable::Create(table_file, word_count, feat_size, RowMapHash());
+        OpenTable(table_tmp, utils::kTableWriteBack);
+      }
     
       std::map<std::string, SettingV> w_setting = *setting["w_filler"].mVal();
       this->params[0].initializer_ = 
           initializer::CreateInitializer<xpu, 4>(w_setting["init_type"].iVal(),
             w_setting, this->prnd_);
-      this->params[0].Init();   
+      if (fill) {
+        this->params[0].Init();   
+        // a file filler holds the rows in word id order
+        if (w_setting["init_type"].iVal() == initializer::kFileInit) {
+          WordOrderToRowOrder();
+        }
+      }
   
-      std::map<std::string, SettingV> &w_updater = *setting["w_updater"].mVal();
-      this->params[0].updater_ = 
-          updater::CreateUpdater<xpu, 4>(w_updater["updater_type"].iVal(),
-            w_updater, this->prnd_);
+      // a readonly table is frozen, it has no updater
+      if (!(table.Mapped() && table_mode == utils::kTableReadOnly)) {
+        std::map<std::string, SettingV> &w_updater = *setting["w_updater"].mVal();
+        this->params[0].updater_ = 
+            updater::CreateUpdater<xpu, 4>(w_updater["updater_type"].iVal(),
+              w_updater, this->prnd_);
+      }
 
       // Check if embedding file is empty
       if(!embedding_file.empty()) {
         read_embed_done = true;
-        ReadInitEmbedding();
+        if (fill) {
+          ReadInitEmbedding();
+        }
+      }
+      if (fill && table.Mapped()) {
+        table.Close();
+        if (!utils::MappedTable::Publish(table_tmp, table_file)) {
+          utils::Printf("EmbeddingLayer: table %s was created by another job, use it\n", table_file.c_str());
+        }
+        OpenTable(table_file, table_mode);
       }
     } else {
       utils::Printf("EmbeddingLayer: Read Embeddings done, skip.");
@@ -94,55 +146,135 @@ class EmbeddingLayer : public Layer<xpu>{
       ReadUpdateIndicationFile();
     }
     if (!this->param_file.empty()) {
+      utils::Check(!Frozen(), "EmbeddingLayer: param_file can not be loaded into a readonly table.");
       this->LoadParams();
     }
 
   }
 
+  // map a table file and point the param at it; reopening flushes the old map
+  void OpenTable(const std::string &path, int mode) {
+    table.Open(path, word_count, feat_size, mode, RowMapHash());
+    this->params[0].MapData(table.Rows(), mshadow::Shape4(word_count, feat_size, 1, 1),
+                            mode == utils::kTableReadOnly);
+  }
+
+  // identifies vocab_map_file in the table header, 0 without a map
+  inline uint64_t RowMapHash(void) const {
+    return utils::RowMapHash(row_of_word.empty() ? NULL : &row_of_word[0], row_of_word.size());
+  }
+
+  inline bool Frozen(void) const { return table.Mapped() && table.ReadOnly(); }
+
+  // a writeback table reaches its file before the checkpoint is written
+  virtual void Flush(void) {
+    table.Flush();
+  }
+
+  void ReadVocabMap() {
+    utils::Printf("EmbeddingLayer: Open vocab map file: %s\n", vocab_map_file.c_str());
+    std::ifstream ifs(vocab_map_file.c_str());
+    utils::Check(ifs.is_open(), "EmbeddingLayer: Open vocab map file problem.");
+    row_of_word.assign(word_count, -1);
+    int w_idx = -1;
+    for (int row = 0; row < word_count; ++row) {
+      utils::Check(static_cast<bool>(ifs >> w_idx) && w_idx >= 0 && w_idx < word_count &&
+                   row_of_word[w_idx] == -1, "EmbeddingLayer: vocab map must be a permutation of word ids.");
+      row_of_word[w_idx] = row;
+    }
+  }
+
+  // table row of a word id, -1 (padding) stays
+  inline int MapWord(int w_idx) const {
+    if (w_idx < 0 || row_of_word.empty()) return w_idx;
+    utils::Assert(w_idx < word_count, "EmbeddingLayer: word id out of range.");
+    return row_of_word[w_idx];
+  }
+
+  // saved params are in word id order whatever the table order is
+  virtual const int *ParamRowMap(int param_idx) {
+    return row_of_word.empty() ? NULL : &row_of_word[0];
+  }
+
+  virtual void SaveParams(Json::Value &params_root) {
+    if (row_of_word.empty()) {
+      Layer<xpu>::SaveParams(params_root);
+      return;
+    }
+    Json::Value node_root;
+    this->params[0].SaveNode(node_root, false, ParamRowMap(0));
+    params_root.append(node_root["data"]);
+  }
+
+  virtual void LoadParams(Json::Value &params_root) {
+    Layer<xpu>::LoadParams(params_root);
+    WordOrderToRowOrder();
+  }
+
+  virtual void LoadParams() {
+    Layer<xpu>::LoadParams();
+    WordOrderToRowOrder();
+  }
+
+  // params loaded by the layer come in word id order; permuted in place along
+  // the cycles of row_of_word, the table may be a mapping larger than memory
+  void WordOrderToRowOrder() {
+    if (row_of_word.empty()) return;
+    mshadow::Tensor<xpu, 2> w = this->params[0].data_d2();
+    // one word of each cycle, found on the map alone
+    std::vector<bool> visited(word_count, false);
+    std::vector<int> cycles;
+    for (int i = 0; i < word_count; ++i) {
+      if (visited[i]) continue;
+      for (int j = i; !visited[j]; j = row_of_word[j]) visited[j] = true;
+      if (row_of_word[i] != i) cycles.push_back(i);
+    }
+    #pragma omp parallel
+    {
+      std::vector<float> scratch(feat_size);
+      #pragma omp for schedule(dynamic)
+      for (int c = 0; c < static_cast<int>(cycles.size()); ++c) {
+        // scratch holds word j, which goes to row row_of_word[j] and takes
+        // the word there out; the last swap refills the start row
+        const int start = cycles[c];
+        memcpy(&scratch[0], w.dptr_ + static_cast<size_t>(start) * w.stride_, feat_size * sizeof(float));
+        int j = start;
+        do {
+          float *row = w.dptr_ + static_cast<size_t>(row_of_word[j]) * w.stride_;
+          std::swap_ranges(row, row + feat_size, scratch.begin());
+          j = row_of_word[j];
+        } while (j != start);
+      }
+    }
+  }
+
   void ReadUpdateIndicationFile() {
     utils::Printf("EmbeddingLayer: Open indication file: %s\n", update_indication_file.c_str());
     std::ifstream ifs(update_indication_file.c_str());
     utils::Check(ifs.is_open(), "EmbeddingLayer: Open indication file problem.");
     int word_idx, indication;
-    while (!ifs.eof()) {
-      ifs >> word_idx >> indication;
-      if (indication == 0) {
-        unupdate_words.insert(word_idx);
+    unupdate_words.Resize(word_count);
+    // "word_idx indication" per line, ids outside the vocabulary are skipped
+    for (int line = 1; ifs >> word_idx >> indication; ++line) {
+      if (indication != 0) continue;
+      if (word_idx < 0 || word_idx >= word_count) {
+        utils::Printf("[Warning] EmbeddingLayer: %s line %d: word %d out of range [0, %d), skipped.\n",
+                      update_indication_file.c_str(), line, word_idx, word_count);
+        continue;
       }
+      unupdate_words.Set(MapWord(word_idx));
     }
-    utils::Printf("EmbeddingLayer: # of un update words: %d\n", unupdate_words.size());
+    utils::Printf("EmbeddingLayer: # of un update words: %d\n", unupdate_words.Count());
   }
 
   void ReadInitEmbedding() {
     utils::Printf("Open embedding file: %s\n", embedding_file.c_str());    
-    std::vector<std::string> lines;
-    std::ifstream fin(embedding_file.c_str());
-    std::string s;
-    utils::Check(fin.is_open(), "Open embedding file problem.");
-    while (!fin.eof()) {
-      std::getline(fin, s);
-      if (s.empty()) break;
-      lines.push_back(s);
-    }
-    fin.close();
-    
-    line_count = lines.size();
+    // "w_idx v_0 .. v_{feat_size-1}" lines parsed in parallel into the rows
+    mshadow::Tensor<xpu, 2> w = this->params[0].data_d2();
+    utils::TextLoader loader(embedding_file, bin_cache);
+    line_count = loader.LoadIndexedRows(w.dptr_, word_count, feat_size, w.stride_,
+                                        row_of_word.empty() ? NULL : &row_of_word[0]);
     utils::Printf("Line count in file: %d\n", line_count);
-
-    std::istringstream iss;
-    int w_idx = 0;
-    for (int i = 0; i < line_count; ++i) {
-      iss.clear();
-      iss.seekg(0, iss.beg);
-      iss.str(lines[i]);
-      iss >> w_idx;
-      int j = 0;
-      while (!iss.eof()) {
-	utils::Check(j < feat_size, "EmbeddingLayer: init embedding error. More %d. %d.", i, j);
-        iss >> this->params[0].data[w_idx][j++][0][0];
-      }
-      utils::Check(j == feat_size, "EmbeddingLayer: init embedding error. Less %d. %d.", i, j);
-    }
   }
   
   virtual void Reshape(const std::vector<Node<xpu>*> &bottom,
@@ -197,8 +329,6 @@ class EmbeddingLayer : public Layer<xpu>{
     mshadow::Tensor<xpu, 2> top_len  = top[0]->length;
     mshadow::Tensor<xpu, 2> weight_data = this->params[0].data_d2();
     
-    // fill all top data to pad_value
-    top_data = pad_value;
     if (length_mode == "embedding") {
       top_len = F<op::identity>(bottom_len);
     } else if (length_mode == "kernel") {
@@ -213,17 +343,25 @@ class EmbeddingLayer : public Layer<xpu>{
       }
     }
 
-    int w_idx = -1;
-    for (int i = 0; i < nbatch; ++i) {
-      for (int j = 0; j < doc_count; ++j) {
+    // gather word rows, only the tail beyond doc_len is set to pad_value
+    const int nseq = nbatch * doc_count;
+    #pragma omp parallel
+    {
+      std::vector<int> ids(max_doc_len);
+      #pragma omp for schedule(dynamic)
+      for (int s = 0; s < nseq; ++s) {
+        int i = s / doc_count, j = s % doc_count;
         int doc_len = bottom_len[i][j];
         utils::Check(doc_len >= 0, "Embedding layer: length must be inited.");
+        utils::Check(doc_len <= max_doc_len, "Embedding layer: length exceeds max_doc_len.");
+        const float *tokens = bottom_data[i][j][0].dptr_;
         for (int k = 0; k < doc_len; ++k) {
-          w_idx = (int)bottom_data[i][j][0][k];
-          if (w_idx != -1) {
-            top_data[i][j][k] = F<op::identity>(weight_data[w_idx]);
-          }
+          ids[k] = MapWord((int)tokens[k]);
         }
+        mshadow::Tensor<xpu, 2> top_seq = top_data[i][j];
+        utils::GatherRows(weight_data.dptr_, weight_data.stride_,
+                          doc_len == 0 ? NULL : &ids[0], doc_len, top_seq.size(0), feat_size,
+                          pad_value, top_seq.dptr_, top_seq.stride_);
       }
     }
   }
@@ -235,52 +373,23 @@ class EmbeddingLayer : public Layer<xpu>{
     mshadow::Tensor<xpu, 2> bottom_len  = bottom[0]->length;
     mshadow::Tensor<xpu, 4> top_diff = top[0]->diff;
     
-    if (this->prop_grad[0]) {
-      std::map<int, int> idx_map;
-      int w_idx = -1;
-      int inc = 0;
+    if (this->prop_grad[0] && !Frozen()) {
+      grad_rows.Clear(feat_size);
       for (int i = 0; i < nbatch; ++i) {
         for (int j = 0; j < doc_count; ++j) {
           int doc_len = bottom_len[i][j];
           utils::Check(doc_len >= 0, "Embedding layer: length must be inited.");
+          const float *tokens = bottom_data[i][j][0].dptr_;
           for (int k = 0; k < doc_len; ++k) {
-            w_idx = (int)bottom_data[i][j][0][k];
-            if (unupdate_words.find(w_idx) != unupdate_words.end()) {
+            int w_idx = MapWord((int)tokens[k]);
+            if (w_idx == -1 || unupdate_words.Test(w_idx)) {
               continue;
             }
-            if (w_idx != -1 && !idx_map.count(w_idx)) {
-              idx_map[w_idx] = inc;
-              inc++;
-            }
-          }
-        }
-      }
-      
-      this->params[0].diff.Resize(mshadow::Shape4(inc, feat_size, 1, 1), 0);
-      this->params[0].idx.Resize(mshadow::Shape1(inc), 0);
-      mshadow::Tensor<xpu, 2> weight_diff = this->params[0].diff_d2();
-      mshadow::Tensor<xpu, 1> weight_idx = this->params[0].idx;
-      
-      for (std::map<int,int>::iterator it=idx_map.begin(); 
-            it!=idx_map.end(); ++it) {
-        weight_idx[it->second] = it->first;      
-      }
-      
-      for (int i = 0; i < nbatch; ++i) {
-        for (int j = 0; j < doc_count; ++j) {
-          int doc_len = bottom_len[i][j];
-          utils::Check(doc_len >= 0, "Embedding layer: length must be inited.");
-          for (int k = 0; k < doc_len; ++k) {
-            w_idx = (int)bottom_data[i][j][0][k];
-            if (unupdate_words.find(w_idx) != unupdate_words.end()) {
-              continue;
-            }
-            if (w_idx != -1) {
-              weight_diff[idx_map[w_idx]] += top_diff[i][j][k];
-            }
+            grad_rows.Add(w_idx, top_diff[i][j][k].dptr_);
           }
         }
       }
+      this->params[0].sparseAddRows(grad_rows);
     }
     if(this->prop_error[0]){
     }
@@ -293,9 +402,17 @@ class EmbeddingLayer : public Layer<xpu>{
   int doc_count;
   int nbatch;
   int line_count;
+  bool bin_cache;
+  std::string table_file;
+  std::string vocab_map_file;
+  // table row of each word id, empty without vocab_map_file
+  std::vector<int> row_of_word;
+  int table_mode;
+  utils::MappedTable table;
   float pad_value;
   bool read_embed_done;
-  std::set<int> unupdate_words;
+  utils::RowBitmap unupdate_words;
+  utils::SparseRowAccumulator grad_rows;
   string length_mode;
 };
 }  // namespace layer
@@ -5,6 +5,7 @@
 #include "../layer.h"
 #include "../op.h"
 #include "../../utils/utils.h"
+#include "../../utils/pooling_engine.h"
 
 namespace textnet {
 namespace layer {
@@ -106,30 +107,30 @@ class GateDynamicPoolingD2Layer : public Layer<xpu> {
 	}
   }
 
-  // this functions return the split spans of each dynamic window
-  // NOTE: if the input size is smaller than output size
-  // this functions will return split spans larger than input size
-  // and it is required to pad the input in other functions
-  void dynamic_split(int input_row, int pool_row, vector<int> &pos) {
-    utils::Check(input_row >= pool_row, "GateDynamicPoolingD2Layer: padding has not been implenmented yet.");
-    pos.clear();
-    int pad_input_row = input_row < pool_row ? pool_row : input_row;
-    int margin = pad_input_row / pool_row;
-    int mod    = pad_input_row % pool_row;
-    pos.push_back(0);
-    for (size_t i = 0; i < pool_row; ++i) {
-      if (i < (pool_row-mod)) { 
-        pos.push_back(pos[pos.size()-1]+margin);
-      } else {
-        pos.push_back(pos[pos.size()-1]+margin+1);
+  // look up the split plans of every example, this must run before the
+  // parallel loops since the plan cache is not thread safe
+  void get_plans(const std::vector<Node<xpu>*> &bottom, bool check_len) {
+    mshadow::Tensor<xpu, 4> bottom_data = bottom[0]->data;
+    mshadow::Tensor<xpu, 2> bottom_len  = bottom[0]->length;
+    int nbatch = bottom_data.size(0);
+    plan_rows.resize(nbatch);
+    plan_cols.resize(nbatch);
+    for (int i = 0; i < nbatch; ++i) {
+      int x_len = bottom_data.size(1);
+      int y_len = bottom_data.size(2);
+      if (is_var_len) {
+        if (check_len) {
+          utils::Check(bottom_len[i][0] > 0, "GateDynamicPoolingD2Layer:length should be unset.");
+          utils::Check(bottom_len[i][1] > 0, "GateDynamicPoolingD2Layer:length should be unset.");
+        }
+        x_len = bottom_len[i][0];
+        y_len = bottom_len[i][1];
+      } else if (check_len) {
+        utils::Check(bottom_len[i][0] == -1, "GateDynamicPoolingD2Layer:length should be unset.");
       }
-    }
-    
-    utils::Check(pos[pos.size()-1] == pad_input_row, "GateDynamicPoolingD2Layer: split error.");
-    
-    for (size_t i = 1; i < pos.size(); ++i) {
-      utils::Check(pos[i-1] < pos[i], "GateDynamicPoolingD2Layer: split error.");
-      utils::Check((pos[i] - pos[i-1]) <= ((pad_input_row-1)/pool_row) + 1, "GateDynamicPoolingD2Layer: split error.");
+      utils::Check(x_len >= row && y_len >= col, "GateDynamicPoolingD2Layer: padding has not been implenmented yet.");
+      plan_rows[i] = &split_cache.Get(x_len, row);
+      plan_cols[i] = &split_cache.Get(y_len, col);
     }
   }
 
@@ -157,21 +158,12 @@ class GateDynamicPoolingD2Layer : public Layer<xpu> {
     // for softmax
     gate_prob.data = mshadow::expr::F<op::orc_exp>(gate_score.data);
 
-    for (int i = 0; i < bottom_data.size(0); ++i) {
-      int x_len = bottom_data.size(1);
-      int y_len = bottom_data.size(2);
-      if (is_var_len) {
-        utils::Check(bottom_len[i][0] > 0, "GateDynamicPoolingD2Layer:length should be unset.");
-        utils::Check(bottom_len[i][1] > 0, "GateDynamicPoolingD2Layer:length should be unset.");
-        x_len = bottom_len[i][0];
-        y_len = bottom_len[i][1];
-      } else {
-        utils::Check(bottom_len[i][0] == -1, "GateDynamicPoolingD2Layer:length should be unset.");
-      }
-
-      vector<int> begin_pos_row, begin_pos_col;
-      dynamic_split(x_len, row, begin_pos_row);
-      dynamic_split(y_len, col, begin_pos_col);
+    get_plans(bottom, true);
+    const int nbatch = bottom_data.size(0);
+    #pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < nbatch; ++i) {
+      const vector<int> &begin_pos_row = *plan_rows[i];
+      const vector<int> &begin_pos_col = *plan_cols[i];
       
       // normalize softmax in a pooling sub matrix
       // then get the top data
@@ -214,17 +206,12 @@ class GateDynamicPoolingD2Layer : public Layer<xpu> {
 
     gate_score.diff = 0.f, gate_prob.diff = 0.f;
 
-    for (int i = 0; i < bottom_data.size(0); ++i) {
-      int x_len = bottom_data.size(1);
-      int y_len = bottom_data.size(2);
-      if (is_var_len) {
-        x_len = bottom_len[i][0];
-        y_len = bottom_len[i][1];
-      } 
-
-      vector<int> begin_pos_row, begin_pos_col;
-      dynamic_split(x_len, row, begin_pos_row);
-      dynamic_split(y_len, col, begin_pos_col);
+    get_plans(bottom, false);
+    const int nbatch = bottom_data.size(0);
+    #pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < nbatch; ++i) {
+      const vector<int> &begin_pos_row = *plan_rows[i];
+      const vector<int> &begin_pos_col = *plan_cols[i];
 
       for (int r = 0; r < row; ++r) {
         for (int c = 0; c < col; ++c) {
@@ -264,6 +251,8 @@ class GateDynamicPoolingD2Layer : public Layer<xpu> {
   /*! \brief random number generator */
   int dim_rep, row, col;
   bool no_bias, is_var_len;
+  utils::SplitPlanCache split_cache;
+  vector<const vector<int> *> plan_rows, plan_cols;
   Node<xpu> gate_score, gate_prob; // gate_score is before softmax, gate_prob is after softmax
 };
 }  // namespace layer
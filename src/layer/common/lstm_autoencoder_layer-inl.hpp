@@ -35,6 +35,7 @@ class LstmAutoencoderLayer : public Layer<xpu> {
     this->defaults["encoder_u_file"] = SettingV("");
     this->defaults["decoder_w_file"] = SettingV("");
     this->defaults["decoder_u_file"] = SettingV("");
+    this->defaults["bin_cache"] = SettingV(true); // keep <file> + ".bin_cache" for the four files above
     // this->defaults["o_gate_bias_init"] = SettingV(0.f);
     // this->defaults["f_gate_bias_init"] = SettingV(0.f);
     // this->defaults["reverse"] = SettingV(false);
@@ -85,6 +86,7 @@ class LstmAutoencoderLayer : public Layer<xpu> {
     encoder_u_file = setting["encoder_u_file"].sVal();
     decoder_w_file = setting["decoder_w_file"].sVal();
     decoder_u_file = setting["decoder_u_file"].sVal();
+    bin_cache = setting["bin_cache"].bVal();
     // reverse = setting["reverse"].bVal();
     // grad_norm2 = setting["grad_norm2"].fVal();
     this->param_file = setting["param_file"].sVal();
@@ -161,16 +163,16 @@ class LstmAutoencoderLayer : public Layer<xpu> {
         updater::CreateUpdater<xpu, 4>(b_dc_updater["updater_type"].iVal(), b_dc_updater, this->prnd_);
 
     if (!encoder_w_file.empty()) {
-      this->params[0].LoadDataSsv(encoder_w_file.c_str());
+      this->params[0].LoadDataSsv(encoder_w_file.c_str(), bin_cache);
     }
     if (!encoder_u_file.empty()) {
-      this->params[1].LoadDataSsv(encoder_u_file.c_str());
+      this->params[1].LoadDataSsv(encoder_u_file.c_str(), bin_cache);
     }
     if (!decoder_w_file.empty()) {
-      this->params[3].LoadDataSsv(decoder_w_file.c_str());
+      this->params[3].LoadDataSsv(decoder_w_file.c_str(), bin_cache);
     }
     if (!decoder_u_file.empty()) {
-      this->params[4].LoadDataSsv(decoder_u_file.c_str());
+      this->params[4].LoadDataSsv(decoder_u_file.c_str(), bin_cache);
     }
   }
 
@@ -611,6 +613,7 @@ class LstmAutoencoderLayer : public Layer<xpu> {
   bool no_bias, reverse, no_out_tanh; 
   float max_norm2;
   string encoder_w_file, encoder_u_file, decoder_w_file, decoder_u_file;
+  bool bin_cache;
   // float grad_norm2;
   // float o_gate_bias_init;
   // float f_gate_bias_init;
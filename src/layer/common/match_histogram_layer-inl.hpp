@@ -5,6 +5,10 @@
 #include <fstream>
 #include <sstream>
 #include <set>
+#include <algorithm>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include <mshadow/tensor.h>
 #include "../layer.h"
@@ -88,68 +92,101 @@ class MatchHistogramLayer : public Layer<xpu>{
     }
   }
 
+  // bin one row of scores into hist[0..hist_size)
+  // bin indexes are computed in double like the scalar formula, and base_val
+  // is added in input order, so the sums are bit identical to a plain loop
+  inline void BinRow(const float *x, int n, float *hist) {
+    const double scale = hist_size - 1;
+    int l = 0;
+#ifdef __SSE2__
+    int idx[4];
+    const __m128d one  = _mm_set1_pd(1.0);
+    const __m128d half = _mm_set1_pd(0.5);
+    const __m128d vs   = _mm_set1_pd(scale);
+    const __m128d lo_b = _mm_setzero_pd();
+    for (; l + 4 <= n; l += 4) {
+      __m128 v = _mm_loadu_ps(x + l);
+      __m128d lo = _mm_cvtps_pd(v);
+      __m128d hi = _mm_cvtps_pd(_mm_movehl_ps(v, v));
+      lo = _mm_mul_pd(_mm_mul_pd(_mm_add_pd(lo, one), half), vs);
+      hi = _mm_mul_pd(_mm_mul_pd(_mm_add_pd(hi, one), half), vs);
+      // scores out of [-1, 1] fall into the border bins, NaN into bin 0 as
+      // max_pd returns its second operand when either is NaN
+      lo = _mm_min_pd(_mm_max_pd(lo, lo_b), vs);
+      hi = _mm_min_pd(_mm_max_pd(hi, lo_b), vs);
+      _mm_storel_epi64(reinterpret_cast<__m128i*>(idx), _mm_cvttpd_epi32(lo));
+      _mm_storel_epi64(reinterpret_cast<__m128i*>(idx + 2), _mm_cvttpd_epi32(hi));
+      hist[idx[0]] += base_val;
+      hist[idx[1]] += base_val;
+      hist[idx[2]] += base_val;
+      hist[idx[3]] += base_val;
+    }
+#endif
+    for (; l < n; ++l) {
+      double d = ((x[l] + 1.0) / 2.0) * scale;
+      // written so that NaN fails the test and goes to bin 0 like the sse lanes
+      d = d > 0.0 ? std::min(d, scale) : 0.0;
+      hist[int(d)] += base_val;
+    }
+  }
+
   virtual void Forward(const std::vector<Node<xpu>*> &bottom,
                        const std::vector<Node<xpu>*> &top) {
     using namespace mshadow::expr;
+    mshadow::Tensor<xpu, 4> bottom_data = bottom[0]->data;
     mshadow::Tensor<xpu, 2> bottom_len = bottom[0]->length;
     mshadow::Tensor<xpu, 4> top_data = top[0]->data;
 	mshadow::Tensor<xpu, 2> top_len = top[0]->length;
 
     top_data = 0.0f;
     if(axis == 1){
-      for(int i = 0 ; i < bottom[0]->data.size(0); ++ i){
-        for(int j = 0 ; j < bottom[0]->data.size(1); ++ j){
-          for(int k = 0 ; k < bottom[0]->data.size(2); ++ k){
-            for(int l = 0 ; l < bottom[0]->data.size(3); ++ l){
-                int idx = int(((bottom[0]->data[i][j][k][l] + 1.0) / 2.0 ) * (hist_size - 1));
-                top[0]->data[i][idx][k][l] += base_val;
+      #pragma omp parallel for
+      for(int i = 0 ; i < bottom_data.size(0); ++ i){
+        for(int j = 0 ; j < bottom_data.size(1); ++ j){
+          for(int k = 0 ; k < bottom_data.size(2); ++ k){
+            for(int l = 0 ; l < bottom_data.size(3); ++ l){
+                int idx = int(((bottom_data[i][j][k][l] + 1.0) / 2.0 ) * (hist_size - 1));
+                top_data[i][idx][k][l] += base_val;
             }
           }
         }
       }
       top_len = F<op::identity>(bottom_len);
     }else if(axis == 2){
-      for(int i = 0 ; i < bottom[0]->data.size(0); ++ i){
-        for(int j = 0 ; j < bottom[0]->data.size(1); ++ j){
-          for(int k = 0 ; k < bottom[0]->data.size(2); ++ k){
-            for(int l = 0 ; l < bottom[0]->data.size(3); ++ l){
-                int idx = int(((bottom[0]->data[i][j][k][l] + 1.0) / 2.0 ) * (hist_size - 1));
-                top[0]->data[i][j][idx][l] += base_val;
+      #pragma omp parallel for
+      for(int i = 0 ; i < bottom_data.size(0); ++ i){
+        for(int j = 0 ; j < bottom_data.size(1); ++ j){
+          for(int k = 0 ; k < bottom_data.size(2); ++ k){
+            for(int l = 0 ; l < bottom_data.size(3); ++ l){
+                int idx = int(((bottom_data[i][j][k][l] + 1.0) / 2.0 ) * (hist_size - 1));
+                top_data[i][j][idx][l] += base_val;
             }
           }
         }
       }
       top_len = F<op::identity>(bottom_len);
     }else if(axis == 3){
-      /*
-      mshadow::Tensor<xpu,2> bottom_data2 = bottom[0]->data_d2_reverse();
-      mshadow::Tensor<xpu,2> top_data2 = top[0]->data_d2_reverse();
-      for(int i = 0 ; i < bottom_data2.size(0); ++ i){
-        for(int j = 0 ; j < bottom_data2.size(1); ++ j){
-          int idx = int(((bottom_data2[i][j] + 1.0) / 2.0 ) * (hist_size - 1));
-          top_data2[i][idx] += base_val;
-        }
-        top_data2[i] /= bottom_data2.size(1); //distribution
-        //for(int j = 0 ; j < hist_size; ++ j){ // rescale
-          //top_data2[i][j] = log10(1.0 + top_data2[i][j]);
-        //}
+      for(int i = 0 ; i < bottom_data.size(0); ++ i){
+        int doc_len = bottom_len[i][1];
+        utils::Check(doc_len <= bottom_data.size(3),"doc-len:%d less than size:%d.", doc_len, bottom_data.size(3));
+        top_len[i][0] = bottom_len[i][0];
+        top_len[i][1] = hist_size;
       }
-      top_len = F<op::identity>(bottom_len);
-      */
-      for(int i = 0 ; i < bottom[0]->data.size(0); ++ i){
-        for(int j = 0 ; j < bottom[0]->data.size(1); ++ j){
-          for(int k = 0 ; k < bottom[0]->data.size(2); ++ k){
-            int doc_len = bottom_len[i][1];
-            utils::Check(doc_len <= bottom[0]->data.size(3),"doc-len:%d less than size:%d.", doc_len, bottom[0]->data.size(3));
-            for(int l = 0 ; l < bottom[0]->data.size(3); ++ l){
-              int idx = int(((bottom[0]->data[i][j][k][l] + 1.0) / 2.0 ) * (hist_size - 1));
-              top[0]->data[i][j][k][idx] += base_val;
-            }
-            for(int l = 0 ; l < hist_size; ++ l){
-              top[0]->data[i][j][k][l] = log10(1 + top[0]->data[i][j][k][l]);
-            }
-            top[0]->length[i][0] = bottom[0]->length[i][0];
-            top[0]->length[i][1] = hist_size;
+      // every (batch, channel, row) is one independent histogram
+      const int nrow = bottom_data.size(1) * bottom_data.size(2);
+      const int nall = bottom_data.size(0) * nrow;
+      const int ncol = bottom_data.size(3);
+      #pragma omp parallel
+      {
+        std::vector<float> hist(hist_size);
+        #pragma omp for schedule(static)
+        for (int r = 0; r < nall; ++r) {
+          int i = r / nrow, j = (r % nrow) / bottom_data.size(2), k = r % bottom_data.size(2);
+          std::fill(hist.begin(), hist.end(), 0.f);
+          BinRow(bottom_data[i][j][k].dptr_, ncol, &hist[0]);
+          float *out = top_data[i][j][k].dptr_;
+          for(int l = 0 ; l < hist_size; ++ l){
+            out[l] = log10(1 + hist[l]);
           }
         }
       }
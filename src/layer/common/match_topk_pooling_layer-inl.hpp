@@ -4,7 +4,7 @@
 #include <mshadow/tensor.h>
 #include "../layer.h"
 #include "../op.h"
-#include <algorithm>
+#include "../../utils/topk_engine.h"
 
 namespace textnet {
 namespace layer {
@@ -83,28 +83,10 @@ class MatchTopKPoolingLayer : public Layer<xpu>{
   typedef mshadow::Tensor<xpu,2> Tensor2D;
   typedef mshadow::Tensor<xpu,2,int> Tensor2DInt;
 
-  struct ValidIdx {
-    float val;
-    int x, y;
-    ValidIdx(void) {
-      x = 0; y = 0; val = 0.f;
-    }
-  };
-
-  class CmpVal {
-    public:
-      bool operator() (const ValidIdx &l, const ValidIdx &r) const {
-         return l.val > r.val;
-      }
-  };
-          
-  // bool cmp_val(const ValidIdx &l, const ValidIdx &r) {
-  //   return l.val > r.val;
-  // }
-
   void pooling_one_matrix(Tensor2D t_in, Tensor2D t_out,
                           int input_row,  int input_col,
-                          int k, Tensor2DInt pos) {
+                          int k, Tensor2DInt pos,
+                          std::vector<int> &sel, utils::TopKWorkspace *ws) {
     utils::Check(t_in.size(0) >= input_row && t_in.size(1) >= input_col, "MatchTopKPoolingLayer: size error.");
     if(input_row * input_col < k){
         printf("input_row:%d,input_col:%d,k:%d\n",input_row,input_col,k);
@@ -113,35 +95,24 @@ class MatchTopKPoolingLayer : public Layer<xpu>{
     utils::Check(pos.size(0) == k && pos.size(1) == 2, "MatchTopKPoolingLayer: size error.");
     utils::Check(t_out.size(0) == k && t_out.size(1) == 1, "MatchTopKPoolingLayer: size error.");
 
-    vector<ValidIdx> all;
-    int iindex = 0;
-    for (int i = 0; i < input_row; ++i) {
-      for (int j = 0; j < input_col; ++j) {
-        ValidIdx val_idx;
-        val_idx.val = t_in[i][j];
-        val_idx.x = i;
-        val_idx.y = j;
-        all.push_back(val_idx);
-        ++iindex;
+    // flatten the valid region in row major order, a flat index f is (f / input_col, f % input_col)
+    const float *all = t_in.dptr_;
+    if (input_col != t_in.stride_) {
+      ws->buf.resize(input_row * input_col);
+      for (int i = 0; i < input_row; ++i) {
+        for (int j = 0; j < input_col; ++j) {
+          ws->buf[i * input_col + j] = t_in[i][j];
+        }
       }
+      all = &ws->buf[0];
     }
-    /*
-    while(iindex < k){
-        ValidIdx val_idx;
-        val_idx.val = 0;
-        val_idx.x = -1;
-        val_idx.y = -1;
-        ++iindex;
-        all.push_back(val_idx);
-    }
-    assert(all.size() >= k);
-    */
-    std::sort(all.begin(), all.end(), CmpVal());
+    sel.resize(k);
+    utils::TopKDesc(all, input_row * input_col, k, &sel[0], NULL, ws);
         
     for (int i = 0; i < k; ++i) {
-      t_out[i][0] = all[i].val;
-      pos[i][0] = all[i].x;
-      pos[i][1] = all[i].y;
+      t_out[i][0] = all[sel[i]];
+      pos[i][0] = sel[i] / input_col;
+      pos[i][1] = sel[i] % input_col;
     }
   }
 
@@ -162,8 +133,15 @@ class MatchTopKPoolingLayer : public Layer<xpu>{
     mshadow::Tensor<xpu, 4> top_data = top[0]->data;
 
     top_data = 0;
-    for (index_t batch_idx = 0; batch_idx < bottom_data.size(0); ++batch_idx) {
-      for (index_t channel_idx = 0; channel_idx < bottom_data.size(1); ++channel_idx) {
+    const int nchannel = bottom_data.size(1);
+    const int nexample = bottom_data.size(0) * nchannel;
+    #pragma omp parallel
+    {
+      utils::TopKWorkspace ws;
+      std::vector<int> sel;
+      #pragma omp for schedule(dynamic)
+      for (int ex = 0; ex < nexample; ++ex) {
+        int batch_idx = ex / nchannel, channel_idx = ex % nchannel;
         int len_l = bottom_data[batch_idx][channel_idx].size(0);
         int len_r = bottom_data[batch_idx][channel_idx].size(1);
         if(nbottom == 3){
@@ -171,12 +149,7 @@ class MatchTopKPoolingLayer : public Layer<xpu>{
           len_r = bottom[2]->length[batch_idx][0];
         }
         pooling_one_matrix(bottom_data[batch_idx][channel_idx], top_data[batch_idx][channel_idx],
-                           len_l, len_r, k, pos[batch_idx][channel_idx]);
-        //printf("label:%d\tbatch_idx:%d\tchannel_idx:%d\n",batch_idx%2,batch_idx,channel_idx);
-        //for(int i = 0 ; i < k; ++ i){
-            //printf(" %.4f",top_data[batch_idx][channel_idx][1][i]);
-        //}
-        //printf("\n");
+                           len_l, len_r, k, pos[batch_idx][channel_idx], sel, &ws);
       }
     }
   }
@@ -188,11 +161,13 @@ class MatchTopKPoolingLayer : public Layer<xpu>{
     mshadow::Tensor<xpu, 4> bottom_diff  = bottom[0]->diff;
     mshadow::Tensor<xpu, 4> top_diff     = top[0]->diff;
 
-    for (index_t batch_idx = 0; batch_idx < bottom_diff.size(0); ++batch_idx) {
-      for (index_t channel_idx = 0; channel_idx < bottom_diff.size(1); ++channel_idx) {
-        unpooling_one_matrix(bottom_diff[batch_idx][channel_idx], top_diff[batch_idx][channel_idx],
-                             k, pos[batch_idx][channel_idx]);
-      }
+    const int nchannel = bottom_diff.size(1);
+    const int nexample = bottom_diff.size(0) * nchannel;
+    #pragma omp parallel for
+    for (int ex = 0; ex < nexample; ++ex) {
+      int batch_idx = ex / nchannel, channel_idx = ex % nchannel;
+      unpooling_one_matrix(bottom_diff[batch_idx][channel_idx], top_diff[batch_idx][channel_idx],
+                           k, pos[batch_idx][channel_idx]);
     }
   }
 
@@ -6,6 +6,7 @@
 #include <mshadow/tensor.h>
 #include "../layer.h"
 #include "../../utils/utils.h"
+#include "../../utils/window_sum.h"
 #include "../../io/json/json.h"
 #include <cassert>
 
@@ -67,61 +68,55 @@ class PhraseAveRepLayer : public Layer<xpu> {
 	}
   }
 
-  // compose phrase rep by ave word reps
-  void ComposeOnePosition(Tensor2D seq, int pos, int len, Tensor2D phrase_ave_rep) {
-    phrase_ave_rep = 0.f;
-    for (int i = pos; i < pos+window; ++i) {
-      if (i < len) {
-        phrase_ave_rep += seq.Slice(i, i+1);
-      } 
-    }
-    phrase_ave_rep /= window;
-  }
-
+  // phrase rep at pos is the ave of word reps [pos, pos+window), words
+  // beyond len count as zero; each sequence is turned into prefix sums
+  // once so the cost does not depend on window
   virtual void Forward(const std::vector<Node<xpu>*> &bottom,
                        const std::vector<Node<xpu>*> &top) {
     Tensor4D bottom_data = bottom[0]->data;
     Tensor4D top_data = top[0]->data;
     top[0]->length = mshadow::expr::F<op::identity>(bottom[0]->length);
 
-    for (index_t batch_idx = 0; batch_idx < bottom_data.size(0); ++batch_idx) {
-      for (index_t seq_idx = 0; seq_idx < bottom_data.size(1); ++seq_idx) {
+    const int nseq = bottom_data.size(1);
+    const int nexample = bottom_data.size(0) * nseq;
+    const int dim = bottom_data.size(3);
+    #pragma omp parallel
+    {
+      std::vector<double> acc;
+      #pragma omp for schedule(dynamic)
+      for (int ex = 0; ex < nexample; ++ex) {
+        int batch_idx = ex / nseq, seq_idx = ex % nseq;
         int len = bottom[0]->length[batch_idx][seq_idx];
         utils::Assert(len >= 0, "PhraseAveRepLayer: sequence length error.");
-        for (int pos = 0; pos < len; ++pos) {
-          Tensor2D phrase_rep = top_data[batch_idx][seq_idx].Slice(pos, pos+1);
-          ComposeOnePosition(bottom_data[batch_idx][seq_idx], pos, len, phrase_rep);
-        }
+        utils::WindowSumForward(bottom_data[batch_idx][seq_idx].dptr_, bottom_data[batch_idx][seq_idx].stride_,
+                                len, dim, window, 1.f / window,
+                                top_data[batch_idx][seq_idx].dptr_, top_data[batch_idx][seq_idx].stride_, &acc);
       }
     }
   }
 
-  // compose phrase rep by ave word reps
-  void BpOnePosition(Tensor2D seq, int pos, int len, Tensor2D phrase_ave_rep) {
-    for (int i = pos; i < pos+window; ++i) {
-      if (i < len) {
-        seq.Slice(i, i+1) += phrase_ave_rep/window;
-      } 
-    }
-  }
-
-  
+  // word i receives 1/window of the diff of every phrase covering it,
+  // i.e. phrases starting in [i-window+1, i]
   virtual void Backprop(const std::vector<Node<xpu>*> &bottom,
                         const std::vector<Node<xpu>*> &top) {
     using namespace mshadow::expr;
     mshadow::Tensor<xpu, 4> top_diff = top[0]->diff;
-    mshadow::Tensor<xpu, 4> top_data = top[0]->data;
-    mshadow::Tensor<xpu, 4> bottom_data = bottom[0]->data;
     mshadow::Tensor<xpu, 4> bottom_diff = bottom[0]->diff;
         
-    for (index_t batch_idx = 0; batch_idx < bottom_data.size(0); ++batch_idx) {
-      for (index_t seq_idx = 0; seq_idx < bottom_data.size(1); ++seq_idx) {
+    const int nseq = bottom_diff.size(1);
+    const int nexample = bottom_diff.size(0) * nseq;
+    const int dim = bottom_diff.size(3);
+    #pragma omp parallel
+    {
+      std::vector<double> acc;
+      #pragma omp for schedule(dynamic)
+      for (int ex = 0; ex < nexample; ++ex) {
+        int batch_idx = ex / nseq, seq_idx = ex % nseq;
         int len = bottom[0]->length[batch_idx][seq_idx];
         utils::Assert(len >= 0, "PhraseAveRepLayer: sequence length error.");
-        for (int pos = 0; pos < len; ++pos) {
-          Tensor2D phrase_rep_diff = top_diff[batch_idx][seq_idx].Slice(pos, pos+1);
-          ComposeOnePosition(bottom_diff[batch_idx][seq_idx], pos, len, phrase_rep_diff);
-        }
+        utils::WindowSumBackward(top_diff[batch_idx][seq_idx].dptr_, top_diff[batch_idx][seq_idx].stride_,
+                                 len, dim, window, 1.f / window,
+                                 bottom_diff[batch_idx][seq_idx].dptr_, bottom_diff[batch_idx][seq_idx].stride_, &acc);
       }
     }
   }
@@ -5,6 +5,7 @@
 #include <mshadow/tensor.h>
 #include "../layer.h"
 #include "../../utils/utils.h"
+#include "../../utils/pooling_engine.h"
 
 namespace textnet {
 namespace layer {
@@ -127,8 +128,12 @@ class PoolingVarLayer : public Layer<xpu> {
       top_data = 0.0;
     }
 
-	int top_len_x = 0, top_len_y = 0, bottom_len_x = 0, bottom_len_y = 0;
-    for (index_t i = 0; i < nbatch; ++i) {
+    const bool is_max = pooling_mode == "max";
+    const bool is_avg = pooling_mode == "avg";
+    utils::Check(is_max || is_avg, "PoolingVarLayer: pooling mode error.");
+    #pragma omp parallel for
+    for (int i = 0; i < nbatch; ++i) {
+	  int top_len_x = 0, top_len_y = 0, bottom_len_x = 0, bottom_len_y = 0;
       if (dim == 1) {
           top_len[i][0] = int(bottom_len[i][0] + pad_y * 2 - kernel_y) / stride_y + 1; // all input channels shoud have the same length
 		  utils::Check(top_len[i][0] > 0, "PoolingVarLayer: top_len must positive. i=%d, bottom_len=%f, top_len=%f", i, bottom_len[i][0], top_len[i][0]);
@@ -159,17 +164,18 @@ class PoolingVarLayer : public Layer<xpu> {
             ystart = max(ystart, 0);
             int pooling_size = (xend - xstart) * (yend - ystart);
 
-            if (pooling_mode == "max") {
+            if (is_max) {
               top_data[i][c][py][px] = -FLT_MAX;
+              if (xend <= xstart) continue;
               for (int y = ystart; y < yend; ++y) {
-                for (int x = xstart; x < xend; ++x) {
-                  if (bottom_data[i][c][y][x] > top_data[i][c][py][px]) {
-                    top_data[i][c][py][px] = bottom_data[i][c][y][x];
-                    mask[i][c][py][px] = y * bottom_len_x + x;
-                  }
+                int arg = 0;
+                float v = utils::RowMaxArg(bottom_data[i][c][y].dptr_ + xstart, xend - xstart, &arg);
+                if (v > top_data[i][c][py][px]) {
+                  top_data[i][c][py][px] = v;
+                  mask[i][c][py][px] = y * bottom_len_x + xstart + arg;
                 }
               }
-            } else if (pooling_mode == "avg") {
+            } else if (is_avg) {
               for (int y = ystart; y < yend; ++y) {
                 for (int x = xstart; x < xend; ++x) {
                   top_data[i][c][py][px] += bottom_data[i][c][y][x];
@@ -198,9 +204,12 @@ class PoolingVarLayer : public Layer<xpu> {
       return;
     }
 
-	int top_len_x = 0, top_len_y = 0, bottom_len_x = 0, bottom_len_y = 0;
-        
+    const bool is_max = pooling_mode == "max";
+    const bool is_avg = pooling_mode == "avg";
+    utils::Check(is_max || is_avg, "PoolingVarLayer: pooling mode error.");
+    #pragma omp parallel for
     for (int i = 0; i < nbatch; ++i) {
+	  int top_len_x = 0, top_len_y = 0, bottom_len_x = 0, bottom_len_y = 0;
       if (dim == 1) {
 		  top_len_x = 1;
 		  top_len_y = top_len[i][0];
@@ -224,11 +233,11 @@ class PoolingVarLayer : public Layer<xpu> {
             ystart = max(ystart, 0);
             int pooling_size = (xend - xstart) * (yend - ystart);
 
-            if (pooling_mode == "max") {
+            if (is_max) {
               int y = int(mask[i][c][py][px]) / bottom_len_x;
               int x = int(mask[i][c][py][px]) % bottom_len_x;
               bottom_diff[i][c][y][x] += top_diff[i][c][py][px];
-            } else if (pooling_mode == "avg") {
+            } else if (is_avg) {
               for (int y = ystart; y < yend; ++y) {
                 for (int x = xstart; x < xend; ++x) {
                   if (bottom_data[i][c][y][x] > top_data[i][c][py][px]) {
@@ -4,6 +4,7 @@
 #include <mshadow/tensor.h>
 #include "../layer.h"
 #include "../op.h"
+#include "../../utils/topk_engine.h"
 
 namespace textnet {
 namespace layer {
@@ -67,34 +68,13 @@ class TopkPoolingLayer : public Layer<xpu>{
   typedef mshadow::Tensor<xpu,2,int> Tensor2DInt;
 
   // select top k positions from gate and keep the relative order
-  void get_topk_pos(Tensor2D gate, Tensor2DInt pos, int length) {
+  void get_topk_pos(Tensor2D gate, Tensor2DInt pos, int length, utils::TopKWorkspace *ws) {
     utils::Assert(gate.shape_[1] == 1 && pos.shape_[1] == 1 && pos.shape_[0] == k, 
                   "TopkPoolingLayer: gate & pos size error.");
     utils::Assert(length >= pos.shape_[0] && length <= gate.shape_[0], 
                   "TopkPoolingLayer: k exceeds the length, we have not consider this case yet.");
-    
-    std::vector<float> v(gate.dptr_, gate.dptr_+length);
-    std::partial_sort(v.begin(), v.begin() + k, v.end(), std::greater<float>());
-    float topk_threshold = v[k-1];
-
-    std::vector<int> topk_pos;
-    for (int i = 0; i < length; ++i) {
-      if (gate[i][0] > topk_threshold) {
-        topk_pos.push_back(i);
-      }
-    }
-    utils::Assert(topk_pos.size() < k, "TopkPoolingLayer: sort error.");
-    for (int i = 0; i < length; ++i) {
-      if (gate[i][0] == topk_threshold) {
-        topk_pos.push_back(i);
-        if (topk_pos.size() == k) break;
-      }
-    }
-    utils::Assert(topk_pos.size() == k, "TopkPoolingLayer: sort error.");
-    std::sort(topk_pos.begin(), topk_pos.end());
-    for (int i = 0; i < k; ++i) {
-      pos[i][0] = topk_pos[i];
-    }
+    // gate is a column of width 1, so the first length values are contiguous
+    utils::TopKByPos(gate.dptr_, length, k, pos.dptr_, NULL, ws);
   }
 
   virtual void Forward(const std::vector<Node<xpu>*> &bottom,
@@ -108,10 +88,16 @@ class TopkPoolingLayer : public Layer<xpu>{
     // top[0]->length = k; // var len to static len
 
     top_data = 0;
-    for (index_t batch_idx = 0; batch_idx < gate_data.size(0); ++batch_idx) {
-      for (index_t seq_idx = 0; seq_idx < gate_data.size(1); ++seq_idx) {
+    const int nseq = gate_data.size(1);
+    const int nexample = gate_data.size(0) * nseq;
+    #pragma omp parallel
+    {
+      utils::TopKWorkspace ws;
+      #pragma omp for schedule(dynamic)
+      for (int ex = 0; ex < nexample; ++ex) {
+        int batch_idx = ex / nseq, seq_idx = ex % nseq;
         int length = bottom_len[batch_idx][seq_idx]; 
-        get_topk_pos(gate_data[batch_idx][seq_idx], pos[batch_idx][seq_idx], length);
+        get_topk_pos(gate_data[batch_idx][seq_idx], pos[batch_idx][seq_idx], length, &ws);
         for (int i = 0; i < k; ++i) {
           top_data[batch_idx][seq_idx][i] = F<op::identity>(rep_data[batch_idx][seq_idx][pos[batch_idx][seq_idx][i][0]]);
         }
@@ -125,11 +111,13 @@ class TopkPoolingLayer : public Layer<xpu>{
     mshadow::Tensor<xpu, 4> top_diff = top[0]->diff;
     mshadow::Tensor<xpu, 4> rep_diff = bottom[1]->diff;
 
-    for (index_t batch_idx = 0; batch_idx < top_diff.size(0); ++batch_idx) {
-      for (index_t seq_idx = 0; seq_idx < top_diff.size(1); ++seq_idx) {
-        for (int i = 0; i < k; ++i) {
-          rep_diff[batch_idx][seq_idx][pos[batch_idx][seq_idx][i][0]] += top_diff[batch_idx][seq_idx][i];
-        }
+    const int nseq = top_diff.size(1);
+    const int nexample = top_diff.size(0) * nseq;
+    #pragma omp parallel for
+    for (int ex = 0; ex < nexample; ++ex) {
+      int batch_idx = ex / nseq, seq_idx = ex % nseq;
+      for (int i = 0; i < k; ++i) {
+        rep_diff[batch_idx][seq_idx][pos[batch_idx][seq_idx][i][0]] += top_diff[batch_idx][seq_idx][i];
       }
     }
   }
@@ -4,6 +4,7 @@
 #include <mshadow/tensor.h>
 #include "../layer.h"
 #include "../op.h"
+#include "../../utils/topk_engine.h"
 
 namespace textnet {
 namespace layer {
@@ -84,20 +85,6 @@ class WholePoolingLayer : public Layer<xpu>{
   typedef mshadow::Tensor<xpu, 2> Tensor2D;
   typedef mshadow::Tensor<xpu, 2, int> Tensor2DInt;
   typedef mshadow::Tensor<xpu, 4> Tensor4D;
-  struct ValidIdx {
-    float val;
-    int x, y;
-    ValidIdx(void) {
-      x = 0; y = 0; val = 0.f;
-    }
-    ValidIdx(float v, int x1, int x2):val(v), x(x1), y(x2){}
-  };
-  class CmpVal {
-    public:
-      bool operator() (const ValidIdx &l, const ValidIdx &r) const {
-         return l.val > r.val;
-      }
-  };
   void wholeAvePooling(Tensor2D in, Tensor2D out) {
     utils::Check(in.size(1) == out.size(1) && out.size(0) == 1, "WholePoolingLayer:pooling io size error");
     out[0] = sum_rows(in);
@@ -154,20 +141,18 @@ class WholePoolingLayer : public Layer<xpu>{
       out[row][col] += in[0][col];
     }
   }
-  void wholeMaxKPooling(Tensor2D in, Tensor2DInt pos, Tensor2D out) {
+  void wholeMaxKPooling(Tensor2D in, Tensor2DInt pos, Tensor2D out,
+                        std::vector<int> &sel, utils::TopKWorkspace *ws) {
     utils::Check(in.size(1) == out.size(1) && out.size(0) == maxk, "WholePoolingLayer:pooling io size error");
     utils::Check(in.size(1) == pos.size(1) && pos.size(0) == maxk, "WholePoolingLayer:pooling io size error");
     out = -1000000;
+    sel.resize(maxk);
     for (index_t col = 0; col < in.size(1); ++col) {
-      vector<ValidIdx> all;
-      for (index_t row = 0; row < in.size(0); ++row) {
-        all.push_back(ValidIdx(in[row][col], row, col));
-      }
-      std::sort(all.begin(), all.end(), CmpVal());
-      int iindex = 0;
-      for(iindex = 0 ; iindex < maxk && iindex < in.size(0); ++ iindex){
-        out[iindex][col] = all[iindex].val;
-        pos[iindex][col] = int(all[iindex].x);
+      const float *x = ws->Gather(in.dptr_ + col, in.size(0), in.stride_);
+      int iindex = utils::TopKDesc(x, in.size(0), maxk, &sel[0], NULL, ws);
+      for (int i = 0; i < iindex; ++i) {
+        out[i][col] = x[sel[i]];
+        pos[i][col] = sel[i];
       }
       for( ; iindex < maxk; ++ iindex){
         out[iindex][col] = pool_pad;
@@ -203,8 +188,15 @@ class WholePoolingLayer : public Layer<xpu>{
     // conv var len to static len, no need to forward length info
 
     top_data = 0;
-    for (index_t batch_idx = 0; batch_idx < bottom_data.size(0); ++batch_idx) {
-      for (index_t seq_idx = 0; seq_idx < bottom_data.size(1); ++seq_idx) {
+    const int nseq = bottom_data.size(1);
+    const int nexample = bottom_data.size(0) * nseq;
+    #pragma omp parallel
+    {
+      utils::TopKWorkspace ws;
+      std::vector<int> sel;
+      #pragma omp for schedule(dynamic)
+      for (int ex = 0; ex < nexample; ++ex) {
+        int batch_idx = ex / nseq, seq_idx = ex % nseq;
         int begin = 0, end = bottom_len[batch_idx][seq_idx]; 
         if(ignore_len)  end = bottom_data.size(2);
         if (begin == end) continue;
@@ -222,7 +214,7 @@ class WholePoolingLayer : public Layer<xpu>{
             if (begin == end) continue;
             wholeMaxKPooling(bottom_data[batch_idx][seq_idx].Slice(begin, end), 
                             pos[batch_idx][seq_idx], 
-                            top_data[batch_idx][seq_idx]);
+                            top_data[batch_idx][seq_idx], sel, &ws);
         } else if (pool_type == "ave") {
             if (begin == end) continue;
             wholeAvePooling(bottom_data[batch_idx][seq_idx].Slice(begin, end), 
@@ -257,43 +249,45 @@ class WholePoolingLayer : public Layer<xpu>{
     mshadow::Tensor<xpu, 2> bottom_len  = bottom[0]->length;
     mshadow::Tensor<xpu, 4> bottom_diff = bottom[0]->diff;
 
-    for (index_t batch_idx = 0; batch_idx < bottom_data.size(0); ++batch_idx) {
-      for (index_t seq_idx = 0; seq_idx < bottom_data.size(1); ++seq_idx) {
-        int begin = 0, end = bottom_len[batch_idx][seq_idx]; 
-        if(ignore_len)  end = bottom_data.size(2);
-        if (end == 0) continue;
-        utils::Check(end >= 0, "WholePoolingLayer: sequence length error.");
+    const int nseq = bottom_data.size(1);
+    const int nexample = bottom_data.size(0) * nseq;
+    #pragma omp parallel for schedule(dynamic)
+    for (int ex = 0; ex < nexample; ++ex) {
+      int batch_idx = ex / nseq, seq_idx = ex % nseq;
+      int begin = 0, end = bottom_len[batch_idx][seq_idx]; 
+      if(ignore_len)  end = bottom_data.size(2);
+      if (end == 0) continue;
+      utils::Check(end >= 0, "WholePoolingLayer: sequence length error.");
 
-        if (this->prop_error[0]) {
-          if (pool_type == "max") {
-              if (begin == end) continue;
-              wholeUnMaxPooling(top_diff[batch_idx][seq_idx], 
-                                pos[batch_idx][seq_idx], 
-                                bottom_diff[batch_idx][seq_idx].Slice(begin, end));
-          } else if (pool_type == "maxk") {
-              if (begin == end) continue;
-              wholeUnMaxKPooling(top_diff[batch_idx][seq_idx], 
-                                pos[batch_idx][seq_idx], 
-                                bottom_diff[batch_idx][seq_idx].Slice(begin, end));
-          } else if (pool_type == "ave") {
-              if (begin == end) continue;
-              wholeUnAvePooling(top_diff[batch_idx][seq_idx], 
-                                bottom_diff[batch_idx][seq_idx].Slice(begin, end));
-          } else if (pool_type == "sum") {
-              if (begin == end) continue;
-              wholeUnSumPooling(top_diff[batch_idx][seq_idx], 
+      if (this->prop_error[0]) {
+        if (pool_type == "max") {
+            if (begin == end) continue;
+            wholeUnMaxPooling(top_diff[batch_idx][seq_idx], 
+                              pos[batch_idx][seq_idx], 
+                              bottom_diff[batch_idx][seq_idx].Slice(begin, end));
+        } else if (pool_type == "maxk") {
+            if (begin == end) continue;
+            wholeUnMaxKPooling(top_diff[batch_idx][seq_idx], 
+                              pos[batch_idx][seq_idx], 
+                              bottom_diff[batch_idx][seq_idx].Slice(begin, end));
+        } else if (pool_type == "ave") {
+            if (begin == end) continue;
+            wholeUnAvePooling(top_diff[batch_idx][seq_idx], 
+                              bottom_diff[batch_idx][seq_idx].Slice(begin, end));
+        } else if (pool_type == "sum") {
+            if (begin == end) continue;
+            wholeUnSumPooling(top_diff[batch_idx][seq_idx], 
+                              bottom_diff[batch_idx][seq_idx].Slice(begin, end));
+        } else if (pool_type == "first") {
+            if (begin == end) continue;
+            wholeUnFirstPooling(top_diff[batch_idx][seq_idx],
                                 bottom_diff[batch_idx][seq_idx].Slice(begin, end));
-          } else if (pool_type == "first") {
-              if (begin == end) continue;
-              wholeUnFirstPooling(top_diff[batch_idx][seq_idx],
-                                  bottom_diff[batch_idx][seq_idx].Slice(begin, end));
-          } else if (pool_type == "last") {
-              if (begin == end) continue;
-              wholeUnLastPooling(top_diff[batch_idx][seq_idx], 
-                                 bottom_diff[batch_idx][seq_idx].Slice(begin, end));
-          } else {
-              utils::Check(false, "WholePoolLayer: pool type error.");
-          }
+        } else if (pool_type == "last") {
+            if (begin == end) continue;
+            wholeUnLastPooling(top_diff[batch_idx][seq_idx], 
+                               bottom_diff[batch_idx][seq_idx].Slice(begin, end));
+        } else {
+            utils::Check(false, "WholePoolLayer: pool type error.");
         }
       }
     }
@@ -32,6 +32,8 @@ class LmInputLayer : public Layer<xpu>{
   virtual void Require() {
     // default value, just set the value you want
     this->defaults["shuffle_seed"] = SettingV(123);
+    // "philox": shuffles from a counter based stream keyed by the layer name
+    this->defaults["rng"] = SettingV("mshadow");
 
     // require value, set to SettingV(),
     // it will force custom to set in config
@@ -60,11 +62,18 @@ class LmInputLayer : public Layer<xpu>{
     position_num = setting["position_num"].i_val;
     vocab_size   = setting["vocab_size"].i_val;
     is_pred_first_word   = setting["is_pred_first_word"].b_val;
+    shuffle_seed = setting["shuffle_seed"].iVal();
+    std::string rng = setting["rng"].sVal();
+    utils::Check(rng == "mshadow" || rng == "philox", "LmInputLayer: unknown rng %s.", rng.c_str());
 
     ReadSequenceData();
     
     line_ptr = 0;
-    sampler.Seed(shuffle_seed);
+    if (rng == "philox") {
+      sampler.SeedCounter(shuffle_seed, utils::StreamId(this->layer_name));
+    } else {
+      sampler.Seed(shuffle_seed);
+    }
   }
 
   // return a list of prediction positions
@@ -16,6 +16,7 @@
 #include <mshadow/tensor.h>
 #include "../layer.h"
 #include "../op.h"
+#include "../../utils/corpus_store.h"
 
 using namespace std;
 
@@ -38,6 +39,7 @@ class Map2TextDataLayer : public Layer<xpu>{
     this->defaults["mode"] = SettingV("batch"); // batch, pair, list    
     this->defaults["shuffle"] = SettingV(false);
     this->defaults["speedup_list"] = SettingV(false); // only when list
+    this->defaults["bin_cache"] = SettingV(true); // keep the data files + ".bin_cache"
     this->defaults["min_doc1_len"] = SettingV(1);
     this->defaults["min_doc2_len"] = SettingV(1);
     this->defaults["fix_length"] = SettingV(false);
@@ -68,14 +70,18 @@ class Map2TextDataLayer : public Layer<xpu>{
     utils::Check(top.size() == TopNodeNum(),
                   "Map2TextDataLayer:top size problem.");
 
-    if (!Layer<xpu>::global_data.count("data1")) {
-        Layer<xpu>::global_data["data1"] = vector<string>();
-    }
-    if (!Layer<xpu>::global_data.count("data2")) {
-        Layer<xpu>::global_data["data2"] = vector<string>();
-    }
-    if (!Layer<xpu>::global_data.count("data12")) {
-        Layer<xpu>::global_data["data12"] = vector<string>();
+    // data layers of different types may be set up at the same time
+    #pragma omp critical(layer_global_data)
+    {
+      if (!Layer<xpu>::global_data.count("data1")) {
+          Layer<xpu>::global_data["data1"] = vector<string>();
+      }
+      if (!Layer<xpu>::global_data.count("data2")) {
+          Layer<xpu>::global_data["data2"] = vector<string>();
+      }
+      if (!Layer<xpu>::global_data.count("data12")) {
+          Layer<xpu>::global_data["data12"] = vector<string>();
+      }
     }
 
     data1_file = setting["data1_file"].sVal();
@@ -89,6 +95,7 @@ class Map2TextDataLayer : public Layer<xpu>{
     mode = setting["mode"].sVal();
     shuffle = setting["shuffle"].bVal();
     speedup_list = setting["speedup_list"].bVal();
+    bin_cache = setting["bin_cache"].bVal();
     fix_length = setting["fix_length"].bVal();
     bi_direct = setting["bi_direct"].bVal();
     disturb_label = setting["disturb_label"].fVal();
@@ -99,10 +106,12 @@ class Map2TextDataLayer : public Layer<xpu>{
     utils::Check(mode == "batch" || mode == "pair" || mode == "list" || mode == "inner_pair" || mode == "inner_list",
                   "Map2TextDataLayer: mode is one of batch, pair or list.");
 
-    ReadRelData(rel_file, rel_set, label_set, data1_set, data2_set);
+    ReadRelData(rel_file, rel_set, label_set);
 
-    ReadTextData(data1_file, data1_set, max_doc1_len, min_doc1_len);
-    ReadTextData(data2_file, data2_set, max_doc2_len, min_doc2_len);
+    data1_corpus = utils::CorpusStore::Global().Acquire(data1_file, max_doc1_len, bin_cache);
+    data2_corpus = utils::CorpusStore::Global().Acquire(data2_file, max_doc2_len, bin_cache);
+    data1_corpus->Resolve(rel_set, 0, min_doc1_len, &rel_doc1);
+    data2_corpus->Resolve(rel_set, 1, min_doc2_len, &rel_doc2);
 
     if (mode == "pair") {
       MakePairs(rel_set, label_set, pair_set);
@@ -123,68 +132,7 @@ class Map2TextDataLayer : public Layer<xpu>{
     return x1.size() < x2.size(); // sort increase
   }
   
-  void ReadTextData(string &data_file, unordered_map<string, vector<int> > &data_set, 
-          int max_doc_len, int min_doc_len) {
-    utils::Printf("Open data file: %s\n", data_file.c_str());    
-
-    std::ifstream fin(data_file.c_str());
-    std::string s;
-    std::string key;
-    std::string last_key;
-    int s_len;
-    int value;
-    utils::Check(fin.is_open(), "Map2TextDataLayer: Open data file problem.");
-
-    istringstream iss;
-    while (!fin.eof()) {
-      std::getline(fin, s);
-      if (s.empty()) break;
-      
-      iss.clear();
-      iss.seekg(0, iss.beg);
-      iss.str(s);
-      iss >> key;
-      iss >> s_len;
-
-      // data_set[key] = vector<int>();
-      if (!data_set.count(key) || data_set[key].size() != 0)
-          continue;
-
-      last_key = key;
-
-      // Check sentence length
-      utils::Check(s_len >= min_doc_len, 
-              "Map2TextDataLayer: [Length] Doc length %d less than %d, on line %d.", s_len, min_doc_len, data_set.size());
-
-      if (s_len == 0) continue;
-
-      while(!iss.eof()) {
-        iss >> value;
-        data_set[key].push_back(value);
-
-        // Constrain on sentence length
-        if (data_set[key].size() >= max_doc_len) {
-            break;
-        }
-      }
-
-      // Check sentence length
-      utils::Check(data_set[key].size() >= min_doc_len, 
-              "Map2TextDataLayer: [Read] Doc length %d less than %d, on line %d.", data_set[key].size(), min_doc_len, data_set.size());
-    }
-    fin.close();
-
-    std::cout << last_key.c_str() << " ";
-    for (int i = 0; i < int(data_set[last_key].size()); ++i) {
-        std::cout << data_set[last_key][i] << " ";
-    }
-    std::cout << std::endl;
-
-    utils::Printf("Line count in file: %d\n", data_set.size());
-  }
-  
-  void ReadRelData(string &rel_file, vector<vector<string> > &rel_set, vector<int> &label_set, 
-                   unordered_map<string, vector<int> > &data1_set, unordered_map<string, vector<int> > &data2_set) {
+  void ReadRelData(string &rel_file, vector<vector<string> > &rel_set, vector<int> &label_set) {
     utils::Printf("Open data file: %s\n", rel_file.c_str());    
 
     max_label = 0;
@@ -212,12 +160,6 @@ class Map2TextDataLayer : public Layer<xpu>{
         iss >> value;
         rel_set[line_count].push_back(value);
       }
-      if (!data1_set.count(rel_set[line_count][0])) {
-        data1_set[rel_set[line_count][0]] = vector<int>();
-      }
-      if (!data2_set.count(rel_set[line_count][1])) {
-        data2_set[rel_set[line_count][1]] = vector<int>();
-      }
       line_count += 1;
     }
     fin.close();
@@ -383,59 +325,42 @@ class Map2TextDataLayer : public Layer<xpu>{
   inline void FillData(mshadow::Tensor<xpu, 4> &top0_data, mshadow::Tensor<xpu, 2> &top0_length,
                        mshadow::Tensor<xpu, 4> &top1_data, mshadow::Tensor<xpu, 2> &top1_length, 
                        int top_idx, int data_idx) {
-      utils::Check(data1_set.count(rel_set[data_idx][0]), 
-              "MapTextdataLayer: %s not in data1_set.", rel_set[data_idx][0].c_str());
-      utils::Check(data2_set.count(rel_set[data_idx][1]), 
-              "MapTextdataLayer: %s not in data2_set.", rel_set[data_idx][1].c_str());
-      vector<int> &data1 = data1_set[rel_set[data_idx][0]];
-      vector<int> &data2 = data2_set[rel_set[data_idx][1]];
-
-      for (int k = 0; k < data1.size(); ++k) {
+      FillDocs(top0_data, top0_length, top1_data, top1_length, top_idx,
+               rel_doc1[data_idx], rel_doc2[data_idx]);
+  }
+
+  inline void FillDocs(mshadow::Tensor<xpu, 4> &top0_data, mshadow::Tensor<xpu, 2> &top0_length,
+                       mshadow::Tensor<xpu, 4> &top1_data, mshadow::Tensor<xpu, 2> &top1_length, 
+                       int top_idx, int doc1, int doc2) {
+      const int *data1 = data1_corpus->Doc(doc1);
+      const int *data2 = data2_corpus->Doc(doc2);
+      int len1 = data1_corpus->Size(doc1);
+      int len2 = data2_corpus->Size(doc2);
+
+      for (int k = 0; k < len1; ++k) {
           top0_data[top_idx][0][0][k] = data1[k];
       }
       if (fix_length) {
           top0_length[top_idx][0] = max_doc1_len;
       } else {
-          top0_length[top_idx][0] = data1.size();
+          top0_length[top_idx][0] = len1;
       }
 
-      for (int k = 0; k < data2.size(); ++k) {
+      for (int k = 0; k < len2; ++k) {
           top1_data[top_idx][0][0][k] = data2[k];
       }
       if (fix_length) {
           top1_length[top_idx][0] = max_doc2_len;
       } else {
-          top1_length[top_idx][0] = data2.size();
+          top1_length[top_idx][0] = len2;
       }
   } 
   
   inline void FillData2(mshadow::Tensor<xpu, 4> &top0_data, mshadow::Tensor<xpu, 2> &top0_length,
                         mshadow::Tensor<xpu, 4> &top1_data, mshadow::Tensor<xpu, 2> &top1_length, 
                         int top_idx, string &data_id1, string &data_id2) {
-      utils::Check(data1_set.count(data_id1), 
-              "MapTextdataLayer: %s not in data1_set.", data_id1.c_str());
-      utils::Check(data2_set.count(data_id2), 
-              "MapTextdataLayer: %s not in data2_set.", data_id2.c_str());
-      vector<int> &data1 = data1_set[data_id1];
-      vector<int> &data2 = data2_set[data_id2];
-
-      for (int k = 0; k < data1.size(); ++k) {
-          top0_data[top_idx][0][0][k] = data1[k];
-      }
-      if (fix_length) {
-          top0_length[top_idx][0] = max_doc1_len;
-      } else {
-          top0_length[top_idx][0] = data1.size();
-      }
-
-      for (int k = 0; k < data2.size(); ++k) {
-          top1_data[top_idx][0][0][k] = data2[k];
-      }
-      if (fix_length) {
-          top1_length[top_idx][0] = max_doc2_len;
-      } else {
-          top1_length[top_idx][0] = data2.size();
-      }
+      FillDocs(top0_data, top0_length, top1_data, top1_length, top_idx,
+               data1_corpus->Find(data_id1), data2_corpus->Find(data_id2));
   } 
 
   virtual void Forward(const std::vector<Node<xpu>*> &bottom,
@@ -626,9 +551,6 @@ class Map2TextDataLayer : public Layer<xpu>{
     
   }
   
-  static unordered_map<string, vector<int> > data1_set;
-  static unordered_map<string, vector<int> > data2_set;
-
  protected:
   string data1_file;
   string data2_file;
@@ -642,6 +564,7 @@ class Map2TextDataLayer : public Layer<xpu>{
   string mode;
   bool shuffle;
   bool speedup_list;
+  bool bin_cache;
   bool fix_length;
   bool bi_direct;
   float disturb_label;
@@ -650,7 +573,13 @@ class Map2TextDataLayer : public Layer<xpu>{
   float augment_ratio;
   float rmchar_ratio;
   
+  // parsed docs, shared with the other layers reading the same files
+  std::shared_ptr<const utils::Corpus> data1_corpus;
+  std::shared_ptr<const utils::Corpus> data2_corpus;
+
   vector<vector<string> > rel_set;
+  vector<int> rel_doc1;
+  vector<int> rel_doc2;
   vector<int> label_set;
   vector<vector<int> > pair_set;
   vector<vector<int> > list_set;
@@ -667,8 +596,6 @@ class Map2TextDataLayer : public Layer<xpu>{
   int max_list;
   std::default_random_engine rnd_generator;
 };
-template<typename xpu> unordered_map<string, vector<int> > Map2TextDataLayer<xpu>::data1_set = unordered_map<string, vector<int> >();
-template<typename xpu> unordered_map<string, vector<int> > Map2TextDataLayer<xpu>::data2_set = unordered_map<string, vector<int> >();
 }  // namespace layer
 }  // namespace textnet
 #endif  // LAYER_MAP_2_TEXTDATA_LAYER_INL_HPP_
@@ -16,6 +16,7 @@
 #include <mshadow/tensor.h>
 #include "../layer.h"
 #include "../op.h"
+#include "../../utils/corpus_store.h"
 
 using namespace std;
 
@@ -39,6 +40,7 @@ class Map2WindowTextDataLayer : public Layer<xpu>{
     this->defaults["mode"] = SettingV("batch"); // batch, pair, list    
     this->defaults["shuffle"] = SettingV(false);
     this->defaults["speedup_list"] = SettingV(false); // only when list
+    this->defaults["bin_cache"] = SettingV(true); // keep the data files + ".bin_cache"
     this->defaults["fix_length"] = SettingV(false);
     this->defaults["max_doc_len"] = SettingV(2000);
     this->defaults["data1_doc_len"] = SettingV(18);
@@ -62,11 +64,15 @@ class Map2WindowTextDataLayer : public Layer<xpu>{
     utils::Check(top.size() == TopNodeNum(),
                   "Map2WindowTextDataLayer:top size problem.");
 
-    if (!Layer<xpu>::global_data.count("data1")) {
-        Layer<xpu>::global_data["data1"] = vector<string>();
-    }
-    if (!Layer<xpu>::global_data.count("data2")) {
-        Layer<xpu>::global_data["data2"] = vector<string>();
+    // data layers of different types may be set up at the same time
+    #pragma omp critical(layer_global_data)
+    {
+      if (!Layer<xpu>::global_data.count("data1")) {
+          Layer<xpu>::global_data["data1"] = vector<string>();
+      }
+      if (!Layer<xpu>::global_data.count("data2")) {
+          Layer<xpu>::global_data["data2"] = vector<string>();
+      }
     }
 
     data1_file = setting["data1_file"].sVal();
@@ -79,9 +85,8 @@ class Map2WindowTextDataLayer : public Layer<xpu>{
     mode = setting["mode"].sVal();
     shuffle = setting["shuffle"].bVal();
     speedup_list = setting["speedup_list"].bVal();
+    bin_cache = setting["bin_cache"].bVal();
     fix_length = setting["fix_length"].bVal();
-    max_doc1_len = -1;
-    max_doc2_len = -1;
     
     utils::Check(mode == "batch" || mode == "pair" || mode == "list" ,
                   "Map2WindowTextDataLayer: mode is one of batch, pair or list.");
@@ -89,10 +94,14 @@ class Map2WindowTextDataLayer : public Layer<xpu>{
     /*
        * rel_set :: vector<vector<string>> ->  vector<pair<query,doc>>
     */
-    ReadRelData(rel_file, rel_set, label_set, data1_set, data2_set);
-
-    ReadTextData(data1_file, data1_set, max_doc1_len, min_doc1_len);
-    ReadTextData(data2_file, data2_set, max_doc2_len, min_doc2_len);
+    ReadRelData(rel_file, rel_set, label_set);
+
+    data1_corpus = utils::CorpusStore::Global().Acquire(data1_file, max_doc_len, bin_cache);
+    data2_corpus = utils::CorpusStore::Global().Acquire(data2_file, max_doc_len, bin_cache);
+    data1_corpus->Resolve(rel_set, 0, 1, &rel_doc1);
+    data2_corpus->Resolve(rel_set, 1, 1, &rel_doc2);
+    max_doc1_len = data1_corpus->MaxSize();
+    max_doc2_len = data2_corpus->MaxSize();
     //printf("SetUpLayer max_doc1_len:%d, max_doc2_len:%d\n",max_doc1_len,max_doc2_len);
 
     if (mode == "pair") {
@@ -115,60 +124,7 @@ class Map2WindowTextDataLayer : public Layer<xpu>{
     return x1.size() < x2.size(); // sort increase
   }
   
-  void ReadTextData(string &data_file, unordered_map<string, vector<int> > &data_set, 
-          int & cmax_doc_len, int & cmin_doc_len) {
-    utils::Printf("Open data file: %s\n", data_file.c_str());    
-
-    std::ifstream fin(data_file.c_str());
-    std::string s;
-    std::string key;
-    std::string last_key;
-    int s_len;
-    int value;
-    utils::Check(fin.is_open(), "Map2WindowTextDataLayer: Open data file problem.");
-
-    istringstream iss;
-    while (!fin.eof()) {
-      std::getline(fin, s);
-      if (s.empty()) break;
-      
-      iss.clear();
-      iss.seekg(0, iss.beg);
-      iss.str(s);
-      iss >> key;
-      iss >> s_len;
-      cmax_doc_len = cmax_doc_len > s_len ? cmax_doc_len : s_len;
-      cmax_doc_len = cmax_doc_len > max_doc_len ? max_doc_len : cmax_doc_len;
-      cmin_doc_len = cmin_doc_len > s_len ? cmin_doc_len : s_len;
-
-      // data_set[key] = vector<int>();
-      if (!data_set.count(key) || data_set[key].size() != 0)
-          continue;
-
-      last_key = key;
-      while(!iss.eof()) {
-        iss >> value;
-        data_set[key].push_back(value);
-        if(data_set[key].size() >= max_doc_len) break;
-      }
-
-      // Check sentence length
-      utils::Check(data_set[key].size() > 0 , 
-              "Map2WindowTextDataLayer: Doc length %d less than 1, on line %d.", data_set[key].size(), data_set.size());
-    }
-    fin.close();
-
-    std::cout << last_key.c_str() << " ";
-    for (int i = 0; i < data_set[last_key].size(); ++i) {
-        std::cout << data_set[last_key][i] << " ";
-    }
-    std::cout << std::endl;
-
-    utils::Printf("Line count in file: %d\n", data_set.size());
-  }
-  
-  void ReadRelData(string &rel_file, vector<vector<string> > &crel_set, vector<int> &label_set, 
-                   unordered_map<string, vector<int> > &data1_set, unordered_map<string, vector<int> > &data2_set) {
+  void ReadRelData(string &rel_file, vector<vector<string> > &crel_set, vector<int> &label_set) {
     utils::Printf("Open data file: %s\n", rel_file.c_str());    
 
     max_label = 0;
@@ -196,12 +152,6 @@ class Map2WindowTextDataLayer : public Layer<xpu>{
         iss >> value;
         crel_set[line_count].push_back(value);
       }
-      if (!data1_set.count(crel_set[line_count][0])) {
-        data1_set[crel_set[line_count][0]] = vector<int>();
-      }
-      if (!data2_set.count(crel_set[line_count][1])) {
-        data2_set[crel_set[line_count][1]] = vector<int>();
-      }
       line_count += 1;
     }
     fin.close();
@@ -337,10 +287,10 @@ class Map2WindowTextDataLayer : public Layer<xpu>{
         } 
         int pos_idx = pair_set[cline_ptr][0];
         int neg_idx = pair_set[cline_ptr][1];
-        int pos_doc_len = data2_set[rel_set[pos_idx][1]].size();
+        int pos_doc_len = data2_corpus->Size(rel_doc2[pos_idx]);
         //int pos_doc_window_num = int((pos_doc_len * 2 - 2 + window_size) / window_size);
         int pos_doc_window_num = int((pos_doc_len  - 1 + window_size) / window_size);
-        int neg_doc_len = data2_set[rel_set[neg_idx][1]].size();
+        int neg_doc_len = data2_corpus->Size(rel_doc2[neg_idx]);
         //int neg_doc_window_num = int((neg_doc_len * 2 - 2 + window_size) / window_size);
         int neg_doc_window_num = int((neg_doc_len  - 1 + window_size) / window_size);
         wbatch_size += (pos_doc_window_num + neg_doc_window_num);
@@ -396,7 +346,7 @@ class Map2WindowTextDataLayer : public Layer<xpu>{
         for (int i = 0; i < list_set[cline_ptr].size(); ++i) {
           int idx = list_set[cline_ptr][i];
           //printf("i:%d,idx:%d,doc:%s\n",i,idx,rel_set[idx][1].c_str());
-          int curr_doc_len = data2_set[rel_set[idx][1]].size();
+          int curr_doc_len = data2_corpus->Size(rel_doc2[idx]);
           //int curr_doc_window_num = int((curr_doc_len * 2 - 2 + window_size) / window_size);
           int curr_doc_window_num = int((curr_doc_len  - 1 + window_size) / window_size);
           wbatch_size += curr_doc_window_num;
@@ -458,28 +408,26 @@ class Map2WindowTextDataLayer : public Layer<xpu>{
   inline void FillData(mshadow::Tensor<xpu, 4> &top0_data, mshadow::Tensor<xpu, 2> &top0_length,
                        mshadow::Tensor<xpu, 4> &top1_data, mshadow::Tensor<xpu, 2> &top1_length, 
                        int top_idx,int step, int data_idx) {
-      utils::Check(data1_set.count(rel_set[data_idx][0]), 
-              "Map2WindowTextDataLayer: %s not in data1_set.", rel_set[data_idx][0].c_str());
-      utils::Check(data2_set.count(rel_set[data_idx][1]), 
-              "Map2WindowTextDataLayer: %s not in data2_set.", rel_set[data_idx][1].c_str());
-      const vector<int> &data1 = data1_set[rel_set[data_idx][0]]; //query 
-      const vector<int> &data2 = data2_set[rel_set[data_idx][1]]; //doc
+      const int *data1 = data1_corpus->Doc(rel_doc1[data_idx]); //query 
+      const int *data2 = data2_corpus->Doc(rel_doc2[data_idx]); //doc
+      int len1 = data1_corpus->Size(rel_doc1[data_idx]);
+      int len2 = data2_corpus->Size(rel_doc2[data_idx]);
 
       for(int i = 0 ; i < step; ++ i){
-        for (int k = 0; k < data1.size(); ++k) {
+        for (int k = 0; k < len1; ++k) {
             top0_data[top_idx+i][0][0][k] = data1[k];
         }
         if (fix_length) {
             top0_length[top_idx+i][0] = max_doc1_len;
         } else {
-            top0_length[top_idx+i][0] = data1.size();
-            utils::Check(data1.size() > 0, "Map2WindowTextDataLayer: data1 size:%d\n",data1.size());
+            top0_length[top_idx+i][0] = len1;
+            utils::Check(len1 > 0, "Map2WindowTextDataLayer: data1 size:%d\n",len1);
         }
 
         //int curr_beg = i * window_size / 2;
         int curr_beg = i * window_size;
         int curr_len = window_size;
-        if(curr_beg + curr_len >= data2.size()) curr_len = data2.size() - curr_beg;
+        if(curr_beg + curr_len >= len2) curr_len = len2 - curr_beg;
         utils::Check(curr_len > 0, "FillData Wrong, curr_len:%d.",curr_len);
         for (int k = 0; k < curr_len; ++k) {
             top1_data[top_idx+i][0][0][k] = data2[curr_beg + k];
@@ -492,10 +440,10 @@ class Map2WindowTextDataLayer : public Layer<xpu>{
       }
       /*
       if(step == 2){
-          printf("data1 length:%d\t,",data1.size());
-          for(int i = 0 ; i < data1.size(); ++ i)   printf(" %d",data1[i]);
-          printf("\ndata2 length:%d\t,",data2.size());
-          for(int i = 0 ; i < data2.size(); ++ i)   printf(" %d",data2[i]);
+          printf("data1 length:%d\t,",len1);
+          for(int i = 0 ; i < len1; ++ i)   printf(" %d",data1[i]);
+          printf("\ndata2 length:%d\t,",len2);
+          for(int i = 0 ; i < len2; ++ i)   printf(" %d",data2[i]);
           printf("\ntop0:\n");
           for(int i = 0 ; i < step; ++ i){
               printf("i:");
@@ -545,9 +493,6 @@ class Map2WindowTextDataLayer : public Layer<xpu>{
     using namespace mshadow::expr;
   }
   
-  static unordered_map<string, vector<int> > data1_set;
-  static unordered_map<string, vector<int> > data2_set;
-
  protected:
   string data1_file;
   string data2_file;
@@ -556,18 +501,23 @@ class Map2WindowTextDataLayer : public Layer<xpu>{
   int batch_size;
   int window_size;
   int wbatch_size; // according to window_num to set new batch size( nbatch_size)
-  int min_doc1_len;
   int max_doc1_len;
-  int min_doc2_len;
   int max_doc2_len;
   int max_doc_len;
   int data1_doc_len;
   string mode;
   bool shuffle;
   bool speedup_list;
+  bool bin_cache;
   bool fix_length;
   
+  // parsed docs, shared with the other layers reading the same files
+  std::shared_ptr<const utils::Corpus> data1_corpus;
+  std::shared_ptr<const utils::Corpus> data2_corpus;
+
   vector<vector<string> > rel_set;
+  vector<int> rel_doc1;
+  vector<int> rel_doc2;
   vector<int> label_set;
   vector<vector<int> > pair_set;
   vector<vector<int> > list_set;
@@ -584,8 +534,6 @@ class Map2WindowTextDataLayer : public Layer<xpu>{
   int max_list;
   std::default_random_engine rnd_generator;
 };
-template<typename xpu> unordered_map<string, vector<int> > Map2WindowTextDataLayer<xpu>::data1_set = unordered_map<string, vector<int> >();
-template<typename xpu> unordered_map<string, vector<int> > Map2WindowTextDataLayer<xpu>::data2_set = unordered_map<string, vector<int> >();
 }  // namespace layer
 }  // namespace textnet
 #endif  // LAYER_MAP_2_TEXTDATA_LAYER_INL_HPP_
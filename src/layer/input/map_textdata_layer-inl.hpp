@@ -14,6 +14,7 @@
 #include <mshadow/tensor.h>
 #include "../layer.h"
 #include "../op.h"
+#include "../../utils/corpus_store.h"
 
 using namespace std;
 
@@ -36,6 +37,7 @@ class MapTextDataLayer : public Layer<xpu>{
     this->defaults["mode"] = SettingV("batch"); // batch, pair, list    
     this->defaults["shuffle"] = SettingV(false);
     this->defaults["speedup_list"] = SettingV(false); // only when list
+    this->defaults["bin_cache"] = SettingV(true); // keep the data files + ".bin_cache"
     this->defaults["min_doc_len"] = SettingV(1);
     // require value, set to SettingV(),
     // it will force custom to set in config
@@ -67,14 +69,17 @@ class MapTextDataLayer : public Layer<xpu>{
     mode = setting["mode"].sVal();
     shuffle = setting["shuffle"].bVal();
     speedup_list = setting["speedup_list"].bVal();
+    bin_cache = setting["bin_cache"].bVal();
     
     utils::Check(mode == "batch" || mode == "pair" || mode == "list",
                   "MapTextDataLayer: mode is one of batch, pair or list.");
 
-    ReadRelData(rel_file, rel_set, label_set, data1_set, data2_set);
+    ReadRelData(rel_file, rel_set, label_set);
 
-    ReadTextData(data1_file, data1_set);
-    ReadTextData(data2_file, data2_set);
+    data1_corpus = utils::CorpusStore::Global().Acquire(data1_file, max_doc_len, bin_cache);
+    data2_corpus = utils::CorpusStore::Global().Acquire(data2_file, max_doc_len, bin_cache);
+    data1_corpus->Resolve(rel_set, 0, min_doc_len, &rel_doc1);
+    data2_corpus->Resolve(rel_set, 1, min_doc_len, &rel_doc2);
 
     if (mode == "pair") {
       MakePairs(rel_set, label_set, pair_set);
@@ -89,60 +94,7 @@ class MapTextDataLayer : public Layer<xpu>{
     return x1.size() < x2.size(); // sort increase
   }
   
-  void ReadTextData(string &data_file, unordered_map<string, vector<int> > &data_set) {
-    utils::Printf("Open data file: %s\n", data_file.c_str());    
-
-    std::ifstream fin(data_file.c_str());
-    std::string s;
-    std::string key;
-    std::string last_key;
-    int s_len;
-    int value;
-    utils::Check(fin.is_open(), "MapTextdataLayer: Open data file problem.");
-
-    istringstream iss;
-    while (!fin.eof()) {
-      std::getline(fin, s);
-      if (s.empty()) break;
-      
-      iss.clear();
-      iss.seekg(0, iss.beg);
-      iss.str(s);
-      iss >> key;
-      iss >> s_len;
-
-      // data_set[key] = vector<int>();
-      if (!data_set.count(key) || data_set[key].size() != 0)
-          continue;
-
-      last_key = key;
-      while(!iss.eof()) {
-        iss >> value;
-        data_set[key].push_back(value);
-
-        // Constrain on sentence length
-        if (data_set[key].size() >= max_doc_len) {
-            break;
-        }
-      }
-
-      // Check sentence length
-      utils::Check(data_set[key].size() >= min_doc_len, 
-              "MapTextdataLayer: Doc length %d less than %d, on line %d.", data_set[key].size(), min_doc_len, data_set.size());
-    }
-    fin.close();
-
-    std::cout << last_key.c_str() << " ";
-    for (int i = 0; i < data_set[last_key].size(); ++i) {
-        std::cout << data_set[last_key][i] << " ";
-    }
-    std::cout << std::endl;
-
-    utils::Printf("Line count in file: %d\n", data_set.size());
-  }
-  
-  void ReadRelData(string &rel_file, vector<vector<string> > &rel_set, vector<int> &label_set, 
-                   unordered_map<string, vector<int> > &data1_set, unordered_map<string, vector<int> > &data2_set) {
+  void ReadRelData(string &rel_file, vector<vector<string> > &rel_set, vector<int> &label_set) {
     utils::Printf("Open data file: %s\n", rel_file.c_str());    
 
     max_label = 0;
@@ -170,12 +122,6 @@ class MapTextDataLayer : public Layer<xpu>{
         iss >> value;
         rel_set[line_count].push_back(value);
       }
-      if (!data1_set.count(rel_set[line_count][0])) {
-        data1_set[rel_set[line_count][0]] = vector<int>();
-      }
-      if (!data2_set.count(rel_set[line_count][1])) {
-        data2_set[rel_set[line_count][1]] = vector<int>();
-      }
       line_count += 1;
     }
     fin.close();
@@ -300,22 +246,20 @@ class MapTextDataLayer : public Layer<xpu>{
 
   inline void FillData(mshadow::Tensor<xpu, 4> &top0_data, mshadow::Tensor<xpu, 2> &top0_length, 
                        int top_idx, int data_idx) {
-      utils::Check(data1_set.count(rel_set[data_idx][0]), 
-              "MapTextdataLayer: %s not in data1_set.", rel_set[data_idx][0].c_str());
-      utils::Check(data2_set.count(rel_set[data_idx][1]), 
-              "MapTextdataLayer: %s not in data2_set.", rel_set[data_idx][1].c_str());
-      vector<int> &data1 = data1_set[rel_set[data_idx][0]];
-      vector<int> &data2 = data2_set[rel_set[data_idx][1]];
-
-      for (int k = 0; k < data1.size(); ++k) {
+      const int *data1 = data1_corpus->Doc(rel_doc1[data_idx]);
+      const int *data2 = data2_corpus->Doc(rel_doc2[data_idx]);
+      int len1 = data1_corpus->Size(rel_doc1[data_idx]);
+      int len2 = data2_corpus->Size(rel_doc2[data_idx]);
+
+      for (int k = 0; k < len1; ++k) {
           top0_data[top_idx][0][0][k] = data1[k];
       }
-      top0_length[top_idx][0] = data1.size();
+      top0_length[top_idx][0] = len1;
 
-      for (int k = 0; k < data2.size(); ++k) {
+      for (int k = 0; k < len2; ++k) {
           top0_data[top_idx][0][1][k] = data2[k];
       }
-      top0_length[top_idx][1] = data2.size();
+      top0_length[top_idx][1] = len2;
   } 
   
   virtual void Forward(const std::vector<Node<xpu>*> &bottom,
@@ -373,9 +317,6 @@ class MapTextDataLayer : public Layer<xpu>{
     
   }
   
-  static unordered_map<string, vector<int> > data1_set;
-  static unordered_map<string, vector<int> > data2_set;
-
  protected:
   string data1_file;
   string data2_file;
@@ -387,8 +328,15 @@ class MapTextDataLayer : public Layer<xpu>{
   string mode;
   bool shuffle;
   bool speedup_list;
+  bool bin_cache;
   
+  // parsed docs, shared with the other layers reading the same files
+  std::shared_ptr<const utils::Corpus> data1_corpus;
+  std::shared_ptr<const utils::Corpus> data2_corpus;
+
   vector<vector<string> > rel_set;
+  vector<int> rel_doc1;
+  vector<int> rel_doc2;
   vector<int> label_set;
   vector<vector<int> > pair_set;
   vector<vector<int> > list_set;
@@ -399,8 +347,6 @@ class MapTextDataLayer : public Layer<xpu>{
 
   int max_list;
 };
-template<typename xpu> unordered_map<string, vector<int> > MapTextDataLayer<xpu>::data1_set = unordered_map<string, vector<int> >();
-template<typename xpu> unordered_map<string, vector<int> > MapTextDataLayer<xpu>::data2_set = unordered_map<string, vector<int> >();
 }  // namespace layer
 }  // namespace textnet
 #endif  // LAYER_MAP_TEXTDATA_LAYER_INL_HPP_
@@ -8,6 +8,7 @@
 #include <mshadow/tensor.h>
 #include "../layer.h"
 #include "../op.h"
+#include "../../utils/philox.h"
 
 namespace textnet {
 namespace layer {
@@ -27,6 +28,9 @@ class NegativeSampleLayer : public Layer<xpu>{
   virtual void Require() {
     // default value, just set the value you want
     this->defaults["shuffle_seed"] = SettingV(123);
+    // "philox": counter based draws keyed by the example slot in the batch,
+    // the rows of a batch are then sampled in parallel
+    this->defaults["rng"] = SettingV("mshadow");
 
     // require value, set to SettingV(),
     // it will force custom to set in config
@@ -61,12 +65,22 @@ class NegativeSampleLayer : public Layer<xpu>{
     vocab_size = setting["vocab_size"].i_val;
     word_freq_file = setting["word_freq_file"].s_val;
     sample_exp_factor = setting["sample_exp_factor"].f_val;
+    shuffle_seed = setting["shuffle_seed"].iVal();
+    std::string rng = setting["rng"].sVal();
+    utils::Check(rng == "mshadow" || rng == "philox",
+                  "NegativeSampleLayer: unknown rng %s.", rng.c_str());
+    use_philox = rng == "philox";
 
     ReadSequenceData();
     construct_sample_pool();
     
     line_ptr = 0;
-    sampler.Seed(shuffle_seed);
+    forward_step = 0;
+    if (use_philox) {
+      sampler.SeedCounter(shuffle_seed, utils::StreamId(this->layer_name));
+    } else {
+      sampler.Seed(shuffle_seed);
+    }
   }
 
   void construct_sample_pool() {
@@ -104,9 +118,12 @@ class NegativeSampleLayer : public Layer<xpu>{
 
   // return a list of negative samples
   void negative_sampler(vector<int> &negative_sample) {
+    negative_sampler(negative_sample, &this->sampler);
+  }
+  void negative_sampler(vector<int> &negative_sample, utils::RandomSampler *rs) {
     negative_sample.clear();
     for (int i = 0; i < negative_num; ++i) {
-      int sample = this->sampler.NextUInt32(sample_vector.size());
+      int sample = rs->NextUInt32(sample_vector.size());
       sample = sample_vector[sample];
       utils::Assert(sample >= 0 && sample < vocab_size, "NegativeSampleLayer: sampler error");
       negative_sample.push_back(sample);
@@ -137,6 +154,10 @@ class NegativeSampleLayer : public Layer<xpu>{
   // 具体是这样的，给定一个长度length，从length中sample一个sub_length，也就是句子中的某个位置
   // 然后用sub_length上的lstm表达去预测sub_length位置比较近的某一个位置上的单词，也就是pred_position
   void position_sampler_4_doc2vec_random_length(int length, int &sub_length, vector<int> &pred_position) {
+    position_sampler_4_doc2vec_random_length(length, sub_length, pred_position, &this->sampler);
+  }
+  void position_sampler_4_doc2vec_random_length(int length, int &sub_length, vector<int> &pred_position,
+                                                utils::RandomSampler *rs) {
     vector<int> shuffle_pos;
     int min_sub_length = 3; // 这个是规定的最小长度
     int window_size = 5; // 也就是说某个位置之前的若干个单词中随机选择
@@ -144,7 +165,7 @@ class NegativeSampleLayer : public Layer<xpu>{
     for (int i = min_sub_length; i <= length; ++i) {
       shuffle_pos.push_back(i);
     } 
-    this->sampler.Shuffle(shuffle_pos);
+    rs->Shuffle(shuffle_pos);
     sub_length = shuffle_pos[0]; // random a sub length
     // ATTENTION!!!
     sub_length = length;
@@ -158,7 +179,7 @@ class NegativeSampleLayer : public Layer<xpu>{
     for (int i = left_bound; i < sub_length; ++i) {
       shuffle_pos.push_back(i);
     } 
-    this->sampler.Shuffle(shuffle_pos);
+    rs->Shuffle(shuffle_pos);
     utils::Check(position_num <= shuffle_pos.size(), "NegativeSampleLayer: position_num error.");
     pred_position = vector<int>(shuffle_pos.begin(), shuffle_pos.begin() + position_num);
     sort(pred_position.begin(), pred_position.end());
@@ -239,39 +260,69 @@ class NegativeSampleLayer : public Layer<xpu>{
     utils::Check(x.size(0) == batch_size, "ORC: error, need reshape.");
     x = -1.f, /*pos = -1.f,*/ sample = -1.f, y = -1.f, x_length = -1, sample_length = -1;
     
-    int sub_length = -1;
-    vector<int> position_sample, negative_sample;
+    if (use_philox) {
+      // pick the examples serially, then every row draws from its own sub stream
+      std::vector<int> batch_ids(batch_size);
+      for (int batch_idx = 0; batch_idx < batch_size; ++batch_idx) {
+        if (this->phrase_type == kTrain && line_ptr == 0) {
+          utils::RandomSampler rs = sampler.Fork(forward_step, batch_size + batch_idx);
+          rs.Shuffle(example_ids);
+        }
+        batch_ids[batch_idx] = example_ids[line_ptr];
+        line_ptr = (line_ptr + 1) % line_count;
+      }
+      #pragma omp parallel for schedule(static)
+      for (int batch_idx = 0; batch_idx < batch_size; ++batch_idx) {
+        utils::RandomSampler rs = sampler.Fork(forward_step, batch_idx);
+        FillExample(batch_idx, batch_ids[batch_idx], &rs, top);
+      }
+      ++forward_step;
+      return;
+    }
     for (int batch_idx = 0; batch_idx < batch_size; ++batch_idx) {
       if (this->phrase_type == kTrain && line_ptr == 0) {
         this->sampler.Shuffle(example_ids);
       }
-      int example_id = example_ids[line_ptr];
-      int len = length[example_id];
-      position_sampler_4_doc2vec_random_length(len, sub_length, position_sample);
-      x[batch_idx][0][0].Slice(0, sub_length) = F<op::identity>(data_set[example_id][0][0].Slice(0, sub_length));
-      x_length[batch_idx][0] = sub_length;
-      
-      // position_sampler(length[example_id], position_sample);
-      for (int pos_idx = 0; pos_idx < position_num; ++pos_idx) {
-        // pos[batch_idx][pos_idx][0][0] = position_sample[pos_idx];
-        int word_pos = position_sample[pos_idx];
-        if (word_pos == -1) {
-          utils::Check(false, "NegativeSampleLayer: position must >= 0");
-        }
-        int word_idx = x[batch_idx][0][0][word_pos];
-        sample[batch_idx][pos_idx][0][0] = word_idx;
-        y[batch_idx][pos_idx][0][0] = 1;
-        sample_length[batch_idx][pos_idx] = negative_num + 1;
-        negative_sampler(negative_sample);
-        for (int sample_idx = 0; sample_idx < negative_num; ++sample_idx) {
-          sample[batch_idx][pos_idx][0][sample_idx+1] = negative_sample[sample_idx];
-          y[batch_idx][pos_idx][sample_idx+1][0] = 0;
-        }
-      }
-      
+      FillExample(batch_idx, example_ids[line_ptr], &this->sampler, top);
       line_ptr = (line_ptr + 1) % line_count;
     }
   }
+
+  // one row of the batch, draws only from rs
+  void FillExample(int batch_idx, int example_id, utils::RandomSampler *rs,
+                   const std::vector<Node<xpu>*> &top) {
+    using namespace mshadow::expr;
+    mshadow::Tensor<xpu, 4> x        = top[0]->data;
+    mshadow::Tensor<xpu, 4> sample   = top[2]->data;
+    mshadow::Tensor<xpu, 4> y        = top[3]->data;
+    mshadow::Tensor<xpu, 2> x_length = top[0]->length;
+    mshadow::Tensor<xpu, 2> sample_length = top[2]->length;
+
+    int sub_length = -1;
+    vector<int> position_sample, negative_sample;
+    int len = length[example_id];
+    position_sampler_4_doc2vec_random_length(len, sub_length, position_sample, rs);
+    x[batch_idx][0][0].Slice(0, sub_length) = F<op::identity>(data_set[example_id][0][0].Slice(0, sub_length));
+    x_length[batch_idx][0] = sub_length;
+    
+    // position_sampler(length[example_id], position_sample);
+    for (int pos_idx = 0; pos_idx < position_num; ++pos_idx) {
+      // pos[batch_idx][pos_idx][0][0] = position_sample[pos_idx];
+      int word_pos = position_sample[pos_idx];
+      if (word_pos == -1) {
+        utils::Check(false, "NegativeSampleLayer: position must >= 0");
+      }
+      int word_idx = x[batch_idx][0][0][word_pos];
+      sample[batch_idx][pos_idx][0][0] = word_idx;
+      y[batch_idx][pos_idx][0][0] = 1;
+      sample_length[batch_idx][pos_idx] = negative_num + 1;
+      negative_sampler(negative_sample, rs);
+      for (int sample_idx = 0; sample_idx < negative_num; ++sample_idx) {
+        sample[batch_idx][pos_idx][0][sample_idx+1] = negative_sample[sample_idx];
+        y[batch_idx][pos_idx][sample_idx+1][0] = 0;
+      }
+    }
+  }
   
   virtual void Backprop(const std::vector<Node<xpu>*> &bottom,
                         const std::vector<Node<xpu>*> &top) {
@@ -285,6 +336,8 @@ class NegativeSampleLayer : public Layer<xpu>{
   mshadow::TensorContainer<xpu, 1, int> length;
   std::vector<int> example_ids;
   int line_count, line_ptr, shuffle_seed;
+  bool use_philox;
+  unsigned long forward_step;
   float sample_exp_factor;
   utils::RandomSampler sampler;
   vector<int> sample_vector; 
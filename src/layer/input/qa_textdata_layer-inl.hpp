@@ -14,6 +14,7 @@
 #include <mshadow/tensor.h>
 #include "../layer.h"
 #include "../op.h"
+#include "../../utils/corpus_store.h"
 
 using namespace std;
 
@@ -36,6 +37,7 @@ class QATextDataLayer : public Layer<xpu>{
     this->defaults["mode"] = SettingV("batch"); // batch, pair, list    
 	this->defaults["shuffle"] = SettingV(false);
 	this->defaults["speedup_list"] = SettingV(true); // only when list
+	this->defaults["bin_cache"] = SettingV(true); // keep the data files + ".bin_cache"
     // require value, set to SettingV(),
     // it will force custom to set in config
     this->defaults["question_data_file"] = SettingV();
@@ -69,16 +71,23 @@ class QATextDataLayer : public Layer<xpu>{
     mode = setting["mode"].sVal();
 	shuffle = setting["shuffle"].bVal();
 	speedup_list = setting["speedup_list"].bVal();
+	bin_cache = setting["bin_cache"].bVal();
     
     utils::Check(mode == "batch" || mode == "pair" || mode == "list",
                   "QATextDataLayer: mode is one of batch, pair or list.");
 
-    ReadTextData(question_data_file, question_data_set);
-    ReadTextData(answer_data_file, answer_data_set);
-
     ReadRelData(question_rel_file, question_rel_set);
     ReadRelData(answer_rel_file, answer_rel_set);
 
+    question_corpus = utils::CorpusStore::Global().Acquire(question_data_file, max_doc_len, bin_cache);
+    answer_corpus = utils::CorpusStore::Global().Acquire(answer_data_file, max_doc_len, bin_cache);
+    question_rel_doc.resize(candids + 1);
+    answer_rel_doc.resize(candids + 1);
+    for (int j = 0; j < candids + 1; ++j) {
+      question_corpus->Resolve(question_rel_set, j, 0, &question_rel_doc[j]);
+      answer_corpus->Resolve(answer_rel_set, j, 0, &answer_rel_doc[j]);
+    }
+
     ReadLabel(question_rel_file, label_set);
 
     if (mode == "pair") {
@@ -93,43 +102,6 @@ class QATextDataLayer : public Layer<xpu>{
   static bool list_size_cmp(const vector<int> &x1, const vector<int> &x2) {
     return x1.size() < x2.size(); // sort increase
   }
-
-  void ReadTextData(string &data_file, unordered_map<string, vector<int> > &data_set) {
-    utils::Printf("Open data file: %s\n", data_file.c_str());    
-
-    std::ifstream fin(data_file.c_str());
-    std::string s;
-    std::string key;
-    int s_len;
-    int value;
-    utils::Check(fin.is_open(), "Open data file problem.");
-
-    istringstream iss;
-    while (!fin.eof()) {
-      std::getline(fin, s);
-      if (s.empty()) break;
-      
-      iss.clear();
-      iss.seekg(0, iss.beg);
-      iss.str(s);
-      iss >> key;
-      iss >> s_len;
-      data_set[key] = vector<int>();
-      while(!iss.eof()) {
-        iss >> value;
-        data_set[key].push_back(value);
-      }
-    }
-    fin.close();
-
-    utils::Printf("%s\n", key.c_str());
-    for (int i = 0; i < data_set[key].size(); ++i) {
-      utils::Printf("%d ", data_set[key][i]);
-    }
-    utils::Printf("\n");
-
-    utils::Printf("Line count in file: %d\n", data_set.size());
-  }
   
   void ReadRelData(string &data_file, vector<vector<string> > &data_set) {
     utils::Printf("Open data file: %s\n", data_file.c_str());    
@@ -288,17 +260,19 @@ class QATextDataLayer : public Layer<xpu>{
                        int top_idx, int data_idx) {
     for (int j = 0; j < candids + 1; ++j) {
 
-      vector<int> &q_data = question_data_set[question_rel_set[data_idx][j]];
-      for (int k = 0; k < q_data.size(); ++k) {
+      const int *q_data = question_corpus->Doc(question_rel_doc[j][data_idx]);
+      int q_len = question_corpus->Size(question_rel_doc[j][data_idx]);
+      for (int k = 0; k < q_len; ++k) {
           top0_data[top_idx*(candids+1)+j][k] = q_data[k];
       }
-      top0_length[top_idx*(candids+1)+j] = q_data.size();
+      top0_length[top_idx*(candids+1)+j] = q_len;
 
-      vector<int> &a_data = answer_data_set[answer_rel_set[data_idx][j]];
-      for (int k = 0; k < a_data.size(); ++k) {
+      const int *a_data = answer_corpus->Doc(answer_rel_doc[j][data_idx]);
+      int a_len = answer_corpus->Size(answer_rel_doc[j][data_idx]);
+      for (int k = 0; k < a_len; ++k) {
           top1_data[top_idx*(candids+1)+j][k] = a_data[k];
       }
-      top1_length[top_idx*(candids+1)+j] = a_data.size();
+      top1_length[top_idx*(candids+1)+j] = a_len;
 
     }
   } 
@@ -374,12 +348,17 @@ class QATextDataLayer : public Layer<xpu>{
   string mode;
   bool shuffle;
   bool speedup_list;
+  bool bin_cache;
   
-  unordered_map<string, vector<int> > question_data_set;
-  unordered_map<string, vector<int> > answer_data_set;
+  // parsed docs, shared with the other layers reading the same files
+  std::shared_ptr<const utils::Corpus> question_corpus;
+  std::shared_ptr<const utils::Corpus> answer_corpus;
 
   vector<vector<string> > question_rel_set;
   vector<vector<string> > answer_rel_set;
+  // doc ids of column j of the rel lines
+  vector<vector<int> > question_rel_doc;
+  vector<vector<int> > answer_rel_doc;
   vector<int> label_set;
   vector<vector<int> > pair_set;
   vector<vector<int> > list_set;
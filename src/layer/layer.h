@@ -521,6 +521,13 @@ class Layer {
     return params;
   }
 
+  // saved row i of a param is its row map[i], NULL if rows are in place
+  virtual const int *ParamRowMap(int param_idx) { return NULL; }
+
+  // write params kept outside the net, e.g. a mapped table, back to their
+  // storage; the net calls it before each checkpoint
+  virtual void Flush(void) {}
+
   virtual void SetPhrase(PhraseType phrase) {
 	phrase_type = phrase;
   }
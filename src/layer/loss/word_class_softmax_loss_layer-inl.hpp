@@ -9,6 +9,7 @@
 #include <mshadow/tensor.h>
 #include "../layer.h"
 #include "../op.h"
+#include "../../utils/sparse_grad.h"
 
 namespace textnet {
 namespace layer {
@@ -71,7 +72,10 @@ class WordClassSoftmaxLossLayer : public Layer<xpu>{
     this->params.resize(4); // two embed and bias matrix
     this->params[0].Resize(1, 1, class_num,  feat_size, true); // class embed
     this->params[1].Resize(1, 1, 1, class_num, true);          // class bias
-    this->params[2].Resize(1, 1, vocab_size, feat_size, true); // word embed
+    // word embed is row sparse like an embedding table, only the rows of the classes in a batch get diff
+    this->params[2].need_diff = false;
+    this->params[2].is_sparse = true;
+    this->params[2].Resize(vocab_size, feat_size, 1, 1, true); // word embed
     this->params[3].Resize(1, 1, 1, vocab_size, true);         // word bias
 
     std::map<std::string, SettingV> &w_class_setting = *setting["w_class_filler"].mVal();
@@ -173,7 +177,7 @@ class WordClassSoftmaxLossLayer : public Layer<xpu>{
 
         int class_beg = class_begins[c];
         int class_end = class_ends[c];
-        mshadow::Tensor<xpu, 2> w_word_one_class    = this->params[2].data_d2_reverse().Slice(class_beg, class_end);
+        mshadow::Tensor<xpu, 2> w_word_one_class    = this->params[2].data_d2().Slice(class_beg, class_end);
         mshadow::Tensor<xpu, 1> b_word_one_class    = this->params[3].data_d1_reverse().Slice(class_beg, class_end);
         mshadow::Tensor<xpu, 2> pred_rep            = bottom[0]->data[batch_idx][pos_idx];
         mshadow::Tensor<xpu, 2> word_prob_all       = word_prob[batch_idx][pos_idx];
@@ -254,6 +258,7 @@ class WordClassSoftmaxLossLayer : public Layer<xpu>{
     // ====
     
     // **** bp to param and bottom word
+    word_grad_rows.Clear(feat_size);
     for (int batch_idx = 0; batch_idx < batch_size; ++batch_idx) {
       for (int pos_idx = 0; pos_idx < position_num; ++pos_idx) {
         int y = static_cast<int>(label[batch_idx][pos_idx][0][0]);
@@ -262,8 +267,7 @@ class WordClassSoftmaxLossLayer : public Layer<xpu>{
         int class_beg = class_begins[c];
         int class_end   = class_ends[c];
 
-        mshadow::Tensor<xpu, 2> w_word_one_class_data = this->params[2].data_d2_reverse().Slice(class_beg, class_end);
-        mshadow::Tensor<xpu, 2> w_word_one_class_diff = this->params[2].diff_d2_reverse().Slice(class_beg, class_end);
+        mshadow::Tensor<xpu, 2> w_word_one_class_data = this->params[2].data_d2().Slice(class_beg, class_end);
         mshadow::Tensor<xpu, 1> b_word_one_class_diff = this->params[3].diff_d1_reverse().Slice(class_beg, class_end);
 
         mshadow::Tensor<xpu, 2> pred_rep_data      = bottom[0]->data[batch_idx][pos_idx];
@@ -272,13 +276,17 @@ class WordClassSoftmaxLossLayer : public Layer<xpu>{
         mshadow::Tensor<xpu, 2> word_prob_one_class_diff(word_prob_all_diff.dptr_+class_beg, \
                                                          mshadow::Shape2(1, class_end-class_beg));
 
-        w_word_one_class_diff += dot(word_prob_one_class_diff.T(), pred_rep_data);
+        // word row r gets word_prob_diff[r] * pred_rep
+        for (int r = class_beg; r < class_end; ++r) {
+          word_grad_rows.Axpy(r, word_prob_all_diff[0][r], pred_rep_data.dptr_);
+        }
         if (!no_bias) {
           b_word_one_class_diff += sum_rows(word_prob_one_class_diff);
         }
         pred_rep_diff += dot(word_prob_one_class_diff, w_word_one_class_data);
       }
     }
+    this->params[2].sparseAddRows(word_grad_rows);
     // ====
   }
 
@@ -335,7 +343,7 @@ class WordClassSoftmaxLossLayer : public Layer<xpu>{
     w_ori_data = mshadow::expr::F<op::identity>(word_embed);
     for (size_t i = 0; i < word_2_new_idx.size(); ++i) {
       int new_idx = word_2_new_idx[i];
-      word_embed[0][0][new_idx] = mshadow::expr::F<op::identity>(w_ori_data[0][0][i]);
+      word_embed[new_idx] = mshadow::expr::F<op::identity>(w_ori_data[i]);
     }
   }
 
@@ -356,6 +364,7 @@ protected:
   vector<int> word_2_new_idx;  // store new word idxes arranged by class, idxed by origin word idx
   vector<int> class_word_num;   
   vector<int> class_begins, class_ends; // the begin word idx and end word idx for each class, by new word idx
+  utils::SparseRowAccumulator word_grad_rows; // diff rows of the word embed
 };
 }  // namespace layer
 }  // namespace textnet
@@ -6,11 +6,15 @@
 #include <vector>
 #include <map>
 #include <string>
+#include <cstring>
 #include <mshadow/tensor.h>
 #include <mshadow/tensor_container.h>
 #include "op.h"
 #include "../utils/utils.h"
 #include "../utils/io.h"
+#include "../utils/sparse_grad.h"
+#include "../utils/grad_clip.h"
+#include "../utils/text_loader.h"
 #include "../initializer/initializer.h"
 #include "../updater/updater.h"
 #include "../io/json/json.h"
@@ -43,6 +47,19 @@ struct Node {
   // set this to false if we only need data 
   bool need_diff;
 
+  // data and diff are views into the param arena of the net,
+  // which updates them, see net/param_arena.h
+  bool in_arena;
+  // data is a view of memory the node does not own, see MapData
+  bool ext_data;
+  // that memory is read only (a readonly mapped table), the data is neither
+  // loaded nor saved by the net
+  bool read_only;
+  // record the rows changed by sparse updates, for incremental checkpoints
+  bool track_dirty;
+  std::vector<int> dirty_rows;
+  std::vector<char> dirty_mark;
+
   // Updater interface
   updater::Updater<xpu, 4>* updater_;
   // Initializer interface
@@ -64,12 +81,17 @@ struct Node {
 	updater_ = NULL;
     initializer_ = NULL;
     master = NULL;
+    in_arena = false;
+    ext_data = false;
+    read_only = false;
+    track_dirty = false;
     node_idx = -1;
   }
   
   inline void FreeSpace(void) {
+    if (in_arena) return; // the arena owns data and diff
     if (inited_data){
-      mshadow::FreeSpace(&data);
+      if (!ext_data) mshadow::FreeSpace(&data);
       mshadow::FreeSpace(&length);
     }
     if (need_diff && inited_diff){
@@ -180,7 +202,20 @@ struct Node {
     }
   }
 
-  void SaveNode(Json::Value &node_root, bool with_diff = false) {
+  // data becomes a view of ptr, e.g. a mapped embedding table; no data
+  // space is allocated, length is as after Resize
+  inline void MapData(float *ptr, mshadow::Shape<4> shape, bool read_only_ = false) {
+    utils::Check(!is_share, "Node: Share node does not manage memory.");
+    length.Resize(mshadow::Shape2(shape[0], shape[1]), -1.f);
+    // use tensor container as a tensor without realloc space, as Share
+    (*(mshadow::Tensor<xpu, 4> *)&data) = mshadow::Tensor<xpu, 4>(ptr, shape);
+    inited_data = true;
+    ext_data = true;
+    read_only = read_only_;
+  }
+
+  // row_map: saved row i is data row row_map[i], see Layer::ParamRowMap
+  void SaveNode(Json::Value &node_root, bool with_diff = false, const int *row_map = NULL) {
     Json::Value data_root;
 	Json::Value diff_root;
     Json::Value data_shape_root;
@@ -193,8 +228,12 @@ struct Node {
 	for (int i = 0; i < 4; ++i) {
 	  data_shape_root.append(shape[i]);
 	}
-    for (int i = 0; i < data.shape_.Size(); ++i) {
-	  data_value_root.append(data.dptr_[i]);
+    const size_t row_size = shape[0] == 0 ? 0 : data.shape_.Size() / shape[0];
+    for (index_t r = 0; r < shape[0]; ++r) {
+      const float *row = data.dptr_ + (row_map == NULL ? r : row_map[r]) * row_size;
+      for (size_t j = 0; j < row_size; ++j) {
+        data_value_root.append(row[j]);
+      }
 	}
 	data_root["shape"] = data_shape_root;
 	data_root["value"] = data_value_root;
@@ -218,51 +257,50 @@ struct Node {
 	node_root["diff"] = diff_root;
   }
   // this load by ssv (space split) format, not json format, the first line is the shape info
-  void LoadDataSsv(const char *data_file) {
+  // bin_cache keeps data_file + ".bin_cache", from the setting of the layer
+  void LoadDataSsv(const char *data_file, bool bin_cache) {
     utils::Printf("Open data file: %s\n", data_file);     
-    std::vector<std::string> lines; 
-    std::ifstream fin(data_file); 
-    std::string s; 
-    utils::Check(fin.is_open(), "Open data file problem."); 
-    while (!fin.eof()) { 
-      std::getline(fin, s);
-      if (s.empty()) break;
-      lines.push_back(s);
-    }
-    fin.close();
-    std::istringstream iss;
-    int row = 0, col = 0;
-    iss.str(lines[0]);
-    iss >> row >> col;
-    utils::Check(row == lines.size()-1, "Data error 1.");
     utils::Check(this->data.shape_[0] == 1, "Data error 2.");
     utils::Check(this->data.shape_[1] == 1, "Data error 3.");
-    utils::Check(this->data.shape_[2] == row, "Data error 4.");
-    utils::Check(this->data.shape_[3] == col, "Data error 5.");
-
-    for (int i = 0; i < row; ++i) {
-      iss.clear();
-      iss.seekg(0, iss.beg);
-      iss.str(lines[i+1]);
-      for (int j = 0; j < col; ++j) {
-        iss >> this->data[0][0][i][j];
-      }
+    // the loader checks the shape line against data
+    utils::TextLoader loader(data_file, bin_cache);
+    loader.LoadSsvMatrix(this->data.dptr_, this->data.shape_[2], this->data.shape_[3],
+                         this->data.stride_);
+  }
+
+  // fit data to a saved shape before loading its values. A sparse param keeps
+  // its row layout when the model stored it dense as (1, 1, rows, row_size),
+  // as the word embed of WordClassSoftmaxLoss was saved before it became row
+  // sparse; any other shape would no longer match the rows the layer uses
+  void ReshapeForLoad(mshadow::Shape<4> shape) {
+    utils::Check(!read_only, "Node %s: can not load into read only data.", node_name.c_str());
+    if (shape == data.shape_) return;
+    if (!is_sparse) {
+      Resize(shape);
+      return;
     }
+    const index_t row_size = data.shape_[1] * data.shape_[2] * data.shape_[3];
+    utils::Check(shape[0] == 1 && shape[1] == 1 && shape[2] == data.shape_[0] && shape[3] == row_size,
+                 "Node %s: saved shape (%d, %d, %d, %d) does not fit the sparse param (%d, %d, %d, %d), "
+                 "a dense model must store it as (1, 1, %d, %d).",
+                 node_name.c_str(), shape[0], shape[1], shape[2], shape[3],
+                 data.shape_[0], data.shape_[1], data.shape_[2], data.shape_[3],
+                 data.shape_[0], row_size);
   }
 
-  void LoadNode(Json::Value &node_root, bool with_diff = false) {
+  void LoadNode(Json::Value &node_root, bool with_diff = false, const int *row_map = NULL) {
     Json::Value data_root = node_root["data"];
     int s0 = data_root["shape"][0].asInt();
     int s1 = data_root["shape"][1].asInt();
     int s2 = data_root["shape"][2].asInt();
     int s3 = data_root["shape"][3].asInt();
     mshadow::Shape<4> shape = mshadow::Shape4(s0, s1, s2, s3);
-    if (!(shape == data.shape_)) {
-      Resize(shape);
-    }
+    ReshapeForLoad(shape);
     int size = s0*s1*s2*s3;
+    const int row_size = data.shape_[0] == 0 ? 0 : data.shape_.Size() / data.shape_[0];
     for (int i = 0; i < size; ++i) {
-      data.dptr_[i] = data_root["value"][i].asFloat();
+      int at = row_map == NULL ? i : row_map[i / row_size] * row_size + i % row_size;
+      data.dptr_[at] = data_root["value"][i].asFloat();
     }
     
     // if doesn't need diff just jump out
@@ -283,6 +321,48 @@ struct Node {
     }
   }
 
+  // binary checkpoint counterpart of LoadNode, src is a mapped tensor blob
+  void LoadData(const float *src, mshadow::Shape<4> shape, const int *row_map = NULL) {
+    ReshapeForLoad(shape);
+    const size_t row_size = data.shape_[0] == 0 ? 0 : data.shape_.Size() / data.shape_[0];
+    if (row_map == NULL) {
+      memcpy(data.dptr_, src, shape.Size() * sizeof(float));
+      return;
+    }
+    for (index_t r = 0; r < data.shape_[0]; ++r) {
+      memcpy(data.dptr_ + row_map[r] * row_size, src + r * row_size, row_size * sizeof(float));
+    }
+  }
+
+  // replay rows of an incremental checkpoint, src row i is saved row ids[i],
+  // which is data row row_map[ids[i]] if a map is given
+  void LoadRows(const float *src, mshadow::Shape<4> shape, const int *ids, int n,
+                const int *row_map = NULL) {
+    utils::Check(!read_only, "Node %s: can not load into read only data.", node_name.c_str());
+    const int nrow = static_cast<int>(data.shape_[0]);
+    const size_t row_size = nrow == 0 ? 0 : data.shape_.Size() / nrow;
+    utils::Check(static_cast<int>(shape[0]) == n && shape.Size() == n * row_size,
+                 "Node %s: %d delta rows of %u x %u x %u, need rows of %lu.", node_name.c_str(),
+                 static_cast<int>(shape[0]), shape[1], shape[2], shape[3],
+                 static_cast<unsigned long>(row_size));
+    for (int i = 0; i < n; ++i) {
+      // the saved row id is checked before it indexes the row map
+      utils::Check(ids[i] >= 0 && ids[i] < nrow, "Node %s: delta row %d out of range %d.",
+                   node_name.c_str(), ids[i], nrow);
+      int r = row_map == NULL ? ids[i] : row_map[ids[i]];
+      utils::Check(r >= 0 && r < nrow, "Node %s: delta row %d out of range %d.", node_name.c_str(), r, nrow);
+      memcpy(data.dptr_ + static_cast<size_t>(r) * row_size, src + i * row_size, row_size * sizeof(float));
+    }
+  }
+
+  void LoadDiff(const float *src, mshadow::Shape<4> shape) {
+    utils::Check(need_diff, "Node: try to load diff but without need_diff");
+    if (!(shape == diff.shape_)) {
+      Resize(shape);
+    }
+    memcpy(diff.dptr_, src, shape.Size() * sizeof(float));
+  }
+
   float AbsMean(float *p, size_t size) {
     utils::Check(size > 0, "Node: mean size error.");
     float sum = 0;
@@ -492,15 +572,38 @@ struct Node {
   }
   
   inline void Update() {
-    if (!updater_) return;
+    if (!updater_ || in_arena) return;
     if (!is_share) {
       if (is_sparse) {
         updater_->UpdateSparse(data, diff, idx);
+        if (track_dirty) MarkDirty();
       } else {
         updater_->Update(data, diff);
       }
     }
   }
+  // rows of idx join dirty_rows, each row once until ClearDirty
+  void MarkDirty(void) {
+    if (dirty_mark.size() != data.size(0)) {
+      dirty_mark.assign(data.size(0), 0);
+      dirty_rows.clear();
+    }
+    for (index_t i = 0; i < idx.size(0); ++i) {
+      int r = static_cast<int>(idx[i]);
+      if (!dirty_mark[r]) {
+        dirty_mark[r] = 1;
+        dirty_rows.push_back(r);
+      }
+    }
+  }
+
+  void ClearDirty(void) {
+    for (size_t i = 0; i < dirty_rows.size(); ++i) {
+      dirty_mark[dirty_rows[i]] = 0;
+    }
+    dirty_rows.clear();
+  }
+
   void sparseAdd(mshadow::TensorContainer<xpu, 4> &l_data, 
                  mshadow::TensorContainer<xpu, 1> &l_idx, 
                  mshadow::TensorContainer<xpu, 4> &r_data, 
@@ -511,32 +614,53 @@ struct Node {
     utils::Assert(l_data.size(3) == 1 && r_data.size(3) == 1, "Merge Sparse Tensor: size problem");
     utils::Assert(l_data.size(1) == r_data.size(1), "Merge Sparse Tensor: size problem");
 
-    std::map<int, int> idx_map;
-    int inc = 0;
+    int feat_size = l_data.size(1);
+    utils::SparseRowAccumulator acc;
+    acc.Clear(feat_size);
     for (int i = 0; i < l_idx.size(0); ++i) {
-      int w_idx = l_idx[i];
-      if (!idx_map.count(w_idx)) {
-        idx_map[w_idx] = inc++;
-      }
+      acc.Add(static_cast<int>(l_idx[i]), l_data.dptr_ + i * feat_size);
     }
     for (int i = 0; i < r_idx.size(0); ++i) {
-      int w_idx = r_idx[i];
-      if (!idx_map.count(w_idx)) {
-        idx_map[w_idx] = inc++;
-      }
+      acc.Add(static_cast<int>(r_idx[i]), r_data.dptr_ + i * feat_size);
     }
+    CopySparseRows(acc, merge_data, merge_idx);
+  }
 
-    int feat_size = l_data.size(1);
-    merge_data.Resize(mshadow::Shape4(inc, feat_size, 1, 1), 0);
-    merge_idx.Resize(mshadow::Shape1(inc), 0);
-    for (std::map<int,int>::iterator it=idx_map.begin(); it!=idx_map.end(); ++it) {
-      merge_idx[it->second] = it->first;
+  // add the gradient rows of acc to the sparse diff, rows already in diff are summed
+  // a shared node has no diff of its own, the rows go to its master
+  void sparseAddRows(const utils::SparseRowAccumulator &acc) {
+    Node *target = this;
+    while (target->is_share && target->master != NULL) {
+      target = target->master;
     }
-    for (int i = 0; i < l_data.size(0); ++i) {
-      merge_data[idx_map[l_idx[i]]] += l_data[i];
+    utils::Check(target->is_sparse, "Node: sparse rows added to a dense node.");
+    if (acc.Size() == 0) return;
+    if (target->idx.size(0) == 0) {
+      CopySparseRows(acc, target->diff, target->idx);
+      return;
     }
-    for (int i = 0; i < r_data.size(0); ++i) {
-      merge_data[idx_map[r_idx[i]]] += r_data[i];
+    utils::Check(target->diff.size(1) == acc.Dim(), "Node: sparse rows size problem.");
+    utils::SparseRowAccumulator merged;
+    merged.Clear(acc.Dim());
+    for (int i = 0; i < target->idx.size(0); ++i) {
+      merged.Add(static_cast<int>(target->idx[i]), target->diff.dptr_ + i * acc.Dim());
+    }
+    for (int i = 0; i < acc.Size(); ++i) {
+      merged.Add(acc.Ids()[i], acc.Rows() + i * acc.Dim());
+    }
+    CopySparseRows(merged, target->diff, target->idx);
+  }
+
+  static void CopySparseRows(const utils::SparseRowAccumulator &acc,
+                             mshadow::TensorContainer<xpu, 4> &rows,
+                             mshadow::TensorContainer<xpu, 1> &row_idx) {
+    int n = acc.Size(), dim = acc.Dim();
+    rows.Resize(mshadow::Shape4(n, dim, 1, 1), 0);
+    row_idx.Resize(mshadow::Shape1(n), 0);
+    if (n == 0) return;
+    memcpy(rows.dptr_, acc.Rows(), sizeof(float) * n * dim);
+    for (int i = 0; i < n; ++i) {
+      row_idx[i] = acc.Ids()[i];
     }
   }
 
@@ -544,15 +668,11 @@ struct Node {
     utils::Check(maxVal >= 0.f, "Node: cut off gradient error.");
     utils::Check(!is_share, "Node: cut off gradient error.");
     utils::Check(!is_sparse, "Node: cut off gradient error.");
-    size_t size = diff.shape_.Size();
-    for (size_t i = 0; i < size; ++i) {
-      float *p = diff.dptr_ + i;
-      if (*p > maxVal) {
-        *p = maxVal;
-      } else if (*p < -maxVal) {
-        *p = -maxVal;
-      }
+    if (maxVal == 0.f) {
+      diff = 0.f;
+      return;
     }
+    utils::ScaleClip(diff.dptr_, diff.shape_.Size(), 1.f, maxVal);
   }
 
   void sparseAdd2Left(mshadow::TensorContainer<xpu, 4> &l_data, 
@@ -88,6 +88,7 @@ class MultiTrainValidTestNet : public Net<xpu>{
 	}
 
 	this->SaveModel(this->max_iters[train_tags[0]], this->model_save_last);
+	this->WaitSave();
   } 
 };
 }  // namespace net
@@ -8,15 +8,24 @@
 #include <fstream>
 #include <vector>
 #include <map>
+#include <set>
+#include <deque>
 #include <string>
+#include <algorithm>
 #include <mshadow/tensor.h>
 #include "../global.h"
 
 #include "../layer/layer.h"
 #include "../layer/common/lstm_autoencoder_layer-inl.hpp"
 #include "../layer/common/lstm_layer-inl.hpp"
+#include "./param_arena.h"
 #include "../utils/utils.h"
 #include "../utils/io.h"
+#include "../utils/grad_clip.h"
+#include "../utils/timer.h"
+#include "../utils/checkpoint.h"
+#include "../utils/async_checkpoint.h"
+#include "../utils/activation_stream.h"
 #include "../io/json/json.h"
 // #include "../statistic/stat.h"
 
@@ -62,6 +71,7 @@ class INet {
     virtual void LoadModel(string model_file) = 0;
     virtual void SaveModel(int cur_iter, bool model_save_last) = 0;
     virtual void SaveModel(string file_name, bool save_diff) = 0;
+    virtual void ExportInference(string tag, vector<string> export_nodes, string model_file) = 0;
     virtual void PrintClock(string tag) = 0;
 
   // For Statistic
@@ -76,8 +86,19 @@ class Net : public INet{
   Net() {
     need_reshape = false;
     var_batch = false;
+    use_param_arena = false;
+    parallel_setup = true;
+    grad_clip_norm = 0.f;
+    grad_clip_value = 0.f;
     model_save_interval = 0;
     model_save_file_prefix = "";
+    model_save_format = "json";
+    model_save_async = true;
+    model_save_max_inflight = 2;
+    model_save_full_interval = 0;
+    model_save_count = 0;
+    model_save_shards = 0;
+    model_save_codec = utils::kCodecNone;
     model_save_last = false;
     model_save_initial = true;
     model_test_initial = true;
@@ -86,6 +107,7 @@ class Net : public INet{
 
   
   virtual ~Net(void) {
+    model_saver.Stop();
     mshadow::ShutdownTensorEngine<xpu>(); 
   }
   
@@ -201,16 +223,23 @@ class Net : public INet{
     utils::ShowMemoryUse();
 
     root = net_root;
+    setup_stages.clear();
+    setup_cost.clear();
+    ready_layers.clear();
+    double clock = utils::GetTime();
 
     setLogFile();
 
     // Write original model file to stand output
-    Json::StyledWriter writer;
-    string json_file = writer.write(root);
-    std::cout << "======== Model File ========" << std::endl;
-    std::cout << json_file << std::endl;
-    std::cout << "======== Model File ========" << std::endl;
-    std::cout << std::endl;
+    if (root["print_config"].isNull() || root["print_config"].asBool()) {
+      Json::StyledWriter writer;
+      string json_file = writer.write(root);
+      std::cout << "======== Model File ========" << std::endl;
+      std::cout << json_file << std::endl;
+      std::cout << "======== Model File ========" << std::endl;
+      std::cout << std::endl;
+      SetupStage("print config", clock);
+    }
 
     utils::Printf("[Process] Initial Network.\n");
 
@@ -237,6 +266,21 @@ class Net : public INet{
       utils::Printf("Set var_batch to %d\n", var_batch);
     }
 
+    if (!root["param_arena"].isNull()) {
+      use_param_arena = root["param_arena"].asBool();
+      utils::Printf("Set param_arena to %d\n", use_param_arena);
+    }
+
+    if (!root["grad_clip_norm"].isNull()) {
+      grad_clip_norm = root["grad_clip_norm"].asFloat();
+      utils::Printf("Set grad_clip_norm to %f\n", grad_clip_norm);
+    }
+
+    if (!root["grad_clip_value"].isNull()) {
+      grad_clip_value = root["grad_clip_value"].asFloat();
+      utils::Printf("Set grad_clip_value to %f\n", grad_clip_value);
+    }
+
     if (!root["model_save_last"].isNull()) {
       model_save_last = root["model_save_last"].asBool();
       utils::Printf("Set model_save_last to %d\n", model_save_last);
@@ -252,19 +296,59 @@ class Net : public INet{
       utils::Printf("Set model_test_initial to %d\n", model_test_initial);
     }
 
+    if (!root["parallel_setup"].isNull()) {
+      parallel_setup = root["parallel_setup"].asBool();
+      utils::Printf("Set parallel_setup to %d\n", parallel_setup);
+    }
+    SetupStage("init engine", clock);
+
     ReadNetConfig();
     ReadLayers();
     ReadNodes();
     ReadConnections();
+    SetupStage("create layers", clock);
 
     SetupAllNets();
+    clock = utils::GetTime();
 
     ReadParamShare();
+    SetupStage("share params", clock);
+    if (use_param_arena) {
+      BuildParamArena();
+      SetupStage("param arena", clock);
+    }
     ReadSave();
 
     // Set init phrase type
     phrase_type = kInit;
     cur_tag = "";
+    PrintSetupTime();
+  }
+
+  // record the seconds since clock as a startup stage, then restart clock
+  void SetupStage(const string &name, double &clock) {
+    double now = utils::GetTime();
+    setup_stages.push_back(make_pair(name, now - clock));
+    clock = now;
+  }
+
+  void PrintSetupTime() {
+    utils::Printf("[Setup] Startup time:\n");
+    double total = 0.0;
+    for (size_t i = 0; i < setup_stages.size(); ++i) {
+      utils::Printf("\t%-16s %8.3fs\n", setup_stages[i].first.c_str(), setup_stages[i].second);
+      total += setup_stages[i].second;
+    }
+    utils::Printf("\t%-16s %8.3fs\n", "total", total);
+    vector<pair<double, string> > slow;
+    for (typename map<Layer<xpu>*, double>::iterator it = setup_cost.begin(); it != setup_cost.end(); ++it) {
+      slow.push_back(make_pair(it->second, it->first->layer_name));
+    }
+    sort(slow.rbegin(), slow.rend());
+    utils::Printf("[Setup] Slowest layers (SetupLayer):\n");
+    for (size_t i = 0; i < slow.size() && i < 10; ++i) {
+      utils::Printf("\t%-24s %8.3fs\n", slow[i].second.c_str(), slow[i].first);
+    }
   }
 
   void ReadNetConfig() {
@@ -486,9 +570,10 @@ class Net : public INet{
           int source_param_id = share_root["source_param_id"].asInt();
 
           // orc: may be a bug, layer may not occur in all tags
-          for (int t = 0; t < tags.size(); ++t) {
-            name2layer[tags[t]][target_layer_name]->ShareParameter(target_param_id,
-               name2layer[tags[t]][source_layer_name]->GetParams()[source_param_id]); 
+          for (int t = 0; t < setup_tags.size(); ++t) {
+            if (!name2layer[setup_tags[t]].count(target_layer_name)) continue;
+            name2layer[setup_tags[t]][target_layer_name]->ShareParameter(target_param_id,
+               name2layer[setup_tags[t]][source_layer_name]->GetParams()[source_param_id]); 
           }
 
           utils::Printf("\t%s.param[%d] <=== %s.param[%d]\n", 
@@ -501,6 +586,36 @@ class Net : public INet{
     }
   }
 
+  // move the dense params into one arena, shared nodes follow their masters
+  void BuildParamArena() {
+    param_arena.Clear();
+    for (int i = 0; i < layers.size(); ++i) {
+      set<string> layer_tags;
+      for (int t = 0; t < tags.size(); ++t) {
+        for (int k = 0; k < nets[tags[t]].size(); ++k) {
+          if (nets[tags[t]][k] == layers[i]) layer_tags.insert(tags[t]);
+        }
+      }
+      for (int j = 0; j < layers[i]->params.size(); ++j) {
+        param_arena.Add(&layers[i]->params[j], layer_tags);
+      }
+    }
+    param_arena.Build(prnd);
+    for (int i = 0; i < layers.size(); ++i) {
+      for (int j = 0; j < layers[i]->params.size(); ++j) {
+        Node<xpu> &param = layers[i]->params[j];
+        if (!param.is_share || param.master == NULL) continue;
+        Node<xpu> *master = param.master;
+        while (master->is_share && master->master != NULL) master = master->master;
+        if (!master->in_arena) continue;
+        (*(mshadow::Tensor<xpu, 4> *)&param.data) = master->data;
+        if (!param.is_sparse) {
+          (*(mshadow::Tensor<xpu, 4> *)&param.diff) = master->diff;
+        }
+      }
+    }
+  }
+
   void ReadSave() {
     // **** read save model and activation config
     Json::Value save_model_root = root["save_model"];
@@ -522,6 +637,31 @@ class Net : public INet{
       } else {
         model_save_diff = false;
       }
+      if (!save_model_root["format"].isNull()) {
+        model_save_format = save_model_root["format"].asString();
+      } else {
+        // python/get_kernel.py, get_cross.py and textnet_multi read json models
+        model_save_format = "json";
+      }
+      utils::Check(model_save_format == "binary" || model_save_format == "json",
+                   "Net: save_model format must be binary or json.");
+      if (!save_model_root["async"].isNull()) {
+        model_save_async = save_model_root["async"].asBool();
+      }
+      if (!save_model_root["max_inflight"].isNull()) {
+        model_save_max_inflight = save_model_root["max_inflight"].asInt();
+      }
+      if (!save_model_root["compress"].isNull()) {
+        model_save_codec = utils::ParseCodec(save_model_root["compress"].asString());
+      }
+      if (!save_model_root["shards"].isNull()) {
+        model_save_shards = save_model_root["shards"].asInt();
+      }
+      if (!save_model_root["full_interval"].isNull()) {
+        model_save_full_interval = save_model_root["full_interval"].asInt();
+        utils::Check(model_save_full_interval <= 0 || model_save_format == "binary",
+                     "Net: incremental save needs the binary format.");
+      }
     }
     Json::Value save_act_root = root["save_activation"];
     if (!save_act_root.isNull()) {
@@ -537,6 +677,11 @@ class Net : public INet{
         } else {
           activation_save_diff[tag] = false;
         }
+        if (!tag_act_root["format"].isNull()) {
+          activation_save_format[tag] = tag_act_root["format"].asString();
+          utils::Check(activation_save_format[tag] == "binary" || activation_save_format[tag] == "json",
+                       "Net: save_activation format must be binary or json.");
+        }
         
         Json::Value save_nodes_root = tag_act_root["save_nodes"];
         vector<string> save_nodes;
@@ -566,20 +711,89 @@ class Net : public INet{
     }
   }
   
+  // a layer shared with a tag set up before is only reshaped here
   virtual void SetupReshape(string tag) {
     utils::Printf("[Process] Setup Layers.\n");
     Json::Value &layers_root = root["layers"];
     
     for (int i = 0; i < nets[tag].size(); ++i) {
-      int layer_idx = nets[tag][i]->layer_idx;
-      utils::Printf("[layer] set layer %s\n", nets[tag][i]->layer_name.c_str());
-      nets[tag][i]->SetupLayer(layers_root[layer_idx], 
-          bottom_vecs[layer_idx], top_vecs[layer_idx], prnd);
-      nets[tag][i]->Reshape(bottom_vecs[layer_idx], top_vecs[layer_idx], true);
+      Layer<xpu> *layer = nets[tag][i];
+      int layer_idx = layer->layer_idx;
+      if (!ready_layers.count(layer)) {
+        utils::Printf("[layer] set layer %s\n", layer->layer_name.c_str());
+        double start = utils::GetTime();
+        layer->SetupLayer(layers_root[layer_idx], 
+            bottom_vecs[layer_idx], top_vecs[layer_idx], prnd);
+        setup_cost[layer] += utils::GetTime() - start;
+        ready_layers.insert(layer);
+      }
+      layer->Reshape(bottom_vecs[layer_idx], top_vecs[layer_idx], true);
       utils::ShowMemoryUse();
     }
   }
 
+  // data layers only read their files in SetupLayer: no bottoms, no params
+  // and no draws from prnd, so on cpu they load in parallel before the
+  // layers are set up in order; corpora are shared through the
+  // CorpusStore, but layers of one type may still keep static members
+  // (memory_global), so they load in turn on one thread
+  void SetupSources() {
+    vector<Layer<xpu>*> sources;
+    map<LayerType, int> group_of_type;
+    vector<vector<int> > groups;
+    for (int t = 0; t < setup_tags.size(); ++t) {
+      for (int i = 0; i < nets[setup_tags[t]].size(); ++i) {
+        Layer<xpu> *layer = nets[setup_tags[t]][i];
+        if (layer->BottomNodeNum() != 0 || layer->ParamNodeNum() != 0) continue;
+        if (std::find(sources.begin(), sources.end(), layer) != sources.end()) continue;
+        if (!group_of_type.count(layer->layer_type)) {
+          group_of_type[layer->layer_type] = groups.size();
+          groups.push_back(vector<int>());
+        }
+        groups[group_of_type[layer->layer_type]].push_back(sources.size());
+        sources.push_back(layer);
+      }
+    }
+    // copies, a layer with tag_mode new shares its config with its twins
+    vector<Json::Value> layer_roots(sources.size());
+    for (size_t i = 0; i < sources.size(); ++i) {
+      layer_roots[i] = root["layers"][sources[i]->layer_idx];
+      utils::Printf("[layer] load layer %s\n", sources[i]->layer_name.c_str());
+    }
+    vector<double> cost(sources.size());
+    const bool parallel = parallel_setup && xpu::kDevCPU;
+    #pragma omp parallel for schedule(dynamic) if (parallel)
+    for (int g = 0; g < static_cast<int>(groups.size()); ++g) {
+      for (size_t k = 0; k < groups[g].size(); ++k) {
+        const int i = groups[g][k];
+        double start = utils::GetTime();
+        int layer_idx = sources[i]->layer_idx;
+        sources[i]->SetupLayer(layer_roots[i], bottom_vecs[layer_idx], top_vecs[layer_idx], prnd);
+        cost[i] = utils::GetTime() - start;
+      }
+    }
+    for (size_t i = 0; i < sources.size(); ++i) {
+      setup_cost[sources[i]] += cost[i];
+      ready_layers.insert(sources[i]);
+    }
+  }
+
+  // the tags this net runs; layers of the other tags are not set up
+  virtual vector<string> SetupTags() {
+    return tags;
+  }
+
+  bool InTags(const string &layer_name, const set<string> &tag_set) {
+    for (set<string>::const_iterator it = tag_set.begin(); it != tag_set.end(); ++it) {
+      if (name2layer[*it].count(layer_name)) return true;
+    }
+    return false;
+  }
+
+  bool LayerReady(int layer_idx) {
+    return ready_layers.count(layers[layer_idx]) != 0;
+  }
+
   virtual void Reshape(string tag) {
     utils::Printf("[Process] Reshape network.\n");
     for (int i = 0; i < nets[tag].size(); ++i) {
@@ -703,25 +917,63 @@ class Net : public INet{
       cout << "BP " << nets[tag][i]->layer_name << endl;
 #endif
     }
-    NormLstmGradient(tag);
+    ClipGradient(tag);
   }
 
-  float Norm2Square(mshadow::Tensor<xpu, 4, float> t) {
-    float norm2_square = 0.f;
-    for (index_t i = 0; i < t.size(0); ++i) 
-      for (index_t j = 0; j < t.size(1); ++j)
-        for (index_t m = 0; m < t.size(2); ++m)
-          for (index_t n = 0; n < t.size(3); ++n)
-              norm2_square += t[i][j][m][n] * t[i][j][m][n];
+  // the diff buffers of the params of a layer; a shared param has its
+  // gradient in the diff of its master, which is added even when the master
+  // layer is not in this tag; each master once, by its data pointer, until
+  // ClearGradSpans
+  void AddGradSpans(Layer<xpu> *layer, vector<utils::GradSpan> *spans) {
+    for (int j = 0; j < layer->ParamNodeNum(); ++j) {
+      Node<xpu> *param = &layer->params[j];
+      while (param->is_share && param->master != NULL) param = param->master;
+      if (!param->need_diff || param->diff.shape_.Size() == 0) continue;
+      if (!grad_span_params.insert(param->data.dptr_).second) continue;
+      spans->push_back(utils::GradSpan(param->diff.dptr_, param->diff.shape_.Size()));
+    }
+  }
 
-    return norm2_square;
+  void ClearGradSpans(void) {
+    grad_spans.clear();
+    grad_span_params.clear();
   }
+
+  // the clipping stage after Backprop:
+  // layers with "grad_clip" : true in their setting are selected, their diffs
+  // are rescaled to global L2 norm grad_clip_norm and then clipped elementwise
+  // to grad_clip_value, in one pass; zero disables either of them
+  // without selected layers the max_norm2 of lstm layers is used as before
+  void ClipGradient(string tag) {
+    utils::Check(phrase_type == kTrain, "Only call in Train Phrase.");
+    ClearGradSpans();
+    for (int i = 0; i < nets[tag].size(); ++i) {
+      Layer<xpu> *layer = nets[tag][i];
+      if (layer->settings.count("grad_clip") && layer->settings["grad_clip"].bVal()) {
+        AddGradSpans(layer, &grad_spans);
+      }
+    }
+    if (grad_spans.empty()) {
+      NormLstmGradient(tag);
+      return;
+    }
+    if (grad_clip_norm <= 0.f && grad_clip_value <= 0.f) return;
+    utils::SplitSpans(grad_spans, &grad_pieces);
+    float scale = 1.f;
+    if (grad_clip_norm > 0.f) {
+      float norm2 = sqrt(utils::GlobalSumSquares(grad_pieces));
+      if (norm2 > grad_clip_norm) scale = grad_clip_norm / norm2;
+    }
+    if (scale == 1.f && grad_clip_value <= 0.f) return;
+    utils::ScaleClipAll(grad_pieces, scale, grad_clip_value);
+  }
+
   // orc this is for lstm or rnn, if the gradients of parameters are too big, 
   // rescale all layers' gradients
   void NormLstmGradient(string tag) {
     utils::Check(phrase_type == kTrain, "Only call in Train Phrase.");
-    float norm2 = 0.f;
     float max_norm2 = 0.f;
+    ClearGradSpans();
     for (int i = 0; i < nets[tag].size(); ++i) {
       int layer_type = nets[tag][i]->layer_type;
       if (layer_type != kRecurrent && layer_type != kLstm && layer_type != kLstmAutoencoder) {
@@ -736,27 +988,29 @@ class Net : public INet{
       if (max_norm2 == 0.f) {
         return;
       }
-      for (int param_id = 0; param_id < nets[tag][i]->ParamNodeNum(); ++param_id) {
-        norm2 += Norm2Square(nets[tag][i]->params[param_id].diff);
-      }
+      AddGradSpans(nets[tag][i], &grad_spans);
     }
     if (max_norm2 == 0.f) 
       return;
-    norm2 = sqrt(norm2);
+    utils::SplitSpans(grad_spans, &grad_pieces);
+    float norm2 = sqrt(utils::GlobalSumSquares(grad_pieces));
     if (norm2 <= max_norm2) 
       return;
     float scale = max_norm2/norm2;
     utils::Printf("Rescale Gradient By %f.\n", scale);
+    ClearGradSpans();
     for (int i = 0; i < nets[tag].size(); ++i) {
-      for (int param_id = 0; param_id < nets[tag][i]->ParamNodeNum(); ++param_id) {
-        nets[tag][i]->params[param_id].diff *= scale;
-      }
+      AddGradSpans(nets[tag][i], &grad_spans);
     }
+    utils::SplitSpans(grad_spans, &grad_pieces);
+    utils::ScaleClipAll(grad_pieces, scale, 0.f);
   }
   
   virtual void Update(string tag) {
     utils::Check(phrase_type == kTrain, 
                   "Only call in Train Phrase.");
+    // params in the arena are skipped by Node::Update
+    param_arena.Step(tag);
     for (int i = 0; i < nets[tag].size(); ++i) {
       for (int j = 0; j < nets[tag][i]->ParamNodeNum(); ++j) {
 #if DEBUG
@@ -789,10 +1043,43 @@ class Net : public INet{
   }
 
   virtual void SetupAllNets() {
-    // Prepare
+    // a skipped tag is set up when a layer of a run tag shares its params
+    vector<string> run_tags = SetupTags();
+    set<string> run_set(run_tags.begin(), run_tags.end());
+    // const, so no null setting is added before the layers read theirs
+    const Json::Value &layers_root = root["layers"];
+    for (bool grow = true; grow; ) {
+      grow = false;
+      for (int i = 0; i < layers_root.size(); ++i) {
+        const Json::Value &shares_root = layers_root[i]["setting"]["share"];
+        if (shares_root.isNull() || !InTags(layers_root[i]["layer_name"].asString(), run_set)) continue;
+        for (int j = 0; j < shares_root.size(); ++j) {
+          string source_layer_name = shares_root[j]["source_layer_name"].asString();
+          if (InTags(source_layer_name, run_set)) continue;
+          for (int t = 0; t < tags.size(); ++t) {
+            if (name2layer[tags[t]].count(source_layer_name)) run_set.insert(tags[t]);
+          }
+          grow = true;
+        }
+      }
+    }
+    setup_tags.clear();
     for (int i = 0; i < tags.size(); ++i) {
-      SetupReshape(tags[i]);
+      if (run_set.count(tags[i])) {
+        setup_tags.push_back(tags[i]);
+      } else {
+        utils::Printf("[Process] Skip setup of tag %s.\n", tags[i].c_str());
+      }
     }
+
+    double clock = utils::GetTime();
+    SetupSources();
+    SetupStage("load data", clock);
+    // Prepare
+    for (int i = 0; i < setup_tags.size(); ++i) {
+      SetupReshape(setup_tags[i]);
+    }
+    SetupStage("setup layers", clock);
     //PropAll();
   }
   
@@ -933,6 +1220,11 @@ class Net : public INet{
   virtual void SaveModelActivation(string tag, vector<string> node_names, int num_iter, string file_name, bool save_diff = false) {
     utils::Printf("[Save] Save activation to %s.\n", file_name.c_str());
     SetPhrase(tag, kTest);
+    // json unless asked for binary, python/get_fc2.py and the script configs read json dumps
+    if (activation_save_format.count(tag) && activation_save_format[tag] == "binary") {
+      SaveActivationBinary(tag, node_names, num_iter, file_name, save_diff);
+      return;
+    }
     Json::Value iters_root;
     for (int iter = 0; iter < num_iter; ++iter) {
       Forward(tag);
@@ -952,9 +1244,142 @@ class Net : public INet{
     ofs << json_file;
     ofs.close();
   }
+
+  // each forward appends its nodes to the stream, written while the next runs
+  void SaveActivationBinary(string tag, vector<string> node_names, int num_iter, string file_name, bool save_diff) {
+    utils::ActivationStream stream;
+    stream.Open(file_name);
+    int shape[4];
+    for (int iter = 0; iter < num_iter; ++iter) {
+      Forward(tag);
+      for (int i = 0; i < node_names.size(); ++i) {
+        Node<xpu> *node = nodes[node_names[i]];
+        for (int k = 0; k < 4; ++k) shape[k] = node->data.shape_[k];
+        stream.Append(iter, node_names[i] + ".data", node->data.dptr_, shape);
+        if (save_diff) {
+          for (int k = 0; k < 4; ++k) shape[k] = node->diff.shape_[k];
+          stream.Append(iter, node_names[i] + ".diff", node->diff.dptr_, shape);
+        }
+      }
+    }
+    stream.Close();
+  }
   
+  // shared params are saved by their owner, read only tables stay in their
+  // file, embedding like tables are saved only if asked to save everything
+  bool SkipSaveParam(int layer_idx, int param_idx) {
+    if (!LayerReady(layer_idx) || layers[layer_idx]->params[param_idx].is_share ||
+        layers[layer_idx]->params[param_idx].read_only) {
+      return true;
+    }
+    if (!model_save_everything && !model_save_everything_once && \
+         (layers[layer_idx]->layer_type == kEmbedding || \
+         layers[layer_idx]->layer_type == kWordClassSoftmaxLoss) ) {
+      cout << "\t Without save embedding, in layer " << layers[layer_idx]->layer_name << "." << endl;
+      return true;
+    }
+    return false;
+  }
+
   virtual void SaveModel(string model_file, bool save_diff = false) {
     utils::Printf("[Save] Save model to %s.\n", model_file.c_str());
+    for (int layer_idx = 0; layer_idx < layers.size(); ++layer_idx) {
+      if (LayerReady(layer_idx)) layers[layer_idx]->Flush();
+    }
+    if (model_save_format == "binary") {
+      SaveModelBinary(model_file, save_diff);
+    } else {
+      SaveModelJson(model_file, save_diff);
+    }
+    // Reset save everything_once
+    if (model_save_everything_once) {
+        model_save_everything_once = false;
+        cout << "\t Turn off save everything." << endl;
+    }
+  }
+
+  // tensors are named layers.<layer>.<param>.data and .diff
+  // async: the params are copied at once, the file is written by model_saver;
+  // tables mapped from a file are not copied, a save holding one is written
+  // before training goes on
+  // incremental (full_interval > 0): between full saves a sparse param only
+  // saves the rows updated since the last save, as .rows ids and .delta
+  // values, meta "prev" chains the file to the one before
+  void SaveModelBinary(string model_file, bool save_diff) {
+    const bool incremental = model_save_full_interval > 0;
+    const bool full = !incremental || model_save_count % model_save_full_interval == 0;
+    ++model_save_count;
+    // saved row ids of the deltas, alive until the writer copied them
+    std::deque<std::vector<int> > delta_ids;
+    utils::CheckpointWriter sync_writer;
+    int slot = -1;
+    if (model_save_async) {
+      model_saver.Start(model_save_max_inflight);
+      slot = model_saver.Acquire();
+    }
+    utils::CheckpointWriter &writer = slot < 0 ? sync_writer : model_saver.Writer(slot);
+    writer.SetShards(model_save_shards);
+    writer.SetCodec(model_save_codec);
+    for (int layer_idx = 0; layer_idx < layers.size(); ++layer_idx) {
+      if (!LayerReady(layer_idx)) continue;
+      for (int param_idx = 0; param_idx < layers[layer_idx]->ParamNodeNum(); ++param_idx) {
+        // incremental saves keep embeddings, the deltas make them cheap
+        if (incremental ? layers[layer_idx]->params[param_idx].is_share ||
+                          layers[layer_idx]->params[param_idx].read_only
+                        : SkipSaveParam(layer_idx, param_idx)) continue;
+        Node<xpu> &node = layers[layer_idx]->params[param_idx];
+        const int *row_map = layers[layer_idx]->ParamRowMap(param_idx);
+        string name = "layers." + int2str(layer_idx) + "." + int2str(param_idx);
+        int shape[4];
+        for (int i = 0; i < 4; ++i) shape[i] = node.data.shape_[i];
+        if (incremental && node.is_sparse) {
+          node.track_dirty = true;
+        }
+        if (!full && node.is_sparse) {
+          const int n = node.dirty_rows.size();
+          delta_ids.push_back(node.dirty_rows);
+          std::vector<int> &ids = delta_ids.back();
+          if (row_map != NULL) {
+            std::vector<int> saved_row(shape[0]);
+            for (int i = 0; i < shape[0]; ++i) saved_row[row_map[i]] = i;
+            for (int i = 0; i < n; ++i) ids[i] = saved_row[ids[i]];
+          }
+          shape[0] = n;
+          writer.Add(name + ".delta", node.data.dptr_, shape, n == 0 ? NULL : &node.dirty_rows[0]);
+          writer.AddIds(name + ".rows", n == 0 ? NULL : &ids[0], n);
+          continue;
+        }
+        writer.Add(name + ".data", node.data.dptr_, shape, row_map, !node.ext_data);
+        if (save_diff) {
+          for (int i = 0; i < 4; ++i) shape[i] = node.diff.shape_[i];
+          writer.Add(name + ".diff", node.diff.dptr_, shape);
+        }
+      }
+    }
+    if (incremental) {
+      writer.Meta()["kind"] = full ? "full" : "delta";
+      if (!full) writer.Meta()["prev"] = model_save_prev;
+      model_save_prev = model_file;
+    }
+    if (slot < 0) {
+      writer.Write(model_file, root);
+    } else {
+      model_saver.Submit(slot, model_file, root);
+    }
+    for (int layer_idx = 0; layer_idx < layers.size(); ++layer_idx) {
+      if (!LayerReady(layer_idx)) continue;
+      for (int param_idx = 0; param_idx < layers[layer_idx]->ParamNodeNum(); ++param_idx) {
+        layers[layer_idx]->params[param_idx].ClearDirty();
+      }
+    }
+  }
+
+  // block until the async checkpoints are written, at the end of Start
+  void WaitSave(void) {
+    model_saver.Wait();
+  }
+
+  void SaveModelJson(string model_file, bool save_diff) {
     ofstream ofs(model_file.c_str());
     Json::StyledWriter writer;
     Json::Value net_root, layers_params_root;
@@ -962,21 +1387,14 @@ class Net : public INet{
     for (int layer_idx = 0; layer_idx < layers.size(); ++layer_idx) {
       Json::Value layer_params_root;
       for (int param_idx = 0; param_idx < layers[layer_idx]->ParamNodeNum(); ++param_idx) {
-        if (layers[layer_idx]->params[param_idx].is_share) {
-            layer_params_root.append(0);
-            continue;
-        }
-        // Check for embedding saving 
-        if (!model_save_everything && !model_save_everything_once && \
-             (layers[layer_idx]->layer_type == kEmbedding || \
-             layers[layer_idx]->layer_type == kWordClassSoftmaxLoss) ) {
-            cout << "\t Without save embedding, in layer " << layers[layer_idx]->layer_name << "." << endl;
+        if (SkipSaveParam(layer_idx, param_idx)) {
             layer_params_root.append(0);
             continue;
         }
         // save the content of the matrix
         Json::Value node_root;
-        layers[layer_idx]->params[param_idx].SaveNode(node_root, save_diff);
+        layers[layer_idx]->params[param_idx].SaveNode(node_root, save_diff,
+                                                      layers[layer_idx]->ParamRowMap(param_idx));
         layer_params_root.append(node_root);
       }
       layers_params_root.append(layer_params_root);
@@ -985,22 +1403,20 @@ class Net : public INet{
     string json_file = writer.write(net_root);
     ofs << json_file;
     ofs.close();
-
-    // Reset save everything_once
-    if (model_save_everything_once) {
-        model_save_everything_once = false;
-        cout << "\t Turn off save everything." << endl;
-    }
-    
   }
 
   void LoadParams(Json::Value &layers_params_root) {
     utils::Printf("[Load] Load Params to Net.\n");
     for (int layer_idx = 0; layer_idx < layers.size(); ++layer_idx) {
+      if (!LayerReady(layer_idx)) continue;
       for (int param_idx = 0; param_idx < layers[layer_idx]->ParamNodeNum(); ++param_idx) {
         if (layers[layer_idx]->params[param_idx].is_share) {
           continue;
         }
+        if (layers[layer_idx]->params[param_idx].read_only) {
+          utils::Printf("\tKeep read only table at layer: %d, param: %d\n", layer_idx, param_idx);
+          continue;
+        }
 
         if (layers_params_root[layer_idx].isNull()) {
           utils::Printf("\tNo Initial Params at layer: %d\n", layer_idx);
@@ -1013,12 +1429,126 @@ class Net : public INet{
         }
 
         Json::Value node_root = layers_params_root[layer_idx][param_idx];
-        layers[layer_idx]->params[param_idx].LoadNode(node_root, false);
+        layers[layer_idx]->params[param_idx].LoadNode(node_root, false,
+                                                      layers[layer_idx]->ParamRowMap(param_idx));
+      }
+    }
+  }
+
+  // layers feeding the out_nodes of tag and the owners of their shared
+  // params, every layer set up if tag is empty
+  vector<bool> LayersToLoad(const string &tag) {
+    vector<bool> need(layers.size(), false);
+    if (tag.empty()) {
+      for (int layer_idx = 0; layer_idx < layers.size(); ++layer_idx) need[layer_idx] = LayerReady(layer_idx);
+      return need;
+    }
+    utils::Check(nets.count(tag), "Net: load_tag [%s] not in config.", tag.c_str());
+    utils::Check(std::find(setup_tags.begin(), setup_tags.end(), tag) != setup_tags.end(),
+                 "Net: load_tag [%s] is not set up by this net.", tag.c_str());
+    // need is indexed as layers, which differs from the config index
+    // layer_idx once a layer has tag_mode new
+    map<Layer<xpu>*, int> position;
+    map<Node<xpu>*, int> owner;
+    for (int layer_idx = 0; layer_idx < layers.size(); ++layer_idx) {
+      position[layers[layer_idx]] = layer_idx;
+      if (!LayerReady(layer_idx)) continue;
+      for (int param_idx = 0; param_idx < layers[layer_idx]->ParamNodeNum(); ++param_idx) {
+        owner[&layers[layer_idx]->params[param_idx]] = layer_idx;
+      }
+    }
+    set<string> used(out_nodes[tag].begin(), out_nodes[tag].end());
+    for (int i = nets[tag].size() - 1; i >= 0; --i) {
+      int layer_idx = nets[tag][i]->layer_idx;
+      int pos = position[nets[tag][i]];
+      for (size_t t = 0; t < top_vecs[layer_idx].size(); ++t) {
+        if (used.count(top_vecs[layer_idx][t]->node_name)) need[pos] = true;
+      }
+      if (!need[pos]) continue;
+      for (size_t b = 0; b < bottom_vecs[layer_idx].size(); ++b) {
+        used.insert(bottom_vecs[layer_idx][b]->node_name);
+      }
+    }
+    for (int layer_idx = 0; layer_idx < layers.size(); ++layer_idx) {
+      if (!need[layer_idx]) continue;
+      for (int param_idx = 0; param_idx < layers[layer_idx]->ParamNodeNum(); ++param_idx) {
+        Node<xpu> *master = layers[layer_idx]->params[param_idx].master;
+        while (master != NULL && master->is_share && master->master != NULL) master = master->master;
+        if (master != NULL && owner.count(master)) need[owner[master]] = true;
       }
     }
+    return need;
+  }
+
+  // the params are checked against the shard checksums and unpacked, then
+  // loaded in parallel
+  void LoadParams(utils::CheckpointReader &reader, const vector<bool> &need) {
+    utils::Printf("[Load] Load Params to Net.\n");
+    vector<pair<int, int> > jobs;
+    vector<string> names;
+    for (int layer_idx = 0; layer_idx < layers.size(); ++layer_idx) {
+      if (!need[layer_idx]) continue;
+      for (int param_idx = 0; param_idx < layers[layer_idx]->ParamNodeNum(); ++param_idx) {
+        if (layers[layer_idx]->params[param_idx].is_share) {
+          continue;
+        }
+        if (layers[layer_idx]->params[param_idx].read_only) {
+          utils::Printf("\tKeep read only table at layer: %d, param: %d\n", layer_idx, param_idx);
+          continue;
+        }
+        string name = "layers." + int2str(layer_idx) + "." + int2str(param_idx);
+        jobs.push_back(make_pair(layer_idx, param_idx));
+        names.push_back(name + ".data");
+        names.push_back(name + ".rows");
+        names.push_back(name + ".delta");
+      }
+    }
+    reader.Prepare(names);
+    #pragma omp parallel for schedule(dynamic)
+    for (int j = 0; j < static_cast<int>(jobs.size()); ++j) {
+      int layer_idx = jobs[j].first, param_idx = jobs[j].second;
+      int s[4], n;
+      const string &name = names[3 * j];
+      const float *src = reader.Find(name, s);
+      const int *ids = reader.FindIds(names[3 * j + 1], &n);
+      if (src != NULL) {
+        layers[layer_idx]->params[param_idx].LoadData(src, mshadow::Shape4(s[0], s[1], s[2], s[3]),
+                                                      layers[layer_idx]->ParamRowMap(param_idx));
+      } else if (ids != NULL) {
+        const float *delta = reader.Find(names[3 * j + 2], s);
+        utils::Check(delta != NULL, "Net: checkpoint has %s but no %s.",
+                     names[3 * j + 1].c_str(), names[3 * j + 2].c_str());
+        layers[layer_idx]->params[param_idx].LoadRows(delta, mshadow::Shape4(s[0], s[1], s[2], s[3]), ids, n,
+                                                      layers[layer_idx]->ParamRowMap(param_idx));
+      } else {
+        utils::Printf("\tNo Initial Params at layer: %d, param: %d\n", layer_idx, param_idx);
+      }
+    }
+  }
+
+  // an incremental checkpoint loads its chain back to the full save first
+  void LoadParamsChain(utils::CheckpointReader &reader, const vector<bool> &need) {
+    if (reader.Meta()["kind"].asString() == "delta") {
+      utils::CheckpointReader prev;
+      prev.Open(reader.Meta()["prev"].asString());
+      LoadParamsChain(prev, need);
+    }
+    LoadParams(reader, need);
   }
 
   virtual void LoadModel(string model_file) {
+    if (utils::IsCheckpointFile(model_file)) {
+      utils::CheckpointReader reader;
+      reader.Open(model_file);
+      root = reader.Config();
+      InitNet(root);
+      // load_tag: only the params that tag's out_nodes need, e.g. for serving
+      string load_tag = root["load_tag"].isNull() ? "" : root["load_tag"].asString();
+      double start = utils::GetTime();
+      LoadParamsChain(reader, LayersToLoad(load_tag));
+      utils::Printf("[Setup] Load params in %.3fs.\n", utils::GetTime() - start);
+      return;
+    }
     Json::Value net_root;
     ifstream ifs(model_file.c_str());
     ifs >> net_root;
@@ -1026,6 +1556,179 @@ class Net : public INet{
     LoadModel(net_root);
   }
 
+  // freeze what the export nodes (default the out_nodes) of tag need into a
+  // binary checkpoint for inference: other layers are pruned, batch norm and
+  // dropout are folded into the full connect or convolution layer feeding
+  // only them, shares from pruned or folded layers become own params
+  virtual void ExportInference(string tag, vector<string> export_nodes, string model_file) {
+    utils::Check(nets.count(tag), "Net: export tag [%s] not in config.", tag.c_str());
+    utils::Check(std::find(setup_tags.begin(), setup_tags.end(), tag) != setup_tags.end(),
+                 "Net: export tag [%s] is not set up by this net.", tag.c_str());
+    utils::Printf("[Export] Export %s to %s.\n", tag.c_str(), model_file.c_str());
+    if (export_nodes.empty()) export_nodes = out_nodes[tag];
+    Json::Value &layers_root = root["layers"];
+    vector<Layer<xpu>*> &net = nets[tag];
+    const int n = net.size();
+
+    vector<bool> keep(n, false);
+    set<string> used(export_nodes.begin(), export_nodes.end());
+    for (int i = n - 1; i >= 0; --i) {
+      Json::Value &layer_root = layers_root[net[i]->layer_idx];
+      for (int t = 0; t < layer_root["top_nodes"].size(); ++t) {
+        if (used.count(layer_root["top_nodes"][t].asString())) keep[i] = true;
+      }
+      if (!keep[i]) continue;
+      for (int b = 0; b < layer_root["bottom_nodes"].size(); ++b) {
+        used.insert(layer_root["bottom_nodes"][b].asString());
+      }
+    }
+    map<string, int> consumers;
+    set<Node<xpu>*> shared_from;
+    for (size_t k = 0; k < export_nodes.size(); ++k) consumers[export_nodes[k]]++;
+    for (int i = 0; i < n; ++i) {
+      if (!keep[i]) continue;
+      Json::Value &layer_root = layers_root[net[i]->layer_idx];
+      for (int b = 0; b < layer_root["bottom_nodes"].size(); ++b) {
+        consumers[layer_root["bottom_nodes"][b].asString()]++;
+      }
+      for (int p = 0; p < net[i]->ParamNodeNum(); ++p) {
+        Node<xpu> *master = net[i]->params[p].master;
+        while (master != NULL && master->is_share && master->master != NULL) master = master->master;
+        if (net[i]->params[p].is_share && master != NULL) shared_from.insert(master);
+      }
+    }
+
+    // per output channel y = scale * y + shift folded into layer i, which then
+    // writes top_name[i], the top of the last folded layer
+    map<string, int> producer;
+    vector<vector<float> > scale(n), shift(n);
+    vector<string> top_name(n);
+    vector<bool> folded(n, false);
+    for (int i = 0; i < n; ++i) {
+      if (!keep[i]) continue;
+      Layer<xpu> *layer = net[i];
+      Json::Value &layer_root = layers_root[layer->layer_idx];
+      const bool foldable = (layer->layer_type == kBatchNorm && layer->settings["ignore_len"].bVal()) ||
+                            layer->layer_type == kDropout;
+      string bottom = layer_root["bottom_nodes"][0].asString();
+      if (foldable && producer.count(bottom) && consumers[bottom] == 1) {
+        int j = producer[bottom];
+        Layer<xpu> *target = net[j];
+        const int nc = target->params[0].data.size(0);
+        bool ok = !shared_from.count(&target->params[0]) && !shared_from.count(&target->params[1]);
+        vector<float> s(nc), t(nc, 0.f);
+        if (layer->layer_type == kDropout) {
+          s.assign(nc, 1.f - layer->settings["rate"].fVal());
+        } else {
+          // test phase batch norm: gamma * (y - mean) / sqrt(var + eps) + beta
+          float count = layer->params[4].data.dptr_[0];
+          ok = ok && count > 0.f && layer->params[0].data.size(0) == nc;
+          for (int c = 0; ok && c < nc; ++c) {
+            float mean = layer->params[2].data.dptr_[c] / count;
+            float var = layer->params[3].data.dptr_[c] / count;
+            s[c] = layer->params[0].data.dptr_[c] / sqrt(var + layer->settings["eps"].fVal());
+            t[c] = layer->params[1].data.dptr_[c] - mean * s[c];
+          }
+        }
+        if (ok) {
+          if (scale[j].empty()) {
+            scale[j].assign(nc, 1.f);
+            shift[j].assign(nc, 0.f);
+          }
+          for (int c = 0; c < nc; ++c) {
+            scale[j][c] *= s[c];
+            shift[j][c] = shift[j][c] * s[c] + t[c];
+          }
+          folded[i] = true;
+          top_name[j] = layer_root["top_nodes"][0].asString();
+          producer.erase(bottom);
+          producer[top_name[j]] = j;
+          utils::Printf("\tFold %s into %s.\n", layer->layer_name.c_str(), target->layer_name.c_str());
+          continue;
+        }
+      }
+      if ((layer->layer_type == kFullConnect || layer->layer_type == kConv) &&
+          layer_root["top_nodes"].size() == 1) {
+        producer[layer_root["top_nodes"][0].asString()] = i;
+      }
+    }
+
+    // the config of the kept layers, shares only between unchanged kept layers
+    set<string> plain;
+    for (int i = 0; i < n; ++i) {
+      if (keep[i] && !folded[i] && scale[i].empty()) plain.insert(net[i]->layer_name);
+    }
+    Json::Value net_root = root, export_layers(Json::arrayValue), net_config;
+    net_root.removeMember("save_model");
+    net_root.removeMember("save_activation");
+    net_root.removeMember("cross_validation");
+    net_root.removeMember("load_tag");
+    for (int t = 0; t < root["net_config"].size(); ++t) {
+      if (root["net_config"][t]["tag"].asString() == tag) net_config = root["net_config"][t];
+    }
+    net_config["out_nodes"] = Json::Value(Json::arrayValue);
+    for (size_t k = 0; k < export_nodes.size(); ++k) net_config["out_nodes"].append(export_nodes[k]);
+    if (net_config["out_nodes_type"].size() != net_config["out_nodes"].size()) {
+      net_config.removeMember("out_nodes_type");
+    }
+    net_root["net_config"] = Json::Value(Json::arrayValue);
+    net_root["net_config"].append(net_config);
+
+    utils::CheckpointWriter writer;
+    std::deque<std::vector<float> > folded_params;
+    for (int i = 0; i < n; ++i) {
+      if (!keep[i] || folded[i]) continue;
+      Layer<xpu> *layer = net[i];
+      Json::Value layer_root = layers_root[layer->layer_idx];
+      layer_root.removeMember("tag");
+      layer_root.removeMember("tag_mode");
+      layer_root.removeMember("layer_idx");
+      if (!top_name[i].empty()) layer_root["top_nodes"][0] = top_name[i];
+      if (!scale[i].empty()) layer_root["setting"]["no_bias"] = false;
+      set<int> shared;
+      Json::Value shares(Json::arrayValue);
+      for (int k = 0; k < layer_root["setting"]["share"].size(); ++k) {
+        Json::Value &share_root = layer_root["setting"]["share"][k];
+        if (plain.count(layer->layer_name) && plain.count(share_root["source_layer_name"].asString())) {
+          shares.append(share_root);
+          shared.insert(share_root["param_id"].asInt());
+        }
+      }
+      layer_root["setting"].removeMember("share");
+      if (shares.size() > 0) layer_root["setting"]["share"] = shares;
+      const int k = export_layers.size();
+      export_layers.append(layer_root);
+
+      for (int p = 0; p < layer->ParamNodeNum(); ++p) {
+        Node<xpu> &node = layer->params[p];
+        // a mapped table stays in its table_file
+        if (shared.count(p) || node.ext_data) continue;
+        string name = "layers." + int2str(k) + "." + int2str(p) + ".data";
+        int shape[4];
+        for (int d = 0; d < 4; ++d) shape[d] = node.data.shape_[d];
+        if (scale[i].empty() || p > 1) {
+          writer.Add(name, node.data.dptr_, shape, layer->ParamRowMap(p));
+          continue;
+        }
+        const int nc = scale[i].size();
+        const size_t row = node.data.shape_.Size() / nc;
+        folded_params.push_back(std::vector<float>(node.data.shape_.Size()));
+        std::vector<float> &dst = folded_params.back();
+        const bool no_bias = layer->settings["no_bias"].bVal();
+        for (int c = 0; c < nc; ++c) {
+          for (size_t r = 0; r < row; ++r) {
+            float v = node.data.dptr_[c * row + r];
+            dst[c * row + r] = p == 0 ? v * scale[i][c] : (no_bias ? 0.f : v) * scale[i][c] + shift[i][c];
+          }
+        }
+        writer.Add(name, &dst[0], shape);
+      }
+    }
+    net_root["layers"] = export_layers;
+    utils::Printf("\tKeep %d of %d layers.\n", static_cast<int>(export_layers.size()), n);
+    writer.Write(model_file, net_root);
+  }
+
   virtual void LoadModel(Json::Value &net_root) {
   utils::Check(!net_root["config"].isNull(), "No [config] section.");
   utils::Check(!net_root["layers_params"].isNull(), "No [layers_params] section.");
@@ -1108,10 +1811,25 @@ class Net : public INet{
   map<string, string> activation_save_file_prefix;
   // save diff for nets
   map<string, bool> activation_save_diff;
+  // "json" (default) or "binary" stream, see utils/activation_stream.h
+  map<string, string> activation_save_format;
   // save nodes
   map<string, vector<string> > activation_save_nodes;
   int model_save_interval;
   string model_save_file_prefix;
+  // "binary" checkpoint, see utils/checkpoint.h, or "json"
+  string model_save_format;
+  bool model_save_async;
+  int model_save_max_inflight;
+  utils::AsyncCheckpoint model_saver;
+  // incremental save: a full save every full_interval saves, the last file
+  int model_save_full_interval;
+  // binary checkpoints are split in this many shard files, see utils/checkpoint.h
+  int model_save_shards;
+  // utils::kCodecNone, kCodecZlib or kCodecLz4, see utils/chunk_codec.h
+  int model_save_codec;
+  int model_save_count;
+  string model_save_prev;
   bool model_save_everything;
   bool model_save_everything_once;
   bool model_save_initial;
@@ -1145,8 +1863,24 @@ class Net : public INet{
   bool need_reshape;
   // var batch : every batch is different, need check
   bool var_batch;
+  // param arena : dense params in one buffer, updated in fused sweeps
+  bool use_param_arena;
+  ParamArena<xpu> param_arena;
+  // gradient clipping of the layers with grad_clip set
+  float grad_clip_norm;
+  float grad_clip_value;
+  vector<utils::GradSpan> grad_spans, grad_pieces;
+  // the data of the params in grad_spans
+  set<const float*> grad_span_params;
   // node list
   vector<Node<xpu>*> node_list;
+  // parallel setup : data layers load their files in parallel
+  bool parallel_setup;
+  // the tags set up, the layers set up and where startup time went
+  vector<string> setup_tags;
+  set<Layer<xpu>*> ready_layers;
+  map<Layer<xpu>*, double> setup_cost;
+  vector<pair<string, double> > setup_stages;
 
   // gpu device id
   int device_id;
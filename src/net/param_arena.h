@@ -0,0 +1,185 @@
+#ifndef TEXTNET_NET_PARAM_ARENA_H_
+#define TEXTNET_NET_PARAM_ARENA_H_
+/*!
+ * \file param_arena.h
+ * \brief dense params and their diffs in two flat buffers
+ *  params whose updaters have the same settings and which are updated by
+ *  the same tags lie next to each other, one updater steps them in one sweep
+ *  the nodes keep their shapes and become views into the buffers
+ */
+#include <vector>
+#include <map>
+#include <set>
+#include <string>
+#include <cstring>
+#include <mshadow/tensor.h>
+#include "../layer/node.h"
+#include "../updater/updater.h"
+#include "../utils/utils.h"
+
+namespace textnet {
+namespace net {
+
+template<typename xpu>
+class ParamArena {
+ public:
+  // every param starts at a multiple of kArenaAlign floats (64 bytes)
+  static const int kArenaAlign = 16;
+
+  ParamArena(void) : data_base_(NULL), diff_base_(NULL), size_(0) {}
+  ~ParamArena(void) { Clear(); }
+
+  inline void Clear(void) {
+    for (size_t i = 0; i < groups_.size(); ++i) {
+      delete groups_[i].updater;
+    }
+    groups_.clear();
+    cands_.clear();
+    data_.clear();
+    diff_.clear();
+    data_base_ = diff_base_ = NULL;
+    size_ = 0;
+  }
+
+  // a param which may go to the arena, tags are the nets which update it
+  inline void Add(layer::Node<xpu> *node, const std::set<std::string> &tags) {
+    if (node->is_share || node->is_sparse || !node->need_diff || !node->updater_) return;
+    if (!node->inited_data || !node->inited_diff) return;
+    if (!node->updater_->Fusable()) return;
+    if (node->data.shape_.Size() == 0 || !(node->data.shape_ == node->diff.shape_)) return;
+    if (node->data.stride_ != node->data.size(3) || node->diff.stride_ != node->diff.size(3)) return;
+    Cand c;
+    c.node = node;
+    c.key = node->updater_->SettingKey() + "|";
+    for (std::set<std::string>::const_iterator it = tags.begin(); it != tags.end(); ++it) {
+      c.key += *it + ",";
+    }
+    c.tags = tags;
+    cands_.push_back(c);
+  }
+
+  // lay out the params added, copy them in and point the nodes at the arena
+  inline void Build(mshadow::Random<xpu> *prnd) {
+    utils::Check(xpu::kDevCPU, "ParamArena: only cpu params are supported.");
+    std::map<std::string, int> group_of;
+    for (size_t i = 0; i < cands_.size(); ++i) {
+      if (!group_of.count(cands_[i].key)) {
+        group_of[cands_[i].key] = groups_.size();
+        groups_.push_back(Group());
+        groups_.back().tags = cands_[i].tags;
+        groups_.back().updater = NULL;
+      }
+      groups_[group_of[cands_[i].key]].nodes.push_back(cands_[i].node);
+    }
+    size_ = 0;
+    for (size_t g = 0; g < groups_.size(); ++g) {
+      Group &grp = groups_[g];
+      grp.offset = size_;
+      for (size_t i = 0; i < grp.nodes.size(); ++i) {
+        grp.node_offset.push_back(size_);
+        grp.node_size.push_back(RoundUp(grp.nodes[i]->data.shape_.Size()));
+        size_ += grp.node_size.back();
+      }
+      grp.size = size_ - grp.offset;
+      // a fresh updater with the same settings, the nodes keep their own
+      // and use it again if they ever leave the arena
+      updater::Updater<xpu, 4> *u = grp.nodes[0]->updater_;
+      std::map<std::string, SettingV> setting = u->GetSetting();
+      grp.updater = updater::CreateUpdater<xpu, 4>(u->GetUpdaterType(), setting, prnd);
+    }
+    data_.assign(size_ + kArenaAlign, 0.f);
+    diff_.assign(size_ + kArenaAlign, 0.f);
+    data_base_ = Align(&data_[0]);
+    diff_base_ = Align(&diff_[0]);
+    for (size_t g = 0; g < groups_.size(); ++g) {
+      Group &grp = groups_[g];
+      for (size_t i = 0; i < grp.nodes.size(); ++i) {
+        layer::Node<xpu> *node = grp.nodes[i];
+        size_t n = node->data.shape_.Size();
+        float *data = data_base_ + grp.node_offset[i];
+        float *diff = diff_base_ + grp.node_offset[i];
+        memcpy(data, node->data.dptr_, n * sizeof(float));
+        memcpy(diff, node->diff.dptr_, n * sizeof(float));
+        // use tensor container as a tensor without realloc space, as Node::Share
+        (*(mshadow::Tensor<xpu, 4> *)&node->data) = mshadow::Tensor<xpu, 4>(data, node->data.shape_);
+        (*(mshadow::Tensor<xpu, 4> *)&node->diff) = mshadow::Tensor<xpu, 4>(diff, node->diff.shape_);
+        node->in_arena = true;
+      }
+    }
+    cands_.clear();
+    utils::Printf("[Process] Param arena: %d params in %d groups, %lu floats.\n",
+                  static_cast<int>(NumParams()), static_cast<int>(groups_.size()),
+                  static_cast<unsigned long>(size_));
+  }
+
+  // one step of every group updated by tag
+  inline void Step(const std::string &tag) {
+    for (size_t g = 0; g < groups_.size(); ++g) {
+      Group &grp = groups_[g];
+      if (!grp.tags.count(tag)) continue;
+      Validate(&grp);
+      mshadow::index_t nrow = static_cast<mshadow::index_t>(grp.size / kArenaAlign);
+      mshadow::Shape<4> shape = mshadow::Shape4(nrow, kArenaAlign, 1, 1);
+      grp.updater->Update(mshadow::Tensor<xpu, 4>(data_base_ + grp.offset, shape),
+                          mshadow::Tensor<xpu, 4>(diff_base_ + grp.offset, shape));
+    }
+  }
+
+  inline bool Empty(void) const { return groups_.empty(); }
+  inline size_t Size(void) const { return size_; }
+  inline const float *DiffBuffer(void) const { return diff_base_; }
+  inline size_t NumParams(void) const {
+    size_t n = 0;
+    for (size_t g = 0; g < groups_.size(); ++g) n += groups_[g].nodes.size();
+    return n;
+  }
+
+ private:
+  struct Cand {
+    layer::Node<xpu> *node;
+    std::string key;
+    std::set<std::string> tags;
+  };
+  struct Group {
+    std::vector<layer::Node<xpu>*> nodes;
+    std::vector<size_t> node_offset, node_size;
+    std::set<std::string> tags;
+    size_t offset, size;
+    updater::Updater<xpu, 4> *updater;
+  };
+
+  inline static size_t RoundUp(size_t n) {
+    return (n + kArenaAlign - 1) / kArenaAlign * kArenaAlign;
+  }
+  inline static float *Align(float *p) {
+    size_t a = kArenaAlign * sizeof(float);
+    return reinterpret_cast<float*>((reinterpret_cast<size_t>(p) + a - 1) / a * a);
+  }
+
+  // a node reallocated by a layer is not a view any more, it goes back to
+  // its own updater; its old rows in the arena are zeroed and read by nobody
+  inline void Validate(Group *grp) {
+    for (size_t i = 0; i < grp->nodes.size(); ++i) {
+      layer::Node<xpu> *node = grp->nodes[i];
+      if (!node->in_arena) continue;
+      if (node->data.dptr_ != data_base_ + grp->node_offset[i] ||
+          node->diff.dptr_ != diff_base_ + grp->node_offset[i]) {
+        utils::Printf("[Warning] Param arena: node %s was reallocated, updated on its own.\n",
+                      node->node_name.c_str());
+        node->in_arena = false;
+        memset(data_base_ + grp->node_offset[i], 0, grp->node_size[i] * sizeof(float));
+        memset(diff_base_ + grp->node_offset[i], 0, grp->node_size[i] * sizeof(float));
+      }
+    }
+  }
+
+  std::vector<Cand> cands_;
+  std::vector<Group> groups_;
+  std::vector<float> data_, diff_;
+  float *data_base_, *diff_base_;
+  size_t size_;
+};
+
+}  // namespace net
+}  // namespace textnet
+#endif  // TEXTNET_NET_PARAM_ARENA_H_
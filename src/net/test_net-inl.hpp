@@ -28,6 +28,12 @@ class TestNet : public Net<xpu>{
   }
 
   virtual ~TestNet(void) {}
+
+  // only the tested tag is set up
+  virtual vector<string> SetupTags() {
+    if (!this->nets.count(tag)) return this->tags;
+    return vector<string>(1, tag);
+  }
   
   virtual void Start() {
 
@@ -12,6 +12,14 @@ class TrainValidNet : public Net<xpu>{
  public:
   TrainValidNet() { this->net_type = kTrainValid; }
   virtual ~TrainValidNet(void) {}
+
+  // a Test tag of the config is not run
+  virtual vector<string> SetupTags() {
+    vector<string> run_tags;
+    run_tags.push_back("Train");
+    run_tags.push_back("Valid");
+    return run_tags;
+  }
   
   virtual void Start() {
 
@@ -42,6 +50,7 @@ class TrainValidNet : public Net<xpu>{
 	if (this->model_save_initial) {
 	    this->SaveModel(this->max_iters["Train"], this->model_save_last);
     }
+	this->WaitSave();
   } 
 };
 }  // namespace net
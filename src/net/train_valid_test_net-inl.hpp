@@ -56,6 +56,7 @@ class TrainValidTestNet : public Net<xpu>{
 	}
 
 	this->SaveModel(this->max_iters["Train"], this->model_save_last);
+	this->WaitSave();
   } 
 };
 }  // namespace net
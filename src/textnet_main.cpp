@@ -8,11 +8,13 @@
 #include <cstring>
 #include <vector>
 #include <map>
+#include <set>
 #include <climits>
 #include <sstream>
 
 #include "./net/net.h"
 #include "./utils/utils.h"
+#include "./utils/corpus_store.h"
 #include "./layer/layer.h"
 #include "./statistic/statistic.h"
 #include "./io/json/json.h"
@@ -77,10 +79,13 @@ void PrintTensor(const char * name, Tensor<cpu, 4> x) {
     cout << endl;
 }
 
-void run_one(Json::Value &cfg_root, int netTagType) {
+// checkpoint_file: a binary checkpoint holding cfg_root and the params
+void run_one(Json::Value &cfg_root, int netTagType, const string &checkpoint_file = "") {
   DeviceType device_type = CPU_DEVICE;
   INet* net = CreateNet(device_type, netTagType);
-  if (cfg_root["layers_params"].isNull()) { // new model
+  if (!checkpoint_file.empty()) {
+    net->LoadModel(checkpoint_file);
+  } else if (cfg_root["layers_params"].isNull()) { // new model
     net->InitNet(cfg_root);
   } else {
     net->LoadModel(cfg_root);
@@ -94,6 +99,40 @@ void run_one(Json::Value &cfg_root, int netTagType) {
   net->Start();
 }
 
+// freeze the model for inference on tag into out_file, see ExportInference
+void run_export(Json::Value &cfg_root, int netTagType, const string &checkpoint_file,
+                const string &tag, const string &out_file, const vector<string> &nodes) {
+  INet* net = CreateNet(CPU_DEVICE, netTagType);
+  if (!checkpoint_file.empty()) {
+    net->LoadModel(checkpoint_file);
+  } else if (cfg_root["layers_params"].isNull()) {
+    net->InitNet(cfg_root);
+  } else {
+    net->LoadModel(cfg_root);
+  }
+  net->ExportInference(tag, nodes, out_file);
+  delete net;
+}
+
+// write the binary corpus cache of every data file in the config, so the
+// data layers of later runs map it instead of parsing the text
+void run_corpus(const Json::Value &cfg_root) {
+  static const char *kFileKeys[] = {"data1_file", "data2_file", "question_data_file", "answer_data_file"};
+  const Json::Value &layers = cfg_root["layers"];
+  set<string> done;
+  for (int i = 0; i < static_cast<int>(layers.size()); ++i) {
+    const Json::Value &setting = layers[i]["setting"];
+    if (!setting.isObject() || (setting.isMember("bin_cache") && !setting["bin_cache"].asBool())) continue;
+    for (size_t k = 0; k < sizeof(kFileKeys) / sizeof(kFileKeys[0]); ++k) {
+      if (!setting.isMember(kFileKeys[k])) continue;
+      string path = setting[kFileKeys[k]].asString();
+      if (!done.insert(path).second) continue;
+      utils::CorpusStore::Global().AcquireFile(path, true);
+    }
+  }
+  utils::Printf("Corpus: %d data files cached.\n", static_cast<int>(done.size()));
+}
+
 void run_cv(Json::Value &cfg_root, int netTagType, int cv_fold) {
   vector<int> data_file_layer_idx;
   if (netTagType == kTrainValidTest) {
@@ -178,19 +217,35 @@ int main(int argc, char *argv[]) {
 	}
   }*/
   Json::Value net_root;
-  ifstream ifs(model_file.c_str());
-  ifs >> net_root;
-  ifs.close();
+  string checkpoint_file;
+  if (utils::IsCheckpointFile(model_file)) {
+    utils::CheckpointReader reader;
+    reader.Open(model_file);
+    net_root = reader.Config();
+    checkpoint_file = model_file;
+  } else {
+    ifstream ifs(model_file.c_str());
+    ifs >> net_root;
+    ifs.close();
+  }
 
-  if (net_root["layers_params"].isNull() && !net_root["cross_validation"].isNull()) { 
+  if (checkpoint_file.empty() && net_root["layers_params"].isNull() && !net_root["cross_validation"].isNull()) { 
     need_cross_valid = true;
   }
 
   int netTagType = kTrainValidTest;
   //int netTagType = kTrainValid;
   //int netTagType = kTestOnly;
-  if (!need_cross_valid) {
-    run_one(net_root, netTagType);
+  // textnet <model_file> -export <tag> <out_file> [node ...]
+  // textnet <model_file> -corpus
+  if (argc > 2 && string(argv[2]) == "-corpus") {
+    run_corpus(net_root);
+  } else if (argc > 2 && string(argv[2]) == "-export") {
+    textnet::utils::Check(argc > 4, "Usage: textnet <model_file> -export <tag> <out_file> [node ...]");
+    vector<string> nodes(argv + 5, argv + argc);
+    run_export(net_root, netTagType, checkpoint_file, argv[3], argv[4], nodes);
+  } else if (!need_cross_valid) {
+    run_one(net_root, netTagType, checkpoint_file);
   } else {
     int n_fold = net_root["cross_validation"].asInt();
     run_cv(net_root, netTagType, n_fold);
@@ -0,0 +1,147 @@
+#define _CRT_SECURE_NO_WARNINGS
+#define _CRT_SECURE_NO_DEPRECATE
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <cstdlib>
+#include <sys/time.h>
+
+#include "./utils/topk_engine.h"
+
+// checks the shared top-k engine against std::partial_sort and times both,
+// usage: topk_bench [repeat]
+
+using namespace std;
+using namespace textnet;
+using namespace textnet::utils;
+
+double Now(void) {
+  timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+// the selection the pooling layers did before the engine, kept as reference:
+// partial_sort on (value, position) pairs, ties go to the lower position
+int RefTopKByPos(const float *x, int n, int k, int *idx, float *val) {
+  vector<pair<float, int> > v(n);
+  for (int i = 0; i < n; ++i) {
+    v[i].first = x[i]; v[i].second = i;
+  }
+  int m = min(k, n);
+  partial_sort(v.begin(), v.begin() + m, v.end(), TopKGreater());
+  for (int i = 0; i < m; ++i) idx[i] = v[i].second;
+  sort(idx, idx + m);
+  for (int i = 0; i < m; ++i) val[i] = x[idx[i]];
+  return m;
+}
+
+// the old layers only partial sorted values and searched positions again
+int OldTopKByPos(const float *x, int n, int k, int *idx) {
+  vector<float> v(x, x + n);
+  int m = min(k, n);
+  partial_sort(v.begin(), v.begin() + m, v.end(), greater<float>());
+  float kth = v[m-1];
+  int cnt = 0;
+  for (int i = 0; i < n && cnt < m; ++i) {
+    if (x[i] > kth) idx[cnt++] = i;
+  }
+  for (int i = 0; i < n && cnt < m; ++i) {
+    if (x[i] == kth) idx[cnt++] = i;
+  }
+  sort(idx, idx + m);
+  return m;
+}
+
+// levels > 0 draws from a few distinct values so ties are common
+void FillRandom(vector<float> &x, int levels) {
+  for (size_t i = 0; i < x.size(); ++i) {
+    x[i] = levels > 0 ? static_cast<float>(rand() % levels)
+                      : static_cast<float>(rand()) / RAND_MAX - 0.5f;
+  }
+}
+
+bool TestEquivalence(void) {
+  TopKWorkspace ws;
+  const int ks[] = {1, 2, 3, 5, 10, 16, 17, 40};
+  const int levels[] = {0, 2, 5, 50};
+  int fail = 0, total = 0;
+  for (int rep = 0; rep < 200; ++rep) {
+    int n = 1 + rand() % 300;
+    for (int a = 0; a < 8; ++a) {
+      for (int b = 0; b < 4; ++b) {
+        vector<float> x(n);
+        FillRandom(x, levels[b]);
+        int k = ks[a];
+        vector<int> idx(k), ref_idx(k), desc_idx(k);
+        vector<float> val(k), ref_val(k), desc_val(k);
+        int m = TopKByPos(&x[0], n, k, &idx[0], &val[0], &ws);
+        int ref_m = RefTopKByPos(&x[0], n, k, &ref_idx[0], &ref_val[0]);
+        TopKDesc(&x[0], n, k, &desc_idx[0], &desc_val[0], &ws);
+        bool ok = m == ref_m;
+        for (int i = 0; ok && i < m; ++i) {
+          ok = idx[i] == ref_idx[i] && val[i] == ref_val[i];
+        }
+        // descending output is non-increasing and ties keep position order
+        for (int i = 1; ok && i < m; ++i) {
+          ok = desc_val[i-1] > desc_val[i] ||
+               (desc_val[i-1] == desc_val[i] && desc_idx[i-1] < desc_idx[i]);
+        }
+        ++total;
+        if (!ok) {
+          ++fail;
+          cout << "mismatch: n=" << n << " k=" << k << " levels=" << levels[b] << endl;
+        }
+      }
+    }
+  }
+  cout << "equivalence: " << total - fail << "/" << total << " cases match" << endl;
+  return fail == 0;
+}
+
+void Bench(int repeat) {
+  TopKWorkspace ws;
+  const int ks[] = {1, 3, 5, 10};
+  const int lens[] = {20, 50, 100, 500, 1000, 2000};
+  const int nseq = 64;
+  cout << "k\tlen\told(us)\tengine(us)\tspeedup" << endl;
+  for (int a = 0; a < 4; ++a) {
+    for (int b = 0; b < 6; ++b) {
+      int k = ks[a], n = lens[b];
+      vector<float> x(nseq * n);
+      FillRandom(x, 0);
+      vector<int> idx(k);
+      vector<float> val(k);
+      long checksum = 0;
+      double t0 = Now();
+      for (int r = 0; r < repeat; ++r) {
+        for (int s = 0; s < nseq; ++s) {
+          OldTopKByPos(&x[s * n], n, k, &idx[0]);
+          checksum += idx[0];
+        }
+      }
+      double t1 = Now();
+      for (int r = 0; r < repeat; ++r) {
+        for (int s = 0; s < nseq; ++s) {
+          TopKByPos(&x[s * n], n, k, &idx[0], &val[0], &ws);
+          checksum -= idx[0];
+        }
+      }
+      double t2 = Now();
+      double old_us = (t1 - t0) * 1e6 / (repeat * nseq);
+      double new_us = (t2 - t1) * 1e6 / (repeat * nseq);
+      cout << k << "\t" << n << "\t" << old_us << "\t" << new_us << "\t"
+           << old_us / new_us << (checksum == 0 ? "" : "\t(diff)") << endl;
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  srand(37);
+  int repeat = argc > 1 ? atoi(argv[1]) : 200;
+  if (!TestEquivalence()) return 1;
+  Bench(repeat);
+  return 0;
+}
@@ -2,8 +2,11 @@
 #define TEXTNET_ADADELTA_UPDATER_INL_HPP_
 
 #include <iostream>
+#include <vector>
+#include <cmath>
 #include <mshadow/tensor.h>
 #include "./updater.h"
+#include "./sparse_row_kernels.h"
 
 namespace textnet {
 namespace updater {
@@ -106,45 +109,39 @@ class AdaDeltaUpdater : public Updater<xpu, dim>{
     }
   }
   
+  // lazy adadelta: a skipped row has a zero diff, which only decays both
+  // accumulators by rho, so the decay is applied when the row comes back
+  // the norm2 constraint works on rows of the param shape
+  virtual bool Fusable() { return norm2 == 0.f; }
+
   virtual void UpdateSparse(mshadow::Tensor<xpu, dim> data, 
                             mshadow::Tensor<xpu, dim> diff, 
                             mshadow::Tensor<xpu, 1> idx) {
-    using namespace mshadow::expr;
-
-
     if (iter++ == 0) {
         sumGradSquare.Resize(data.shape_, 0.);
         sumDeltaSquare.Resize(data.shape_, 0.);
-        delta.Resize(data.shape_, 0.);
+        row_step.assign(data.size(0), 0);
     }
 
-    int w_idx = -1;
-    for (int i = 0; i < idx.size(0); ++i) {
-      w_idx = idx[i];
-      utils::Assert(w_idx >= 0 && w_idx < data.size(0), "");
-      
-      mshadow::Tensor<xpu, dim> dataRow = data.Slice(w_idx, w_idx+1);
-      mshadow::Tensor<xpu, dim> diffRow = diff.Slice(i, i+1);
-      mshadow::Tensor<xpu, dim> deltaRow = delta.Slice(w_idx, w_idx+1);
-      mshadow::Tensor<xpu, dim> sumGradSquareRow = sumGradSquare.Slice(w_idx, w_idx+1);
-      mshadow::Tensor<xpu, dim> sumDeltaSquareRow = sumDeltaSquare.Slice(w_idx, w_idx+1);
-
-      if (wd > 0.f) {
-        diffRow += wd * dataRow;
-      }
-      sumGradSquareRow = rho * sumGradSquareRow + (1-rho) * (diffRow * diffRow);
-      deltaRow = diffRow * (1.f/(F<square_root>(sumGradSquareRow + eps))) * (F<square_root>(sumDeltaSquareRow + eps));
-      sumDeltaSquareRow = rho * sumDeltaSquareRow + (1-rho) * (deltaRow * deltaRow);
-
-      dataRow -= deltaRow;
-      // if (wd > 0.) {
-      //   dataRow -= wd * dataRow;
-      // }
+    const float l2 = wd > 0.f ? wd : 0.f;
+    const int nrow = idx.size(0);
+    const int row_len = data.shape_.Size() / data.size(0);
+    #pragma omp parallel for
+    for (int i = 0; i < nrow; ++i) {
+      int w_idx = idx[i];
+      utils::Assert(w_idx >= 0 && w_idx < data.size(0), "AdaDelta Sparse Update index error.");
+      int skipped = iter - row_step[w_idx] - 1;
+      row_step[w_idx] = iter;
+      size_t offset = static_cast<size_t>(w_idx) * row_len;
+      AdaDeltaRow(data.dptr_ + offset, diff.dptr_ + static_cast<size_t>(i) * row_len,
+                  sumGradSquare.dptr_ + offset, sumDeltaSquare.dptr_ + offset, row_len,
+                  l2, rho, pow(rho, skipped), eps);
     }
   }
  protected: 
   int iter, batch_size;
   mshadow::TensorContainer<xpu, dim> sumGradSquare, sumDeltaSquare, delta;
+  std::vector<int> row_step; // the last sparse update that touched each row
   float eps, rho, wd, norm2;
 
 };
@@ -2,8 +2,11 @@
 #define TEXTNET_ADAGRAD_UPDATER_INL_HPP_
 
 #include <iostream>
+#include <vector>
 #include <mshadow/tensor.h>
 #include "./updater.h"
+#include "./sparse_row_kernels.h"
+#include "./row_state.h"
 
 namespace textnet {
 namespace updater {
@@ -25,6 +28,9 @@ class AdagradUpdater : public Updater<xpu, dim>{
     this->defaults["max_iter"] = SettingV(-1);
     this->defaults["lr_decay_factor"] = SettingV(1.f);
     this->defaults["lr_decay_interval"] = SettingV(0);
+    // full, touched (sums of the rows which got a diff) or
+    // row_wise (one sum of the mean squared diff per row)
+    this->defaults["state"] = SettingV("full");
 
     // require value, set to SettingV(),
     // it will force custom to set in config
@@ -43,6 +49,8 @@ class AdagradUpdater : public Updater<xpu, dim>{
     wd = setting["l2"].fVal(); 
     lr_decay_interval = setting["lr_decay_interval"].iVal(); 
     lr_decay_factor   = setting["lr_decay_factor"].fVal(); 
+    state_mode = ParseStateMode(setting["state"].sVal());
+    utils::Check(state_mode != kStateInt8, "Adagrad: int8 state is not supported.");
     
     iter = 0;
   }
@@ -55,6 +63,12 @@ class AdagradUpdater : public Updater<xpu, dim>{
 
   virtual void Update(mshadow::Tensor<xpu, dim> data, 
                       mshadow::Tensor<xpu, dim> diff) {
+    if (state_mode != kStateFull) {
+      rows.resize(data.size(0));
+      for (int i = 0; i < data.size(0); ++i) rows[i] = i;
+      UpdateRows(data, diff, rows);
+      return;
+    }
 
     if (iter == 0 || ((max_iter > 0) && (iter % max_iter == 0))) {
       sumGradSquare.Resize(data.shape_, 0.);
@@ -64,6 +78,20 @@ class AdagradUpdater : public Updater<xpu, dim>{
     }
 
     ++iter;
+
+    if (xpu::kDevCPU) {
+      // elementwise, chunks of the flat tensor run in parallel
+      const size_t n = data.shape_.Size();
+      const int nchunk = FlatChunkNum(n);
+      const float l2 = wd > 0.f ? wd : 0.f;
+      #pragma omp parallel for
+      for (int c = 0; c < nchunk; ++c) {
+        size_t beg = static_cast<size_t>(c) * kFlatChunk;
+        AdagradRow(data.dptr_ + beg, diff.dptr_ + beg, sumGradSquare.dptr_ + beg,
+                   FlatChunkLen(n, c), 1.f, l2, lr, eps);
+      }
+      return;
+    }
     
     if (wd > 0.) {
         diff += wd * data;
@@ -76,12 +104,29 @@ class AdagradUpdater : public Updater<xpu, dim>{
     // }
   }
   
+  virtual bool Fusable() { return state_mode == kStateFull; }
+
   virtual void UpdateSparse(mshadow::Tensor<xpu, dim> data, 
                             mshadow::Tensor<xpu, dim> diff, 
                             mshadow::Tensor<xpu, 1> idx) {
+    rows.resize(idx.size(0));
+    for (int i = 0; i < idx.size(0); ++i) rows[i] = idx[i];
+    UpdateRows(data, diff, rows);
+  }
 
+  // diff row i belongs to data row rows[i], rows are distinct
+  void UpdateRows(mshadow::Tensor<xpu, dim> data, 
+                  mshadow::Tensor<xpu, dim> diff, 
+                  const std::vector<int> &rows) {
+    const int row_len = data.shape_.Size() / data.size(0);
     if (iter == 0 || ((max_iter > 0) && (iter % max_iter == 0))) {
-      sumGradSquare.Resize(data.shape_, 0.);
+      if (state_mode == kStateFull) {
+        sumGradSquare.Resize(data.shape_, 0.);
+      } else if (state_mode == kStateRowWise) {
+        rowGradSquare.assign(data.size(0), 0.f);
+      } else {
+        row_state.Init(data.size(0), row_len);
+      }
     }
     if ((iter > 0) && (lr_decay_interval > 0) && (iter % lr_decay_interval == 0)) {
       lr *= lr_decay_factor;
@@ -89,30 +134,40 @@ class AdagradUpdater : public Updater<xpu, dim>{
 
     ++iter;
 
-
-    int w_idx = -1;
-    for (int i = 0; i < idx.size(0); ++i) {
-      w_idx = idx[i];
+    // each row is updated by one thread
+    const int nrow = rows.size();
+    const float l2 = wd > 0.f ? wd : 0.f;
+    if (state_mode == kStateTouched) {
+      for (int i = 0; i < nrow; ++i) {
+        utils::Check(rows[i] >= 0 && rows[i] < data.size(0), "Adagrad Sparse Update index error.");
+        row_state.Alloc(rows[i]);
+      }
+    }
+    #pragma omp parallel for
+    for (int i = 0; i < nrow; ++i) {
+      int w_idx = rows[i];
       utils::Assert(w_idx >= 0 && w_idx < data.size(0), "Adagrad Sparse Update index error.");
-
-      mshadow::Tensor<xpu, dim> sumGradSquareRow = sumGradSquare.Slice(w_idx, w_idx+1);
-      mshadow::Tensor<xpu, dim> diffRow = diff.Slice(i, i+1);
-      mshadow::Tensor<xpu, dim> dataRow = data.Slice(w_idx, w_idx+1);
-
-      if (wd > 0.) {
-        diffRow += wd * dataRow;
+      size_t offset = static_cast<size_t>(w_idx) * row_len;
+      float *w = data.dptr_ + offset;
+      const float *g = diff.dptr_ + static_cast<size_t>(i) * row_len;
+      if (state_mode == kStateFull) {
+        AdagradRow(w, g, sumGradSquare.dptr_ + offset, row_len, 1.f, l2, lr, eps);
+      } else if (state_mode == kStateRowWise) {
+        AdagradRowWise(w, g, &rowGradSquare[w_idx], row_len, 1.f, l2, lr, eps);
+      } else {
+        AdagradRow(w, g, row_state.Find(w_idx), row_len, 1.f, l2, lr, eps);
       }
-      sumGradSquareRow += diffRow * diffRow;
-      dataRow -= (lr * (diffRow / ((mshadow::expr::F<square_root>(sumGradSquareRow)) + eps)));
-      // if (wd > 0.) {
-      //   dataRow -= (wd*lr) * dataRow;
-      // }
     }
   }
  protected: 
   int iter, max_iter, lr_decay_interval;
   mshadow::TensorContainer<xpu, dim> sumGradSquare;
   float eps, lr, wd, lr_decay_factor;
+  // sums of the touched rows, or one sum per row, when state is not full
+  int state_mode;
+  RowState row_state;
+  std::vector<float> rowGradSquare;
+  std::vector<int> rows;
 
 };
 }  // namespace updater
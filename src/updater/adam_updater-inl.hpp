@@ -2,8 +2,12 @@
 #define TEXTNET_ADAM_UPDATER_INL_HPP_
 
 #include <iostream>
+#include <vector>
+#include <cmath>
 #include <mshadow/tensor.h>
 #include "./updater.h"
+#include "./sparse_row_kernels.h"
+#include "./row_state.h"
 
 namespace textnet {
 namespace updater {
@@ -29,6 +33,9 @@ class AdamUpdater : public Updater<xpu, dim>{
     this->defaults["lr_decay_factor"] = SettingV(1.f);
     this->defaults["lr_decay_interval"] = SettingV(0);
     this->defaults["batch_size"] = SettingV(1);
+    // full, touched (moments of the rows which got a diff) or
+    // int8 (8 bit block quantized moments of those rows)
+    this->defaults["state"] = SettingV("full");
 
     // require value, set to SettingV(),
     // it will force custom to set in config
@@ -51,6 +58,8 @@ class AdamUpdater : public Updater<xpu, dim>{
     wd = setting["l2"].fVal(); 
     lr_decay_interval = setting["lr_decay_interval"].iVal(); 
     lr_decay_factor   = setting["lr_decay_factor"].fVal(); 
+    state_mode = ParseStateMode(setting["state"].sVal());
+    utils::Check(state_mode != kStateRowWise, "Adam: row_wise state is not supported.");
     
     iter = 0;
   }
@@ -63,6 +72,13 @@ class AdamUpdater : public Updater<xpu, dim>{
 
   virtual void Update(mshadow::Tensor<xpu, dim> data, 
                       mshadow::Tensor<xpu, dim> diff) {
+    if (state_mode != kStateFull) {
+      // every row has a diff, the lazy row update is exact then
+      rows.resize(data.size(0));
+      for (int i = 0; i < data.size(0); ++i) rows[i] = i;
+      UpdateRows(data, diff, rows);
+      return;
+    }
 
     if (iter == 0 || ((max_iter > 0) && (iter % max_iter == 0))) {
       b1pt = 1.0f;
@@ -75,6 +91,28 @@ class AdamUpdater : public Updater<xpu, dim>{
     }
 
     ++iter;
+
+    if (xpu::kDevCPU) {
+      float step = lr, inv_c2 = 1.f;
+      if (bias_correct) {
+        b1pt *= (1.0 - b1);
+        b2pt *= (1.0 - b2);
+        step = lr / (1.0 - b1pt);
+        inv_c2 = 1.0 / (1.0 - b2pt);
+      }
+      // elementwise, chunks of the flat tensor run in parallel
+      const float gscale = batch_size > 1 ? 1.f / batch_size : 1.f;
+      const float l2 = wd > 0.f ? wd : 0.f;
+      const size_t n = data.shape_.Size();
+      const int nchunk = FlatChunkNum(n);
+      #pragma omp parallel for
+      for (int c = 0; c < nchunk; ++c) {
+        size_t beg = static_cast<size_t>(c) * kFlatChunk;
+        AdamRow(data.dptr_ + beg, diff.dptr_ + beg, adam_mt.dptr_ + beg, adam_vt.dptr_ + beg,
+                FlatChunkLen(n, c), gscale, l2, 1.0 - b1, b1, 1.0 - b2, b2, step, inv_c2, eps);
+      }
+      return;
+    }
     
     if (batch_size > 1) {
         diff /= float(batch_size);
@@ -94,47 +132,94 @@ class AdamUpdater : public Updater<xpu, dim>{
     }
   }
   
+  virtual bool Fusable() { return state_mode == kStateFull; }
+
+  // lazy adam: a row only changes when it has a diff, the decay of the
+  // moments over the steps it was skipped is applied when it comes back,
+  // so the cost depends on the rows in idx, not on the table size
   virtual void UpdateSparse(mshadow::Tensor<xpu, dim> data, 
                             mshadow::Tensor<xpu, dim> diff, 
                             mshadow::Tensor<xpu, 1> idx) {
+    rows.resize(idx.size(0));
+    for (int i = 0; i < idx.size(0); ++i) rows[i] = idx[i];
+    UpdateRows(data, diff, rows);
+  }
 
+  // diff row i belongs to data row rows[i], rows are distinct
+  void UpdateRows(mshadow::Tensor<xpu, dim> data, 
+                  mshadow::Tensor<xpu, dim> diff, 
+                  const std::vector<int> &rows) {
+    const int row_len = data.shape_.Size() / data.size(0);
     if (iter == 0 || ((max_iter > 0) && (iter % max_iter == 0))) {
       b1pt = 1.0f;
       b2pt = 1.0f;
-      adam_mt.Resize(data.shape_, 0.);
-      adam_vt.Resize(data.shape_, 0.);
+      if (state_mode == kStateFull) {
+        adam_mt.Resize(data.shape_, 0.);
+        adam_vt.Resize(data.shape_, 0.);
+      } else {
+        row_state.Init(data.size(0), state_mode == kStateInt8 ?
+                       Adam8bitRowFloats(row_len) : 2 * row_len);
+      }
+      row_step.assign(data.size(0), 0);
+      sparse_step = 0;
     }
     if ((iter > 0) && (lr_decay_interval > 0) && (iter % lr_decay_interval == 0)) {
       lr *= lr_decay_factor;
     }
 
     ++iter;
+    ++sparse_step;
 
-    if (batch_size > 1) {
-        diff /= float(batch_size);
+    float step = lr, inv_c2 = 1.f;
+    if (bias_correct) {
+      b1pt *= (1.0 - b1);
+      b2pt *= (1.0 - b2);
+      step = lr / (1.0 - b1pt);
+      inv_c2 = 1.0 / (1.0 - b2pt);
     }
-
-    int w_idx = -1;
-    for (int i = 0; i < idx.size(0); ++i) {
-      w_idx = idx[i];
-      utils::Assert(w_idx >= 0 && w_idx < data.size(0), "Adagrad Sparse Update index error.");
-
-      mshadow::Tensor<xpu, dim> adam_mtRow = adam_mt.Slice(w_idx, w_idx+1);
-      mshadow::Tensor<xpu, dim> adam_vtRow = adam_vt.Slice(w_idx, w_idx+1);
-      mshadow::Tensor<xpu, dim> diffRow = diff.Slice(i, i+1);
-      mshadow::Tensor<xpu, dim> dataRow = data.Slice(w_idx, w_idx+1);
-
-      if (wd > 0.) {
-        diffRow += wd * dataRow;
+    const float gscale = batch_size > 1 ? 1.f / batch_size : 1.f;
+    const float l2 = wd > 0.f ? wd : 0.f;
+    const int nrow = rows.size();
+    if (state_mode != kStateFull) {
+      for (int i = 0; i < nrow; ++i) {
+        utils::Check(rows[i] >= 0 && rows[i] < data.size(0), "Adam Sparse Update index error.");
+        row_state.Alloc(rows[i]);
       }
-      adam_mtRow = (1.0 - b1) * adam_mtRow + b1 * diffRow;
-      adam_vtRow = (1.0 - b2) * adam_vtRow + b2 * diffRow * diffRow;
-      if (bias_correct) {
-          b1pt *= (1.0 - b1);
-          b2pt *= (1.0 - b2);
-          dataRow -= lr * (adam_mtRow / (mshadow::expr::F<square_root>(adam_vtRow) / (1.0 - b2pt) + eps)) / (1.0 - b1pt);
-      } else {
-          dataRow -= lr * (adam_mtRow / (mshadow::expr::F<square_root>(adam_vtRow) + eps));
+    }
+    #pragma omp parallel
+    {
+      std::vector<float> m_buf, v_buf;
+      if (state_mode == kStateInt8) {
+        m_buf.resize(row_len);
+        v_buf.resize(row_len);
+      }
+      #pragma omp for
+      for (int i = 0; i < nrow; ++i) {
+        int w_idx = rows[i];
+        utils::Assert(w_idx >= 0 && w_idx < data.size(0), "Adam Sparse Update index error.");
+        int skipped = sparse_step - row_step[w_idx] - 1;
+        row_step[w_idx] = sparse_step;
+        float a1 = pow(1.0 - b1, skipped + 1);
+        float a2 = pow(1.0 - b2, skipped + 1);
+        size_t offset = static_cast<size_t>(w_idx) * row_len;
+        float *w = data.dptr_ + offset;
+        const float *g = diff.dptr_ + static_cast<size_t>(i) * row_len;
+        if (state_mode == kStateFull) {
+          AdamRow(w, g, adam_mt.dptr_ + offset, adam_vt.dptr_ + offset, row_len,
+                  gscale, l2, a1, b1, a2, b2, step, inv_c2, eps);
+        } else if (state_mode == kStateTouched) {
+          float *m = row_state.Find(w_idx);
+          AdamRow(w, g, m, m + row_len, row_len,
+                  gscale, l2, a1, b1, a2, b2, step, inv_c2, eps);
+        } else {
+          Adam8bitRow q(row_state.Find(w_idx), row_len);
+          DequantizeMoment1(q.m, q.m_scale, row_len, &m_buf[0]);
+          DequantizeMoment2(q.v, q.v_scale, row_len, &v_buf[0]);
+          AdamRow(w, g, &m_buf[0], &v_buf[0], row_len,
+                  gscale, l2, a1, b1, a2, b2, step, inv_c2, eps);
+          QuantizeMoment1(&m_buf[0], row_len, q.m, q.m_scale);
+          QuantizeMoment2(&v_buf[0], row_len, q.v, q.v_scale);
+        }
       }
     }
   }
@@ -146,6 +231,13 @@ class AdamUpdater : public Updater<xpu, dim>{
   float b1, b2;
   float b1pt, b2pt;
   bool bias_correct;
+  // sparse updates since the last reset, and the last one that touched each row
+  int sparse_step;
+  std::vector<int> row_step;
+  // moments of the touched rows when state is not full
+  int state_mode;
+  RowState row_state;
+  std::vector<int> rows;
 
 };
 }  // namespace updater
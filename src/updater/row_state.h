@@ -0,0 +1,140 @@
+#ifndef TEXTNET_UPDATER_ROW_STATE_H_
+#define TEXTNET_UPDATER_ROW_STATE_H_
+/*!
+ * \file row_state.h
+ * \brief memory lean optimizer state for big row sparse params:
+ *        state rows allocated the first time a row gets a diff, and
+ *        8 bit block quantization of adam moments
+ */
+#include <vector>
+#include <string>
+#include <cmath>
+#include <algorithm>
+#include "../utils/utils.h"
+
+namespace textnet {
+namespace updater {
+
+/*! \brief how an updater keeps its state, "state" of the updater setting */
+const int kStateFull = 0;     // "full": tensors of the param shape
+const int kStateTouched = 1;  // "touched": state rows allocated on their first diff
+const int kStateRowWise = 2;  // "row_wise": one accumulator per row
+const int kStateInt8 = 3;     // "int8": 8 bit block quantized state of touched rows
+
+inline int ParseStateMode(const std::string &s) {
+  if (s == "full") return kStateFull;
+  if (s == "touched") return kStateTouched;
+  if (s == "row_wise") return kStateRowWise;
+  if (s == "int8") return kStateInt8;
+  utils::Error("Updater: unknown state %s.", s.c_str());
+  return kStateFull;
+}
+
+/*!
+ * \brief a fixed number of floats of state per param row, stored only for
+ *  the rows which have been touched
+ *  Alloc is not thread safe, allocate all rows of a step before the
+ *  parallel update and use Find inside it
+ */
+class RowState {
+ public:
+  RowState(void) : row_floats_(0) {}
+  inline void Init(int nrow, int row_floats) {
+    slot_.assign(nrow, -1);
+    store_.clear();
+    row_floats_ = row_floats;
+  }
+  inline bool Inited(void) const { return !slot_.empty(); }
+  /*! \brief the state of row, zero filled when it is new */
+  inline float *Alloc(int row) {
+    if (slot_[row] < 0) {
+      slot_[row] = static_cast<int>(store_.size() / row_floats_);
+      store_.resize(store_.size() + row_floats_, 0.f);
+    }
+    return Find(row);
+  }
+  inline float *Find(int row) {
+    return slot_[row] < 0 ? NULL : &store_[0] + static_cast<size_t>(slot_[row]) * row_floats_;
+  }
+  /*! \brief number of rows with state */
+  inline size_t Size(void) const { return row_floats_ == 0 ? 0 : store_.size() / row_floats_; }
+
+ private:
+  int row_floats_;
+  std::vector<int> slot_;
+  std::vector<float> store_;
+};
+
+/*! \brief values sharing one scale in the 8 bit state */
+const int kQuantBlock = 64;
+
+inline int QuantBlockNum(int n) { return (n + kQuantBlock - 1) / kQuantBlock; }
+
+/*!
+ * \brief floats of RowState needed by the 8 bit moments of a row of n values:
+ *  n int8 codes of m, n uint8 codes of sqrt(v), and two scales per block
+ */
+inline int Adam8bitRowFloats(int n) {
+  return 2 * ((n + 3) / 4) + 2 * QuantBlockNum(n);
+}
+
+/*! \brief views into the 8 bit moments of one row */
+struct Adam8bitRow {
+  signed char *m;
+  unsigned char *v;
+  float *m_scale, *v_scale;
+  Adam8bitRow(float *state, int n) {
+    int code_floats = (n + 3) / 4;
+    m = reinterpret_cast<signed char*>(state);
+    v = reinterpret_cast<unsigned char*>(state + code_floats);
+    m_scale = state + 2 * code_floats;
+    v_scale = m_scale + QuantBlockNum(n);
+  }
+};
+
+/*! \brief m: symmetric int8 with one absmax scale per block, round to nearest */
+inline void QuantizeMoment1(const float *x, int n, signed char *q, float *scale) {
+  for (int b = 0; b * kQuantBlock < n; ++b) {
+    int beg = b * kQuantBlock, end = std::min(n, beg + kQuantBlock);
+    float amax = 0.f;
+    for (int i = beg; i < end; ++i) amax = std::max(amax, std::fabs(x[i]));
+    scale[b] = amax / 127.f;
+    float inv = amax > 0.f ? 127.f / amax : 0.f;
+    for (int i = beg; i < end; ++i) {
+      q[i] = static_cast<signed char>(lrintf(x[i] * inv));
+    }
+  }
+}
+
+inline void DequantizeMoment1(const signed char *q, const float *scale, int n, float *x) {
+  for (int i = 0; i < n; ++i) x[i] = q[i] * scale[i / kQuantBlock];
+}
+
+/*!
+ * \brief v: sqrt(v) as uint8 with one max scale per block, rounded up so a
+ *  dequantized v is never below the true one and steps are never enlarged
+ */
+inline void QuantizeMoment2(const float *x, int n, unsigned char *q, float *scale) {
+  for (int b = 0; b * kQuantBlock < n; ++b) {
+    int beg = b * kQuantBlock, end = std::min(n, beg + kQuantBlock);
+    float smax = 0.f;
+    for (int i = beg; i < end; ++i) smax = std::max(smax, std::sqrt(x[i]));
+    scale[b] = smax / 255.f;
+    float inv = smax > 0.f ? 255.f / smax : 0.f;
+    for (int i = beg; i < end; ++i) {
+      float c = std::ceil(std::sqrt(x[i]) * inv);
+      q[i] = static_cast<unsigned char>(std::min(c, 255.f));
+    }
+  }
+}
+
+inline void DequantizeMoment2(const unsigned char *q, const float *scale, int n, float *x) {
+  for (int i = 0; i < n; ++i) {
+    float s = q[i] * scale[i / kQuantBlock];
+    x[i] = s * s;
+  }
+}
+
+}  // namespace updater
+}  // namespace textnet
+#endif  // TEXTNET_UPDATER_ROW_STATE_H_
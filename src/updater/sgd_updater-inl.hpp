@@ -2,8 +2,11 @@
 #define TEXTNET_SGD_UPDATER_INL_HPP_
 
 #include <iostream>
+#include <vector>
 #include <mshadow/tensor.h>
 #include "./updater.h"
+#include "./sparse_row_kernels.h"
+#include "./row_state.h"
 
 namespace textnet {
 namespace updater {
@@ -24,6 +27,8 @@ class SGDUpdater : public Updater<xpu, dim>{
     this->defaults["momentum"] = SettingV(0.0f);
     this->defaults["l2"] = SettingV(0.0f);
     this->defaults["batch_size"] = SettingV(1);
+    // full or touched (momentum history of the rows which got a diff)
+    this->defaults["state"] = SettingV("full");
 
     // require value, set to SettingV(),
     // it will force custom to set in config
@@ -41,15 +46,43 @@ class SGDUpdater : public Updater<xpu, dim>{
     decay = setting["decay"].fVal();
     momentum = setting["momentum"].fVal();
     l2 = setting["l2"].fVal();
+    state_mode = ParseStateMode(setting["state"].sVal());
+    utils::Check(state_mode == kStateFull || state_mode == kStateTouched,
+                 "SGD: only full and touched state are supported.");
     iteration = 0;
 	  lr = base_lr;
   }
   
   virtual void Update(mshadow::Tensor<xpu, dim> data, 
                       mshadow::Tensor<xpu, dim> diff) {
+    if (momentum != 0.0 && state_mode == kStateTouched) {
+      rows.resize(data.size(0));
+      for (int i = 0; i < data.size(0); ++i) rows[i] = i;
+      UpdateTouchedRows(data, diff, rows);
+      return;
+    }
     if (momentum != 0.0 && iteration == 0) {
       history.Resize(data.shape_, 0);
     }
+    if (xpu::kDevCPU) {
+      AdaptLearningRate();
+      iteration++;
+      // elementwise, chunks of the flat tensor run in parallel
+      const size_t n = data.shape_.Size();
+      const int nchunk = FlatChunkNum(n);
+      const float gscale = batch_size > 1 ? 1.f / batch_size : 1.f;
+      #pragma omp parallel for
+      for (int c = 0; c < nchunk; ++c) {
+        size_t beg = static_cast<size_t>(c) * kFlatChunk;
+        if (momentum == 0.0) {
+          SgdRow(data.dptr_ + beg, diff.dptr_ + beg, FlatChunkLen(n, c), gscale, l2, lr);
+        } else {
+          MomentumRow(data.dptr_ + beg, diff.dptr_ + beg, history.dptr_ + beg,
+                      FlatChunkLen(n, c), gscale, l2, lr, momentum);
+        }
+      }
+      return;
+    }
     if (batch_size > 1) {
         diff /= float(batch_size);
     }
@@ -68,6 +101,12 @@ class SGDUpdater : public Updater<xpu, dim>{
   virtual void UpdateSparse(mshadow::Tensor<xpu, dim> data, 
                             mshadow::Tensor<xpu, dim> diff, 
                             mshadow::Tensor<xpu, 1> idx) {
+    if (momentum != 0.0 && state_mode == kStateTouched) {
+      rows.resize(idx.size(0));
+      for (int i = 0; i < idx.size(0); ++i) rows[i] = idx[i];
+      UpdateTouchedRows(data, diff, rows);
+      return;
+    }
     if (momentum != 0.0 && iteration == 0) {
       history.Resize(data.shape_, 0);
     }
@@ -94,6 +133,34 @@ class SGDUpdater : public Updater<xpu, dim>{
     }
   }
   
+  // momentum history only for the rows which got a diff,
+  // diff row i belongs to data row rows[i], rows are distinct
+  void UpdateTouchedRows(mshadow::Tensor<xpu, dim> data, 
+                         mshadow::Tensor<xpu, dim> diff, 
+                         const std::vector<int> &rows) {
+    const int row_len = data.shape_.Size() / data.size(0);
+    if (iteration == 0) {
+      row_history.Init(data.size(0), row_len);
+    }
+    AdaptLearningRate();
+    iteration++;
+
+    const int nrow = rows.size();
+    for (int i = 0; i < nrow; ++i) {
+      utils::Check(rows[i] >= 0 && rows[i] < data.size(0), "SGD Sparse Update index error.");
+      row_history.Alloc(rows[i]);
+    }
+    const float gscale = batch_size > 1 ? 1.f / batch_size : 1.f;
+    #pragma omp parallel for
+    for (int i = 0; i < nrow; ++i) {
+      MomentumRow(data.dptr_ + static_cast<size_t>(rows[i]) * row_len,
+                  diff.dptr_ + static_cast<size_t>(i) * row_len,
+                  row_history.Find(rows[i]), row_len, gscale, l2, lr, momentum);
+    }
+  }
+
+  virtual bool Fusable() { return state_mode == kStateFull; }
+
   virtual void AdaptLearningRate() {
 	if (lr < 0.1 * base_lr) return;
     lr = base_lr * (1.0 - decay * iteration);
@@ -107,6 +174,9 @@ class SGDUpdater : public Updater<xpu, dim>{
   float base_lr;
   float decay;
   float l2;
+  int state_mode;
+  RowState row_history;
+  std::vector<int> rows;
 };
 }  // namespace updater
 }  // namespace textnet
@@ -90,6 +90,8 @@ class SGDStepUpdater : public Updater<xpu, dim>{
     }
   }
   
+  virtual bool Fusable() { return true; }
+
   virtual void UpdateSparse(mshadow::Tensor<xpu, dim> data, 
                             mshadow::Tensor<xpu, dim> diff, 
                             mshadow::Tensor<xpu, 1> idx) {
@@ -0,0 +1,180 @@
+#ifndef TEXTNET_UPDATER_SPARSE_ROW_KERNELS_H_
+#define TEXTNET_UPDATER_SPARSE_ROW_KERNELS_H_
+/*!
+ * \file sparse_row_kernels.h
+ * \brief one row update of the adaptive optimizers, used by the sparse
+ *        updaters; rows of one update are distinct so they run in parallel
+ *  g is the raw diff row, it is scaled by gscale and gets wd * w added
+ *  dense updates on cpu run the same kernels over chunks of kFlatChunk values
+ */
+#include <cmath>
+#include <cstddef>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace textnet {
+namespace updater {
+
+const int kFlatChunk = 4096;
+
+inline int FlatChunkNum(size_t n) {
+  return static_cast<int>((n + kFlatChunk - 1) / kFlatChunk);
+}
+
+inline int FlatChunkLen(size_t n, int c) {
+  size_t beg = static_cast<size_t>(c) * kFlatChunk;
+  return static_cast<int>(n - beg < kFlatChunk ? n - beg : kFlatChunk);
+}
+
+/*! \brief w -= lr * g */
+inline void SgdRow(float *w, const float *g, int n, float gscale, float wd, float lr) {
+  int f = 0;
+#ifdef __SSE2__
+  const __m128 vs = _mm_set1_ps(gscale), vwd = _mm_set1_ps(wd), vlr = _mm_set1_ps(lr);
+  for (; f + 4 <= n; f += 4) {
+    __m128 vw = _mm_loadu_ps(w + f);
+    __m128 vg = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(g + f), vs), _mm_mul_ps(vwd, vw));
+    _mm_storeu_ps(w + f, _mm_sub_ps(vw, _mm_mul_ps(vlr, vg)));
+  }
+#endif
+  for (; f < n; ++f) {
+    w[f] -= lr * (g[f] * gscale + wd * w[f]);
+  }
+}
+
+/*! \brief h += g^2; w -= lr * g / (sqrt(h) + eps) */
+inline void AdagradRow(float *w, const float *g, float *h, int n,
+                       float gscale, float wd, float lr, float eps) {
+  int f = 0;
+#ifdef __SSE2__
+  const __m128 vs = _mm_set1_ps(gscale), vwd = _mm_set1_ps(wd);
+  const __m128 vlr = _mm_set1_ps(lr), veps = _mm_set1_ps(eps);
+  for (; f + 4 <= n; f += 4) {
+    __m128 vw = _mm_loadu_ps(w + f);
+    __m128 vg = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(g + f), vs), _mm_mul_ps(vwd, vw));
+    __m128 vh = _mm_add_ps(_mm_loadu_ps(h + f), _mm_mul_ps(vg, vg));
+    _mm_storeu_ps(h + f, vh);
+    vw = _mm_sub_ps(vw, _mm_div_ps(_mm_mul_ps(vlr, vg), _mm_add_ps(_mm_sqrt_ps(vh), veps)));
+    _mm_storeu_ps(w + f, vw);
+  }
+#endif
+  for (; f < n; ++f) {
+    float gi = g[f] * gscale + wd * w[f];
+    h[f] += gi * gi;
+    w[f] -= lr * gi / (sqrtf(h[f]) + eps);
+  }
+}
+
+/*!
+ * \brief row-wise adagrad, one accumulator per row:
+ *        h += mean(g^2); w -= lr * g / (sqrt(h) + eps)
+ */
+inline void AdagradRowWise(float *w, const float *g, float *h, int n,
+                           float gscale, float wd, float lr, float eps) {
+  if (n <= 0) return;
+  float sq = 0.f;
+  for (int f = 0; f < n; ++f) {
+    float gi = g[f] * gscale + wd * w[f];
+    sq += gi * gi;
+  }
+  *h += sq / n;
+  const float r = lr / (sqrtf(*h) + eps);
+  for (int f = 0; f < n; ++f) {
+    w[f] -= r * (g[f] * gscale + wd * w[f]);
+  }
+}
+
+/*! \brief h = lr * g + momentum * h; w -= h */
+inline void MomentumRow(float *w, const float *g, float *h, int n,
+                        float gscale, float wd, float lr, float momentum) {
+  int f = 0;
+#ifdef __SSE2__
+  const __m128 vs = _mm_set1_ps(gscale), vwd = _mm_set1_ps(wd);
+  const __m128 vlr = _mm_set1_ps(lr), vmom = _mm_set1_ps(momentum);
+  for (; f + 4 <= n; f += 4) {
+    __m128 vw = _mm_loadu_ps(w + f);
+    __m128 vg = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(g + f), vs), _mm_mul_ps(vwd, vw));
+    __m128 vh = _mm_add_ps(_mm_mul_ps(vlr, vg), _mm_mul_ps(vmom, _mm_loadu_ps(h + f)));
+    _mm_storeu_ps(h + f, vh);
+    _mm_storeu_ps(w + f, _mm_sub_ps(vw, vh));
+  }
+#endif
+  for (; f < n; ++f) {
+    float gi = g[f] * gscale + wd * w[f];
+    h[f] = lr * gi + momentum * h[f];
+    w[f] -= h[f];
+  }
+}
+
+/*!
+ * \brief m = a1 * m + b1 * g; v = a2 * v + b2 * g^2;
+ *        w -= step * m / (sqrt(v) * inv_c2 + eps)
+ *  a1, a2 fold in the decay of the steps the row was not touched
+ */
+inline void AdamRow(float *w, const float *g, float *m, float *v, int n,
+                    float gscale, float wd, float a1, float b1, float a2, float b2,
+                    float step, float inv_c2, float eps) {
+  int f = 0;
+#ifdef __SSE2__
+  const __m128 vs = _mm_set1_ps(gscale), vwd = _mm_set1_ps(wd);
+  const __m128 va1 = _mm_set1_ps(a1), vb1 = _mm_set1_ps(b1);
+  const __m128 va2 = _mm_set1_ps(a2), vb2 = _mm_set1_ps(b2);
+  const __m128 vstep = _mm_set1_ps(step), vc2 = _mm_set1_ps(inv_c2), veps = _mm_set1_ps(eps);
+  for (; f + 4 <= n; f += 4) {
+    __m128 vw = _mm_loadu_ps(w + f);
+    __m128 vg = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(g + f), vs), _mm_mul_ps(vwd, vw));
+    __m128 vm = _mm_add_ps(_mm_mul_ps(va1, _mm_loadu_ps(m + f)), _mm_mul_ps(vb1, vg));
+    __m128 vv = _mm_add_ps(_mm_mul_ps(va2, _mm_loadu_ps(v + f)), _mm_mul_ps(vb2, _mm_mul_ps(vg, vg)));
+    _mm_storeu_ps(m + f, vm);
+    _mm_storeu_ps(v + f, vv);
+    __m128 den = _mm_add_ps(_mm_mul_ps(_mm_sqrt_ps(vv), vc2), veps);
+    _mm_storeu_ps(w + f, _mm_sub_ps(vw, _mm_div_ps(_mm_mul_ps(vstep, vm), den)));
+  }
+#endif
+  for (; f < n; ++f) {
+    float gi = g[f] * gscale + wd * w[f];
+    m[f] = a1 * m[f] + b1 * gi;
+    v[f] = a2 * v[f] + b2 * gi * gi;
+    w[f] -= step * m[f] / (sqrtf(v[f]) * inv_c2 + eps);
+  }
+}
+
+/*!
+ * \brief eg = a * eg + (1-rho) * g^2; d = g * sqrt(ed' + eps) / sqrt(eg + eps);
+ *        ed = rho * ed' + (1-rho) * d^2; w -= d, where ed' = decay * ed
+ *  a = rho * decay, decay folds in the steps the row was not touched
+ */
+inline void AdaDeltaRow(float *w, const float *g, float *eg, float *ed, int n,
+                        float wd, float rho, float decay, float eps) {
+  const float a = rho * decay, c = 1.f - rho;
+  int f = 0;
+#ifdef __SSE2__
+  const __m128 vwd = _mm_set1_ps(wd), va = _mm_set1_ps(a), vc = _mm_set1_ps(c);
+  const __m128 vrho = _mm_set1_ps(rho), vdecay = _mm_set1_ps(decay), veps = _mm_set1_ps(eps);
+  for (; f + 4 <= n; f += 4) {
+    __m128 vw = _mm_loadu_ps(w + f);
+    __m128 vg = _mm_add_ps(_mm_loadu_ps(g + f), _mm_mul_ps(vwd, vw));
+    __m128 veg = _mm_add_ps(_mm_mul_ps(va, _mm_loadu_ps(eg + f)), _mm_mul_ps(vc, _mm_mul_ps(vg, vg)));
+    __m128 ved = _mm_mul_ps(vdecay, _mm_loadu_ps(ed + f));
+    __m128 vd = _mm_div_ps(_mm_mul_ps(vg, _mm_sqrt_ps(_mm_add_ps(ved, veps))),
+                           _mm_sqrt_ps(_mm_add_ps(veg, veps)));
+    ved = _mm_add_ps(_mm_mul_ps(vrho, ved), _mm_mul_ps(vc, _mm_mul_ps(vd, vd)));
+    _mm_storeu_ps(eg + f, veg);
+    _mm_storeu_ps(ed + f, ved);
+    _mm_storeu_ps(w + f, _mm_sub_ps(vw, vd));
+  }
+#endif
+  for (; f < n; ++f) {
+    float gi = g[f] + wd * w[f];
+    eg[f] = a * eg[f] + c * gi * gi;
+    float edf = decay * ed[f];
+    float d = gi * sqrtf(edf + eps) / sqrtf(eg[f] + eps);
+    ed[f] = rho * edf + c * d * d;
+    w[f] -= d;
+  }
+}
+
+}  // namespace updater
+}  // namespace textnet
+#endif  // TEXTNET_UPDATER_SPARSE_ROW_KERNELS_H_
@@ -4,6 +4,7 @@
 #include <vector>
 #include <map>
 #include <string>
+#include <sstream>
 #include <mshadow/tensor.h>
 #include "../global.h"
 #include "../utils/utils.h"
@@ -53,6 +54,7 @@ class Updater {
   virtual void SetupUpdater(std::map<std::string, SettingV> &setting) {
     updater_type = 0;
     this->Require(setting);
+    setting_ = setting;
   }
   
   virtual void Update(mshadow::Tensor<xpu, dim> data, 
@@ -64,12 +66,40 @@ class Updater {
                             
   
   virtual UpdaterType GetUpdaterType() { return updater_type; }
+
+  // true if Update is elementwise with state of the param shape, then params
+  // with equal SettingKey can be stepped as one flat tensor by one updater
+  virtual bool Fusable() { return false; }
+
+  std::map<std::string, SettingV> &GetSetting() { return setting_; }
+
+  // all settings in one string, updaters with the same key behave the same
+  std::string SettingKey() {
+    std::ostringstream oss;
+    oss.precision(9);
+    for (std::map<std::string, SettingV>::iterator it = setting_.begin();
+          it != setting_.end(); ++it) {
+      SettingV &v = it->second;
+      oss << it->first << "=";
+      switch (v.value_type) {
+        case SET_INT: oss << "i" << v.i_val; break;
+        case SET_FLOAT: oss << "f" << v.f_val; break;
+        case SET_BOOL: oss << "b" << v.b_val; break;
+        case SET_STRING: oss << "s" << v.s_val; break;
+        default: oss << "?"; break;
+      }
+      oss << ";";
+    }
+    return oss.str();
+  }
   
  protected:
   UpdaterType updater_type;
   mshadow::Random<xpu>* prnd_;
   // required setting
   std::map<std::string, SettingV> defaults;
+  // setting after defaults are filled in
+  std::map<std::string, SettingV> setting_;
   
 };
 
@@ -0,0 +1,165 @@
+#ifndef TEXTNET_UTILS_ACTIVATION_STREAM_H_
+#define TEXTNET_UTILS_ACTIVATION_STREAM_H_
+/*!
+ * \file activation_stream.h
+ * \brief node activations appended to a binary file as they are produced,
+ *  a background thread does the writes, python/read_activation.py reads it
+ *  file: "TNACT001", then records of
+ *    uint32 name bytes, name, int32 iter, uint64 npy bytes, a .npy v1.0 blob
+ *  so each record payload loads with numpy.load
+ */
+#include <vector>
+#include <deque>
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <stdint.h>
+#include <unistd.h>
+#include "./utils.h"
+#include "./thread.h"
+
+namespace textnet {
+namespace utils {
+
+const char kActMagic[] = "TNACT001";
+
+/*! \brief a float32 .npy v1.0 header for shape, padded to 64 bytes */
+inline std::string NpyHeader(const int shape[4]) {
+  char dict[256];
+  int len = snprintf(dict, sizeof(dict),
+                     "{'descr': '<f4', 'fortran_order': False, 'shape': (%d, %d, %d, %d), }",
+                     shape[0], shape[1], shape[2], shape[3]);
+  std::string head("\x93NUMPY\x01\x00", 8);
+  size_t total = (10 + len + 1 + 63) / 64 * 64;
+  uint16_t head_len = total - 10;
+  head.append(reinterpret_cast<const char*>(&head_len), 2);
+  head.append(dict, len);
+  head.append(total - 10 - len - 1, ' ');
+  head.push_back('\n');
+  return head;
+}
+
+class ActivationStream {
+ public:
+  ActivationStream(void) : fp_(NULL) {}
+  ~ActivationStream(void) { Close(); }
+
+  /*! \brief write to a temporary file, renamed to path by Close;
+   *  at most max_pending records wait for the writer */
+  inline void Open(const std::string &path, int max_pending = 16) {
+    Close();
+    Check(max_pending > 0, "ActivationStream: max_pending must be positive.");
+    char suffix[32];
+    SPrintf(suffix, sizeof(suffix), ".tmp%d", static_cast<int>(getpid()));
+    path_ = path;
+    tmp_ = path + suffix;
+    fp_ = fopen(tmp_.c_str(), "wb");
+    Check(fp_ != NULL, "ActivationStream: open %s failed.", tmp_.c_str());
+    ok_ = fwrite(kActMagic, 1, 8, fp_) == 8;
+    records_.resize(max_pending);
+    free_slots_.clear();
+    pending_.clear();
+    for (int i = 0; i < max_pending; ++i) free_slots_.push_back(i);
+    free_.Init(max_pending);
+    ready_.Init(0);
+    lock_.Init(1);
+    stop_ = false;
+    thread_.Start(Entry, this);
+  }
+
+  /*! \brief copy one tensor into a record, waits while max_pending are queued */
+  inline void Append(int iter, const std::string &name, const float *ptr, const int shape[4]) {
+    free_.Wait();
+    lock_.Wait();
+    int slot = free_slots_.front();
+    free_slots_.pop_front();
+    lock_.Post();
+
+    const std::string npy = NpyHeader(shape);
+    const uint32_t name_bytes = name.size();
+    const int32_t iter32 = iter;
+    const uint64_t value_bytes = static_cast<uint64_t>(shape[0]) * shape[1] * shape[2] * shape[3] * sizeof(float);
+    const uint64_t npy_bytes = npy.size() + value_bytes;
+    std::vector<char> &rec = records_[slot];
+    rec.resize(4 + name_bytes + 4 + 8 + npy_bytes);
+    char *p = &rec[0];
+    memcpy(p, &name_bytes, 4); p += 4;
+    memcpy(p, name.data(), name_bytes); p += name_bytes;
+    memcpy(p, &iter32, 4); p += 4;
+    memcpy(p, &npy_bytes, 8); p += 8;
+    memcpy(p, npy.data(), npy.size()); p += npy.size();
+    memcpy(p, ptr, value_bytes);
+
+    lock_.Wait();
+    pending_.push_back(slot);
+    lock_.Post();
+    ready_.Post();
+  }
+
+  /*! \brief write the pending records and move the file to its path */
+  inline void Close(void) {
+    if (fp_ == NULL) return;
+    const int n = static_cast<int>(records_.size());
+    for (int i = 0; i < n; ++i) free_.Wait();
+    stop_ = true;
+    ready_.Post();
+    thread_.Join();
+    free_.Destroy();
+    ready_.Destroy();
+    lock_.Destroy();
+    ok_ = fclose(fp_) == 0 && ok_;
+    fp_ = NULL;
+    if (!ok_ || rename(tmp_.c_str(), path_.c_str()) != 0) {
+      remove(tmp_.c_str());
+      Error("ActivationStream: write %s failed.", path_.c_str());
+    }
+  }
+
+ private:
+  inline void Run(void) {
+    while (true) {
+      ready_.Wait();
+      lock_.Wait();
+      if (pending_.empty()) {
+        lock_.Post();
+        if (stop_) break;
+        continue;
+      }
+      int slot = pending_.front();
+      pending_.pop_front();
+      lock_.Post();
+
+      const std::vector<char> &rec = records_[slot];
+      ok_ = ok_ && fwrite(&rec[0], 1, rec.size(), fp_) == rec.size();
+
+      lock_.Wait();
+      free_slots_.push_back(slot);
+      lock_.Post();
+      free_.Post();
+    }
+  }
+
+  inline static CXXNET_THREAD_PREFIX Entry(void *self) {
+    static_cast<ActivationStream*>(self)->Run();
+    ThreadExit(NULL);
+    return NULL;
+  }
+
+  ActivationStream(const ActivationStream &);
+  ActivationStream &operator=(const ActivationStream &);
+
+  FILE *fp_;
+  bool ok_;
+  volatile bool stop_;
+  std::string path_, tmp_;
+  // record buffers, reused once written
+  std::vector<std::vector<char> > records_;
+  std::deque<int> free_slots_, pending_;
+  // free_ counts free records, ready_ pending ones, lock_ guards the queues
+  Semaphore free_, ready_, lock_;
+  Thread thread_;
+};
+
+}  // namespace utils
+}  // namespace textnet
+#endif  // TEXTNET_UTILS_ACTIVATION_STREAM_H_
@@ -0,0 +1,158 @@
+#ifndef TEXTNET_UTILS_ASYNC_CHECKPOINT_H_
+#define TEXTNET_UTILS_ASYNC_CHECKPOINT_H_
+/*!
+ * \file async_checkpoint.h
+ * \brief checkpoints written by a background thread: the caller only takes a
+ *  snapshot of the tensors, serialization, fsync and rename run behind training;
+ *  at most max_inflight checkpoints are staged, Acquire blocks beyond that
+ *  tensors added with stage false are not copied, a checkpoint holding one
+ *  is written by Submit in the caller, so staging costs at most max_inflight
+ *  times the staged tensors of one checkpoint
+ */
+#include <vector>
+#include <deque>
+#include <string>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "./utils.h"
+#include "./thread.h"
+#include "./checkpoint.h"
+#include "../io/json/json.h"
+
+namespace textnet {
+namespace utils {
+
+class AsyncCheckpoint {
+ public:
+  AsyncCheckpoint(void) : started_(false) {}
+  ~AsyncCheckpoint(void) { Stop(); }
+
+  inline void Start(int max_inflight) {
+    if (started_) return;
+    Check(max_inflight > 0, "AsyncCheckpoint: max_inflight must be positive.");
+    jobs_.resize(max_inflight);
+    for (int i = 0; i < max_inflight; ++i) free_slots_.push_back(i);
+    free_.Init(max_inflight);
+    ready_.Init(0);
+    lock_.Init(1);
+    stop_ = false;
+    started_ = true;
+    thread_.Start(Entry, this);
+  }
+
+  inline bool Started(void) const { return started_; }
+
+  /*! \brief a free slot, waits while max_inflight checkpoints are pending */
+  inline int Acquire(void) {
+    free_.Wait();
+    lock_.Wait();
+    int slot = free_slots_.front();
+    free_slots_.pop_front();
+    lock_.Post();
+    return slot;
+  }
+
+  /*! \brief the writer of slot, tensors are added to it before Submit */
+  inline CheckpointWriter &Writer(int slot) { return jobs_[slot].writer; }
+
+  /*!
+   * \brief snapshot the added tensors now, write them to path later; with
+   *  unstaged tensors the checkpoint is written now and the slot freed
+   */
+  inline void Submit(int slot, const std::string &path, const Json::Value &config) {
+    Job &job = jobs_[slot];
+    if (!job.writer.Snapshot()) {
+      job.writer.Write(path, config);
+      Printf("[Save] Model %s written.\n", path.c_str());
+      Release(slot);
+      return;
+    }
+    job.path = path;
+    job.config = config;
+    lock_.Wait();
+    pending_.push_back(slot);
+    lock_.Post();
+    ready_.Post();
+  }
+
+  /*! \brief block until every submitted checkpoint is on disk */
+  inline void Wait(void) {
+    if (!started_) return;
+    const int n = static_cast<int>(jobs_.size());
+    for (int i = 0; i < n; ++i) free_.Wait();
+    for (int i = 0; i < n; ++i) free_.Post();
+  }
+
+  inline void Stop(void) {
+    if (!started_) return;
+    Wait();
+    stop_ = true;
+    ready_.Post();
+    thread_.Join();
+    free_.Destroy();
+    ready_.Destroy();
+    lock_.Destroy();
+    started_ = false;
+  }
+
+ private:
+  struct Job {
+    CheckpointWriter writer;
+    std::string path;
+    Json::Value config;
+  };
+
+  inline void Run(void) {
+#ifdef _OPENMP
+    // pack and shard loops of this thread stay on one core, the cores
+    // belong to the training threads
+    omp_set_num_threads(1);
+#endif
+    while (true) {
+      ready_.Wait();
+      lock_.Wait();
+      if (pending_.empty()) {
+        lock_.Post();
+        if (stop_) break;
+        continue;
+      }
+      int slot = pending_.front();
+      pending_.pop_front();
+      lock_.Post();
+
+      Job &job = jobs_[slot];
+      job.writer.Write(job.path, job.config);
+      Printf("[Save] Model %s written.\n", job.path.c_str());
+      Release(slot);
+    }
+  }
+
+  inline void Release(int slot) {
+    lock_.Wait();
+    free_slots_.push_back(slot);
+    lock_.Post();
+    free_.Post();
+  }
+
+  inline static CXXNET_THREAD_PREFIX Entry(void *self) {
+    static_cast<AsyncCheckpoint*>(self)->Run();
+    ThreadExit(NULL);
+    return NULL;
+  }
+
+  AsyncCheckpoint(const AsyncCheckpoint &);
+  AsyncCheckpoint &operator=(const AsyncCheckpoint &);
+
+  bool started_;
+  volatile bool stop_;
+  std::vector<Job> jobs_;
+  std::deque<int> free_slots_, pending_;
+  // free_ counts free slots, ready_ pending jobs, lock_ guards the queues
+  Semaphore free_, ready_, lock_;
+  Thread thread_;
+};
+
+}  // namespace utils
+}  // namespace textnet
+#endif  // TEXTNET_UTILS_ASYNC_CHECKPOINT_H_
@@ -0,0 +1,68 @@
+#ifndef TEXTNET_UTILS_BATCH_GEMM_H_
+#define TEXTNET_UTILS_BATCH_GEMM_H_
+/*!
+ * \file batch_gemm.h
+ * \brief small row-major gemm kernels and a strided batched driver,
+ *        used by layers that multiply a different matrix for every example
+ */
+#include <vector>
+#if MSHADOW_USE_MKL
+#include <mkl.h>
+#else
+extern "C" {
+#include <cblas.h>
+}
+#endif
+#include "./utils.h"
+
+namespace textnet {
+namespace utils {
+
+/*!
+ * \brief C = alpha * op(A) * op(B) + beta * C, all matrices row-major
+ *  op(A) is m x k, op(B) is k x n, C is m x n; forwards to the same BLAS
+ *  sgemm that mshadow's dot uses
+ */
+inline void Gemm(bool trans_a, bool trans_b, int m, int n, int k,
+                 float alpha, const float *A, int lda,
+                 const float *B, int ldb,
+                 float beta, float *C, int ldc) {
+  cblas_sgemm(CblasRowMajor,
+              trans_a ? CblasTrans : CblasNoTrans,
+              trans_b ? CblasTrans : CblasNoTrans,
+              m, n, k, alpha, A, lda, B, ldb, beta, C, ldc);
+}
+
+/*! \brief shape of one problem in a batched gemm, sizes may differ per example */
+struct GemmShape {
+  int m, n, k;
+  GemmShape(void) : m(0), n(0), k(0) {}
+  GemmShape(int m, int n, int k) : m(m), n(n), k(k) {}
+};
+
+/*!
+ * \brief C_b = alpha * op(A_b) * op(B_b) + beta * C_b for every b in the batch
+ *  A_b = A + b * stride_a, the same for B and C; an example with an empty
+ *  shape is skipped, examples are distributed over threads; each example is
+ *  small, so the BLAS call itself is expected to run single threaded
+ */
+inline void GemmStridedBatched(bool trans_a, bool trans_b,
+                               const std::vector<GemmShape> &shapes,
+                               float alpha,
+                               const float *A, int lda, size_t stride_a,
+                               const float *B, int ldb, size_t stride_b,
+                               float beta, float *C, int ldc, size_t stride_c) {
+  const int nbatch = static_cast<int>(shapes.size());
+  #pragma omp parallel for schedule(dynamic)
+  for (int b = 0; b < nbatch; ++b) {
+    const GemmShape &s = shapes[b];
+    if (s.m == 0 || s.n == 0) continue;
+    Gemm(trans_a, trans_b, s.m, s.n, s.k, alpha,
+         A + b * stride_a, lda, B + b * stride_b, ldb,
+         beta, C + b * stride_c, ldc);
+  }
+}
+
+}  // namespace utils
+}  // namespace textnet
+#endif  // TEXTNET_UTILS_BATCH_GEMM_H_
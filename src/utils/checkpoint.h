@@ -0,0 +1,535 @@
+#ifndef TEXTNET_UTILS_CHECKPOINT_H_
+#define TEXTNET_UTILS_CHECKPOINT_H_
+/*!
+ * \file checkpoint.h
+ * \brief binary model checkpoint, loaded by mmap without parsing any value
+ *  file: "TNCKPT01", uint64 header bytes, a json header
+ *    {"format", "version", "config", "meta", "tensors": [{name, shape, dtype, offset, bytes}]},
+ *  zero padding up to the data start (a multiple of kCkptPage), then the
+ *  tensor blobs, each at data start + offset, offsets multiples of kCkptAlign
+ *  a sharded checkpoint is a manifest with no tensors and "shards":
+ *  [{file, bytes, crc32}], each shard a checkpoint file next to it
+ *  a compressed tensor adds "codec" and "chunks", the packed bytes of its
+ *  kCodecChunk raw byte pieces, see chunk_codec.h
+ */
+#include <vector>
+#include <map>
+#include <string>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <stdint.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "./utils.h"
+#include "./mapped_file.h"
+#include "./chunk_codec.h"
+#include "../io/json/json.h"
+
+namespace textnet {
+namespace utils {
+
+const size_t kCkptAlign = 64;
+const size_t kCkptPage = 4096;
+const char kCkptMagic[] = "TNCKPT01";
+
+inline size_t CkptRoundUp(size_t n, size_t a) { return (n + a - 1) / a * a; }
+
+/*! \brief zlib crc32 over n bytes, in pieces that fit its length type */
+inline uint32_t CkptCrc(uint32_t crc, const void *p, size_t n) {
+  const Bytef *b = static_cast<const Bytef*>(p);
+  if (b == NULL) return crc32(crc, Z_NULL, 0);
+  while (n > 0) {
+    uInt k = n < (1u << 30) ? static_cast<uInt>(n) : (1u << 30);
+    crc = crc32(crc, b, k);
+    b += k;
+    n -= k;
+  }
+  return crc;
+}
+
+/*! \brief whether path starts as a binary checkpoint */
+inline bool IsCheckpointFile(const std::string &path) {
+  FILE *fp = fopen(path.c_str(), "rb");
+  if (fp == NULL) return false;
+  char magic[8];
+  bool ok = fread(magic, 1, 8, fp) == 8 && memcmp(magic, kCkptMagic, 8) == 0;
+  fclose(fp);
+  return ok;
+}
+
+/*!
+ * \brief tensors are added as pointers and written by Write, row_map as in
+ *  Node::SaveNode: blob row i is source row row_map[i]; stage false keeps a
+ *  tensor out of Snapshot, e.g. a mapped table too large to copy
+ */
+class CheckpointWriter {
+ public:
+  CheckpointWriter(void) : shards_(0), codec_(kCodecNone) {}
+
+  inline void Add(const std::string &name, const float *ptr, const int shape[4],
+                  const int *row_map = NULL, bool stage = true) {
+    Tensor t;
+    t.name = name;
+    for (int i = 0; i < 4; ++i) t.shape[i] = shape[i];
+    t.ptr = ptr;
+    t.row_map = row_map;
+    t.dtype = "float32";
+    t.codec = kCodecNone;
+    t.stage = stage;
+    tensors_.push_back(t);
+  }
+
+  /*! \brief n row ids, an int32 tensor of shape n x 1 x 1 x 1 */
+  inline void AddIds(const std::string &name, const int *ids, int n) {
+    const int shape[4] = {n, 1, 1, 1};
+    // copied as raw 4 byte words, like the float tensors
+    Add(name, reinterpret_cast<const float*>(ids), shape);
+    tensors_.back().dtype = "int32";
+  }
+
+  /*! \brief free form json saved with the next Write, e.g. an incremental chain */
+  inline Json::Value &Meta(void) { return meta_; }
+
+  /*!
+   * \brief copy the added tensors into a staging buffer owned by the writer,
+   *  so Write may run after the sources changed, e.g. in AsyncCheckpoint;
+   *  the buffer keeps its capacity for the next snapshot
+   * \return false if some tensors were added with stage false, Write still
+   *  reads their sources
+   */
+  inline bool Snapshot(void) {
+    size_t total = 0;
+    bool staged = true;
+    for (size_t i = 0; i < tensors_.size(); ++i) {
+      if (tensors_[i].stage) {
+        total += Size(tensors_[i]);
+      } else {
+        staged = false;
+      }
+    }
+    if (staging_.size() < total) staging_.resize(total);
+    float *dst = total == 0 ? NULL : &staging_[0];
+    for (size_t i = 0; i < tensors_.size(); ++i) {
+      Tensor &t = tensors_[i];
+      if (!t.stage) continue;
+      const size_t nrow = t.shape[0], row = nrow == 0 ? 0 : Size(t) / nrow;
+      if (t.row_map == NULL) {
+        memcpy(dst, t.ptr, Size(t) * sizeof(float));
+      } else {
+        for (size_t r = 0; r < nrow; ++r) {
+          memcpy(dst + r * row, t.ptr + static_cast<size_t>(t.row_map[r]) * row, row * sizeof(float));
+        }
+      }
+      t.ptr = dst;
+      t.row_map = NULL;
+      dst += Size(t);
+    }
+    return staged;
+  }
+
+  /*!
+   * \brief tensors go to shards size balanced files path.shard<k>, written in
+   *  parallel, path is then a manifest holding their sizes and crc32; 0 or 1
+   *  keeps one file; shard files left by an earlier save are removed
+   */
+  inline void SetShards(int shards) { shards_ = shards; }
+
+  /*! \brief pack the tensors with codec, kCodecNone keeps them mappable */
+  inline void SetCodec(int codec) { codec_ = codec; }
+
+  /*! \brief write to a temporary file and rename it to path */
+  inline void Write(const std::string &path, const Json::Value &config) {
+    Pack();
+    std::vector<const Tensor*> all;
+    for (size_t i = 0; i < tensors_.size(); ++i) all.push_back(&tensors_[i]);
+    if (shards_ <= 1) {
+      WriteFile(path, config, meta_, Json::Value(), all, NULL);
+    } else {
+      // largest first onto the lightest shard
+      std::vector<std::pair<size_t, size_t> > order;
+      for (size_t i = 0; i < tensors_.size(); ++i) order.push_back(std::make_pair(StoredBytes(tensors_[i]), i));
+      std::sort(order.rbegin(), order.rend());
+      std::vector<std::vector<const Tensor*> > groups(shards_);
+      std::vector<size_t> load(shards_, 0);
+      for (size_t i = 0; i < order.size(); ++i) {
+        int k = std::min_element(load.begin(), load.end()) - load.begin();
+        groups[k].push_back(&tensors_[order[i].second]);
+        load[k] += order[i].first;
+      }
+      std::vector<FileSum> sums(shards_);
+      #pragma omp parallel for schedule(dynamic)
+      for (int k = 0; k < shards_; ++k) {
+        WriteFile(ShardPath(path, k), Json::Value(), Json::Value(), Json::Value(), groups[k], &sums[k]);
+      }
+      Json::Value shards_root;
+      for (int k = 0; k < shards_; ++k) {
+        std::string shard = ShardPath(path, k);
+        shards_root[k]["file"] = shard.substr(shard.find_last_of('/') + 1);
+        shards_root[k]["bytes"] = Json::UInt64(sums[k].bytes);
+        shards_root[k]["crc32"] = Json::UInt(sums[k].crc);
+      }
+      WriteFile(path, config, meta_, shards_root, std::vector<const Tensor*>(), NULL);
+    }
+    // shards of an earlier save to path with more of them
+    for (int k = shards_ <= 1 ? 0 : shards_; remove(ShardPath(path, k).c_str()) == 0; ++k) {}
+    tensors_.clear();
+    meta_ = Json::Value();
+  }
+
+  inline static std::string ShardPath(const std::string &path, int k) {
+    char suffix[32];
+    SPrintf(suffix, sizeof(suffix), ".shard%d", k);
+    return path + suffix;
+  }
+
+ private:
+  struct Tensor {
+    std::string name;
+    int shape[4];
+    const float *ptr;
+    const int *row_map;
+    const char *dtype;
+    // copied by Snapshot
+    bool stage;
+    // the codec used and the packed chunks, if packed
+    int codec;
+    std::vector<std::vector<char> > packed;
+  };
+  /*! \brief bytes and crc32 of a written file */
+  struct FileSum {
+    uint64_t bytes;
+    uint32_t crc;
+  };
+  inline static size_t Size(const Tensor &t) {
+    return static_cast<size_t>(t.shape[0]) * t.shape[1] * t.shape[2] * t.shape[3];
+  }
+  inline static size_t Bytes(const Tensor &t) { return Size(t) * sizeof(float); }
+  inline static size_t StoredBytes(const Tensor &t) {
+    if (t.codec == kCodecNone) return Bytes(t);
+    size_t n = 0;
+    for (size_t c = 0; c < t.packed.size(); ++c) n += t.packed[c].size();
+    return n;
+  }
+
+  /*! \brief n raw bytes of t from byte begin, rows in saved order */
+  inline static void CopyBytes(const Tensor &t, size_t begin, size_t n, char *dst) {
+    const char *src = reinterpret_cast<const char*>(t.ptr);
+    if (t.row_map == NULL) {
+      memcpy(dst, src + begin, n);
+      return;
+    }
+    const size_t row_bytes = Bytes(t) / t.shape[0];
+    while (n > 0) {
+      size_t r = begin / row_bytes, off = begin % row_bytes;
+      size_t k = std::min(n, row_bytes - off);
+      memcpy(dst, src + static_cast<size_t>(t.row_map[r]) * row_bytes + off, k);
+      dst += k;
+      begin += k;
+      n -= k;
+    }
+  }
+
+  /*! \brief pack every chunk of every tensor, in parallel */
+  inline void Pack(void) {
+    if (codec_ == kCodecNone) return;
+    std::vector<std::pair<size_t, size_t> > jobs;
+    for (size_t i = 0; i < tensors_.size(); ++i) {
+      Tensor &t = tensors_[i];
+      const size_t nchunk = (Bytes(t) + kCodecChunk - 1) / kCodecChunk;
+      t.codec = CodecUsed(codec_);
+      t.packed.assign(nchunk, std::vector<char>());
+      for (size_t c = 0; c < nchunk; ++c) jobs.push_back(std::make_pair(i, c));
+    }
+    #pragma omp parallel
+    {
+      std::vector<char> raw(kCodecChunk);
+      #pragma omp for schedule(dynamic)
+      for (int j = 0; j < static_cast<int>(jobs.size()); ++j) {
+        Tensor &t = tensors_[jobs[j].first];
+        const size_t begin = jobs[j].second * kCodecChunk;
+        const size_t n = std::min(kCodecChunk, Bytes(t) - begin);
+        CopyBytes(t, begin, n, &raw[0]);
+        PackChunk(codec_, &raw[0], n, &t.packed[jobs[j].second]);
+      }
+    }
+  }
+
+  inline static bool Put(FILE *fp, const void *p, size_t n, FileSum *sum) {
+    if (sum != NULL) {
+      sum->crc = CkptCrc(sum->crc, p, n);
+      sum->bytes += n;
+    }
+    return fwrite(p, 1, n, fp) == n;
+  }
+  inline static bool Pad(FILE *fp, size_t n, FileSum *sum) {
+    static const char zero[kCkptAlign] = {0};
+    while (n > 0) {
+      size_t k = n < kCkptAlign ? n : kCkptAlign;
+      if (!Put(fp, zero, k, sum)) return false;
+      n -= k;
+    }
+    return true;
+  }
+
+  inline static void WriteFile(const std::string &path, const Json::Value &config,
+                               const Json::Value &meta, const Json::Value &shards,
+                               const std::vector<const Tensor*> &tensors, FileSum *sum) {
+    Json::Value head, tensors_root;
+    head["format"] = "textnet-binary";
+    head["version"] = 1;
+    head["config"] = config;
+    head["meta"] = meta;
+    if (!shards.isNull()) head["shards"] = shards;
+    std::vector<size_t> offsets(tensors.size());
+    size_t offset = 0;
+    for (size_t i = 0; i < tensors.size(); ++i) {
+      Json::Value t;
+      t["name"] = tensors[i]->name;
+      for (int k = 0; k < 4; ++k) t["shape"].append(tensors[i]->shape[k]);
+      t["dtype"] = tensors[i]->dtype;
+      t["offset"] = Json::UInt64(offset);
+      t["bytes"] = Json::UInt64(StoredBytes(*tensors[i]));
+      if (tensors[i]->codec != kCodecNone) {
+        t["codec"] = CodecName(tensors[i]->codec);
+        t["chunks"] = Json::Value(Json::arrayValue);
+        for (size_t c = 0; c < tensors[i]->packed.size(); ++c) {
+          t["chunks"].append(Json::UInt64(tensors[i]->packed[c].size()));
+        }
+      }
+      tensors_root.append(t);
+      offsets[i] = offset;
+      offset = CkptRoundUp(offset + StoredBytes(*tensors[i]), kCkptAlign);
+    }
+    head["tensors"] = tensors_root;
+    Json::FastWriter writer;
+    std::string head_str = writer.write(head);
+    const uint64_t head_bytes = head_str.size();
+    const size_t data_start = CkptRoundUp(16 + head_bytes, kCkptPage);
+
+    char suffix[32];
+    SPrintf(suffix, sizeof(suffix), ".tmp%d", static_cast<int>(getpid()));
+    std::string tmp = path + suffix;
+    FILE *fp = fopen(tmp.c_str(), "wb");
+    Check(fp != NULL, "Checkpoint: open %s failed.", tmp.c_str());
+    std::vector<char> buf(1 << 22);
+    setvbuf(fp, &buf[0], _IOFBF, buf.size());
+    if (sum != NULL) {
+      sum->bytes = 0;
+      sum->crc = CkptCrc(0, NULL, 0);
+    }
+    bool ok = Put(fp, kCkptMagic, 8, sum);
+    ok = ok && Put(fp, &head_bytes, sizeof(head_bytes), sum);
+    ok = ok && Put(fp, head_str.data(), head_bytes, sum);
+    size_t pos = 16 + head_bytes;
+    for (size_t i = 0; ok && i < tensors.size(); ++i) {
+      const Tensor &t = *tensors[i];
+      ok = Pad(fp, data_start + offsets[i] - pos, sum);
+      pos = data_start + offsets[i];
+      const size_t nrow = t.shape[0], row = nrow == 0 ? 0 : Size(t) / nrow;
+      if (t.codec != kCodecNone) {
+        for (size_t c = 0; ok && c < t.packed.size(); ++c) {
+          ok = Put(fp, &t.packed[c][0], t.packed[c].size(), sum);
+        }
+      } else if (t.row_map == NULL) {
+        ok = ok && Put(fp, t.ptr, Bytes(t), sum);
+      } else {
+        for (size_t r = 0; ok && r < nrow; ++r) {
+          ok = Put(fp, t.ptr + static_cast<size_t>(t.row_map[r]) * row, row * sizeof(float), sum);
+        }
+      }
+      pos += StoredBytes(t);
+    }
+    // the data is on disk before the rename makes it visible
+    ok = ok && fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    ok = fclose(fp) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+      remove(tmp.c_str());
+      Error("Checkpoint: write %s failed.", path.c_str());
+    }
+  }
+
+  std::vector<Tensor> tensors_;
+  std::vector<float> staging_;
+  Json::Value meta_;
+  int shards_;
+  int codec_;
+};
+
+/*!
+ * \brief a mapped checkpoint, tensors point into the map while it is open;
+ *  the shards of a manifest are mapped on Open and checked against their
+ *  crc32 by Prepare, which also unpacks compressed tensors
+ */
+class CheckpointReader {
+ public:
+  CheckpointReader(void) {}
+  ~CheckpointReader(void) {
+    for (size_t i = 0; i < parts_.size(); ++i) delete parts_[i];
+  }
+
+  inline void Open(const std::string &path) {
+    for (size_t i = 0; i < parts_.size(); ++i) delete parts_[i];
+    parts_.clear();
+    index_.clear();
+    unpacked_.clear();
+    OpenPart(path);
+    const Json::Value &shards = Head()["shards"];
+    if (shards.isNull()) return;
+    const std::string dir = path.substr(0, path.find_last_of('/') + 1);
+    parts_.resize(1 + shards.size());
+    #pragma omp parallel for schedule(dynamic)
+    for (int k = 0; k < static_cast<int>(shards.size()); ++k) {
+      parts_[1 + k] = MapPart(dir + shards[k]["file"].asString());
+      Check(parts_[1 + k]->file.Size() == shards[k]["bytes"].asUInt64(),
+            "Checkpoint: shard %s has a wrong size.", parts_[1 + k]->path.c_str());
+    }
+    for (size_t k = 1; k < parts_.size(); ++k) IndexPart(k);
+  }
+
+  inline const Json::Value &Config(void) const { return Head()["config"]; }
+  inline const Json::Value &Meta(void) const { return Head()["meta"]; }
+
+  /*!
+   * \brief check the crc32 of the shards holding any of names and unpack
+   *  those which are compressed, in parallel; Find needs this for packed ones
+   */
+  inline void Prepare(const std::vector<std::string> &names) {
+    std::vector<char> need(parts_.size(), 0);
+    for (size_t i = 0; i < names.size(); ++i) {
+      std::map<std::string, std::pair<int, Json::ArrayIndex> >::const_iterator it = index_.find(names[i]);
+      if (it != index_.end()) need[it->second.first] = 1;
+    }
+    const Json::Value &shards = Head()["shards"];
+    #pragma omp parallel for schedule(dynamic)
+    for (int k = 1; k < static_cast<int>(parts_.size()); ++k) {
+      if (!need[k]) continue;
+      const MappedFile &f = parts_[k]->file;
+      Check(CkptCrc(CkptCrc(0, NULL, 0), f.Data(), f.Size()) == shards[k - 1]["crc32"].asUInt(),
+            "Checkpoint: shard %s fails its checksum.", parts_[k]->path.c_str());
+    }
+    // chunks of all packed tensors in one parallel loop
+    struct Job {
+      int codec;
+      const char *src;
+      size_t packed;
+      char *dst;
+      size_t raw;
+    };
+    std::vector<Job> jobs;
+    for (size_t i = 0; i < names.size(); ++i) {
+      std::map<std::string, std::pair<int, Json::ArrayIndex> >::const_iterator it = index_.find(names[i]);
+      if (it == index_.end() || unpacked_.count(names[i])) continue;
+      const Part &part = *parts_[it->second.first];
+      const Json::Value &t = part.head["tensors"][it->second.second];
+      if (t["codec"].isNull()) continue;
+      size_t raw = sizeof(float);
+      for (int k = 0; k < 4; ++k) raw *= t["shape"][k].asUInt();
+      std::vector<float> &buf = unpacked_[names[i]];
+      buf.resize(raw / sizeof(float));
+      const char *src = part.file.Data() + part.data_start + t["offset"].asUInt64();
+      const Json::Value &chunks = t["chunks"];
+      for (Json::ArrayIndex c = 0; c < chunks.size(); ++c) {
+        Job job;
+        job.codec = ParseCodec(t["codec"].asString());
+        job.src = src;
+        job.packed = chunks[c].asUInt64();
+        job.dst = reinterpret_cast<char*>(&buf[0]) + c * kCodecChunk;
+        job.raw = std::min(kCodecChunk, raw - c * kCodecChunk);
+        jobs.push_back(job);
+        src += job.packed;
+      }
+    }
+    #pragma omp parallel for schedule(dynamic)
+    for (int j = 0; j < static_cast<int>(jobs.size()); ++j) {
+      UnpackChunk(jobs[j].codec, jobs[j].src, jobs[j].packed, jobs[j].dst, jobs[j].raw);
+    }
+  }
+
+  /*! \brief the values and shape of tensor name, NULL if it is not saved */
+  inline const float *Find(const std::string &name, int shape[4]) const {
+    return static_cast<const float*>(Locate(name, "float32", shape));
+  }
+
+  /*! \brief the ids saved by AddIds and their number, NULL if not saved */
+  inline const int *FindIds(const std::string &name, int *n) const {
+    int shape[4];
+    const void *p = Locate(name, "int32", shape);
+    *n = p == NULL ? 0 : shape[0];
+    return static_cast<const int*>(p);
+  }
+
+ private:
+  struct Part {
+    MappedFile file;
+    Json::Value head;
+    size_t data_start;
+    std::string path;
+  };
+
+  inline const Json::Value &Head(void) const { return parts_[0]->head; }
+
+  inline void OpenPart(const std::string &path) {
+    parts_.push_back(MapPart(path));
+    IndexPart(parts_.size() - 1);
+  }
+
+  inline static Part *MapPart(const std::string &path) {
+    Part *part = new Part();
+    MappedFile &file = part->file;
+    Check(file.Open(path) && file.Size() >= 16 && memcmp(file.Data(), kCkptMagic, 8) == 0,
+          "Checkpoint: %s is not a binary checkpoint.", path.c_str());
+    uint64_t head_bytes;
+    memcpy(&head_bytes, file.Data() + 8, sizeof(head_bytes));
+    Check(16 + head_bytes <= file.Size(), "Checkpoint: %s is truncated.", path.c_str());
+    Json::Reader reader;
+    Check(reader.parse(file.Data() + 16, file.Data() + 16 + head_bytes, part->head),
+          "Checkpoint: bad header in %s.", path.c_str());
+    Check(part->head["version"].asInt() == 1, "Checkpoint: unknown version in %s.", path.c_str());
+    part->data_start = CkptRoundUp(16 + head_bytes, kCkptPage);
+    part->path = path;
+    return part;
+  }
+
+  inline void IndexPart(int k) {
+    const Part &part = *parts_[k];
+    const Json::Value &tensors = part.head["tensors"];
+    for (Json::ArrayIndex i = 0; i < tensors.size(); ++i) {
+      Check(tensors[i]["dtype"].asString() == "float32" || tensors[i]["dtype"].asString() == "int32",
+            "Checkpoint: only float32 and int32 tensors.");
+      Check(part.data_start + tensors[i]["offset"].asUInt64() + tensors[i]["bytes"].asUInt64() <= part.file.Size(),
+            "Checkpoint: %s is truncated.", part.path.c_str());
+      index_[tensors[i]["name"].asString()] = std::make_pair(k, i);
+    }
+  }
+
+  inline const void *Locate(const std::string &name, const char *dtype, int shape[4]) const {
+    std::map<std::string, std::pair<int, Json::ArrayIndex> >::const_iterator it = index_.find(name);
+    if (it == index_.end()) return NULL;
+    const Part &part = *parts_[it->second.first];
+    const Json::Value &t = part.head["tensors"][it->second.second];
+    Check(t["dtype"].asString() == dtype, "Checkpoint: %s is not %s.", name.c_str(), dtype);
+    for (int k = 0; k < 4; ++k) shape[k] = t["shape"][k].asInt();
+    if (!t["codec"].isNull()) {
+      std::map<std::string, std::vector<float> >::const_iterator un = unpacked_.find(name);
+      Check(un != unpacked_.end(), "Checkpoint: %s is compressed, Prepare it first.", name.c_str());
+      static const float empty = 0.f;
+      return un->second.empty() ? &empty : &un->second[0];
+    }
+    return part.file.Data() + part.data_start + t["offset"].asUInt64();
+  }
+
+  CheckpointReader(const CheckpointReader &);
+  CheckpointReader &operator=(const CheckpointReader &);
+
+  // parts_[0] is path, then its shards
+  std::vector<Part*> parts_;
+  // tensor name to part and index in its table
+  std::map<std::string, std::pair<int, Json::ArrayIndex> > index_;
+  // compressed tensors, unpacked by Prepare
+  std::map<std::string, std::vector<float> > unpacked_;
+};
+
+}  // namespace utils
+}  // namespace textnet
+#endif  // TEXTNET_UTILS_CHECKPOINT_H_
@@ -0,0 +1,123 @@
+#ifndef TEXTNET_UTILS_CHUNK_CODEC_H_
+#define TEXTNET_UTILS_CHUNK_CODEC_H_
+/*!
+ * \file chunk_codec.h
+ * \brief compression of 4 byte word chunks for checkpoints: the bytes are
+ *  shuffled (all first bytes, then all second bytes, ...) so the exponent
+ *  bytes of floats line up, then packed by lz4 or zlib
+ *  lz4 needs TEXTNET_USE_LZ4 (USE_LZ4=1 in the Makefile); without it a
+ *  request for lz4 packs with the fastest zlib level
+ *  a packed chunk as large as its input is stored raw and unshuffled
+ */
+#include <vector>
+#include <string>
+#include <cstring>
+#include <zlib.h>
+#include "./utils.h"
+
+#ifndef TEXTNET_USE_LZ4
+#define TEXTNET_USE_LZ4 0
+#endif
+#if TEXTNET_USE_LZ4
+#include <lz4.h>
+#endif
+
+namespace textnet {
+namespace utils {
+
+/*! \brief the raw bytes of a chunk, a multiple of 4 */
+const size_t kCodecChunk = 4 << 20;
+
+const int kCodecNone = 0;
+const int kCodecZlib = 1;
+const int kCodecLz4 = 2;
+
+inline int ParseCodec(const std::string &s) {
+  if (s == "none") return kCodecNone;
+  if (s == "zlib") return kCodecZlib;
+  if (s == "lz4") return kCodecLz4;
+  Error("ChunkCodec: unknown codec %s.", s.c_str());
+  return kCodecNone;
+}
+
+inline const char *CodecName(int codec) {
+  return codec == kCodecLz4 ? "lz4" : (codec == kCodecZlib ? "zlib" : "none");
+}
+
+/*! \brief the codec written for a requested one */
+inline int CodecUsed(int codec) {
+  return codec == kCodecLz4 && !TEXTNET_USE_LZ4 ? kCodecZlib : codec;
+}
+
+inline void ShuffleBytes(const char *src, size_t n, char *dst) {
+  const size_t words = n / 4;
+  for (size_t i = 0; i < words; ++i) {
+    for (int b = 0; b < 4; ++b) dst[b * words + i] = src[i * 4 + b];
+  }
+}
+
+inline void UnshuffleBytes(const char *src, size_t n, char *dst) {
+  const size_t words = n / 4;
+  for (size_t i = 0; i < words; ++i) {
+    for (int b = 0; b < 4; ++b) dst[i * 4 + b] = src[b * words + i];
+  }
+}
+
+/*!
+ * \brief pack n bytes of src, n <= kCodecChunk, into out
+ * \param codec the requested codec, lz4 falls back as CodecUsed
+ */
+inline void PackChunk(int codec, const char *src, size_t n, std::vector<char> *out) {
+  std::vector<char> shuffled(n);
+  ShuffleBytes(src, n, n == 0 ? NULL : &shuffled[0]);
+  size_t packed = n;
+#if TEXTNET_USE_LZ4
+  if (codec == kCodecLz4) {
+    out->resize(LZ4_compressBound(static_cast<int>(n)));
+    int k = LZ4_compress_default(&shuffled[0], &(*out)[0], static_cast<int>(n), out->size());
+    packed = k > 0 ? k : n;
+  }
+#endif
+  if (CodecUsed(codec) == kCodecZlib) {
+    uLongf k = compressBound(n);
+    out->resize(k);
+    int level = codec == kCodecLz4 ? Z_BEST_SPEED : Z_DEFAULT_COMPRESSION;
+    if (compress2(reinterpret_cast<Bytef*>(&(*out)[0]), &k,
+                  reinterpret_cast<const Bytef*>(&shuffled[0]), n, level) == Z_OK) {
+      packed = k;
+    }
+  }
+  if (packed >= n) {
+    out->assign(src, src + n);
+  } else {
+    out->resize(packed);
+  }
+}
+
+/*! \brief unpack a chunk of packed bytes into raw_bytes at dst */
+inline void UnpackChunk(int codec, const char *src, size_t packed, char *dst, size_t raw_bytes) {
+  if (packed == raw_bytes) {
+    memcpy(dst, src, raw_bytes);
+    return;
+  }
+  std::vector<char> shuffled(raw_bytes);
+  bool ok = false;
+  if (codec == kCodecLz4) {
+#if TEXTNET_USE_LZ4
+    ok = LZ4_decompress_safe(src, &shuffled[0], static_cast<int>(packed),
+                             static_cast<int>(raw_bytes)) == static_cast<int>(raw_bytes);
+#else
+    Error("ChunkCodec: lz4 data, build with USE_LZ4=1 to read it.");
+#endif
+  } else if (codec == kCodecZlib) {
+    uLongf k = raw_bytes;
+    ok = uncompress(reinterpret_cast<Bytef*>(&shuffled[0]), &k,
+                    reinterpret_cast<const Bytef*>(src), packed) == Z_OK && k == raw_bytes;
+  }
+  Check(ok, "ChunkCodec: corrupt %s chunk.", CodecName(codec));
+  UnshuffleBytes(&shuffled[0], raw_bytes, dst);
+}
+
+}  // namespace utils
+}  // namespace textnet
+#endif  // TEXTNET_UTILS_CHUNK_CODEC_H_
@@ -0,0 +1,366 @@
+#ifndef TEXTNET_UTILS_CORPUS_STORE_H_
+#define TEXTNET_UTILS_CORPUS_STORE_H_
+/*!
+ * \file corpus_store.h
+ * \brief the documents of a "key length token ..." text file, parsed once
+ *  per process and shared by every data layer and tag that reads it
+ *  the tokens of all documents are one int32 array: doc d holds
+ *  tokens[offsets[d], offsets[d + 1]), keys map to doc ids
+ *  a binary cache is kept at path + ".bin_cache" and memory mapped while
+ *  the size and mtime of the text file do not change; it is not read
+ *  into memory, so a corpus costs pages only for the docs batches touch
+ *  a corpus is freed when the last layer holding it lets it go
+ */
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "./utils.h"
+#include "./thread.h"
+#include "./mapped_file.h"
+#include "./text_loader.h"
+
+namespace textnet {
+namespace utils {
+
+/*! \brief all docs of one file, as read from the text or its cache */
+class CorpusFile {
+ public:
+  CorpusFile(void)
+    : ndoc(0), ntoken(0), offsets(NULL), key_offsets(NULL), tokens(NULL),
+      order(NULL), keys(NULL) {}
+
+  /*!
+   * \brief read path, reading stops at the first empty line
+   *  a later line with the key of an earlier one is skipped
+   * \param bin_cache load from and keep path + ".bin_cache"
+   */
+  inline void Load(const std::string &path, bool bin_cache) {
+    this->path = path;
+    if (bin_cache && MapCache()) {
+      Printf("CorpusStore: load %s from %s, %d docs.\n", path.c_str(),
+             CachePath().c_str(), ndoc);
+      return;
+    }
+    Parse();
+    Printf("CorpusStore: parse %s, %d docs, %lu tokens.\n", path.c_str(),
+           ndoc, static_cast<unsigned long>(ntoken));
+    // the parsed arrays give way to the mapped cache, which the kernel can page out
+    if (bin_cache && WriteCache() && MapCache()) {
+      std::vector<uint64_t>().swap(offsets_);
+      std::vector<uint64_t>().swap(key_offsets_);
+      std::vector<int32_t>().swap(tokens_);
+      std::vector<int32_t>().swap(order_);
+      std::string().swap(keys_);
+    }
+  }
+
+  /*! \brief the doc id of key, -1 if the file has no such line */
+  inline int Find(const std::string &key) const {
+    int lo = 0, hi = ndoc;
+    while (lo < hi) {
+      int mid = lo + (hi - lo) / 2;
+      if (CompareKey(order[mid], key) < 0) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    return lo < ndoc && CompareKey(order[lo], key) == 0 ? order[lo] : -1;
+  }
+
+  inline std::string CachePath(void) const { return path + ".bin_cache"; }
+
+  std::string path;
+  int ndoc;
+  uint64_t ntoken;
+  // ndoc + 1 token offsets and key offsets
+  const uint64_t *offsets;
+  const uint64_t *key_offsets;
+  const int32_t *tokens;
+  // doc ids by key, for Find
+  const int32_t *order;
+  const char *keys;
+
+ private:
+  struct CacheHeader {
+    char magic[8];
+    uint64_t src_size;
+    int64_t src_mtime;
+    uint64_t ndoc, ntoken, key_bytes;
+  };
+
+  inline int CompareKey(int doc, const std::string &key) const {
+    size_t len = key_offsets[doc + 1] - key_offsets[doc];
+    int c = memcmp(keys + key_offsets[doc], key.data(), std::min(len, key.size()));
+    if (c != 0) return c;
+    return len < key.size() ? -1 : (len > key.size() ? 1 : 0);
+  }
+
+  inline void Parse(void) {
+    MappedFile text;
+    Check(text.Open(path), "CorpusStore: open %s failed.", path.c_str());
+    const char *p = text.Data(), *end = p + text.Size();
+    std::unordered_map<std::string, int> seen;
+    offsets_.assign(1, 0);
+    key_offsets_.assign(1, 0);
+    tokens_.clear();
+    keys_.clear();
+    while (p < end && *p != '\n') {
+      while (p < end && IsBlank(*p)) ++p;
+      const char *key = p;
+      while (p < end && !IsSpace(*p)) ++p;
+      std::string k(key, p);
+      // the length field, the tokens follow it
+      int value = 0;
+      while (p < end && IsBlank(*p)) ++p;
+      ParseInt(p, end, &value);
+      bool fresh = seen.insert(std::make_pair(k, static_cast<int>(offsets_.size()) - 1)).second;
+      while (fresh) {
+        while (p < end && IsBlank(*p)) ++p;
+        if (!ParseInt(p, end, &value)) break;
+        tokens_.push_back(value);
+      }
+      if (fresh) {
+        offsets_.push_back(tokens_.size());
+        keys_ += k;
+        key_offsets_.push_back(keys_.size());
+      }
+      while (p < end && *p != '\n') ++p;
+      if (p < end) ++p;
+    }
+    text.Close();
+    ndoc = static_cast<int>(offsets_.size()) - 1;
+    ntoken = tokens_.size();
+    std::vector<std::pair<std::string, int> > sorted(seen.begin(), seen.end());
+    std::sort(sorted.begin(), sorted.end());
+    order_.clear();
+    for (size_t i = 0; i < sorted.size(); ++i) order_.push_back(sorted[i].second);
+    offsets = &offsets_[0];
+    key_offsets = &key_offsets_[0];
+    tokens = tokens_.empty() ? NULL : &tokens_[0];
+    order = order_.empty() ? NULL : &order_[0];
+    keys = keys_.data();
+  }
+
+  // point the arrays into the cache, false if there is none or it is stale
+  inline bool MapCache(void) {
+    size_t src_size;
+    int64_t src_mtime;
+    if (!FileStat(path, &src_size, &src_mtime)) return false;
+    if (!cache_.Open(CachePath()) || cache_.Size() < sizeof(CacheHeader)) return false;
+    CacheHeader h;
+    memcpy(&h, cache_.Data(), sizeof(h));
+    if (memcmp(h.magic, "TNCORPS1", 8) != 0 || h.src_size != src_size ||
+        h.src_mtime != src_mtime) {
+      cache_.Close();
+      return false;
+    }
+    size_t need = sizeof(h) + 2 * (h.ndoc + 1) * sizeof(uint64_t) +
+                  (h.ntoken + h.ndoc) * sizeof(int32_t) + h.key_bytes;
+    if (cache_.Size() != need) {
+      cache_.Close();
+      return false;
+    }
+    // batches read docs in any order
+    cache_.Advise(MADV_NORMAL);
+    const char *body = cache_.Data() + sizeof(h);
+    ndoc = static_cast<int>(h.ndoc);
+    ntoken = h.ntoken;
+    offsets = reinterpret_cast<const uint64_t*>(body);
+    key_offsets = offsets + ndoc + 1;
+    tokens = reinterpret_cast<const int32_t*>(key_offsets + ndoc + 1);
+    order = tokens + ntoken;
+    keys = reinterpret_cast<const char*>(order + ndoc);
+    return true;
+  }
+
+  // written to a temporary file and renamed, so readers never see half a cache
+  inline bool WriteCache(void) {
+    CacheHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, "TNCORPS1", 8);
+    size_t src_size;
+    int64_t src_mtime;
+    if (!FileStat(path, &src_size, &src_mtime)) return false;
+    h.src_size = src_size;
+    h.src_mtime = src_mtime;
+    h.ndoc = ndoc;
+    h.ntoken = ntoken;
+    h.key_bytes = keys_.size();
+    char suffix[32];
+    SPrintf(suffix, sizeof(suffix), ".tmp%d", static_cast<int>(getpid()));
+    std::string tmp = CachePath() + suffix;
+    FILE *fp = fopen(tmp.c_str(), "wb");
+    if (fp == NULL) {
+      Printf("[Warning] CorpusStore: can not write %s, no cache.\n", tmp.c_str());
+      return false;
+    }
+    bool ok = fwrite(&h, sizeof(h), 1, fp) == 1;
+    ok = ok && fwrite(&offsets_[0], sizeof(uint64_t), ndoc + 1, fp) == static_cast<size_t>(ndoc + 1);
+    ok = ok && fwrite(&key_offsets_[0], sizeof(uint64_t), ndoc + 1, fp) == static_cast<size_t>(ndoc + 1);
+    ok = ok && (tokens_.empty() || fwrite(&tokens_[0], sizeof(int32_t), ntoken, fp) == ntoken);
+    ok = ok && (order_.empty() || fwrite(&order_[0], sizeof(int32_t), ndoc, fp) == static_cast<size_t>(ndoc));
+    ok = ok && (keys_.empty() || fwrite(keys_.data(), 1, keys_.size(), fp) == keys_.size());
+    ok = fclose(fp) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), CachePath().c_str()) != 0) {
+      Printf("[Warning] CorpusStore: write %s failed, no cache.\n", CachePath().c_str());
+      remove(tmp.c_str());
+      return false;
+    }
+    return true;
+  }
+
+  // not copyable, the arrays may point into the mapping
+  CorpusFile(const CorpusFile &);
+  CorpusFile &operator=(const CorpusFile &);
+
+  MappedFile cache_;
+  // the parsed arrays, when there is no cache
+  std::vector<uint64_t> offsets_;
+  std::vector<uint64_t> key_offsets_;
+  std::vector<int32_t> tokens_;
+  std::vector<int32_t> order_;
+  std::string keys_;
+};
+
+/*! \brief the docs of a file cut to at most max_len tokens, 0 keeps all */
+class Corpus {
+ public:
+  Corpus(const std::shared_ptr<const CorpusFile> &file, int max_len)
+    : file_(file), max_len_(max_len) {}
+
+  /*! \brief the doc id of key, -1 if the file has no such line */
+  inline int Find(const std::string &key) const {
+    return file_->Find(key);
+  }
+  /*! \brief the token count of doc, 0 for the missing doc -1 */
+  inline int Size(int doc) const {
+    if (doc < 0) return 0;
+    int size = static_cast<int>(file_->offsets[doc + 1] - file_->offsets[doc]);
+    return max_len_ > 0 && size > max_len_ ? max_len_ : size;
+  }
+  inline const int *Doc(int doc) const {
+    return doc < 0 || file_->tokens == NULL ? NULL : file_->tokens + file_->offsets[doc];
+  }
+  inline int Count(void) const {
+    return file_->ndoc;
+  }
+  inline int MaxSize(void) const {
+    int max_size = 0;
+    for (int d = 0; d < Count(); ++d) max_size = Size(d) > max_size ? Size(d) : max_size;
+    return max_size;
+  }
+  inline const std::string &Path(void) const {
+    return file_->path;
+  }
+
+  /*!
+   * \brief the doc ids of the keys in column col of the rel lines, a key
+   *  not in the file gives the empty doc -1, a doc shorter than min_len fails
+   */
+  inline void Resolve(const std::vector<std::vector<std::string> > &rel, int col, int min_len,
+                      std::vector<int> *docs) const {
+    int missing = 0;
+    docs->resize(rel.size());
+    for (size_t i = 0; i < rel.size(); ++i) {
+      (*docs)[i] = Find(rel[i][col]);
+      if ((*docs)[i] < 0) {
+        ++missing;
+        continue;
+      }
+      Check(Size((*docs)[i]) >= min_len, "Corpus: doc %s of %s has %d tokens, less than %d.",
+            rel[i][col].c_str(), Path().c_str(), Size((*docs)[i]), min_len);
+    }
+    if (missing != 0) {
+      Printf("Corpus: %d keys not in %s, read as empty docs.\n", missing, Path().c_str());
+    }
+  }
+
+ private:
+  std::shared_ptr<const CorpusFile> file_;
+  int max_len_;
+};
+
+/*! \brief the process wide corpora, files by path and their cuts by max_len */
+class CorpusStore {
+ public:
+  static CorpusStore &Global(void) {
+    static CorpusStore store;
+    return store;
+  }
+
+  /*! \brief the corpus of path, read here unless a layer holds the file;
+   *  different files load at the same time, one file is read once */
+  inline std::shared_ptr<const Corpus> Acquire(const std::string &path, int max_len,
+                                               bool bin_cache = true) {
+    char suffix[32];
+    SPrintf(suffix, sizeof(suffix), "\t%d", max_len);
+    std::shared_ptr<Slot<Corpus> > slot = GetSlot(&corpora_, path + suffix);
+    slot->lock.Wait();
+    std::shared_ptr<const Corpus> corpus = slot->value.lock();
+    if (!corpus) {
+      corpus.reset(new Corpus(AcquireFile(path, bin_cache), max_len));
+      slot->value = corpus;
+    }
+    slot->lock.Post();
+    return corpus;
+  }
+
+  inline std::shared_ptr<const CorpusFile> AcquireFile(const std::string &path, bool bin_cache) {
+    std::shared_ptr<Slot<CorpusFile> > slot = GetSlot(&files_, path);
+    slot->lock.Wait();
+    std::shared_ptr<const CorpusFile> file = slot->value.lock();
+    if (file) {
+      Printf("CorpusStore: reuse %s, %d docs.\n", path.c_str(), file->ndoc);
+    } else {
+      std::shared_ptr<CorpusFile> fresh(new CorpusFile());
+      fresh->Load(path, bin_cache);
+      file = fresh;
+      slot->value = file;
+    }
+    slot->lock.Post();
+    return file;
+  }
+
+ private:
+  template<typename T>
+  struct Slot {
+    Slot(void) { lock.Init(1); }
+    ~Slot(void) { lock.Destroy(); }
+    Semaphore lock;
+    std::weak_ptr<const T> value;
+  };
+
+  template<typename T>
+  inline std::shared_ptr<Slot<T> > GetSlot(std::map<std::string, std::shared_ptr<Slot<T> > > *slots,
+                                           const std::string &key) {
+    lock_.Wait();
+    std::shared_ptr<Slot<T> > &slot = (*slots)[key];
+    if (!slot) slot.reset(new Slot<T>());
+    std::shared_ptr<Slot<T> > hold = slot;
+    lock_.Post();
+    return hold;
+  }
+
+  CorpusStore(void) { lock_.Init(1); }
+  ~CorpusStore(void) { lock_.Destroy(); }
+  CorpusStore(const CorpusStore &);
+  CorpusStore &operator=(const CorpusStore &);
+
+  // lock_ guards the slot maps, a slot's lock guards loading its value
+  Semaphore lock_;
+  std::map<std::string, std::shared_ptr<Slot<CorpusFile> > > files_;
+  std::map<std::string, std::shared_ptr<Slot<Corpus> > > corpora_;
+};
+
+}  // namespace utils
+}  // namespace textnet
+#endif  // TEXTNET_UTILS_CORPUS_STORE_H_
@@ -0,0 +1,103 @@
+#ifndef TEXTNET_UTILS_GRAD_CLIP_H_
+#define TEXTNET_UTILS_GRAD_CLIP_H_
+/*!
+ * \file grad_clip.h
+ * \brief global L2 norm and clipping of gradients spread over many buffers
+ *  buffers are cut into pieces which run in parallel, each piece sums its
+ *  squares in float lanes and hands a double to the total
+ */
+#include <vector>
+#include <cstddef>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace textnet {
+namespace utils {
+
+/*! \brief floats of one piece of the parallel passes */
+const size_t kClipPiece = 4096;
+
+/*! \brief a gradient buffer */
+struct GradSpan {
+  float *ptr;
+  size_t n;
+  GradSpan(float *ptr_, size_t n_) : ptr(ptr_), n(n_) {}
+};
+
+/*! \brief cut spans into pieces of at most kClipPiece floats */
+inline void SplitSpans(const std::vector<GradSpan> &spans, std::vector<GradSpan> *pieces) {
+  pieces->clear();
+  for (size_t i = 0; i < spans.size(); ++i) {
+    for (size_t beg = 0; beg < spans[i].n; beg += kClipPiece) {
+      size_t n = spans[i].n - beg < kClipPiece ? spans[i].n - beg : kClipPiece;
+      pieces->push_back(GradSpan(spans[i].ptr + beg, n));
+    }
+  }
+}
+
+inline double SumSquares(const float *x, size_t n) {
+  size_t f = 0;
+  float s = 0.f;
+#ifdef __SSE2__
+  __m128 acc = _mm_setzero_ps();
+  for (; f + 4 <= n; f += 4) {
+    __m128 v = _mm_loadu_ps(x + f);
+    acc = _mm_add_ps(acc, _mm_mul_ps(v, v));
+  }
+  float lanes[4];
+  _mm_storeu_ps(lanes, acc);
+  s = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+#endif
+  for (; f < n; ++f) s += x[f] * x[f];
+  return s;
+}
+
+/*! \brief x = x * scale, then clipped to [-bound, bound] if bound > 0 */
+inline void ScaleClip(float *x, size_t n, float scale, float bound) {
+  size_t f = 0;
+  if (bound > 0.f) {
+#ifdef __SSE2__
+    const __m128 vs = _mm_set1_ps(scale), vhi = _mm_set1_ps(bound), vlo = _mm_set1_ps(-bound);
+    for (; f + 4 <= n; f += 4) {
+      __m128 v = _mm_mul_ps(_mm_loadu_ps(x + f), vs);
+      _mm_storeu_ps(x + f, _mm_max_ps(vlo, _mm_min_ps(vhi, v)));
+    }
+#endif
+    for (; f < n; ++f) {
+      float v = x[f] * scale;
+      x[f] = v > bound ? bound : (v < -bound ? -bound : v);
+    }
+  } else {
+#ifdef __SSE2__
+    const __m128 vs = _mm_set1_ps(scale);
+    for (; f + 4 <= n; f += 4) {
+      _mm_storeu_ps(x + f, _mm_mul_ps(_mm_loadu_ps(x + f), vs));
+    }
+#endif
+    for (; f < n; ++f) x[f] *= scale;
+  }
+}
+
+/*! \brief squared L2 norm of all pieces */
+inline double GlobalSumSquares(const std::vector<GradSpan> &pieces) {
+  double total = 0.0;
+  const int n = pieces.size();
+  #pragma omp parallel for reduction(+:total) schedule(static)
+  for (int i = 0; i < n; ++i) {
+    total += SumSquares(pieces[i].ptr, pieces[i].n);
+  }
+  return total;
+}
+
+inline void ScaleClipAll(const std::vector<GradSpan> &pieces, float scale, float bound) {
+  const int n = pieces.size();
+  #pragma omp parallel for schedule(static)
+  for (int i = 0; i < n; ++i) {
+    ScaleClip(pieces[i].ptr, pieces[i].n, scale, bound);
+  }
+}
+
+}  // namespace utils
+}  // namespace textnet
+#endif  // TEXTNET_UTILS_GRAD_CLIP_H_
@@ -0,0 +1,86 @@
+#ifndef TEXTNET_UTILS_MAPPED_FILE_H_
+#define TEXTNET_UTILS_MAPPED_FILE_H_
+/*!
+ * \file mapped_file.h
+ * \brief read only memory map of a whole file
+ */
+#include <string>
+#include <cstddef>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "./utils.h"
+
+namespace textnet {
+namespace utils {
+
+class MappedFile {
+ public:
+  MappedFile(void) : data_(NULL), size_(0), mtime_(0) {}
+  ~MappedFile(void) { Close(); }
+
+  /*! \brief map path, false if it can not be opened */
+  inline bool Open(const std::string &path) {
+    Close();
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      close(fd);
+      return false;
+    }
+    size_ = static_cast<size_t>(st.st_size);
+    mtime_ = static_cast<int64_t>(st.st_mtime);
+    if (size_ != 0) {
+      void *p = mmap(NULL, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      close(fd);
+      Check(p != MAP_FAILED, "MappedFile: mmap %s failed.", path.c_str());
+      data_ = static_cast<const char*>(p);
+      // pages are read front to back by the parsers
+      madvise(const_cast<char*>(data_), size_, MADV_SEQUENTIAL);
+    } else {
+      close(fd);
+    }
+    return true;
+  }
+
+  inline void Close(void) {
+    if (data_ != NULL) munmap(const_cast<char*>(data_), size_);
+    data_ = NULL;
+    size_ = 0;
+    mtime_ = 0;
+  }
+
+  /*! \brief madvise the whole mapping, for readers not going front to back */
+  inline void Advise(int advice) {
+    if (data_ != NULL) madvise(const_cast<char*>(data_), size_, advice);
+  }
+
+  inline const char *Data(void) const { return data_; }
+  inline size_t Size(void) const { return size_; }
+  inline int64_t MTime(void) const { return mtime_; }
+
+ private:
+  // not copyable, the mapping is owned
+  MappedFile(const MappedFile &);
+  MappedFile &operator=(const MappedFile &);
+
+  const char *data_;
+  size_t size_;
+  int64_t mtime_;
+};
+
+/*! \brief size and modification time of path, false if it does not exist */
+inline bool FileStat(const std::string &path, size_t *size, int64_t *mtime) {
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0) return false;
+  *size = static_cast<size_t>(st.st_size);
+  *mtime = static_cast<int64_t>(st.st_mtime);
+  return true;
+}
+
+}  // namespace utils
+}  // namespace textnet
+#endif  // TEXTNET_UTILS_MAPPED_FILE_H_
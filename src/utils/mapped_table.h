@@ -0,0 +1,178 @@
+#ifndef TEXTNET_UTILS_MAPPED_TABLE_H_
+#define TEXTNET_UTILS_MAPPED_TABLE_H_
+/*!
+ * \file mapped_table.h
+ * \brief a float table of nrow x ncol kept in a binary file and used through
+ *  a memory map, so it may be larger than ram and read only tables are
+ *  shared page cache between processes
+ *  file: a kTableHead byte header, then the rows, contiguous
+ *  header: "TNEMBTB1", int64 nrow, int64 ncol, uint64 hash of the row map
+ */
+#include <string>
+#include <cstring>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "./utils.h"
+
+namespace textnet {
+namespace utils {
+
+/*! \brief how the table is mapped, "table_mode" of the embedding layer */
+const int kTableReadOnly = 0;   // "readonly": shared and frozen
+const int kTablePrivate = 1;    // "private": copy on write, the file is never changed
+const int kTableWriteBack = 2;  // "writeback": updates go to the file, flushed on save
+
+inline int ParseTableMode(const std::string &s) {
+  if (s == "readonly") return kTableReadOnly;
+  if (s == "private") return kTablePrivate;
+  if (s == "writeback") return kTableWriteBack;
+  utils::Error("MappedTable: unknown table mode %s.", s.c_str());
+  return kTablePrivate;
+}
+
+/*! \brief header bytes, one page so the rows are page aligned */
+const size_t kTableHead = 4096;
+
+/*!
+ * \brief fnv-1a hash of a row map (map[i] is the row of item i), 0 for no
+ *  map or the identity, which is also what tables without a hash hold
+ */
+inline uint64_t RowMapHash(const int *map, int64_t n) {
+  if (map == NULL) return 0;
+  int64_t i = 0;
+  while (i < n && map[i] == i) ++i;
+  if (i == n) return 0;
+  uint64_t h = 14695981039346656037ULL;
+  const unsigned char *p = reinterpret_cast<const unsigned char*>(map);
+  for (size_t k = 0; k < n * sizeof(int); ++k) {
+    h = (h ^ p[k]) * 1099511628211ULL;
+  }
+  return h == 0 ? 1 : h;
+}
+
+class MappedTable {
+ public:
+  MappedTable(void) : base_(NULL), bytes_(0), mode_(kTablePrivate) {}
+  ~MappedTable(void) { Close(); }
+
+  inline static bool Exists(const std::string &path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0;
+  }
+
+  /*!
+   * \brief a new zero filled table in a temporary file next to path, return
+   *  its name; fill it and move it into place with Publish, so jobs sharing
+   *  path never map or truncate a table that is being built
+   */
+  inline static std::string Create(const std::string &path, int64_t nrow, int64_t ncol,
+                                   uint64_t map_hash = 0) {
+    static int serial = 0;
+    char suffix[64];
+    int n;
+    #pragma omp critical (mapped_table_create)
+    n = serial++;
+    SPrintf(suffix, sizeof(suffix), ".tmp%d.%d", static_cast<int>(getpid()), n);
+    std::string tmp = path + suffix;
+    int fd = open(tmp.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    Check(fd >= 0, "MappedTable: create %s failed.", tmp.c_str());
+    char head[kTableHead];
+    memset(head, 0, sizeof(head));
+    memcpy(head, "TNEMBTB1", 8);
+    memcpy(head + 8, &nrow, sizeof(nrow));
+    memcpy(head + 16, &ncol, sizeof(ncol));
+    memcpy(head + 24, &map_hash, sizeof(map_hash));
+    bool ok = write(fd, head, sizeof(head)) == static_cast<ssize_t>(sizeof(head));
+    ok = ok && ftruncate(fd, kTableHead + nrow * ncol * sizeof(float)) == 0;
+    close(fd);
+    if (!ok) unlink(tmp.c_str());
+    Check(ok, "MappedTable: write %s failed.", tmp.c_str());
+    return tmp;
+  }
+
+  /*!
+   * \brief move a table built in tmp to path unless a table is there already,
+   *  e.g. built by another job at the same time; tmp is removed either way
+   *  \return false if the table at path was kept
+   */
+  inline static bool Publish(const std::string &tmp, const std::string &path) {
+    // link never replaces path, unlike rename
+    bool placed = link(tmp.c_str(), path.c_str()) == 0;
+    int err = errno;
+    unlink(tmp.c_str());
+    Check(placed || err == EEXIST, "MappedTable: can not move %s to %s.", tmp.c_str(), path.c_str());
+    return placed;
+  }
+
+  /*! \brief map the table, its shape must be nrow x ncol and its rows in the order of map_hash */
+  inline void Open(const std::string &path, int64_t nrow, int64_t ncol, int mode,
+                   uint64_t map_hash = 0) {
+    Close();
+    int fd = open(path.c_str(), mode == kTableReadOnly ? O_RDONLY : O_RDWR);
+    Check(fd >= 0, "MappedTable: open %s failed.", path.c_str());
+    char head[32];
+    Check(read(fd, head, sizeof(head)) == static_cast<ssize_t>(sizeof(head)) &&
+          memcmp(head, "TNEMBTB1", 8) == 0, "MappedTable: %s is not a table file.", path.c_str());
+    int64_t file_row, file_col;
+    memcpy(&file_row, head + 8, sizeof(file_row));
+    memcpy(&file_col, head + 16, sizeof(file_col));
+    Check(file_row == nrow && file_col == ncol, "MappedTable: %s is %ld x %ld, need %ld x %ld.",
+          path.c_str(), static_cast<long>(file_row), static_cast<long>(file_col),
+          static_cast<long>(nrow), static_cast<long>(ncol));
+    uint64_t file_hash;
+    memcpy(&file_hash, head + 24, sizeof(file_hash));
+    Check(file_hash == map_hash, "MappedTable: %s was built with another vocab map "
+          "(row map hash %016llx, need %016llx), rebuild it.", path.c_str(),
+          static_cast<unsigned long long>(file_hash), static_cast<unsigned long long>(map_hash));
+    struct stat st;
+    bytes_ = kTableHead + nrow * ncol * sizeof(float);
+    Check(fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= bytes_,
+          "MappedTable: %s is truncated.", path.c_str());
+    int prot = mode == kTableReadOnly ? PROT_READ : PROT_READ | PROT_WRITE;
+    int flags = mode == kTablePrivate ? MAP_PRIVATE : MAP_SHARED;
+    void *p = mmap(NULL, bytes_, prot, flags, fd, 0);
+    close(fd);
+    Check(p != MAP_FAILED, "MappedTable: mmap %s failed.", path.c_str());
+    base_ = static_cast<char*>(p);
+    mode_ = mode;
+    path_ = path;
+    // embedding rows are looked up at random
+    madvise(base_, bytes_, MADV_RANDOM);
+  }
+
+  /*! \brief write dirty rows of a writeback table to the file */
+  inline void Flush(void) {
+    if (base_ == NULL || mode_ != kTableWriteBack) return;
+    Check(msync(base_, bytes_, MS_SYNC) == 0, "MappedTable: msync %s failed.", path_.c_str());
+  }
+
+  inline void Close(void) {
+    if (base_ == NULL) return;
+    Flush();
+    munmap(base_, bytes_);
+    base_ = NULL;
+    bytes_ = 0;
+  }
+
+  inline bool Mapped(void) const { return base_ != NULL; }
+  inline bool ReadOnly(void) const { return mode_ == kTableReadOnly; }
+  /*! \brief the rows, writable unless the table is read only */
+  inline float *Rows(void) const { return reinterpret_cast<float*>(base_ + kTableHead); }
+
+ private:
+  MappedTable(const MappedTable &);
+  MappedTable &operator=(const MappedTable &);
+
+  char *base_;
+  size_t bytes_;
+  int mode_;
+  std::string path_;
+};
+
+}  // namespace utils
+}  // namespace textnet
+#endif  // TEXTNET_UTILS_MAPPED_TABLE_H_
@@ -0,0 +1,146 @@
+#ifndef TEXTNET_UTILS_PHILOX_H_
+#define TEXTNET_UTILS_PHILOX_H_
+/*!
+ * \file philox.h
+ * \brief counter based random numbers (Philox4x32-10, Salmon et al. 2011)
+ *  value i of step s of a stream is a pure function of (seed, stream, s, i),
+ *  so big fills run in parallel and give the same numbers on any thread count
+ */
+#include <string>
+#include <cmath>
+#include <cstddef>
+#include <stdint.h>
+
+namespace textnet {
+namespace utils {
+
+/*! \brief ten rounds of Philox4x32 on ctr with key */
+inline void Philox4x32(const uint32_t ctr[4], const uint32_t key[2], uint32_t out[4]) {
+  const uint32_t kM0 = 0xD2511F53u, kM1 = 0xCD9E8D57u;
+  const uint32_t kW0 = 0x9E3779B9u, kW1 = 0xBB67AE85u;
+  uint32_t c0 = ctr[0], c1 = ctr[1], c2 = ctr[2], c3 = ctr[3];
+  uint32_t k0 = key[0], k1 = key[1];
+  for (int r = 0; r < 10; ++r) {
+    uint64_t p0 = static_cast<uint64_t>(kM0) * c0;
+    uint64_t p1 = static_cast<uint64_t>(kM1) * c2;
+    uint32_t n0 = static_cast<uint32_t>(p1 >> 32) ^ c1 ^ k0;
+    uint32_t n2 = static_cast<uint32_t>(p0 >> 32) ^ c3 ^ k1;
+    c1 = static_cast<uint32_t>(p1);
+    c3 = static_cast<uint32_t>(p0);
+    c0 = n0;
+    c2 = n2;
+    k0 += kW0;
+    k1 += kW1;
+  }
+  out[0] = c0; out[1] = c1; out[2] = c2; out[3] = c3;
+}
+
+/*! \brief uniform in [0, 1) with 24 random bits */
+inline float U32ToFloat(uint32_t u) {
+  return (u >> 8) * (1.0f / 16777216.0f);
+}
+
+/*! \brief stable 32 bit id of a name, e.g. a layer name, FNV-1a */
+inline uint32_t StreamId(const std::string &name) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < name.size(); ++i) {
+    h ^= static_cast<unsigned char>(name[i]);
+    h *= 16777619u;
+  }
+  return h;
+}
+
+/*!
+ * \brief one stream of counter based random numbers
+ *  a fill of step s uses counters (i / 4, s), blocks of kRandBlock values
+ *  are generated in parallel
+ */
+class CounterRandom {
+ public:
+  static const size_t kRandBlock = 1024;
+
+  CounterRandom(void) { key_[0] = key_[1] = 0; }
+  CounterRandom(uint32_t seed, uint32_t stream) { Seed(seed, stream); }
+  inline void Seed(uint32_t seed, uint32_t stream) {
+    key_[0] = seed;
+    key_[1] = stream;
+  }
+
+  /*! \brief the four values with index [4 * q, 4 * q + 4) of step */
+  inline void Block(uint64_t step, uint64_t q, uint32_t out[4]) const {
+    uint32_t ctr[4] = {static_cast<uint32_t>(q), static_cast<uint32_t>(q >> 32),
+                       static_cast<uint32_t>(step), static_cast<uint32_t>(step >> 32)};
+    Philox4x32(ctr, key_, out);
+  }
+
+  inline void FillUInt32(uint32_t *x, size_t n, uint64_t step) const {
+    const long nblock = static_cast<long>((n + kRandBlock - 1) / kRandBlock);
+    #pragma omp parallel for schedule(static)
+    for (long b = 0; b < nblock; ++b) {
+      size_t beg = b * kRandBlock, end = beg + kRandBlock < n ? beg + kRandBlock : n;
+      uint32_t r[4];
+      for (size_t i = beg; i < end; i += 4) {
+        Block(step, i / 4, r);
+        for (size_t k = 0; k < 4 && i + k < end; ++k) x[i + k] = r[k];
+      }
+    }
+  }
+
+  /*! \brief uniform in [lo, hi) */
+  inline void FillUniform(float *x, size_t n, float lo, float hi, uint64_t step) const {
+    const float w = hi - lo;
+    const long nblock = static_cast<long>((n + kRandBlock - 1) / kRandBlock);
+    #pragma omp parallel for schedule(static)
+    for (long b = 0; b < nblock; ++b) {
+      size_t beg = b * kRandBlock, end = beg + kRandBlock < n ? beg + kRandBlock : n;
+      uint32_t r[4];
+      for (size_t i = beg; i < end; i += 4) {
+        Block(step, i / 4, r);
+        for (size_t k = 0; k < 4 && i + k < end; ++k) x[i + k] = lo + w * U32ToFloat(r[k]);
+      }
+    }
+  }
+
+  /*! \brief normal by Box-Muller, each block of four values gives four normals */
+  inline void FillGaussian(float *x, size_t n, float mu, float sigma, uint64_t step) const {
+    const long nblock = static_cast<long>((n + kRandBlock - 1) / kRandBlock);
+    #pragma omp parallel for schedule(static)
+    for (long b = 0; b < nblock; ++b) {
+      size_t beg = b * kRandBlock, end = beg + kRandBlock < n ? beg + kRandBlock : n;
+      uint32_t r[4];
+      float g[4];
+      for (size_t i = beg; i < end; i += 4) {
+        Block(step, i / 4, r);
+        for (int k = 0; k < 4; k += 2) {
+          // 1 - u is in (0, 1], safe for the log
+          float rad = sqrtf(-2.f * logf(1.f - U32ToFloat(r[k])));
+          float ang = 6.28318530718f * U32ToFloat(r[k + 1]);
+          g[k] = rad * cosf(ang);
+          g[k + 1] = rad * sinf(ang);
+        }
+        for (size_t k = 0; k < 4 && i + k < end; ++k) x[i + k] = mu + sigma * g[k];
+      }
+    }
+  }
+
+  /*! \brief 1 with probability p, else 0 */
+  inline void FillBernoulli(float *x, size_t n, float p, uint64_t step) const {
+    const long nblock = static_cast<long>((n + kRandBlock - 1) / kRandBlock);
+    #pragma omp parallel for schedule(static)
+    for (long b = 0; b < nblock; ++b) {
+      size_t beg = b * kRandBlock, end = beg + kRandBlock < n ? beg + kRandBlock : n;
+      uint32_t r[4];
+      for (size_t i = beg; i < end; i += 4) {
+        Block(step, i / 4, r);
+        for (size_t k = 0; k < 4 && i + k < end; ++k) x[i + k] = U32ToFloat(r[k]) < p ? 1.f : 0.f;
+      }
+    }
+  }
+
+ private:
+  uint32_t key_[2];
+};
+
+}  // namespace utils
+}  // namespace textnet
+#endif  // TEXTNET_UTILS_PHILOX_H_
@@ -0,0 +1,153 @@
+#ifndef TEXTNET_UTILS_POOLING_ENGINE_H_
+#define TEXTNET_UTILS_POOLING_ENGINE_H_
+/*!
+ * \file pooling_engine.h
+ * \brief shared kernels for max pooling over sub matrices:
+ *        cached dynamic split plans and vectorized max with argmax
+ */
+#include <map>
+#include <vector>
+#include <utility>
+#include <cfloat>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "./utils.h"
+
+namespace textnet {
+namespace utils {
+
+/*!
+ * \brief split plans of dynamic pooling, one per (input_len, pool_size)
+ *  a plan has pool_size+1 boundaries, chunk i is [pos[i], pos[i+1])
+ *  NOTE: if the input is shorter than the pool size the plan spans
+ *  pool_size positions, callers wrap indexes with % input_len
+ *  Get is not thread safe, fetch the plans before entering parallel loops
+ */
+class SplitPlanCache {
+ public:
+  inline const std::vector<int> &Get(int input_len, int pool_size) {
+    std::pair<int, int> key(input_len, pool_size);
+    std::map<std::pair<int, int>, std::vector<int> >::iterator it = plans_.find(key);
+    if (it != plans_.end()) return it->second;
+    std::vector<int> &pos = plans_[key];
+    Split(input_len, pool_size, &pos);
+    return pos;
+  }
+  inline size_t Size(void) const { return plans_.size(); }
+
+  static void Split(int input_len, int pool_size, std::vector<int> *p_pos) {
+    std::vector<int> &pos = *p_pos;
+    pos.clear();
+    int pad_input_len = input_len < pool_size ? pool_size : input_len;
+    int margin = pad_input_len / pool_size;
+    int mod    = pad_input_len % pool_size;
+    pos.push_back(0);
+    for (int i = 0; i < pool_size; ++i) {
+      if (i < (pool_size-mod)) {
+        pos.push_back(pos.back()+margin);
+      } else {
+        pos.push_back(pos.back()+margin+1);
+      }
+    }
+
+    Check(pos.back() == pad_input_len, "SplitPlanCache: split error.");
+    for (size_t i = 1; i < pos.size(); ++i) {
+      Check(pos[i-1] < pos[i], "SplitPlanCache: split error.");
+      Check((pos[i] - pos[i-1]) <= ((pad_input_len-1)/pool_size) + 1, "SplitPlanCache: split error.");
+    }
+  }
+
+ private:
+  std::map<std::pair<int, int>, std::vector<int> > plans_;
+};
+
+/*!
+ * \brief max of p[0..n) and the first position holding it, n > 0
+ */
+inline float RowMaxArg(const float *p, int n, int *arg) {
+  int j = 0;
+  float max_val = p[0];
+#ifdef __SSE2__
+  if (n >= 8) {
+    __m128 vmax = _mm_loadu_ps(p);
+    for (j = 4; j + 4 <= n; j += 4) {
+      vmax = _mm_max_ps(vmax, _mm_loadu_ps(p + j));
+    }
+    float buf[4];
+    _mm_storeu_ps(buf, vmax);
+    max_val = buf[0];
+    for (int k = 1; k < 4; ++k) {
+      if (buf[k] > max_val) max_val = buf[k];
+    }
+    for (; j < n; ++j) {
+      if (p[j] > max_val) max_val = p[j];
+    }
+    // locate the first lane equal to the max
+    __m128 vm = _mm_set1_ps(max_val);
+    for (j = 0; j + 4 <= n; j += 4) {
+      int mask = _mm_movemask_ps(_mm_cmpeq_ps(_mm_loadu_ps(p + j), vm));
+      if (mask) {
+        *arg = j + __builtin_ctz(mask);
+        return max_val;
+      }
+    }
+    for (; j < n; ++j) {
+      if (p[j] == max_val) break;
+    }
+    *arg = j;
+    return max_val;
+  }
+#endif
+  *arg = 0;
+  for (j = 1; j < n; ++j) {
+    if (p[j] > max_val) {
+      max_val = p[j];
+      *arg = j;
+    }
+  }
+  return max_val;
+}
+
+/*!
+ * \brief max over rows [begin_row, end_row) and cols [begin_col, end_col)
+ *  of a row-major matrix with leading dimension ld, the chunk may run past
+ *  (input_row, input_col), such indexes wrap around the valid region
+ *  max_row/max_col get the first position of the max in row-major order,
+ *  already wrapped into the valid region
+ */
+inline float ChunkMaxArg(const float *t, int ld,
+                         int input_row, int input_col,
+                         int begin_row, int end_row,
+                         int begin_col, int end_col,
+                         int *max_row, int *max_col) {
+  float max_val = -FLT_MAX;
+  *max_row = *max_col = -1;
+  const bool wrap_col = end_col > input_col;
+  for (int r = begin_row; r < end_row; ++r) {
+    const float *p = t + (r % input_row) * ld;
+    if (!wrap_col) {
+      int arg = 0;
+      float v = RowMaxArg(p + begin_col, end_col - begin_col, &arg);
+      if (*max_row < 0 || v > max_val) {
+        max_val = v;
+        *max_row = r % input_row;
+        *max_col = begin_col + arg;
+      }
+    } else {
+      for (int c = begin_col; c < end_col; ++c) {
+        float v = p[c % input_col];
+        if (*max_row < 0 || v > max_val) {
+          max_val = v;
+          *max_row = r % input_row;
+          *max_col = c % input_col;
+        }
+      }
+    }
+  }
+  return max_val;
+}
+
+}  // namespace utils
+}  // namespace textnet
+#endif  // TEXTNET_UTILS_POOLING_ENGINE_H_
@@ -9,13 +9,14 @@
 #include <vector>
 #include <cmath>
 #include "./utils.h"
+#include "./philox.h"
 
 namespace textnet {
 namespace utils {
 /*! \brief simple thread dependent random sampler */
 class RandomSampler {
  public:
-  RandomSampler(void) : rseed_(0) {
+  RandomSampler(void) : rseed_(0), counter_(false), step_(0), block_(0), draw_(0) {
   }
   /*!
    * \brief seed random number 
@@ -23,9 +24,41 @@ class RandomSampler {
    */
   inline void Seed(unsigned seed) {
     this->rseed_ = seed;
+    this->counter_ = false;
+  }
+  /*!
+   * \brief draw from the counter based stream (seed, stream) instead of rand_r
+   *  the k-th draw after Fork(step, block) depends only on
+   *  (seed, stream, step, block, k)
+   */
+  inline void SeedCounter(unsigned seed, uint32_t stream) {
+    this->crnd_.Seed(seed, stream);
+    this->counter_ = true;
+    this->step_ = 0;
+    this->block_ = 0;
+    this->draw_ = 0;
+  }
+  /*!
+   * \brief a copy drawing from sub stream block of step, forks of distinct
+   *  blocks may draw on different threads; needs SeedCounter
+   */
+  inline RandomSampler Fork(uint64_t step, uint32_t block) const {
+    utils::Assert(counter_, "RandomSampler: Fork needs SeedCounter.");
+    RandomSampler fork = *this;
+    fork.step_ = step;
+    fork.block_ = block;
+    fork.draw_ = 0;
+    return fork;
   }
   /*! \brief return a real number uniform in [0,1) */
   inline double NextDouble() {
+    if (counter_) {
+      if (draw_ % 4 == 0) {
+        // counter (draw / 4, block) of step, four draws per block
+        crnd_.Block(step_, (static_cast<uint64_t>(block_) << 32) | (draw_ / 4), buf_);
+      }
+      return buf_[draw_++ % 4] * (1.0 / 4294967296.0);
+    }
     return static_cast<double>(rand_r(&rseed_)) /
         (static_cast<double>(RAND_MAX) + 1.0);
   }
@@ -49,6 +82,12 @@ class RandomSampler {
 
  private:
   unsigned rseed_;
+  // counter based mode
+  bool counter_;
+  CounterRandom crnd_;
+  uint64_t step_;
+  uint32_t block_, draw_;
+  uint32_t buf_[4];
 };
 }  // namespace utils
 }  // namespace textnet
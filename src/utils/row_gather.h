@@ -0,0 +1,57 @@
+#ifndef TEXTNET_UTILS_ROW_GATHER_H_
+#define TEXTNET_UTILS_ROW_GATHER_H_
+/*!
+ * \file row_gather.h
+ * \brief gather rows of a big row-major table (e.g. an embedding matrix)
+ *        with software prefetch of the rows a few tokens ahead
+ */
+#include <cstddef>
+
+namespace textnet {
+namespace utils {
+
+/*! \brief how many tokens ahead the table rows are prefetched */
+const int kGatherPrefetchDist = 4;
+
+inline void PrefetchRow_(const float *row, int dim) {
+#ifdef __GNUC__
+  // one prefetch per 64 byte cache line
+  for (int f = 0; f < dim; f += 16) {
+    __builtin_prefetch(row + f, 0, 1);
+  }
+#endif
+}
+
+/*!
+ * \brief out row k = table row ids[k] for k < n; rows whose id is -1 and
+ *  the tail rows [n, n_out) are filled with pad
+ *  \param ld_table leading dimension of the table
+ *  \param ld_out leading dimension of out
+ */
+inline void GatherRows(const float *table, size_t ld_table,
+                       const int *ids, int n, int n_out, int dim,
+                       float pad, float *out, size_t ld_out) {
+  for (int k = 0; k < n && k < kGatherPrefetchDist; ++k) {
+    if (ids[k] != -1) PrefetchRow_(table + ids[k] * ld_table, dim);
+  }
+  for (int k = 0; k < n; ++k) {
+    if (k + kGatherPrefetchDist < n && ids[k + kGatherPrefetchDist] != -1) {
+      PrefetchRow_(table + ids[k + kGatherPrefetchDist] * ld_table, dim);
+    }
+    float *dst = out + k * ld_out;
+    if (ids[k] == -1) {
+      for (int f = 0; f < dim; ++f) dst[f] = pad;
+    } else {
+      const float *src = table + ids[k] * ld_table;
+      for (int f = 0; f < dim; ++f) dst[f] = src[f];
+    }
+  }
+  for (int k = n; k < n_out; ++k) {
+    float *dst = out + k * ld_out;
+    for (int f = 0; f < dim; ++f) dst[f] = pad;
+  }
+}
+
+}  // namespace utils
+}  // namespace textnet
+#endif  // TEXTNET_UTILS_ROW_GATHER_H_
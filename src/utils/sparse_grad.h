@@ -0,0 +1,137 @@
+#ifndef TEXTNET_UTILS_SPARSE_GRAD_H_
+#define TEXTNET_UTILS_SPARSE_GRAD_H_
+/*!
+ * \file sparse_grad.h
+ * \brief accumulation of row sparse gradients, e.g. of embedding tables:
+ *        rows are deduplicated by an open addressing hash and summed in
+ *        one flat buffer, and a bitmap marks rows which are never updated
+ */
+#include <vector>
+#include <cstring>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "./utils.h"
+
+namespace textnet {
+namespace utils {
+
+/*! \brief dst[0..n) += a * src[0..n) */
+inline void AxpyRow(float *dst, float a, const float *src, int n) {
+  int f = 0;
+#ifdef __SSE2__
+  __m128 va = _mm_set1_ps(a);
+  for (; f + 4 <= n; f += 4) {
+    _mm_storeu_ps(dst + f, _mm_add_ps(_mm_loadu_ps(dst + f),
+                                      _mm_mul_ps(va, _mm_loadu_ps(src + f))));
+  }
+#endif
+  for (; f < n; ++f) dst[f] += a * src[f];
+}
+
+/*! \brief dst[0..n) += src[0..n) */
+inline void AddRow(float *dst, const float *src, int n) {
+  int f = 0;
+#ifdef __SSE2__
+  for (; f + 4 <= n; f += 4) {
+    _mm_storeu_ps(dst + f, _mm_add_ps(_mm_loadu_ps(dst + f), _mm_loadu_ps(src + f)));
+  }
+#endif
+  for (; f < n; ++f) dst[f] += src[f];
+}
+
+/*! \brief one bit per row */
+class RowBitmap {
+ public:
+  RowBitmap(void) : size_(0), count_(0) {}
+  inline void Resize(int n) {
+    bits_.assign((n + 63) / 64, 0);
+    size_ = n; count_ = 0;
+  }
+  inline void Set(int i) {
+    Check(i >= 0 && i < size_, "RowBitmap: index %d out of range %d.", i, size_);
+    unsigned long long m = 1ULL << (i & 63);
+    if (!(bits_[i >> 6] & m)) {
+      bits_[i >> 6] |= m;
+      ++count_;
+    }
+  }
+  inline bool Test(int i) const {
+    return i >= 0 && i < size_ && ((bits_[i >> 6] >> (i & 63)) & 1ULL);
+  }
+  inline int Count(void) const { return count_; }
+
+ private:
+  std::vector<unsigned long long> bits_;
+  int size_, count_;
+};
+
+/*!
+ * \brief sums gradient rows by row id
+ *  rows are kept in the order of their first occurrence
+ *  NOTE: a pointer returned by Row is invalidated by the next new row
+ */
+class SparseRowAccumulator {
+ public:
+  SparseRowAccumulator(void) : dim_(0), mask_(0) {}
+  /*! \brief drop all rows, capacity is kept */
+  inline void Clear(int dim) {
+    for (size_t i = 0; i < slots_.size(); ++i) {
+      table_[slots_[i]] = -1;
+    }
+    slots_.clear();
+    ids_.clear();
+    rows_.clear();
+    dim_ = dim;
+  }
+  /*! \brief the row of id, a new row starts at zero */
+  inline float *Row(int id) {
+    if (table_.empty() || (ids_.size() + 1) * 2 > table_.size()) {
+      Grow();
+    }
+    size_t h = Hash(id);
+    while (table_[h] != -1) {
+      if (ids_[table_[h]] == id) return &rows_[0] + static_cast<size_t>(table_[h]) * dim_;
+      h = (h + 1) & mask_;
+    }
+    table_[h] = static_cast<int>(ids_.size());
+    slots_.push_back(h);
+    ids_.push_back(id);
+    rows_.resize(rows_.size() + dim_, 0.f);
+    return &rows_[0] + (ids_.size() - 1) * dim_;
+  }
+  inline void Add(int id, const float *g) { AddRow(Row(id), g, dim_); }
+  inline void Axpy(int id, float a, const float *g) { AxpyRow(Row(id), a, g, dim_); }
+
+  inline int Size(void) const { return static_cast<int>(ids_.size()); }
+  inline int Dim(void) const { return dim_; }
+  inline const std::vector<int> &Ids(void) const { return ids_; }
+  inline const float *Rows(void) const { return rows_.empty() ? NULL : &rows_[0]; }
+
+ private:
+  inline size_t Hash(int id) const {
+    return (static_cast<unsigned>(id) * 2654435761u) & mask_;
+  }
+  inline void Grow(void) {
+    size_t cap = table_.empty() ? 1024 : table_.size() * 2;
+    table_.assign(cap, -1);
+    mask_ = cap - 1;
+    for (size_t i = 0; i < ids_.size(); ++i) {
+      size_t h = Hash(ids_[i]);
+      while (table_[h] != -1) h = (h + 1) & mask_;
+      table_[h] = static_cast<int>(i);
+      slots_[i] = h;
+    }
+  }
+
+  int dim_;
+  size_t mask_;
+  std::vector<int> ids_;
+  std::vector<float> rows_;
+  std::vector<int> table_;   // open addressing, position in ids_ or -1
+  std::vector<size_t> slots_; // used table entries, to clear them cheaply
+};
+
+}  // namespace utils
+}  // namespace textnet
+#endif  // TEXTNET_UTILS_SPARSE_GRAD_H_
@@ -0,0 +1,470 @@
+#ifndef TEXTNET_UTILS_TEXT_LOADER_H_
+#define TEXTNET_UTILS_TEXT_LOADER_H_
+/*!
+ * \file text_loader.h
+ * \brief parallel loading of float text files (embeddings, filler and ssv
+ *  params) straight into param memory
+ *  the file is memory mapped and cut into line aligned chunks, which are
+ *  parsed in parallel; a binary cache is kept at path + ".bin_cache" and
+ *  used while the size and mtime of the text file do not change
+ */
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <stdint.h>
+#include <unistd.h>
+#include "./utils.h"
+#include "./mapped_file.h"
+
+namespace textnet {
+namespace utils {
+
+/*! \brief bytes of text per parse chunk */
+const size_t kTextChunk = 1 << 22;
+
+inline bool IsBlank(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+inline bool IsSpace(char c) { return IsBlank(c) || c == '\n'; }
+
+/*!
+ * \brief parse the number at p, a token ends at white space or end
+ *  plain decimals are parsed in place, anything else (inf, nan, more than
+ *  19 digits of mantissa) goes to strtof; p is moved past the token
+ * \return false if the token is not a number
+ */
+inline bool ParseFloat(const char *&p, const char *end, float *out) {
+  static const double kPow10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+                                  1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19,
+                                  1e20, 1e21, 1e22};
+  const char *s = p;
+  bool neg = false;
+  if (s < end && (*s == '-' || *s == '+')) neg = *s++ == '-';
+  uint64_t mant = 0;
+  int digits = 0, exp10 = 0;
+  bool any = false, exact = true;
+  for (; s < end && *s >= '0' && *s <= '9'; ++s) {
+    any = true;
+    if (digits < 19) {
+      mant = mant * 10 + (*s - '0');
+      if (mant != 0) ++digits;
+    } else {
+      ++exp10;
+      exact = false;
+    }
+  }
+  if (s < end && *s == '.') {
+    for (++s; s < end && *s >= '0' && *s <= '9'; ++s) {
+      any = true;
+      if (digits < 19) {
+        mant = mant * 10 + (*s - '0');
+        if (mant != 0) ++digits;
+        --exp10;
+      } else {
+        exact = false;
+      }
+    }
+  }
+  if (any && s < end && (*s == 'e' || *s == 'E')) {
+    const char *e = s + 1;
+    bool eneg = false;
+    if (e < end && (*e == '-' || *e == '+')) eneg = *e++ == '-';
+    int ev = 0;
+    bool edigit = false;
+    for (; e < end && *e >= '0' && *e <= '9'; ++e) {
+      edigit = true;
+      if (ev < 100000) ev = ev * 10 + (*e - '0');
+    }
+    if (edigit) {
+      exp10 += eneg ? -ev : ev;
+      s = e;
+    }
+  }
+  if (any && exact && (s == end || IsSpace(*s))) {
+    double v = static_cast<double>(mant);
+    if (exp10 < 0) {
+      v = exp10 >= -22 ? v / kPow10[-exp10] : v * std::pow(10.0, exp10);
+    } else if (exp10 > 0) {
+      v = exp10 <= 22 ? v * kPow10[exp10] : v * std::pow(10.0, exp10);
+    }
+    *out = static_cast<float>(neg ? -v : v);
+    p = s;
+    return true;
+  }
+  // slow path on a copy of the token, the map is not zero terminated
+  const char *t = p;
+  while (t < end && !IsSpace(*t)) ++t;
+  char buf[128];
+  size_t len = t - p;
+  if (len == 0 || len >= sizeof(buf)) return false;
+  memcpy(buf, p, len);
+  buf[len] = '\0';
+  char *stop = NULL;
+  *out = strtof(buf, &stop);
+  if (stop != buf + len) return false;
+  p = t;
+  return true;
+}
+
+inline bool ParseInt(const char *&p, const char *end, int *out) {
+  const char *s = p;
+  bool neg = false;
+  if (s < end && (*s == '-' || *s == '+')) neg = *s++ == '-';
+  if (s == end || *s < '0' || *s > '9') return false;
+  long v = 0;
+  for (; s < end && *s >= '0' && *s <= '9'; ++s) v = v * 10 + (*s - '0');
+  if (s != end && !IsSpace(*s)) return false;
+  *out = static_cast<int>(neg ? -v : v);
+  p = s;
+  return true;
+}
+
+/*!
+ * \brief line aligned chunks of [0, size), chunk i is [cut[i], cut[i + 1])
+ *  every cut but the first is just past a '\n'
+ */
+inline void CutChunks(const char *data, size_t size, std::vector<size_t> *cut) {
+  size_t n = size / kTextChunk + 1;
+  cut->assign(1, 0);
+  for (size_t i = 1; i < n; ++i) {
+    size_t c = size / n * i;
+    if (c < cut->back()) c = cut->back();
+    const char *nl = static_cast<const char*>(memchr(data + c, '\n', size - c));
+    c = nl == NULL ? size : nl - data + 1;
+    if (c > cut->back() && c < size) cut->push_back(c);
+  }
+  cut->push_back(size);
+}
+
+/*!
+ * \brief text files of floats, three layouts:
+ *  stream: white space separated values, as many as the param has
+ *  indexed rows: "row v_0 .. v_{ncol-1}" per line, up to the first empty line,
+ *    written at row_map[row] if a row map is given; of a row given twice the
+ *    last line wins
+ *  ssv matrix: a "nrow ncol" line, then exactly nrow rows, one per line
+ *  rows are written at dst + row * stride
+ */
+class TextLoader {
+ public:
+  static const int kStream = 0;
+  static const int kIndexedRows = 1;
+  static const int kSsvMatrix = 2;
+
+  TextLoader(const std::string &path, bool bin_cache)
+    : path_(path), bin_cache_(bin_cache), row_map_(NULL) {}
+
+  /*! \return number of values in the file, dst gets the first n */
+  inline size_t LoadStream(float *dst, size_t n) {
+    if (ReadCache(kStream, 1, n, dst, 1, NULL)) return n;
+    MapText();
+    const char *data = file_.Data();
+    const long nchunk = cut_.size() - 1;
+    // count, then parse each chunk at its offset
+    std::vector<size_t> count(nchunk + 1, 0);
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (long c = 0; c < nchunk; ++c) {
+      const char *p = data + cut_[c], *end = data + cut_[c + 1];
+      size_t k = 0;
+      while (true) {
+        while (p < end && IsSpace(*p)) ++p;
+        if (p == end) break;
+        ++k;
+        while (p < end && !IsSpace(*p)) ++p;
+      }
+      count[c + 1] = k;
+    }
+    for (long c = 0; c < nchunk; ++c) count[c + 1] += count[c];
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (long c = 0; c < nchunk; ++c) {
+      const char *p = data + cut_[c], *end = data + cut_[c + 1];
+      for (size_t k = count[c]; k < count[c + 1] && k < n; ++k) {
+        while (p < end && IsSpace(*p)) ++p;
+        Check(ParseFloat(p, end, dst + k), "TextLoader: %s, bad number at value %lu.",
+              path_.c_str(), static_cast<unsigned long>(k));
+      }
+    }
+    file_.Close();
+    if (count[nchunk] == n) WriteCache(kStream, 1, n, dst, 1, std::vector<int>());
+    return count[nchunk];
+  }
+
+  /*! \return number of distinct rows read */
+  inline size_t LoadIndexedRows(float *dst, int nrow, int ncol, size_t stride,
+                                const int *row_map = NULL) {
+    row_map_ = row_map;
+    std::vector<int> rows;
+    if (ReadCache(kIndexedRows, nrow, ncol, dst, stride, &rows)) return rows.size();
+    MapText();
+    const char *data = file_.Data();
+    // reading stops at the first empty line
+    size_t size = FirstEmptyLine();
+    while (cut_.size() > 1 && cut_[cut_.size() - 2] >= size) cut_.pop_back();
+    cut_.back() = size;
+    const long nchunk = cut_.size() - 1;
+    // rows and their line offsets, per chunk
+    std::vector<std::vector<int> > chunk_rows(nchunk);
+    std::vector<std::vector<size_t> > chunk_lines(nchunk);
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (long c = 0; c < nchunk; ++c) {
+      const char *p = data + cut_[c], *end = data + cut_[c + 1];
+      while (p < end) {
+        chunk_lines[c].push_back(p - data);
+        chunk_rows[c].push_back(ParseIndexedRow(p, end, dst, nrow, ncol, stride));
+        if (p < end) ++p;
+      }
+    }
+    std::vector<int> all;
+    std::vector<size_t> lines;
+    for (long c = 0; c < nchunk; ++c) {
+      all.insert(all.end(), chunk_rows[c].begin(), chunk_rows[c].end());
+      lines.insert(lines.end(), chunk_lines[c].begin(), chunk_lines[c].end());
+    }
+    // a row given twice may have been written by two chunks at once: its last
+    // line in file order is parsed again, rows keeps each row once
+    std::vector<char> seen(nrow, 0);
+    for (size_t i = 0; i < all.size(); ++i) {
+      if (seen[all[i]] == 0) rows.push_back(all[i]);
+      if (seen[all[i]] < 2) ++seen[all[i]];
+    }
+    std::vector<size_t> again;
+    for (size_t i = all.size(); i-- > 0;) {
+      if (seen[all[i]] == 2) {
+        again.push_back(lines[i]);
+        seen[all[i]] = 3;
+      }
+    }
+    if (!again.empty()) {
+      utils::Printf("[Warning] TextLoader: %s, %lu rows are given more than once, the last line wins.\n",
+                    path_.c_str(), static_cast<unsigned long>(again.size()));
+    }
+    const long nagain = again.size();
+    #pragma omp parallel for schedule(static)
+    for (long i = 0; i < nagain; ++i) {
+      const char *p = data + again[i];
+      ParseIndexedRow(p, data + cut_.back(), dst, nrow, ncol, stride);
+    }
+    file_.Close();
+    WriteCache(kIndexedRows, nrow, ncol, dst, stride, rows);
+    return rows.size();
+  }
+
+  inline void LoadSsvMatrix(float *dst, int nrow, int ncol, size_t stride) {
+    if (ReadCache(kSsvMatrix, nrow, ncol, dst, stride, NULL)) return;
+    MapText();
+    const char *data = file_.Data(), *end = data + file_.Size();
+    const char *p = data;
+    int file_row = -1, file_col = -1;
+    while (p < end && IsBlank(*p)) ++p;
+    Check(ParseInt(p, end, &file_row), "TextLoader: %s, bad shape line.", path_.c_str());
+    while (p < end && IsBlank(*p)) ++p;
+    Check(ParseInt(p, end, &file_col), "TextLoader: %s, bad shape line.", path_.c_str());
+    Check(file_row == nrow && file_col == ncol, "TextLoader: %s is %d x %d, need %d x %d.",
+          path_.c_str(), file_row, file_col, nrow, ncol);
+    while (p < end && *p != '\n') ++p;
+    const size_t head = p < end ? p - data + 1 : file_.Size();
+    // rows of each chunk, then parse at the row offsets
+    std::vector<size_t> body;
+    CutChunks(data + head, file_.Size() - head, &body);
+    const long nchunk = body.size() - 1;
+    std::vector<size_t> first(nchunk + 1, 0);
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (long c = 0; c < nchunk; ++c) {
+      first[c + 1] = CountLines(data + head + body[c], data + head + body[c + 1]);
+    }
+    for (long c = 0; c < nchunk; ++c) first[c + 1] += first[c];
+    Check(first[nchunk] == static_cast<size_t>(nrow), "TextLoader: %s has %lu rows, need %d.",
+          path_.c_str(), static_cast<unsigned long>(first[nchunk]), nrow);
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (long c = 0; c < nchunk; ++c) {
+      const char *q = data + head + body[c], *qend = data + head + body[c + 1];
+      for (size_t i = first[c]; i < first[c + 1]; ++i) {
+        while (q < qend && *q == '\n') ++q;
+        float *out = dst + i * stride;
+        for (int j = 0; j < ncol; ++j) {
+          while (q < qend && IsBlank(*q)) ++q;
+          Check(ParseFloat(q, qend, out + j), "TextLoader: %s, bad number in row %lu.",
+                path_.c_str(), static_cast<unsigned long>(i));
+        }
+        while (q < qend && *q != '\n') ++q;
+        if (q < qend) ++q;
+      }
+    }
+    file_.Close();
+    WriteCache(kSsvMatrix, nrow, ncol, dst, stride, std::vector<int>());
+  }
+
+ private:
+  struct CacheHeader {
+    char magic[8];
+    uint64_t src_size;
+    int64_t src_mtime;
+    int32_t kind, nrow;
+    uint64_t ncol, count;
+  };
+
+  // one "row v_0 .. v_{ncol-1}" line at p into its row of dst, p is left at
+  // the end of the line; returns the row
+  inline int ParseIndexedRow(const char *&p, const char *end, float *dst, int nrow, int ncol,
+                             size_t stride) const {
+    while (p < end && IsBlank(*p)) ++p;
+    int row = -1;
+    Check(ParseInt(p, end, &row) && row >= 0 && row < nrow,
+          "TextLoader: %s, bad row index.", path_.c_str());
+    float *out = dst + static_cast<size_t>(MapRow(row)) * stride;
+    int j = 0;
+    while (true) {
+      while (p < end && IsBlank(*p)) ++p;
+      if (p == end || *p == '\n') break;
+      Check(j < ncol, "TextLoader: %s, more than %d values in row %d.", path_.c_str(), ncol, row);
+      Check(ParseFloat(p, end, out + j), "TextLoader: %s, bad number in row %d.", path_.c_str(), row);
+      ++j;
+    }
+    Check(j == ncol, "TextLoader: %s, %d values in row %d, need %d.", path_.c_str(), j, row, ncol);
+    return row;
+  }
+
+  // the cache keeps file row ids, so it does not depend on the row map
+  inline size_t MapRow(size_t row) const {
+    return row_map_ == NULL ? row : static_cast<size_t>(row_map_[row]);
+  }
+
+  inline void MapText(void) {
+    Check(file_.Open(path_), "TextLoader: open %s failed.", path_.c_str());
+    utils::Printf("TextLoader: parse %s, %lu bytes.\n", path_.c_str(),
+                  static_cast<unsigned long>(file_.Size()));
+    CutChunks(file_.Data(), file_.Size(), &cut_);
+  }
+
+  // non-empty lines in [p, end), a last line without '\n' counts
+  inline static size_t CountLines(const char *p, const char *end) {
+    size_t n = 0;
+    while (p < end) {
+      const char *nl = static_cast<const char*>(memchr(p, '\n', end - p));
+      const char *e = nl == NULL ? end : nl;
+      if (e != p) ++n;
+      p = e + 1;
+    }
+    return n;
+  }
+
+  // offset of the first empty line of the mapped text, or its size
+  inline size_t FirstEmptyLine(void) {
+    const char *data = file_.Data();
+    const size_t size = file_.Size();
+    if (size != 0 && data[0] == '\n') return 0;
+    const long nchunk = cut_.size() - 1;
+    size_t found = size;
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (long c = 0; c < nchunk; ++c) {
+      // a chunk starts past a '\n', so an empty first line is "\n" at its start
+      size_t beg = cut_[c] == 0 ? 0 : cut_[c] - 1;
+      const char *p = data + beg, *end = data + cut_[c + 1];
+      while (p + 1 < end) {
+        const char *nl = static_cast<const char*>(memchr(p, '\n', end - p - 1));
+        if (nl == NULL) break;
+        if (nl[1] == '\n') {
+          size_t at = nl - data + 1;
+          #pragma omp critical(text_loader_empty)
+          if (at < found) found = at;
+          break;
+        }
+        p = nl + 1;
+      }
+    }
+    return found;
+  }
+
+  inline std::string CachePath(void) const { return path_ + ".bin_cache"; }
+
+  // fill dst from the cache, false if there is none or it is stale
+  inline bool ReadCache(int kind, int nrow, size_t ncol, float *dst, size_t stride,
+                        std::vector<int> *rows) {
+    if (!bin_cache_) return false;
+    size_t src_size;
+    int64_t src_mtime;
+    if (!FileStat(path_, &src_size, &src_mtime)) return false;
+    MappedFile cache;
+    if (!cache.Open(CachePath()) || cache.Size() < sizeof(CacheHeader)) return false;
+    CacheHeader h;
+    memcpy(&h, cache.Data(), sizeof(h));
+    if (memcmp(h.magic, "TNTXTBC1", 8) != 0 || h.kind != kind || h.nrow != nrow ||
+        h.ncol != ncol || h.src_size != src_size || h.src_mtime != src_mtime) {
+      return false;
+    }
+    const char *body = cache.Data() + sizeof(h);
+    size_t need = sizeof(h) + h.count * ncol * sizeof(float);
+    if (kind == kIndexedRows) need += h.count * sizeof(int32_t);
+    if (cache.Size() != need) return false;
+    utils::Printf("TextLoader: load %s from %s.\n", path_.c_str(), CachePath().c_str());
+    if (kind == kStream) {
+      memcpy(dst, body, ncol * sizeof(float));
+      return true;
+    }
+    const int32_t *idx = reinterpret_cast<const int32_t*>(body);
+    const float *val = reinterpret_cast<const float*>(
+        kind == kIndexedRows ? body + h.count * sizeof(int32_t) : body);
+    const long count = static_cast<long>(h.count);
+    #pragma omp parallel for schedule(static)
+    for (long i = 0; i < count; ++i) {
+      size_t row = kind == kIndexedRows ? idx[i] : i;
+      if (row < static_cast<size_t>(nrow)) {
+        if (kind == kIndexedRows) row = MapRow(row);
+        memcpy(dst + row * stride, val + i * ncol, ncol * sizeof(float));
+      }
+    }
+    if (rows != NULL && kind == kIndexedRows) rows->assign(idx, idx + count);
+    return true;
+  }
+
+  // written to a temporary file and renamed, so readers never see half a cache
+  inline void WriteCache(int kind, int nrow, size_t ncol, const float *dst, size_t stride,
+                         const std::vector<int> &rows) {
+    if (!bin_cache_) return;
+    CacheHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, "TNTXTBC1", 8);
+    size_t src_size;
+    int64_t src_mtime;
+    if (!FileStat(path_, &src_size, &src_mtime)) return;
+    h.src_size = src_size;
+    h.src_mtime = src_mtime;
+    h.kind = kind;
+    h.nrow = nrow;
+    h.ncol = ncol;
+    h.count = kind == kIndexedRows ? rows.size() : (kind == kStream ? 1 : nrow);
+    char suffix[32];
+    utils::SPrintf(suffix, sizeof(suffix), ".tmp%d", static_cast<int>(getpid()));
+    std::string tmp = CachePath() + suffix;
+    FILE *fp = fopen(tmp.c_str(), "wb");
+    if (fp == NULL) {
+      utils::Printf("[Warning] TextLoader: can not write %s, no cache.\n", tmp.c_str());
+      return;
+    }
+    bool ok = fwrite(&h, sizeof(h), 1, fp) == 1;
+    if (kind == kIndexedRows && !rows.empty()) {
+      std::vector<int32_t> idx(rows.begin(), rows.end());
+      ok = ok && fwrite(&idx[0], sizeof(int32_t), idx.size(), fp) == idx.size();
+    }
+    for (size_t i = 0; ok && i < h.count; ++i) {
+      size_t row = kind == kIndexedRows ? MapRow(rows[i]) : i;
+      ok = fwrite(dst + row * stride, sizeof(float), ncol, fp) == ncol;
+    }
+    ok = fclose(fp) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), CachePath().c_str()) != 0) {
+      utils::Printf("[Warning] TextLoader: write %s failed, no cache.\n", CachePath().c_str());
+      remove(tmp.c_str());
+    }
+  }
+
+  std::string path_;
+  bool bin_cache_;
+  const int *row_map_;
+  MappedFile file_;
+  std::vector<size_t> cut_;
+};
+
+}  // namespace utils
+}  // namespace textnet
+#endif  // TEXTNET_UTILS_TEXT_LOADER_H_
@@ -57,7 +57,7 @@ inline void ThreadExit(void *status) {
 // thread interface using g++     
 #include <semaphore.h>
 #include <pthread.h>
-namespace cxxnet {
+namespace textnet {
 namespace utils {
 /*!\brief semaphore class */
 class Semaphore {
@@ -0,0 +1,126 @@
+#ifndef TEXTNET_UTILS_TOPK_ENGINE_H_
+#define TEXTNET_UTILS_TOPK_ENGINE_H_
+/*!
+ * \file topk_engine.h
+ * \brief k-max selection shared by the top-k pooling layers
+ *  the k largest values of a sequence are selected together with their
+ *  positions, ties always go to the lower position so results are stable
+ */
+#include <vector>
+#include <utility>
+#include <algorithm>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "./utils.h"
+
+namespace textnet {
+namespace utils {
+
+/*!
+ * \brief scratch buffers of the selection, keep one per thread
+ */
+struct TopKWorkspace {
+  std::vector<float> buf;
+  std::vector<std::pair<float, int> > pairs;
+  /*! \brief copy n values read with stride into buf, return a contiguous view */
+  inline const float *Gather(const float *x, int n, int stride) {
+    if (stride == 1) return x;
+    buf.resize(n);
+    for (int i = 0; i < n; ++i) buf[i] = x[i * stride];
+    return n == 0 ? NULL : &buf[0];
+  }
+};
+
+/*! \brief larger value first, the lower position wins a tie */
+struct TopKGreater {
+  inline bool operator()(const std::pair<float, int> &l,
+                         const std::pair<float, int> &r) const {
+    return l.first > r.first || (l.first == r.first && l.second < r.second);
+  }
+};
+
+/*! \brief below this k the selection keeps a sorted candidate list in registers */
+const int kTopKSmall = 16;
+
+// keeps val/idx[0..k) sorted by TopKGreater, inserts x[i] if it beats the kth
+inline void TopKInsert_(float v, int i, int k, int *cnt, float *val, int *idx) {
+  int p = *cnt < k ? (*cnt)++ : k - 1;
+  while (p > 0 && val[p-1] < v) {
+    val[p] = val[p-1]; idx[p] = idx[p-1]; --p;
+  }
+  val[p] = v; idx[p] = i;
+}
+
+inline int TopKSmall_(const float *x, int n, int k, float *val, int *idx) {
+  int cnt = 0, i = 0;
+  for (; i < n && cnt < k; ++i) {
+    TopKInsert_(x[i], i, k, &cnt, val, idx);
+  }
+#ifdef __SSE2__
+  // most elements fall below the current kth value, reject them four at a time
+  for (; i + 4 <= n; i += 4) {
+    int mask = _mm_movemask_ps(_mm_cmpgt_ps(_mm_loadu_ps(x + i),
+                                            _mm_set1_ps(val[k-1])));
+    while (mask) {
+      int j = __builtin_ctz(mask);
+      mask &= mask - 1;
+      if (x[i+j] > val[k-1]) TopKInsert_(x[i+j], i + j, k, &cnt, val, idx);
+    }
+  }
+#endif
+  for (; i < n; ++i) {
+    if (x[i] > val[k-1]) TopKInsert_(x[i], i, k, &cnt, val, idx);
+  }
+  return cnt;
+}
+
+/*!
+ * \brief select the min(k, n) largest values of x[0..n)
+ *  idx (and val if not NULL) are filled in descending order of value
+ *  \return the number of selected elements
+ */
+inline int TopKDesc(const float *x, int n, int k, int *idx, float *val,
+                    TopKWorkspace *ws) {
+  int m = std::min(k, n);
+  if (m <= 0) return 0;
+  if (m <= kTopKSmall) {
+    float v[kTopKSmall];
+    TopKSmall_(x, n, m, v, idx);
+    if (val != NULL) {
+      for (int i = 0; i < m; ++i) val[i] = v[i];
+    }
+    return m;
+  }
+  std::vector<std::pair<float, int> > &pairs = ws->pairs;
+  pairs.resize(n);
+  for (int i = 0; i < n; ++i) {
+    pairs[i].first = x[i]; pairs[i].second = i;
+  }
+  if (m < n) {
+    std::nth_element(pairs.begin(), pairs.begin() + m, pairs.end(), TopKGreater());
+  }
+  std::sort(pairs.begin(), pairs.begin() + m, TopKGreater());
+  for (int i = 0; i < m; ++i) {
+    idx[i] = pairs[i].second;
+    if (val != NULL) val[i] = pairs[i].first;
+  }
+  return m;
+}
+
+/*!
+ * \brief the same selection as TopKDesc, but idx/val keep the input order
+ */
+inline int TopKByPos(const float *x, int n, int k, int *idx, float *val,
+                     TopKWorkspace *ws) {
+  int m = TopKDesc(x, n, k, idx, NULL, ws);
+  std::sort(idx, idx + m);
+  if (val != NULL) {
+    for (int i = 0; i < m; ++i) val[i] = x[idx[i]];
+  }
+  return m;
+}
+
+}  // namespace utils
+}  // namespace textnet
+#endif  // TEXTNET_UTILS_TOPK_ENGINE_H_
@@ -0,0 +1,67 @@
+#ifndef TEXTNET_UTILS_WINDOW_SUM_H_
+#define TEXTNET_UTILS_WINDOW_SUM_H_
+/*!
+ * \file window_sum.h
+ * \brief sliding window sums over the rows of a sequence via prefix sums,
+ *        every window costs one subtraction whatever its size
+ */
+#include <vector>
+#include <algorithm>
+
+namespace textnet {
+namespace utils {
+
+// acc[i*dim .. (i+1)*dim) = sum of x rows [0, i), i in [0, len]
+// accumulated in double so long sequences do not lose the short windows
+inline void PrefixRows_(const float *x, int ld, int len, int dim,
+                        std::vector<double> *p_acc) {
+  std::vector<double> &acc = *p_acc;
+  acc.resize(static_cast<size_t>(len + 1) * dim);
+  std::fill(acc.begin(), acc.begin() + dim, 0.0);
+  for (int i = 0; i < len; ++i) {
+    const double *prev = &acc[0] + static_cast<size_t>(i) * dim;
+    double *cur = &acc[0] + static_cast<size_t>(i + 1) * dim;
+    const float *row = x + static_cast<size_t>(i) * ld;
+    for (int f = 0; f < dim; ++f) cur[f] = prev[f] + row[f];
+  }
+}
+
+/*!
+ * \brief y[p] = scale * sum of x[i] for i in [p, min(p+window, len)), p < len
+ *  x and y are len rows of dim floats with leading dimensions ldx / ldy
+ */
+inline void WindowSumForward(const float *x, int ldx, int len, int dim,
+                             int window, float scale, float *y, int ldy,
+                             std::vector<double> *acc) {
+  if (len <= 0) return;
+  PrefixRows_(x, ldx, len, dim, acc);
+  const double *s = &(*acc)[0];
+  for (int p = 0; p < len; ++p) {
+    const double *lo = s + static_cast<size_t>(p) * dim;
+    const double *hi = s + static_cast<size_t>(std::min(p + window, len)) * dim;
+    float *out = y + static_cast<size_t>(p) * ldy;
+    for (int f = 0; f < dim; ++f) out[f] = static_cast<float>((hi[f] - lo[f]) * scale);
+  }
+}
+
+/*!
+ * \brief adjoint of WindowSumForward:
+ *  gx[i] += scale * sum of gy[p] for p in [max(0, i-window+1), i], i < len
+ */
+inline void WindowSumBackward(const float *gy, int ldy, int len, int dim,
+                              int window, float scale, float *gx, int ldx,
+                              std::vector<double> *acc) {
+  if (len <= 0) return;
+  PrefixRows_(gy, ldy, len, dim, acc);
+  const double *s = &(*acc)[0];
+  for (int i = 0; i < len; ++i) {
+    const double *lo = s + static_cast<size_t>(std::max(0, i - window + 1)) * dim;
+    const double *hi = s + static_cast<size_t>(i + 1) * dim;
+    float *out = gx + static_cast<size_t>(i) * ldx;
+    for (int f = 0; f < dim; ++f) out[f] += static_cast<float>((hi[f] - lo[f]) * scale);
+  }
+}
+
+}  // namespace utils
+}  // namespace textnet
+#endif  // TEXTNET_UTILS_WINDOW_SUM_H_